@@ -553,19 +553,28 @@ u32 CAliM1543C_ide::ide_command_read(int index, u32 address, int dsize) {
     break;
 
   case REG_COMMAND_SECTOR_COUNT:
-    data = SEL_REGISTERS(index).sector_count;
+    data = (CONTROLLER(index).hob ? SEL_REGISTERS(index).hob_sector_count
+                                  : SEL_REGISTERS(index).sector_count) &
+           0xff;
     break;
 
   case REG_COMMAND_SECTOR_NO:
-    data = SEL_REGISTERS(index).sector_no;
+    data = (CONTROLLER(index).hob ? SEL_REGISTERS(index).hob_sector_no
+                                  : SEL_REGISTERS(index).sector_no) &
+           0xff;
     break;
 
   case REG_COMMAND_CYL_LOW:
-    data = SEL_REGISTERS(index).cylinder_no & 0xff;
+    data = (CONTROLLER(index).hob ? SEL_REGISTERS(index).hob_cylinder_no
+                                  : SEL_REGISTERS(index).cylinder_no) &
+           0xff;
     break;
 
   case REG_COMMAND_CYL_HI:
-    data = (SEL_REGISTERS(index).cylinder_no >> 8) & 0xff;
+    data = ((CONTROLLER(index).hob ? SEL_REGISTERS(index).hob_cylinder_no
+                                   : SEL_REGISTERS(index).cylinder_no) >>
+            8) &
+           0xff;
     break;
 
   case REG_COMMAND_DRIVE:
@@ -651,23 +660,39 @@ void CAliM1543C_ide::ide_command_write(int index, u32 address, int dsize,
     REGISTERS(index, 1).features = data;
     break;
 
+  // Each write moves the previous value to the high order byte, which
+  // 48-bit commands use. Writing a register clears HOB.
   case REG_COMMAND_SECTOR_COUNT:
+    REGISTERS(index, 0).hob_sector_count = REGISTERS(index, 1).hob_sector_count =
+        REGISTERS(index, 1).sector_count & 0xff;
     REGISTERS(index, 0).sector_count = REGISTERS(index, 1).sector_count =
         data & 0xff;
+    CONTROLLER(index).hob = false;
     break;
 
   case REG_COMMAND_SECTOR_NO:
+    REGISTERS(index, 0).hob_sector_no = REGISTERS(index, 1).hob_sector_no =
+        REGISTERS(index, 1).sector_no & 0xff;
     REGISTERS(index, 0).sector_no = REGISTERS(index, 1).sector_no = data & 0xff;
+    CONTROLLER(index).hob = false;
     break;
 
   case REG_COMMAND_CYL_LOW:
+    REGISTERS(index, 0).hob_cylinder_no = REGISTERS(index, 1).hob_cylinder_no =
+        (REGISTERS(index, 1).hob_cylinder_no & 0xff00) |
+        (REGISTERS(index, 1).cylinder_no & 0xff);
     REGISTERS(index, 0).cylinder_no = REGISTERS(index, 1).cylinder_no =
         (REGISTERS(index, 1).cylinder_no & 0xff00) | (data & 0xff);
+    CONTROLLER(index).hob = false;
     break;
 
   case REG_COMMAND_CYL_HI:
+    REGISTERS(index, 0).hob_cylinder_no = REGISTERS(index, 1).hob_cylinder_no =
+        (REGISTERS(index, 1).hob_cylinder_no & 0xff) |
+        (REGISTERS(index, 1).cylinder_no & 0xff00);
     REGISTERS(index, 0).cylinder_no = REGISTERS(index, 1).cylinder_no =
         (REGISTERS(index, 1).cylinder_no & 0xff) | ((data << 8) & 0xff00);
+    CONTROLLER(index).hob = false;
     break;
 
   case REG_COMMAND_DRIVE:
@@ -704,6 +729,10 @@ void CAliM1543C_ide::ide_command_write(int index, u32 address, int dsize,
     if ((data & 0xf0) == 0x10)
       data = 0x10;
 
+    SEL_REGISTERS(index).ext = false;
+    if (SEL_DISK(index) && !SEL_DISK(index)->cdrom())
+      data = start_lba48(index, data);
+
     SEL_COMMAND(index).command_in_progress = false;
     SEL_COMMAND(index).current_command = data;
 #ifdef DEBUG_IDE_CMD
@@ -781,6 +810,7 @@ void CAliM1543C_ide::ide_control_write(int index, u32 address, u32 data) {
     prev_reset = CONTROLLER(index).reset;
     CONTROLLER(index).reset = (data >> 2) & 1;
     CONTROLLER(index).disable_irq = (data >> 1) & 1;
+    CONTROLLER(index).hob = (data >> 7) & 1;
 
     if (!prev_reset && CONTROLLER(index).reset) {
 #ifdef DEBUG_IDE_REG_CONTROL
@@ -954,6 +984,7 @@ void CAliM1543C_ide::ide_busmaster_write(int index, u32 address, u32 data,
 void CAliM1543C_ide::set_signature(int index, int id) {
 
   // Device signature
+  REGISTERS(index, id).ext = false;
   REGISTERS(index, id).head_no = 0;
   REGISTERS(index, id).sector_count = 1;
   REGISTERS(index, id).sector_no = 1;
@@ -1130,11 +1161,11 @@ void CAliM1543C_ide::identify_drive(int index, bool packet) {
     CONTROLLER(index).data[59] = 0x0000;
   }
 
-  // lba capacity
-  CONTROLLER(index).data[60] =
-      (u16)(SEL_DISK(index)->get_lba_size() >> 0) & 0xFFFF;
-  CONTROLLER(index).data[61] =
-      (u16)(SEL_DISK(index)->get_lba_size() >> 16) & 0xFFFF;
+  // lba capacity (28-bit commands)
+  u64 lba_size = SEL_DISK(index)->get_lba_size();
+  u64 lba28_size = lba_size > 0x0fffffff ? 0x0fffffff : lba_size;
+  CONTROLLER(index).data[60] = (u16)(lba28_size >> 0) & 0xFFFF;
+  CONTROLLER(index).data[61] = (u16)(lba28_size >> 16) & 0xFFFF;
 
   // multiword dma capability (10-8: modes selected, 2-0, modes
   // supported)
@@ -1174,18 +1205,101 @@ void CAliM1543C_ide::identify_drive(int index, bool packet) {
   // command set supported (cdrom = nop,packet,removable; disk=nop)
   CONTROLLER(index).data[82] = SEL_DISK(index)->cdrom() ? 0x4014 : 0x4000;
 
-  // command sets supported(no additional command sets)
-  CONTROLLER(index).data[83] = 0x4000;
+  // command sets supported (disk: 48-bit address feature set, bit 10)
+  CONTROLLER(index).data[83] = SEL_DISK(index)->cdrom() ? 0x4000 : 0x4400;
   CONTROLLER(index).data[84] = 0x4000;
 
   // command sets enabled.
   CONTROLLER(index).data[85] = SEL_DISK(index)->cdrom() ? 0x4014 : 0x4000;
-  CONTROLLER(index).data[86] = 0x4000;
+  CONTROLLER(index).data[86] = SEL_DISK(index)->cdrom() ? 0x4000 : 0x4400;
   CONTROLLER(index).data[87] = 0x4000;
 
   // ultra dma modes supported (10-8: modes selected, 2-0, modes
   // supported)
   CONTROLLER(index).data[88] = 0x0000;
+
+  // lba capacity (48-bit commands)
+  if (!SEL_DISK(index)->cdrom()) {
+    CONTROLLER(index).data[100] = (u16)(lba_size >> 0) & 0xFFFF;
+    CONTROLLER(index).data[101] = (u16)(lba_size >> 16) & 0xFFFF;
+    CONTROLLER(index).data[102] = (u16)(lba_size >> 32) & 0xFFFF;
+    CONTROLLER(index).data[103] = 0;
+  }
+}
+
+/**
+ * Prepare a 48-bit (EXT) command.
+ *
+ * The LBA and sector count are assembled from the current and the high
+ * order register contents and kept in ext_lba and ext_count (a count of up
+ * to 65536), which SEL_LBA and SEL_COUNT use while ext is set. The command
+ * is then executed as its 28-bit counterpart.
+ *
+ * \return The command to execute.
+ **/
+int CAliM1543C_ide::start_lba48(int index, int command) {
+  int cmd28;
+
+  switch (command) {
+  case 0x24: // read sectors ext
+    cmd28 = 0x20;
+    break;
+  case 0x25: // read dma ext
+    cmd28 = 0xc8;
+    break;
+  case 0x29: // read multiple ext
+    cmd28 = 0xc4;
+    break;
+  case 0x34: // write sectors ext
+    cmd28 = 0x30;
+    break;
+  case 0x35: // write dma ext
+    cmd28 = 0xca;
+    break;
+  case 0x39: // write multiple ext
+    cmd28 = 0xc5;
+    break;
+  default:
+    return command;
+  }
+
+  REGISTERS(index, 0).lba_mode = REGISTERS(index, 1).lba_mode = true;
+
+  int count = (SEL_REGISTERS(index).hob_sector_count << 8) |
+              SEL_REGISTERS(index).sector_count;
+  SEL_REGISTERS(index).ext = true;
+  SEL_REGISTERS(index).ext_count = count ? count : 65536;
+  SEL_REGISTERS(index).ext_lba =
+      ((u64)SEL_REGISTERS(index).hob_cylinder_no << 32) |
+      ((u64)SEL_REGISTERS(index).hob_sector_no << 24) |
+      ((u64)SEL_REGISTERS(index).cylinder_no << 8) |
+      (u64)SEL_REGISTERS(index).sector_no;
+
+#ifdef DEBUG_IDE_CMD
+  printf("%%IDE-I-LBA48: Command %02x: %d sectors at %" PRIu64 ".\n", command,
+         SEL_COUNT(index), SEL_LBA(index));
+#endif
+  return cmd28;
+}
+
+/**
+ * Advance the LBA past a number of sectors.
+ *
+ * The LBA registers follow, so they read back the current position: for a
+ * 48-bit command in the current and high order bytes, otherwise in
+ * sector_no, cylinder_no and the low bits of head_no.
+ **/
+void CAliM1543C_ide::advance_lba(int index, int sectors) {
+  u64 lba = SEL_LBA(index) + sectors;
+
+  SEL_REGISTERS(index).sector_no = (int)(lba & 0xff);
+  SEL_REGISTERS(index).cylinder_no = (int)((lba >> 8) & 0xffff);
+  if (SEL_REGISTERS(index).ext) {
+    SEL_REGISTERS(index).ext_lba = lba;
+    SEL_REGISTERS(index).hob_sector_no = (int)((lba >> 24) & 0xff);
+    SEL_REGISTERS(index).hob_cylinder_no = (int)((lba >> 32) & 0xffff);
+  } else
+    SEL_REGISTERS(index).head_no = (int)((lba >> 24) & 0x0f);
 }
 
 void CAliM1543C_ide::command_aborted(int index, u8 command) {
@@ -1216,9 +1330,7 @@ void CAliM1543C_ide::ide_status(int index) {
          SEL_REGISTERS(index).cylinder_no, SEL_REGISTERS(index).head_no,
          SEL_REGISTERS(index).sector_no, SEL_REGISTERS(index).sector_count,
          SEL_REGISTERS(index).features,
-         (SEL_REGISTERS(index).head_no << 24) |
-             (SEL_REGISTERS(index).cylinder_no << 8) |
-             SEL_REGISTERS(index).sector_no,
+         (int)SEL_LBA(index),
          CONTROLLER(index).data_ptr, CONTROLLER(index).data_size,
          SEL_REGISTERS(index).error, SEL_COMMAND(index).current_command & 0xff,
          SEL_COMMAND(index).command_in_progress,
@@ -1318,8 +1430,8 @@ void CAliM1543C_ide::execute(int index) {
       if (SEL_COMMAND(index).command_cycle == 0) {
 
         // fixup the 0=256 case.
-        if (SEL_REGISTERS(index).sector_count == 0)
-          SEL_REGISTERS(index).sector_count = 256;
+        if (SEL_COUNT(index) == 0)
+          SEL_COUNT(index) = 256;
       }
 
       if (!SEL_STATUS(index).drq) {
@@ -1328,9 +1440,7 @@ void CAliM1543C_ide::execute(int index) {
         if (!SEL_REGISTERS(index).lba_mode) {
           FAILURE(NotImplemented, "Non-LBA disk read");
         } else {
-          u32 lba = (SEL_REGISTERS(index).head_no << 24) |
-                    (SEL_REGISTERS(index).cylinder_no << 8) |
-                    SEL_REGISTERS(index).sector_no;
+          u64 lba = SEL_LBA(index);
 
           SEL_DISK(index)->seek_block(lba);
           SEL_DISK(index)->read_blocks(&(CONTROLLER(index).data[0]), 1);
@@ -1348,24 +1458,15 @@ void CAliM1543C_ide::execute(int index) {
           CONTROLLER(index).data_size = 256;
 
           // prepare for next sector
-          SEL_REGISTERS(index).sector_count--;
-          if (SEL_REGISTERS(index).sector_count == 0) {
+          SEL_COUNT(index)--;
+          if (SEL_COUNT(index) == 0) {
             SEL_COMMAND(index).command_in_progress = false;
             if (SEL_DISK(index)->cdrom())
               set_signature(index, CONTROLLER(index).selected); // per 9.1
           } else {
 
             // set the next block to read.
-            // increment the lba.
-            SEL_REGISTERS(index).sector_no++;
-            if (SEL_REGISTERS(index).sector_no > 255) {
-              SEL_REGISTERS(index).sector_no = 0;
-              SEL_REGISTERS(index).cylinder_no++;
-              if (SEL_REGISTERS(index).cylinder_no > 65535) {
-                SEL_REGISTERS(index).cylinder_no = 0;
-                SEL_REGISTERS(index).head_no++;
-              }
-            }
+            advance_lba(index, 1);
           }
         }
 
@@ -1386,8 +1487,8 @@ void CAliM1543C_ide::execute(int index) {
           SEL_STATUS(index).drq = true;
           SEL_STATUS(index).busy = false;
           CONTROLLER(index).data_size = 256;
-          if (SEL_REGISTERS(index).sector_count == 0)
-            SEL_REGISTERS(index).sector_count = 256;
+          if (SEL_COUNT(index) == 0)
+            SEL_COUNT(index) = 256;
         }
       } else {
 
@@ -1398,9 +1499,7 @@ void CAliM1543C_ide::execute(int index) {
           if (!SEL_REGISTERS(index).lba_mode) {
             FAILURE(NotImplemented, "Non-LBA disk write");
           } else {
-            u32 lba = (SEL_REGISTERS(index).head_no << 24) |
-                      (SEL_REGISTERS(index).cylinder_no << 8) |
-                      SEL_REGISTERS(index).sector_no;
+            u64 lba = SEL_LBA(index);
 
 #if defined(ES40_BIG_ENDIAN)
             {
@@ -1425,25 +1524,16 @@ void CAliM1543C_ide::execute(int index) {
             CONTROLLER(index).data_ptr = 0;
 
             // prepare for next sector
-            SEL_REGISTERS(index).sector_count--;
-            if (SEL_REGISTERS(index).sector_count == 0) {
+            SEL_COUNT(index)--;
+            if (SEL_COUNT(index) == 0) {
 
               // we're done
               SEL_STATUS(index).drq = false;
               SEL_COMMAND(index).command_in_progress = false;
             } else {
 
-              // set the next block to read.
-              // increment the lba.
-              SEL_REGISTERS(index).sector_no++;
-              if (SEL_REGISTERS(index).sector_no > 255) {
-                SEL_REGISTERS(index).sector_no = 0;
-                SEL_REGISTERS(index).cylinder_no++;
-                if (SEL_REGISTERS(index).cylinder_no > 65535) {
-                  SEL_REGISTERS(index).cylinder_no = 0;
-                  SEL_REGISTERS(index).head_no++;
-                }
-              }
+              // set the next block to write.
+              advance_lba(index, 1);
             }
           }
 
@@ -1765,8 +1855,8 @@ void CAliM1543C_ide::execute(int index) {
         if (SEL_COMMAND(index).command_cycle == 0) {
 
           // fixup the 0=256 case.
-          if (SEL_REGISTERS(index).sector_count == 0)
-            SEL_REGISTERS(index).sector_count = 256;
+          if (SEL_COUNT(index) == 0)
+            SEL_COUNT(index) = 256;
           SEL_STATUS(index).drq = false;
         }
 
@@ -1776,31 +1866,26 @@ void CAliM1543C_ide::execute(int index) {
           if (!SEL_REGISTERS(index).lba_mode) {
             FAILURE(NotImplemented, "Non-LBA disk read");
           } else {
-            u32 lba = (SEL_REGISTERS(index).head_no << 24) |
-                      (SEL_REGISTERS(index).cylinder_no << 8) |
-                      SEL_REGISTERS(index).sector_no;
+            u64 lba = SEL_LBA(index);
 
-            if (SEL_REGISTERS(index).sector_count >=
-                SEL_PER_DRIVE(index).multiple_size) {
+            if (SEL_COUNT(index) >= SEL_PER_DRIVE(index).multiple_size) {
 
               // easy, its a full block
               CONTROLLER(index).data_size =
                   256 * SEL_PER_DRIVE(index).multiple_size;
-              SEL_REGISTERS(index).sector_count -=
-                  SEL_PER_DRIVE(index).multiple_size;
+              SEL_COUNT(index) -= SEL_PER_DRIVE(index).multiple_size;
             } else {
 
               // partial block.
-              CONTROLLER(index).data_size =
-                  256 * SEL_REGISTERS(index).sector_count;
-              SEL_REGISTERS(index).sector_count = 0;
+              CONTROLLER(index).data_size = 256 * SEL_COUNT(index);
+              SEL_COUNT(index) = 0;
             }
 
 #ifdef DEBUG_IDE_MULTIPLE
             printf("IDE %d.%d: Reading %d sectors, %d sectors left.\n", index,
                    CONTROLLER(index).selected,
                    CONTROLLER(index).data_size / 256,
-                   SEL_REGISTERS(index).sector_count);
+                   SEL_COUNT(index));
 #endif
             SEL_DISK(index)->seek_block(lba);
             SEL_DISK(index)->read_blocks(
@@ -1819,24 +1904,14 @@ void CAliM1543C_ide::execute(int index) {
             CONTROLLER(index).data_ptr = 0;
 
             // prepare for next sector
-            if (SEL_REGISTERS(index).sector_count == 0) {
+            if (SEL_COUNT(index) == 0) {
               SEL_COMMAND(index).command_in_progress = false;
               if (SEL_DISK(index)->cdrom())
                 set_signature(index, CONTROLLER(index).selected); // per 9.1
             } else {
 
               // set the next block to read.
-              // increment the lba.
-              SEL_REGISTERS(index).sector_no +=
-                  CONTROLLER(index).data_size * 256; // # sectors read.
-              if (SEL_REGISTERS(index).sector_no > 255) {
-                SEL_REGISTERS(index).sector_no = 0;
-                SEL_REGISTERS(index).cylinder_no++;
-                if (SEL_REGISTERS(index).cylinder_no > 65535) {
-                  SEL_REGISTERS(index).cylinder_no = 0;
-                  SEL_REGISTERS(index).head_no++;
-                }
-              }
+              advance_lba(index, CONTROLLER(index).data_size / 256);
             }
           }
 
@@ -1859,18 +1934,15 @@ void CAliM1543C_ide::execute(int index) {
           } else {
             SEL_STATUS(index).drq = true;
             SEL_STATUS(index).busy = false;
-            if (SEL_REGISTERS(index).sector_count == 0)
-              SEL_REGISTERS(index).sector_count = 256;
-            if (SEL_REGISTERS(index).sector_count >=
-                SEL_PER_DRIVE(index).multiple_size) {
+            if (SEL_COUNT(index) == 0)
+              SEL_COUNT(index) = 256;
+            if (SEL_COUNT(index) >= SEL_PER_DRIVE(index).multiple_size) {
               CONTROLLER(index).data_size =
                   256 * SEL_PER_DRIVE(index).multiple_size;
-              SEL_REGISTERS(index).sector_count -=
-                  SEL_PER_DRIVE(index).multiple_size;
+              SEL_COUNT(index) -= SEL_PER_DRIVE(index).multiple_size;
             } else {
-              CONTROLLER(index).data_size =
-                  256 * SEL_REGISTERS(index).sector_count;
-              SEL_REGISTERS(index).sector_count = 0;
+              CONTROLLER(index).data_size = 256 * SEL_COUNT(index);
+              SEL_COUNT(index) = 0;
             }
           }
         } else {
@@ -1882,9 +1954,7 @@ void CAliM1543C_ide::execute(int index) {
             if (!SEL_REGISTERS(index).lba_mode) {
               FAILURE(NotImplemented, "Non-LBA disk write");
             } else {
-              u32 lba = (SEL_REGISTERS(index).head_no << 24) |
-                        (SEL_REGISTERS(index).cylinder_no << 8) |
-                        SEL_REGISTERS(index).sector_no;
+              u64 lba = SEL_LBA(index);
 
 #if defined(ES40_BIG_ENDIAN)
               {
@@ -1909,36 +1979,24 @@ void CAliM1543C_ide::execute(int index) {
               SEL_STATUS(index).err = false;
               CONTROLLER(index).data_ptr = 0;
 
-              if (SEL_REGISTERS(index).sector_count == 0) {
+              if (SEL_COUNT(index) == 0) {
 
                 // we're done
                 SEL_STATUS(index).drq = false;
                 SEL_COMMAND(index).command_in_progress = false;
               } else {
 
+                // set the next block to write, past the one just written.
+                advance_lba(index, CONTROLLER(index).data_size / 256);
+
                 // prepare for next block
-                if (SEL_REGISTERS(index).sector_count >=
-                    SEL_PER_DRIVE(index).multiple_size) {
+                if (SEL_COUNT(index) >= SEL_PER_DRIVE(index).multiple_size) {
                   CONTROLLER(index).data_size =
                       256 * SEL_PER_DRIVE(index).multiple_size;
-                  SEL_REGISTERS(index).sector_count -=
-                      SEL_PER_DRIVE(index).multiple_size;
+                  SEL_COUNT(index) -= SEL_PER_DRIVE(index).multiple_size;
                 } else {
-                  CONTROLLER(index).data_size =
-                      256 * SEL_REGISTERS(index).sector_count;
-                  SEL_REGISTERS(index).sector_count = 0;
-                }
-
-                // set the next block to read.
-                // increment the lba.
-                SEL_REGISTERS(index).sector_no++;
-                if (SEL_REGISTERS(index).sector_no > 255) {
-                  SEL_REGISTERS(index).sector_no = 0;
-                  SEL_REGISTERS(index).cylinder_no++;
-                  if (SEL_REGISTERS(index).cylinder_no > 65535) {
-                    SEL_REGISTERS(index).cylinder_no = 0;
-                    SEL_REGISTERS(index).head_no++;
-                  }
+                  CONTROLLER(index).data_size = 256 * SEL_COUNT(index);
+                  SEL_COUNT(index) = 0;
                 }
               }
             }
@@ -1974,27 +2032,17 @@ void CAliM1543C_ide::execute(int index) {
         command_aborted(index, SEL_COMMAND(index).current_command);
         SEL_COMMAND(index).command_in_progress = false;
       } else {
-        if (SEL_REGISTERS(index).sector_count == 0)
-          SEL_REGISTERS(index).sector_count = 256;
+        if (SEL_COUNT(index) == 0)
+          SEL_COUNT(index) = 256;
 
 #ifdef DEBUG_IDE_DMA
         printf("%%IDE-I-DMA: Read %d sectors = %d bytes.\n",
-               SEL_REGISTERS(index).sector_count,
-               SEL_REGISTERS(index).sector_count * 512);
+               SEL_COUNT(index), SEL_COUNT(index) * 512);
 #endif
 
-        u32 lba = (SEL_REGISTERS(index).head_no << 24) |
-                  (SEL_REGISTERS(index).cylinder_no << 8) |
-                  SEL_REGISTERS(index).sector_no;
-
-        SEL_DISK(index)->seek_block(lba);
+        u64 lba = SEL_LBA(index);
 
-        SEL_DISK(index)->read_blocks(&(CONTROLLER(index).data[0]),
-                                     SEL_REGISTERS(index).sector_count);
-
-        u8 *ptr = (u8 *)(&CONTROLLER(index).data[0]);
-        do_dma_transfer(index, ptr, SEL_REGISTERS(index).sector_count * 512,
-                        false);
+        do_dma_disk(index, lba, SEL_COUNT(index) * 512, false);
         SEL_COMMAND(index).command_in_progress = false;
         SEL_STATUS(index).drive_ready = true;
         SEL_STATUS(index).seek_complete = true;
@@ -2016,25 +2064,17 @@ void CAliM1543C_ide::execute(int index) {
                  index, CONTROLLER(index).selected);
           command_aborted(index, SEL_COMMAND(index).current_command);
         } else {
-          if (SEL_REGISTERS(index).sector_count == 0)
-            SEL_REGISTERS(index).sector_count = 256;
+          if (SEL_COUNT(index) == 0)
+            SEL_COUNT(index) = 256;
 
 #ifdef DEBUG_IDE_DMA
           printf("%%IDE-I-DMA: Write %d sectors = %d bytes.\n",
-                 SEL_REGISTERS(index).sector_count,
-                 SEL_REGISTERS(index).sector_count * 512);
+                 SEL_COUNT(index), SEL_COUNT(index) * 512);
 #endif
 
-          u8 *ptr = (u8 *)(&CONTROLLER(index).data[0]);
-          do_dma_transfer(index, ptr, SEL_REGISTERS(index).sector_count * 512,
-                          true);
-          u32 lba = (SEL_REGISTERS(index).head_no << 24) |
-                    (SEL_REGISTERS(index).cylinder_no << 8) |
-                    SEL_REGISTERS(index).sector_no;
+          u64 lba = SEL_LBA(index);
 
-          SEL_DISK(index)->seek_block(lba);
-          SEL_DISK(index)->write_blocks(&(CONTROLLER(index).data[0]),
-                                        SEL_REGISTERS(index).sector_count);
+          do_dma_disk(index, lba, SEL_COUNT(index) * 512, true);
           SEL_COMMAND(index).command_in_progress = false;
           SEL_STATUS(index).drive_ready = true;
           SEL_STATUS(index).seek_complete = true;
@@ -2133,14 +2173,21 @@ void CAliM1543C_ide::execute(int index) {
 
     /***
      * Special cases:  commands we don't support, but return success.
+     * Flush cache writes back the host-side block cache first.
      ***/
+    case 0xe7: // flush cache
+    case 0xea: // flush cache ext
+      if (!SEL_DISK(index)->flush_cache()) {
+        SEL_REGISTERS(index).error = 0x40; // uncorrectable data error
+        command_aborted(index, SEL_COMMAND(index).current_command);
+        break;
+      }
+      // fall through
     case 0xe0: // standby now
     case 0xe1: // idle immediate
     case 0xe2: // standby
     case 0xe3: // idle
     case 0xe6: // sleep
-    case 0xe7: // flush cache
-    case 0xea: // flush cache ext
       SEL_STATUS(index).busy = false;
       SEL_STATUS(index).drive_ready = true;
       SEL_STATUS(index).drq = false;
@@ -2235,6 +2282,137 @@ int CAliM1543C_ide::do_dma_transfer(int index, u8 *buffer, u32 buffersize,
     }
   } while (xfer != 0x80 && status == 0);
 
+  finish_dma(index, status);
+  return status;
+}
+
+/**
+ * \brief DMA transfer between the disk and memory.
+ *
+ * Like do_dma_transfer, but the PRD list is resolved first and the disk
+ * reads or writes guest memory directly wherever a PRD entry maps to main
+ * memory. Only entries that point elsewhere go through the controller
+ * buffer.
+ *
+ * \param lba        First block on the disk.
+ * \param buffersize Number of bytes the command transfers.
+ * \param direction  false: disk to memory, true: memory to disk.
+ **/
+int CAliM1543C_ide::do_dma_disk(int index, u64 lba, u32 buffersize,
+                                bool direction) {
+  struct SPRDEntry {
+    u32 base;
+    size_t size;
+    char *ptr; // nullptr if the entry doesn't map to main memory
+  };
+
+  std::vector<SPRDEntry> entry;
+  std::vector<SDiskVec> vec;
+  u8 xfer;
+  size_t xfersize = 0;
+  u8 status = 0;
+  u32 prd;
+  u8 *bounce = (u8 *)(&CONTROLLER(index).data[0]);
+  size_t bounce_size;
+  size_t bounce_used = 0;
+
+  semBusMaster[index]->wait(); // wait until the start bit is set.
+  {
+    SCOPED_READ_LOCK(mtBusMaster[index]);
+    prd = endian_32(*(u32 *)(&CONTROLLER(index).busmaster[4]));
+  }
+
+  // Walk the PRD list, with the same rules as do_dma_transfer.
+  do {
+    u32 base;
+    do_pci_read(prd, &base, 4, 1);
+
+    u16 size_16;
+    do_pci_read(prd + 4, &size_16, 2, 1);
+
+    size_t size = size_16 ? size_16 : 65536;
+    do_pci_read(prd + 7, &xfer, 1, 1);
+
+    if (xfersize + size > buffersize) {
+      size = buffersize - xfersize;
+      status = 2;
+    }
+
+    // A PRD table can't cross a 64K boundary: at most 8192 entries.
+    if (entry.size() >= 8192) {
+      FAILURE(InvalidArgument, "Too many PRD nodes?");
+    }
+
+    if (size)
+      entry.push_back({base, size, dma_map(base, size)});
+
+    xfersize += size;
+    prd += 8; // go to next entry.
+    if (xfer == 0x80 && xfersize < buffersize) {
+
+      // we still have disk data left over!
+      status = 1;
+    }
+
+    if (buffersize == xfersize && xfer != 0x80) {
+      // we're done, but there's more prd nodes.
+      status = 2;
+    }
+  } while (xfer != 0x80 && status == 0);
+
+  // Entries that don't map, and disk data beyond the PRD list, go through
+  // the controller buffer. A larger one is only allocated if they don't fit.
+  bounce_size = buffersize - xfersize;
+  for (auto &e : entry) {
+    if (!e.ptr)
+      bounce_size += e.size;
+  }
+  if (bounce_size > sizeof(CONTROLLER(index).data)) {
+    if (dma_bounce[index].size() < bounce_size)
+      dma_bounce[index].resize(bounce_size);
+    bounce = dma_bounce[index].data();
+  }
+
+  for (auto &e : entry) {
+    if (e.ptr)
+      vec.push_back({e.ptr, e.size});
+    else {
+      vec.push_back({bounce + bounce_used, e.size});
+      bounce_used += e.size;
+    }
+  }
+  if (xfersize < buffersize)
+    vec.push_back({bounce + bounce_used, buffersize - xfersize});
+
+  SEL_DISK(index)->seek_block(lba);
+
+  if (!direction) {
+    SEL_DISK(index)->read_vec(vec.data(), (int)vec.size());
+    for (size_t i = 0; i < entry.size(); i++) {
+      if (entry[i].ptr)
+        dma_unmap(entry[i].base, entry[i].size);
+      else
+        do_pci_write(entry[i].base, vec[i].buf, 1, entry[i].size);
+    }
+  } else {
+    for (size_t i = 0; i < entry.size(); i++) {
+      if (!entry[i].ptr)
+        do_pci_read(entry[i].base, vec[i].buf, 1, entry[i].size);
+    }
+    SEL_DISK(index)->write_vec(vec.data(), (int)vec.size());
+  }
+
+  finish_dma(index, status);
+  return status;
+}
+
+/**
+ * \brief Update the busmaster status at the end of a DMA transfer.
+ *
+ * \param status 0: normal completion, 1: PRD smaller than the data,
+ *               2: PRD larger than the data.
+ **/
+void CAliM1543C_ide::finish_dma(int index, u8 status) {
   switch (status) {
   case 0: // normal completion.
   {
@@ -2261,7 +2439,6 @@ int CAliM1543C_ide::do_dma_transfer(int index, u8 *buffer, u32 buffersize,
   }
 
   semBusMasterReady[index]->set();
-  return status;
 }
 
 /**
@@ -47,6 +47,8 @@
 #include "SCSIBus.hpp"
 #include "SCSIDevice.hpp"
 
+#include <vector>
+
 #define MAX_MULTIPLE_SECTORS 128
 
 /**
@@ -98,6 +100,10 @@ private:
   u32 ide_busmaster_read(int channel, u32 address, int dsize);
   void ide_busmaster_write(int channel, u32 address, u32 data, int dsize);
   int do_dma_transfer(int index, u8 *buffer, u32 size, bool direction);
+  int do_dma_disk(int index, u64 lba, u32 size, bool direction);
+  int start_lba48(int index, int command);
+  void advance_lba(int index, int sectors);
+  void finish_dma(int index, u8 status);
 
   void raise_interrupt(int channel);
   void set_signature(int channel, int id);
@@ -120,6 +126,10 @@ private:
 
   bool usedma;
 
+  /// Bounce buffer for DMA transfers larger than the controller buffer
+  /// (48-bit commands move up to 65536 sectors).
+  std::vector<u8> dma_bounce[2];
+
   // The state structure contains all elements that need to be saved to the
   // statefile.
   struct SAliM1543C_ideState {
@@ -151,6 +161,17 @@ private:
         int cylinder_no;
         int head_no;
         int command;
+
+        // previous contents, for 48-bit commands (high order bytes)
+        int hob_sector_count;
+        int hob_sector_no;
+        int hob_cylinder_no;
+
+        // 48-bit command in progress: its LBA and remaining sector count,
+        // which don't fit the 8-bit registers (see start_lba48)
+        bool ext;
+        u64 ext_lba;
+        int ext_count;
       } registers;
 
       struct {
@@ -177,6 +198,7 @@ private:
       // control data.
       bool disable_irq;
       bool reset;
+      bool hob; // device control HOB: read the high order bytes
 
       // internal state
       bool reset_in_progress;
@@ -210,6 +232,20 @@ private:
 #define SEL_REGISTERS(a)                                                       \
   state.controller[a].drive[state.controller[a].selected].registers
 
+/// LBA of the command on the selected drive on controller a.
+#define SEL_LBA(a)                                                             \
+  (SEL_REGISTERS(a).ext                                                        \
+       ? SEL_REGISTERS(a).ext_lba                                              \
+       : (((u64)(SEL_REGISTERS(a).head_no & 0x0f) << 24) |                     \
+          ((u64)SEL_REGISTERS(a).cylinder_no << 8) |                           \
+          (u64)SEL_REGISTERS(a).sector_no))
+
+/// Remaining sector count of the command on the selected drive on
+/// controller a; can be assigned to.
+#define SEL_COUNT(a)                                                           \
+  (SEL_REGISTERS(a).ext ? SEL_REGISTERS(a).ext_count                           \
+                        : SEL_REGISTERS(a).sector_count)
+
 /// Selected drive on controller a
 #define SEL_DISK(a) get_disk(a, state.controller[a].selected)
 
@@ -63,7 +63,7 @@ void CAlphaCPU::run() {
       if (StopThread)
         return;
       for (int i = 0; i < 1000000; i++)
-        execute();
+        execute_block();
     }
   } catch (CException &e) {
     printf("Exception in CPU thread: %s.\n", e.displayText().c_str());
@@ -92,6 +92,15 @@ void CAlphaCPU::init() {
   icache_enabled = true;
   flush_icache();
   icache_enabled = myCfg->get_bool_value("icache", false);
+  block_cache_enabled = myCfg->get_bool_value("block_cache", true);
+  idle_enabled = myCfg->get_bool_value("idle_detect", true);
+  idle_window = 0;
+  idle_known_window = U64(0x1);
+  idle_count = 0;
+  memset(block_cache, 0, sizeof(block_cache));
+  block_epoch = 1;
+  for (int i = 0; i < 6; i++)
+    irq_post[i] = IRQ_POST_NONE;
   skip_memtest_hack = myCfg->get_bool_value("skip_memtest_hack", false);
   skip_memtest_counter = 0;
 
@@ -110,21 +119,7 @@ void CAlphaCPU::init() {
   bListing = false;
 #endif
 
-  cc_large = 0;
-  prev_cc = 0;
-  start_cc = 0;
-  prev_time = 0;
-  prev_icount = 0;
-  start_icount = 0;
-
-#if defined(CONSTANT_TIME_FACTOR)
-  cc_per_instruction = CONSTANT_TIME_FACTOR;
-#else
-  cc_per_instruction = 70;
-#endif
-  ins_per_timer_int = cpu_hz / 1024;
-  next_timer_int = state.iProcNum ? U64(0xFFFFFFFFFFFFFFFF)
-                                  : ins_per_timer_int; /* only on CPU 0 */
+  set_cc_base();
 
   state.r[22] = state.r[22 + 32] = state.iProcNum;
 
@@ -202,55 +197,11 @@ static double max_mips = 0.0;
 
 /**
  * Check if threads are still running.
- *
- * Calibrate the CPU timing loop.
  **/
 void CAlphaCPU::check_state() {
   if (myThreadDead.load())
     FAILURE(Thread, "CPU thread has died");
 
-#if !defined(CONSTANT_TIME_FACTOR)
-  if (state.instruction_count > 0) {
-    // correct CPU timing loop...
-    u64 icount = state.instruction_count;
-    u64 cc = cc_large;
-    u64 time = start_time.elapsed();
-    s64 ce = cc_per_instruction;
-
-    u64 cc_aim = time * cpu_hz / 1000000; // microsecond resolution
-    u64 ce_aim = cc_aim / icount;
-
-    s64 icount_lapse = icount - prev_icount;
-    s64 cc_diff = cc_aim - cc;
-    s64 ce_diff = (u64)((float)cc_diff / (float)icount_lapse);
-
-    s64 ce_new = ce_aim + ce_diff;
-    if (ce_new < 0)
-      ce_new = 0;
-    if (ce_new > 200)
-      ce_new = 200;
-
-    if (ce_new != ce) {
-
-      //    printf("                                     time %12" PRId64 " | prev
-      //    %12" PRId64 "  \n",time,prev_time); printf("          count lapse %12"
-      //    LL "d | curr %12" PRId64 " | prev %12" PRId64 "
-      //    \n",icount_lapse,icount,prev_icount); printf("cc %12" PRId64 " | aim
-      //    %12" PRId64 " | diff %12" PRId64 " | prev %12" PRId64 "
-      //    \n",cc,cc_aim,cc_diff,prev_cc); printf("ce %12" PRId64 " | aim %12" LL
-      //    "d | diff %12" PRId64 " | new  %12" PRId64 "
-      //    \n",ce,ce_aim,ce_diff,ce_new);
-      //    printf("==========================================================================
-      //    \n");
-      cc_per_instruction = ce_new;
-      //    printf("cpu %d speed factor: %d\n",get_cpuid(),ce_new);
-    }
-
-    prev_cc = cc;
-    prev_icount = icount;
-    prev_time = time;
-  }
-#endif
   return;
 }
 
@@ -323,6 +274,113 @@ inline void CAlphaCPU::skip_memtest() {
   }
 }
 
+/**
+ * \brief Advance the clock by a number of executed instructions.
+ *
+ * Increases the instruction counter, and counts down the delayed irq_h
+ * interrupts. The interval timer and the cycle counter run on host time
+ * (see CSystem::check_timer and sync_cc).
+ **/
+inline void CAlphaCPU::advance_clock(u64 count) {
+  state.instruction_count += count;
+
+  if (state.check_timers) {
+
+    // There are one or more active delayed irq_h interrupts. Go through the 6
+    // irq_h timers, decrease them as needed, and set the interrupt if the
+    // timer reaches 0.
+    state.check_timers = false;
+    for (int i = 0; i < 6; i++) {
+      if (state.irq_h_timer[i]) {
+
+        // This timer is active. Decrease it, and check if it reached 0.
+        if ((u64)state.irq_h_timer[i] > count) {
+
+          // The timer hasn't reached 0 yet; check on the timers again next
+          // clock tick.
+          state.irq_h_timer[i] -= (int)count;
+          state.check_timers = true;
+        } else {
+
+          // The timer has reached 0. Set the interrupt status, and set the
+          // flag that we need to check the interrupt status
+          state.irq_h_timer[i] = 0;
+          state.eir |= (U64(0x1) << i);
+          state.check_int = true;
+        }
+      }
+    }
+  }
+}
+
+/**
+ * \brief Check for pending interrupts.
+ *
+ * \return true if an interrupt is taken; the program counter then points to
+ *         the PALcode interrupt entry point.
+ **/
+inline bool CAlphaCPU::check_interrupts() {
+  if (irq_posted.load(std::memory_order_acquire))
+    take_posted_irqs();
+
+  if (state.check_int && !(state.pc & 1)) {
+
+    // One or more of the variables that affect interrupt status have changed,
+    // and we are not currently inside PALmode. It is not certain that this
+    // means we hava an interrupt to service, but we might have. This needs to
+    // be checked.
+
+    /*
+    if (state.pal_vms) {
+      // PALcode base is set to 0x8000; meaning OpenVMS PALcode is currently
+    active. In this
+      // case, our VMS PALcode replacement routines are valid, and should be
+    used as it is
+      // faster than using the original PALcode.
+
+      if (state.eir & state.eien & 6)
+        if (vmspal_ent_ext_int(state.eir&state.eien & 6))
+          return;
+
+      if (state.sir & state.sien & 0xfffc)
+        if (vmspal_ent_sw_int(state.sir&state.sien))
+          return;
+
+      if (state.asten && (state.aster & state.astrr & ((1<<(state.cm+1))-1) ))
+        if (vmspal_ent_ast_int(state.aster & state.astrr &
+    ((1<<(state.cm+1))-1) )) return;
+
+      if (state.sir & state.sien)
+        if (vmspal_ent_sw_int(state.sir&state.sien))
+          return;
+    } else
+*/
+    {
+
+      // PALcode base is set to an unsupported value. We have no choice but to
+      // transfer control to PALmode at the PALcode interrupt entry point.
+      //        if (state.eir & 8)
+      //        {
+      //          printf("%s: IP interrupt received%s...\n",devid_string,
+      //          (state.eien&8)?"(enabled)":"(masked)");
+      //        }
+      if ((state.eien & state.eir) || (state.sien & state.sir) ||
+          (state.asten &&
+           (state.aster & state.astrr & ((1 << (state.cm + 1)) - 1)))) {
+        GO_PAL(INTERRUPT);
+        return true;
+      }
+    }
+
+    // This point is reached only if there are no more active interrupts. We
+    // can safely set check_int to false now to save time on the next CPU
+    // clock ticks.
+    state.check_int = false;
+  }
+
+  return false;
+}
+
 /**
  * \brief Called each clock-cycle.
  *
@@ -334,16 +392,6 @@ inline void CAlphaCPU::skip_memtest() {
  **/
 void CAlphaCPU::execute() {
   u32 ins;
-  int i;
-  u64 phys_address;
-  u64 temp_64;
-  u64 temp_64_1;
-  u64 temp_64_2;
-
-  bool pbc;
-
-  int opcode;
-  int function;
 
 #if defined(MIPS_ESTIMATE)
 
@@ -368,7 +416,6 @@ void CAlphaCPU::execute() {
   }
 #endif
 #if defined(IDB)
-  char *funcname = 0;
   dbg_string[0] = '\0';
 #if !defined(LS_MASTER) && !defined(LS_SLAVE)
   dbg_strptr = dbg_string;
@@ -384,101 +431,11 @@ void CAlphaCPU::execute() {
 
     // We're actually executing code. Cycle counter should be updated, interrupt
     // and interrupt timer status needs to be checked, and the next instruction
-    // should be fetched from the instruction cache. Increase the cycle counter
-    // if it is currently enabled.
-    state.instruction_count++;
-    cc_large += cc_per_instruction;
-
-    if (cc_large > next_timer_int) {
-      next_timer_int += ins_per_timer_int;
-      cSystem->interrupt(-1, true);
-    }
-
-    if (state.cc_ena) {
-      state.cc += cc_per_instruction;
-    }
-
-    if (state.check_timers) {
-
-      // There are one or more active delayed irq_h interrupts. Go through the 6
-      // irq_h timers, decrease them as needed, and set the interrupt if the
-      // timer reaches 0.
-      state.check_timers = false;
-      for (int i = 0; i < 6; i++) {
-        if (state.irq_h_timer[i]) {
-
-          // This timer is active. Decrease it, and check if it reached 0.
-          state.irq_h_timer[i]--;
-          if (state.irq_h_timer[i]) {
-
-            // The timer hasn't reached 0 yet; check on the timers again next
-            // clock tick.
-            state.check_timers = true;
-          } else {
-
-            // The timer has reached 0. Set the interrupt status, and set the
-            // flag that we need to check the interrupt status
-            state.eir |= (U64(0x1) << i);
-            state.check_int = true;
-          }
-        }
-      }
-    }
+    // should be fetched from the instruction cache.
+    advance_clock(1);
 
-    if (state.check_int && !(state.pc & 1)) {
-
-      // One or more of the variables that affect interrupt status have changed,
-      // and we are not currently inside PALmode. It is not certain that this
-      // means we hava an interrupt to service, but we might have. This needs to
-      // be checked.
-
-      /*
-      if (state.pal_vms) {
-        // PALcode base is set to 0x8000; meaning OpenVMS PALcode is currently
-      active. In this
-        // case, our VMS PALcode replacement routines are valid, and should be
-      used as it is
-        // faster than using the original PALcode.
-
-        if (state.eir & state.eien & 6)
-          if (vmspal_ent_ext_int(state.eir&state.eien & 6))
-            return;
-
-        if (state.sir & state.sien & 0xfffc)
-          if (vmspal_ent_sw_int(state.sir&state.sien))
-            return;
-
-        if (state.asten && (state.aster & state.astrr & ((1<<(state.cm+1))-1) ))
-          if (vmspal_ent_ast_int(state.aster & state.astrr &
-      ((1<<(state.cm+1))-1) )) return;
-
-        if (state.sir & state.sien)
-          if (vmspal_ent_sw_int(state.sir&state.sien))
-            return;
-      } else
-*/
-      {
-
-        // PALcode base is set to an unsupported value. We have no choice but to
-        // transfer control to PALmode at the PALcode interrupt entry point.
-        //        if (state.eir & 8)
-        //        {
-        //          printf("%s: IP interrupt received%s...\n",devid_string,
-        //          (state.eien&8)?"(enabled)":"(masked)");
-        //        }
-        if ((state.eien & state.eir) || (state.sien & state.sir) ||
-            (state.asten &&
-             (state.aster & state.astrr & ((1 << (state.cm + 1)) - 1)))) {
-          GO_PAL(INTERRUPT);
-          return;
-        }
-      }
-
-      // This point is reached only if there are no more active interrupts. We
-      // can safely set check_int to false now to save time on the next CPU
-      // clock ticks.
-      state.check_int = false;
-    }
+    if (check_interrupts())
+      return;
 
     // If profiling is enabled, increase the profiling counter for the current
     // block of addresses.
@@ -502,6 +459,235 @@ void CAlphaCPU::execute() {
     ins = (u32)(cSystem->ReadMem(state.pc, 32, this));
   }
 
+  execute_ins(ins);
+}
+
+/**
+ * Check if an instruction writes to memory.
+ **/
+static inline bool is_store(u32 ins) {
+  switch (ins >> 26) {
+  case 0x0d: // STW
+  case 0x0e: // STB
+  case 0x0f: // STQ_U
+  case 0x1f: // HW_ST
+  case 0x24: // STF
+  case 0x25: // STG
+  case 0x26: // STS
+  case 0x27: // STT
+  case 0x2c: // STL
+  case 0x2d: // STQ
+  case 0x2e: // STL_C
+  case 0x2f: // STQ_C
+    return true;
+  default:
+    return false;
+  }
+}
+
+/**
+ * Return true if an instruction ends a basic block, because it may change
+ * the flow of control, the processor mode or the interrupt state, or reads
+ * the cycle counter.
+ **/
+static inline bool ends_block(u32 ins) {
+  switch (ins >> 26) {
+  case 0x00: // CALL_PAL
+  case 0x18: // Misc (MB, RPCC, RC, RS, ...)
+  case 0x1a: // JMP, JSR, RET, JSR_COROUTINE
+  case 0x1d: // HW_MTPR
+  case 0x1e: // HW_RET
+    return true;
+  default:
+    return (ins >> 26) >= 0x30; // branches
+  }
+}
+
+/**
+ * Fill a block cache entry with the instructions starting at a physical
+ * address (bit 0 set for PALmode). Decoding stops after the first instruction
+ * that ends a basic block, at the end of the 8 KB page, or after BLOCK_MAX_INS
+ * instructions.
+ **/
+void CAlphaCPU::decode_block(SBlock *b, u64 p_address) {
+  u64 p_a = p_address & ~U64(0x3);
+  u32 *mem;
+  int max;
+
+  b->p_address = p_address;
+  b->epoch = block_epoch;
+  b->code_gen = cSystem->mark_code_page(p_a);
+
+  mem = (u32 *)cSystem->PtrToMem(p_a);
+  max = (int)((U64(0x1) << CODE_PAGE_SHIFT) -
+              (p_a & ((U64(0x1) << CODE_PAGE_SHIFT) - 1))) /
+        4;
+  if (max > BLOCK_MAX_INS)
+    max = BLOCK_MAX_INS;
+
+  b->stores = false;
+  for (b->count = 0; b->count < max;) {
+    u32 ins = endian_32(mem[b->count]);
+    b->ins[b->count++] = ins;
+    if (is_store(ins))
+      b->stores = true;
+    if (ends_block(ins))
+      break;
+  }
+}
+
+/**
+ * \brief Execute a basic block.
+ *
+ * Used by the CPU thread instead of execute(). The instructions are taken
+ * from the decoded block cache, and interrupts and the clock are handled once
+ * per block instead of once per instruction. Falls back to execute() when the
+ * instruction cache is enabled (its contents may differ from memory), or when
+ * the code is not in main memory.
+ **/
+void CAlphaCPU::execute_block() {
+#if defined(IDB)
+  execute();
+#else
+  SBlock *b;
+  u64 p_a;
+  u64 key;
+  bool asm_bit;
+  int n;
+
+  if (!block_cache_enabled || icache_enabled) {
+    execute();
+    return;
+  }
+
+  state.current_pc = state.pc;
+  if (check_interrupts()) {
+    advance_clock(1);
+    return;
+  }
+
+  // Get the physical address of the next instruction. Like the icache-less
+  // path in get_icache, only translate when we enter a new page.
+  if (state.pc & 1) {
+    p_a = state.pc & ~U64(0x3);
+  } else if (state.rem_ins_in_page) {
+    p_a = state.pc_phys;
+  } else {
+    if (virt2phys(state.pc, &p_a, ACCESS_EXEC, &asm_bit, 0)) {
+      advance_clock(1);
+      return;
+    }
+
+    state.rem_ins_in_page = 2048 - ((((u32)state.pc) >> 2) & 2047);
+  }
+
+  state.pc_phys = p_a;
+
+  if (p_a >> cSystem->iNumMemoryBits) {
+    execute();
+    return;
+  }
+
+  key = p_a | (state.pc & 1);
+  b = &block_cache[(p_a >> 2) & (BLOCK_CACHE_ENTRIES - 1)];
+  if (b->epoch != block_epoch || b->p_address != key ||
+      b->code_gen != cSystem->get_code_gen(p_a))
+    decode_block(b, key);
+
+  // Run the block until it ends, or until an instruction transfers control
+  // (branch, trap) or writes to the page the block was decoded from.
+  for (n = 0; n < b->count;) {
+    u64 next = state.pc + 4;
+
+    state.current_pc = state.pc;
+    if (skip_memtest_hack)
+      skip_memtest();
+
+    execute_ins(b->ins[n++]);
+
+    if (state.pc != next || b->code_gen != cSystem->get_code_gen(p_a))
+      break;
+  }
+
+  advance_clock(n);
+
+  if (idle_enabled)
+    idle_check(p_a, b->stores, n);
+#endif
+}
+
+/**
+ * \brief Detect the guest idle loop.
+ *
+ * A guest that has nothing to do spins in a small loop that polls memory
+ * but writes nothing, until an interrupt arrives. When the CPU has run
+ * IDLE_INSTRUCTIONS instructions within one small window of code without
+ * executing a store, it is taken to be idle and the thread sleeps. The
+ * window is remembered, so when the guest returns to the same loop after
+ * handling the interrupt it goes to sleep again much sooner.
+ **/
+inline void CAlphaCPU::idle_check(u64 p_a, bool stores, int count) {
+  u64 window = p_a & IDLE_WINDOW_MASK;
+
+  if (stores || window != idle_window) {
+    idle_window = window;
+    idle_count = 0;
+    return;
+  }
+
+  idle_count += count;
+  if (idle_count < ((window == idle_known_window) ? IDLE_KNOWN_INSTRUCTIONS
+                                                  : IDLE_INSTRUCTIONS))
+    return;
+
+  idle_known_window = window;
+  idle_count = 0;
+  idle_wait();
+}
+
+/**
+ * Sleep until an interrupt is posted to this CPU, or for at most one
+ * interval timer period.
+ *
+ * On a multiprocessor the loop may be waiting for another CPU to write to
+ * memory rather than for an interrupt, so the CPU only sleeps while all
+ * other CPUs sleep as well, and is woken up as soon as one of them wakes.
+ **/
+void CAlphaCPU::idle_wait() {
+  // Delayed interrupts count down with executed instructions, and pending
+  // ones are about to be taken; don't sleep on those.
+  if (StopThread || state.check_int || state.check_timers)
+    return;
+
+  idle_sleeping = true;
+  if (cSystem->cpu_idle_begin() && !irq_posted.load())
+    idle_event.tryWait(1);
+  idle_sleeping = false;
+  cSystem->cpu_idle_end(this);
+}
+
+/**
+ * \brief Execute a single instruction.
+ *
+ * Advances the program counter and decodes and dispatches the instruction.
+ * Called by execute() and execute_block() once the instruction is fetched.
+ **/
+void CAlphaCPU::execute_ins(u32 ins) {
+  int i;
+  u64 phys_address;
+  u64 temp_64;
+  u64 temp_64_1;
+  u64 temp_64_2;
+
+  bool pbc;
+
+  int opcode;
+  int function;
+
+#if defined(IDB)
+  char *funcname = 0;
+#endif
+
   // Increase the program counter. The current value is retained in
   // state.current_pc.
   next_pc();
@@ -1237,6 +1423,11 @@ static u32 cpu_magic2 = 0xC8646212;
 int CAlphaCPU::SaveState(FILE *f) {
   long ss = sizeof(state);
 
+  // Twice, to also apply a release queued behind an assert.
+  take_posted_irqs();
+  take_posted_irqs();
+  sync_cc();
+
   fwrite(&cpu_magic1, sizeof(u32), 1, f);
   fwrite(&ss, sizeof(long), 1, f);
   fwrite(&state, sizeof(state), 1, f);
@@ -1293,6 +1484,14 @@ int CAlphaCPU::RestoreState(FILE *f) {
     return -1;
   }
 
+  icache_rebuild_index();
+  flush_blocks();
+  ftb_flush();
+  for (int i = 0; i < 6; i++)
+    irq_post[i] = IRQ_POST_NONE;
+  irq_posted = false;
+  set_cc_base();
+
   printf("%s: %d bytes restored.\n", devid_string, (int)ss);
   return 0;
 }
@@ -1734,6 +1933,17 @@ void CAlphaCPU::add_tb(u64 virt, u64 pte_phys, u64 pte_flags, int flags) {
       state.next_tb[t] = 0;
   }
 
+  // Keep the fast translation cache coherent with the DTB entry we're about
+  // to replace. Fast TB entries are per 8 KB page, so replacing an entry that
+  // maps a larger page flushes it completely.
+  if (!t) {
+    if (state.tb[t][i].valid && state.tb[t][i].match_mask != GH_0_MATCH)
+      ftb_flush();
+    else
+      ftb_invalidate(state.tb[t][i].virt);
+    ftb_invalidate(virt);
+  }
+
   state.tb[t][i].match_mask = match_mask;
   state.tb[t][i].keep_mask = keep_mask;
   state.tb[t][i].virt = virt & match_mask;
@@ -1845,6 +2055,8 @@ void CAlphaCPU::tbia(int flags) {
   int i;
   for (i = 0; i < TB_ENTRIES; i++)
     state.tb[t][i].valid = false;
+  if (!t)
+    ftb_flush();
   state.last_found_tb[t][0] = 0;
   state.last_found_tb[t][1] = 0;
   state.next_tb[t] = 0;
@@ -1864,6 +2076,8 @@ void CAlphaCPU::tbiap(int flags) {
   for (i = 0; i < TB_ENTRIES; i++)
     if (!state.tb[t][i].asm_bit)
       state.tb[t][i].valid = false;
+  if (!t)
+    ftb_flush_process();
 }
 
 /**
@@ -1877,10 +2091,68 @@ void CAlphaCPU::tbis(u64 virt, int flags) {
   int i = FindTBEntry(virt, flags);
   if (i >= 0)
     state.tb[t][i].valid = false;
+
+  // The page may be in the fast translation cache even if it has been
+  // replaced in the DTB, so always invalidate it there.
+  if (!t) {
+    if (i >= 0 && state.tb[t][i].match_mask != GH_0_MATCH)
+      ftb_flush();
+    else
+      ftb_invalidate(virt);
+  }
+}
+
+/**
+ * \brief Invalidate all fast data translation cache entries
+ **/
+void CAlphaCPU::ftb_flush() { memset(ftb, 0, sizeof(ftb)); }
+
+/**
+ * \brief Invalidate all process-specific fast data translation cache entries
+ *
+ * Invalidate all fast translation cache entries that do not have the ASM bit
+ * set.
+ **/
+void CAlphaCPU::ftb_flush_process() {
+  int rw;
+  int i;
+  for (rw = 0; rw < 2; rw++)
+    for (i = 0; i < FTB_ENTRIES; i++)
+      if (!ftb[rw][i].asm_bit)
+        ftb[rw][i].tag = 0;
+}
+
+/**
+ * \brief Invalidate the fast data translation cache entries for a page
+ *
+ * \param virt    Virtual address for which the entries should be invalidated.
+ **/
+void CAlphaCPU::ftb_invalidate(u64 virt) {
+  ftb[0][FTB_INDEX(virt)].tag = 0;
+  ftb[1][FTB_INDEX(virt)].tag = 0;
 }
 
 //\}
 
+/**
+ * \brief Rebuild the i-cache lookup index from the i-cache contents.
+ *
+ * Needed after the i-cache lines have been replaced wholesale, as on a
+ * state restore.
+ **/
+void CAlphaCPU::icache_rebuild_index() {
+  int i;
+
+  for (i = 0; i < ICACHE_HASH_SIZE; i++)
+    icache_hash[i] = -1;
+
+  for (i = ICACHE_ENTRIES - 1; i >= 0; i--) {
+    icache_bucket[i] = -1;
+    if (state.icache[i].valid)
+      icache_link(i);
+  }
+}
+
 /**
  * \brief Enable i-cache regardles of config file.
  *
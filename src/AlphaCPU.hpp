@@ -31,6 +31,7 @@
 
 #include "System.hpp"
 #include "SystemComponent.hpp"
+#include "base/Event.hpp"
 #include "cpu_defs.hpp"
 
 /// Number of entries in the Instruction Cache
@@ -44,8 +45,35 @@
 #define ICACHE_INDEX_MASK (u64)(ICACHE_LINE_SIZE - U64(0x1))
 /// Byte numer of an address in an ICache entry.
 #define ICACHE_BYTE_MASK (u64)(ICACHE_INDEX_MASK << 2)
+/// Number of buckets in the Instruction Cache lookup index
+#define ICACHE_HASH_SIZE 1024
+/// Bucket in the Instruction Cache lookup index for a (masked) address.
+#define ICACHE_HASH(a)                                                         \
+  ((int)(((a) >> 11) ^ ((a) >> 21) ^ (a)) & (ICACHE_HASH_SIZE - 1))
 /// Number of entries in each Translation Buffer
 #define TB_ENTRIES 16
+/// Number of entries in each fast data translation cache
+#define FTB_ENTRIES 2048
+/// Entry in the fast data translation cache for a virtual address.
+#define FTB_INDEX(a) ((int)((a) >> 13) & (FTB_ENTRIES - 1))
+/// Part of a virtual address that is translated by a fast TB entry.
+#define FTB_PAGE_MASK (~U64(0x1fff))
+/// Set in the tag of a valid fast TB entry.
+#define FTB_VALID U64(0x4)
+/// Number of entries in the decoded basic block cache
+#define BLOCK_CACHE_ENTRIES 4096
+/// Maximum number of instructions in a decoded basic block
+#define BLOCK_MAX_INS 32
+/// Code a store-free loop has to stay within to be taken as an idle loop
+#define IDLE_WINDOW_MASK (~U64(0x3ff))
+/// Instructions a new store-free loop has to run before it is taken as idle
+#define IDLE_INSTRUCTIONS 1000000
+/// Same, for the loop that was found idle last time
+#define IDLE_KNOWN_INSTRUCTIONS 2000
+/// No change posted for an IRQ_H line (see CAlphaCPU::irq_post)
+#define IRQ_POST_NONE -1
+/// Flag on a posted assert: the line was released again after it
+#define IRQ_POST_RELEASE 0x40000000
 
 /**
  * \brief Emulated CPU.
@@ -67,11 +95,13 @@ public:
   virtual int SaveState(FILE *f);
   virtual int RestoreState(FILE *f);
   void irq_h(int number, bool assert, int delay);
+  inline void idle_wake();
   int get_cpuid();
   void flush_icache();
 
   void run();
   void execute();
+  void execute_block();
   void release_threads();
 
   void set_PAL_BASE(u64 pb);
@@ -113,6 +143,7 @@ public:
   void listing(u64 from, u64 to, u64 mark);
 #endif
   int virt2phys(u64 virt, u64 *phys, int flags, bool *asm_bit, u32 instruction);
+  int virt2phys_data(u64 virt, u64 *phys, int flags, u32 instruction);
 
   virtual void init();
   virtual void start_threads();
@@ -125,6 +156,19 @@ private:
   bool StopThread;
 
   int get_icache(u64 address, u32 *data);
+  void icache_link(int i);
+  void icache_unlink(int i);
+  void icache_rebuild_index();
+  void execute_ins(u32 ins);
+  void advance_clock(u64 count);
+  bool check_interrupts();
+  void irq_h_apply(int number, bool assert, int delay);
+  void take_posted_irqs();
+  void idle_check(u64 p_a, bool stores, int count);
+  void idle_wait();
+  void sync_cc();
+  void set_cc_base();
+  void flush_blocks();
   int FindTBEntry(u64 virt, int flags);
   void add_tb(u64 virt, u64 pte_phys, u64 pte_flags, int flags);
   void add_tb_i(u64 virt, u64 pte);
@@ -132,6 +176,9 @@ private:
   void tbia(int flags);
   void tbiap(int flags);
   void tbis(u64 virt, int flags);
+  void ftb_flush();
+  void ftb_flush_process();
+  void ftb_invalidate(u64 virt);
 
   /* Floating Point routines */
   u64 ieee_lds(u32 op);
@@ -234,22 +281,35 @@ private:
   int vmspal_int_initiate_interrupt();
 
   bool icache_enabled;
+  bool block_cache_enabled;
+
+  /// Mailbox for IRQ_H[0:5] changes posted by other threads: 0 to release
+  /// the line, delay + 1 to assert it, delay + 1 | IRQ_POST_RELEASE for an
+  /// assert followed by a release, or IRQ_POST_NONE. Only this CPU's own
+  /// thread applies them to the state.
+  std::atomic<int> irq_post[6];
+  std::atomic_bool irq_posted{false};
+
+  /// Idle loop detection: the CPU thread sleeps in a loop that does not
+  /// write to memory until irq_h or another CPU waking up wakes it, or the
+  /// timer tick passes.
+  bool idle_enabled;
+  u64 idle_window;       /**< Window (physical) the current loop runs in */
+  u64 idle_known_window; /**< Window of the last loop found idle */
+  u64 idle_count;        /**< Store-free instructions run in idle_window */
+  std::atomic_bool idle_sleeping{false};
+  CEvent idle_event;
   bool skip_memtest_hack;
   int skip_memtest_counter;
 
   // ... ... ...
-  u64 cc_large;
-  u64 start_icount;
-  u64 start_cc;
-  CTimestamp start_time;
-  u64 prev_icount;
-  u64 prev_cc;
-  u64 prev_time;
-  u64 cc_per_instruction;
-  u64 ins_per_timer_int;
-  u64 next_timer_int;
   u64 cpu_hz;
 
+  /// Value of state.cc at host time cc_base_time. While the cycle counter
+  /// is enabled, state.cc is derived from the host clock and these.
+  u64 cc_base;
+  u64 cc_base_time;
+
   /// The state structure contains all elements that need to be saved to the
   /// statefile
   struct SCPU_state {
@@ -371,6 +431,57 @@ private:
     bool check_timers;
   } state; /**< Determines CPU state that needs to be saved to the state file */
 
+  /**
+   * \brief Fast data translation cache entry.
+   *
+   * A direct-mapped cache of successful data-stream translations done by
+   * virt2phys, per 8 KB page, processor mode and access type (read or write).
+   * Access and fault checks have already passed for a cached translation, so
+   * virt2phys_data can skip virt2phys for it. The emulated translation buffer
+   * (state.tb) stays the architectural one; this cache is kept coherent with
+   * it by tbia, tbiap, tbis and add_tb, and is not saved to the state file.
+   **/
+  struct SFastTB {
+    u64 tag;      /**< Virtual page | current mode | FTB_VALID */
+    u64 phys;     /**< Physical address of page */
+    int asn;      /**< Address Space Number */
+    bool asm_bit; /**< Address Space Match bit */
+  } ftb[2][FTB_ENTRIES]; /**< Fast TB entries [read/write] */
+
+  /**
+   * \brief Decoded basic block.
+   *
+   * A run of up to BLOCK_MAX_INS instructions, starting at a physical address,
+   * that ends with the first instruction that may change the flow of control
+   * or the processor mode, or at the end of the 8 KB page. The interrupt and
+   * timer bookkeeping that execute() does for every instruction is done once
+   * per block by execute_block().
+   *
+   * Blocks are keyed by physical address (bit 0 set in PALmode), so they
+   * don't depend on the ASN; they are dropped when the instruction cache is
+   * flushed, and when the page they were read from is written to (see
+   * CSystem::get_code_gen).
+   **/
+  struct SBlock {
+    u64 p_address;          /**< Physical address of first instruction */
+    u32 epoch;              /**< Value of block_epoch when decoded */
+    u32 code_gen;           /**< Code page generation when decoded */
+    int count;              /**< Number of instructions in the block */
+    bool stores;            /**< Block contains store instructions */
+    u32 ins[BLOCK_MAX_INS]; /**< Pre-fetched instructions */
+  } block_cache[BLOCK_CACHE_ENTRIES];
+  u32 block_epoch; /**< Incremented to invalidate all decoded blocks */
+
+  /**
+   * Lookup index over state.icache. Lines are chained per bucket of
+   * ICACHE_HASH(address); this is derived from state.icache and rebuilt
+   * after a restore, so it is not part of the saved state.
+   **/
+  int icache_hash[ICACHE_HASH_SIZE];  /**< First line in each bucket, or -1 */
+  int icache_next[ICACHE_ENTRIES];    /**< Next line in the same bucket */
+  int icache_bucket[ICACHE_ENTRIES];  /**< Bucket a line is linked in, or -1 */
+  void decode_block(SBlock *b, u64 p_address);
+
 #ifdef IDB
   u64 current_pc_physical; /**< Physical address of current instruction */
   u32 last_instruction;
@@ -387,10 +498,24 @@ private:
 #define RREG(a)                                                                \
   (((a)&0x1f) + (((state.pc & 1) && (((a)&0xc) == 0x4) && state.sde) ? 32 : 0))
 
+/**
+ * Invalidate all decoded basic blocks.
+ **/
+inline void CAlphaCPU::flush_blocks() {
+  block_epoch++;
+  if (!block_epoch) {
+    // wrapped around; make sure no stale block can match again.
+    for (int i = 0; i < BLOCK_CACHE_ENTRIES; i++)
+      block_cache[i].epoch = 0;
+    block_epoch = 1;
+  }
+}
+
 /**
  * Empty the instruction cache.
  **/
 inline void CAlphaCPU::flush_icache() {
+  flush_blocks();
   if (icache_enabled) {
 
     //  memset(state.icache,0,sizeof(state.icache));
@@ -401,15 +526,50 @@ inline void CAlphaCPU::flush_icache() {
       //    state.icache[i].asm_bit = true;
     }
 
+    for (i = 0; i < ICACHE_HASH_SIZE; i++)
+      icache_hash[i] = -1;
+    for (i = 0; i < ICACHE_ENTRIES; i++)
+      icache_bucket[i] = -1;
+
     state.next_icache = 0;
     state.last_found_icache = 0;
   }
 }
 
+/**
+ * Add an instruction cache line to the lookup index.
+ **/
+inline void CAlphaCPU::icache_link(int i) {
+  int h = ICACHE_HASH(state.icache[i].address);
+  icache_next[i] = icache_hash[h];
+  icache_hash[h] = i;
+  icache_bucket[i] = h;
+}
+
+/**
+ * Remove an instruction cache line from the lookup index.
+ **/
+inline void CAlphaCPU::icache_unlink(int i) {
+  int *p;
+
+  if (icache_bucket[i] < 0)
+    return;
+
+  for (p = &icache_hash[icache_bucket[i]]; *p >= 0; p = &icache_next[*p]) {
+    if (*p == i) {
+      *p = icache_next[i];
+      break;
+    }
+  }
+
+  icache_bucket[i] = -1;
+}
+
 /**
  * Empty the instruction cache of lines with the ASM bit clear.
  **/
 inline void CAlphaCPU::flush_icache_asm() {
+  flush_blocks();
   if (icache_enabled) {
     int i;
     for (i = 0; i < ICACHE_ENTRIES; i++)
@@ -431,10 +591,11 @@ inline void CAlphaCPU::set_PAL_BASE(u64 pb) {
  * Get an instruction from the instruction cache.
  * If necessary, fill a new cache block from memory.
  *
- * get_icache checks all cache entries, to see if there is a
- * cache entry that matches the current address space number,
- * and that contains the address we're looking for. If it
- * exists, the instruction is fetched from this cache,
+ * get_icache checks the cache entries in the index bucket for
+ * the address, to see if there is a cache entry that matches the
+ * current address space number, and that contains the address
+ * we're looking for. If it exists, the instruction is fetched
+ * from this cache,
  * otherwise, the physical address for the instruction is
  * calculated, and the cache block is filled.
  *
@@ -467,7 +628,9 @@ inline int CAlphaCPU::get_icache(u64 address, u32 *data) {
       return 0;
     }
 
-    for (i = 0; i < ICACHE_ENTRIES; i++) {
+    // Only the lines in the matching bucket of the index can match.
+    for (i = icache_hash[ICACHE_HASH(address & ICACHE_MATCH_MASK)]; i >= 0;
+         i = icache_next[i]) {
       if (state.icache[i].valid &&
           (state.icache[i].asn == state.asn || state.icache[i].asm_bit) &&
           state.icache[i].address == (address & ICACHE_MATCH_MASK)) {
@@ -494,6 +657,7 @@ inline int CAlphaCPU::get_icache(u64 address, u32 *data) {
         return result;
     }
 
+    icache_unlink(state.next_icache);
     memcpy(state.icache[state.next_icache].data, cSystem->PtrToMem(p_a),
            ICACHE_LINE_SIZE * 4);
 
@@ -502,6 +666,7 @@ inline int CAlphaCPU::get_icache(u64 address, u32 *data) {
     state.icache[state.next_icache].asm_bit = asm_bit;
     state.icache[state.next_icache].address = address & ICACHE_MATCH_MASK;
     state.icache[state.next_icache].p_address = p_a;
+    icache_link(state.next_icache);
 
     *data = endian_32(state.icache[state.next_icache]
                           .data[(address >> 2) & ICACHE_INDEX_MASK]);
@@ -534,6 +699,40 @@ inline int CAlphaCPU::get_icache(u64 address, u32 *data) {
   return 0;
 }
 
+/**
+ * \brief Translate a data-stream virtual address to a physical address.
+ *
+ * Plain reads and writes are looked up in the fast translation cache first;
+ * on a miss, or for any other kind of access, this is virt2phys. Successful
+ * plain translations are added to the fast translation cache.
+ **/
+inline int CAlphaCPU::virt2phys_data(u64 virt, u64 *phys, int flags,
+                                     u32 ins) {
+#if !defined(IDB)
+  if (!(flags & ~ACCESS_WRITE)) {
+    SFastTB *e = &ftb[flags][FTB_INDEX(virt)];
+    u64 tag = (virt & FTB_PAGE_MASK) | state.cm | FTB_VALID;
+    bool asm_bit;
+
+    if (e->tag == tag && (e->asm_bit || e->asn == state.asn0)) {
+      *phys = e->phys | (virt & ~FTB_PAGE_MASK);
+      return 0;
+    }
+
+    if (virt2phys(virt, phys, flags, &asm_bit, ins))
+      return -1;
+
+    e->tag = tag;
+    e->phys = *phys & FTB_PAGE_MASK;
+    e->asn = state.asn0;
+    e->asm_bit = asm_bit;
+    return 0;
+  }
+#endif
+
+  return virt2phys(virt, phys, flags, NULL, ins);
+}
+
 /**
  * Convert a virtual address to va_form format.
  * Used for IPR VA_FORM [HRM 5-5..6] and IPR IVA_FORM [HRM 5-9].
@@ -567,8 +766,41 @@ inline int CAlphaCPU::get_cpuid() { return state.iProcNum; }
 
 /**
  * Assert or release an external interrupt line to the cpu.
+ *
+ * This may be called from any thread; the change is posted to the CPU and
+ * picked up by the CPU's own thread before it checks for interrupts. A CPU
+ * sleeping in its idle loop is woken up.
  **/
 inline void CAlphaCPU::irq_h(int number, bool assert, int delay) {
+  int post = irq_post[number].load(std::memory_order_relaxed);
+  int next;
+
+  // A release that follows an assert the CPU hasn't picked up yet is queued
+  // behind it, so the CPU still sees the interrupt.
+  do {
+    if (assert)
+      next = delay + 1;
+    else if (post > 0)
+      next = post | IRQ_POST_RELEASE;
+    else
+      next = 0;
+  } while (!irq_post[number].compare_exchange_weak(post, next));
+  irq_posted.store(true);
+  idle_wake();
+}
+
+/**
+ * Wake the CPU thread up if it is sleeping in an idle loop.
+ **/
+inline void CAlphaCPU::idle_wake() {
+  if (idle_sleeping.load())
+    idle_event.set();
+}
+
+/**
+ * Apply a change to an external interrupt line to the cpu state.
+ **/
+inline void CAlphaCPU::irq_h_apply(int number, bool assert, int delay) {
   bool active = (state.eir & (U64(0x1) << number)) || state.irq_h_timer[number];
   if (assert && !active) {
     if (delay) {
@@ -593,6 +825,56 @@ inline void CAlphaCPU::irq_h(int number, bool assert, int delay) {
   }
 }
 
+/**
+ * Apply the interrupt line changes other threads have posted.
+ **/
+inline void CAlphaCPU::take_posted_irqs() {
+  int post;
+  int none;
+
+  // Clear the flag before emptying the mailbox; a change posted after this
+  // sets it again.
+  irq_posted.exchange(false);
+  for (int i = 0; i < 6; i++) {
+    post = irq_post[i].exchange(IRQ_POST_NONE);
+    if (post == IRQ_POST_NONE)
+      continue;
+
+    if (post & IRQ_POST_RELEASE) {
+      // Assert now, and leave the release for the next time round, after
+      // the interrupt has been checked for. A newer change replaces it.
+      post &= ~IRQ_POST_RELEASE;
+      none = IRQ_POST_NONE;
+      if (irq_post[i].compare_exchange_strong(none, 0))
+        irq_posted.store(true);
+    }
+
+    irq_h_apply(i, post != 0, post ? post - 1 : 0);
+  }
+}
+
+/**
+ * Bring the cycle counter up to date with the host clock; call this before
+ * reading state.cc.
+ **/
+inline void CAlphaCPU::sync_cc() {
+  if (!state.cc_ena)
+    return;
+
+  u64 lapse = host_time_ns() - cc_base_time;
+  state.cc = cc_base + (lapse / 1000000000) * cpu_hz +
+             (lapse % 1000000000) * cpu_hz / 1000000000;
+}
+
+/**
+ * Make the host clock count on from the current cycle counter value; call
+ * this after changing state.cc or state.cc_ena.
+ **/
+inline void CAlphaCPU::set_cc_base() {
+  cc_base = state.cc;
+  cc_base_time = host_time_ns();
+}
+
 /**
  * Return program counter value.
  **/
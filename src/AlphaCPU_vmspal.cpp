@@ -208,6 +208,7 @@ void CAlphaCPU::vmspal_call_swpctx() {
   hw_ldq(r16 + 0x40, p7);
   hw_ldq(r16 + 0x20, p6);
 
+  sync_cc();
   p4 = (state.cc & U64(0xffffffff)) + state.cc_offset;
   state.cc_offset = ((u32)p7 & 0xffffffff) - (state.cc & U64(0xffffffff));
 
@@ -741,6 +742,7 @@ void CAlphaCPU::vmspal_call_wr_ps_sw() {
  * Implementation of CALL_PAL RSCC opcode.
  **/
 void CAlphaCPU::vmspal_call_rscc() {
+  sync_cc();
   hw_ldq(p21 + 0xa0, r0);
   if ((state.cc & U64(0xffffffff)) < (r0 & U64(0x00000000ffffffff)))
     r0 += U64(0x1) << 0x20;
@@ -946,6 +948,7 @@ int CAlphaCPU::vmspal_ent_ext_int(int ei) {
     p22 += U64(0x0000010000000000);
     p22 &= U64(0xffff0fffffffffff);
 
+    sync_cc();
     hw_ldq(p21 + 0xa0, p20);
     p6 = U64(0x1) << 0x20;
     p4 = (state.cc & U64(0xffffffff));
@@ -34,6 +34,7 @@
 #include "Cirrus.hpp"
 #include "DMA.hpp"
 #include "DPR.hpp"
+#include "DiskCow.hpp"
 #include "DiskDevice.hpp"
 #include "DiskFile.hpp"
 #include "DiskRam.hpp"
@@ -49,7 +50,7 @@
 #include "Radeon.h"
 #endif
 #include "gui/plugin.hpp"
-#if defined(HAVE_PCAP)
+#if defined(HAVE_NETWORK)
 #include "DEC21143.hpp"
 #endif
 #include "Sym53C810.hpp"
@@ -553,6 +554,7 @@ classinfo classes[] = {{"tsunami", c_tsunami, N_P | IS_CS | HAS_PCI},
                        {"file", c_file, IS_DISK},
                        {"device", c_device, IS_DISK},
                        {"ramdisk", c_ramdisk, IS_DISK},
+                       {"cow", c_cow, IS_DISK},
                        {"sdl", c_sdl, N_P | IS_GUI},
                        {"win32", c_win32, N_P | IS_GUI},
                        {"X11", c_x11, N_P | IS_GUI},
@@ -608,11 +610,11 @@ void CConfigurator::initialize() {
                 myName);
   }
 
-#if !defined(HAVE_PCAP)
+#if !defined(HAVE_NETWORK)
   if (myFlags & IS_NIC)
     FAILURE_2(Configuration,
-              "Class %s for %s needs compilation with libpcap support", myValue,
-              myName);
+              "Class %s for %s needs compilation with a network backend",
+              myValue, myName);
 #endif
   if (myFlags & IS_PCI) {
     if (strncmp(myName, "pci", 3))
@@ -730,7 +732,7 @@ void CConfigurator::initialize() {
 #endif
     break;
 
-#if defined(HAVE_PCAP)
+#if defined(HAVE_NETWORK)
 
   case c_dec21143:
     myDevice =
@@ -774,6 +776,12 @@ void CConfigurator::initialize() {
                      idebus, idedev);
     break;
 
+  case c_cow:
+    myDevice =
+        new CDiskCow(this, theSystem, (CDiskController *)pParent->get_device(),
+                     idebus, idedev);
+    break;
+
   case c_serial:
     number = 0;
     if (!strncmp(myName, "serial", 6)) {
@@ -60,6 +60,7 @@ typedef enum {
   c_file,
   c_device,
   c_ramdisk,
+  c_cow,
 
   // gui's
   c_sdl,
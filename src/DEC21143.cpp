@@ -32,10 +32,26 @@
 
 #include "StdAfx.hpp"
 
-#if defined(HAVE_PCAP)
+#if defined(HAVE_NETWORK)
 #include "DEC21143.hpp"
+#include "NetPcap.hpp"
+#include "NetTap.hpp"
+#include "NetVswitch.hpp"
 #include "System.hpp"
 
+#if defined(HAVE_POLL)
+#include <fcntl.h>
+#include <poll.h>
+#endif
+#if defined(HAVE_EVENTFD)
+#include <sys/eventfd.h>
+#endif
+
+/// How long the NIC thread sleeps when nothing happens. Received packets and
+/// register writes wake it up earlier; this only paces transmit descriptor
+/// polling and backends without a selectable descriptor.
+#define NIC_IDLE_MS 20
+
 #if defined(DEBUG_NIC)
 #define DEBUG_NIC_FILTER
 #define DEBUG_NIC_SROM
@@ -50,6 +66,92 @@
 #define MII_STATE_D 5
 #define MII_STATE_IDLE 6
 
+/**
+ * \brief Create the doorbell used to wake the NIC thread.
+ **/
+void CDEC21143::open_doorbell() {
+#if defined(HAVE_EVENTFD)
+  doorbell_rd = doorbell_wr = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+#elif defined(HAVE_POLL)
+  int fds[2];
+  if (pipe(fds) == 0) {
+    fcntl(fds[0], F_SETFL, O_NONBLOCK);
+    fcntl(fds[1], F_SETFL, O_NONBLOCK);
+    doorbell_rd = fds[0];
+    doorbell_wr = fds[1];
+  }
+#endif
+  if (doorbell_rd < 0)
+    printf("%s: no doorbell; polling every %d ms.\n", devid_string,
+           NIC_IDLE_MS);
+}
+
+void CDEC21143::close_doorbell() {
+#if defined(HAVE_POLL)
+  if (doorbell_wr >= 0 && doorbell_wr != doorbell_rd)
+    close(doorbell_wr);
+  if (doorbell_rd >= 0)
+    close(doorbell_rd);
+#endif
+  doorbell_rd = doorbell_wr = -1;
+}
+
+/**
+ * \brief Wake the NIC thread.
+ *
+ * Called from the CPU thread when the guest demands a transmit or receive
+ * poll, changes the operating mode, or acknowledges interrupts.
+ **/
+void CDEC21143::ring_doorbell() {
+#if defined(HAVE_POLL)
+  if (doorbell_wr >= 0) {
+#if defined(HAVE_EVENTFD)
+    u64 one = 1;
+#else
+    u8 one = 1;
+#endif
+    // If this fails, the doorbell is already ringing.
+    (void)!write(doorbell_wr, &one, sizeof(one));
+  }
+#endif
+}
+
+/**
+ * \brief Sleep until a packet arrives, the doorbell rings, or NIC_IDLE_MS
+ * have passed.
+ **/
+void CDEC21143::wait_for_work() {
+#if defined(HAVE_POLL)
+  struct pollfd pfd[2];
+  int n = 0;
+
+  if (doorbell_rd >= 0) {
+    pfd[n].fd = doorbell_rd;
+    pfd[n].events = POLLIN;
+    n++;
+  }
+
+  // Only wait for packets if we would take them.
+  int net_fd = backend->get_fd();
+  if (net_fd >= 0 && (state.reg[CSR_OPMODE / 8] & OPMODE_SR) &&
+      !(state.reg[CSR_OPMODE / 8] & OPMODE_OM_INTLOOP)) {
+    pfd[n].fd = net_fd;
+    pfd[n].events = POLLIN;
+    n++;
+  }
+
+  if (n && poll(pfd, n, NIC_IDLE_MS) > 0 && doorbell_rd >= 0 &&
+      (pfd[0].revents & POLLIN)) {
+    u8 buf[64];
+    while (read(doorbell_rd, buf, sizeof(buf)) > 0)
+      ;
+  }
+  if (n)
+    return;
+#endif
+  std::this_thread::sleep_for(std::chrono::milliseconds(NIC_IDLE_MS));
+}
+
 /**
  * Thread entry point.
  **/
@@ -81,7 +183,7 @@ void CDEC21143::run() {
           state.irq_was_asserted = asserted;
       }
 
-      std::this_thread::sleep_for(std::chrono::milliseconds(20));
+      wait_for_work();
     }
   }
 
@@ -236,84 +338,44 @@ CDEC21143::CDEC21143(CConfigurator *confg, CSystem *c, int pcibus, int pcidev)
  * Initialize the network device.
  **/
 void CDEC21143::init() {
-  pcap_if_t *alldevs;
-
-  pcap_if_t *d;
-  u_int inum;
-  u_int i = 0;
-  char errbuf[PCAP_ERRBUF_SIZE];
   char *cfg;
 
   add_function(0, dec21143_cfg_data, dec21143_cfg_mask);
 
-  cfg = myCfg->get_text_value("adapter");
-  if (!cfg) {
-    printf("\n%s: Choose a network adapter to connect to:\n", devid_string);
-    if (pcap_findalldevs(&alldevs, errbuf) == -1) {
-      FAILURE_1(Runtime, "Error in pcap_findalldevs_ex: %s", errbuf);
-    }
-
-    /* Print the list */
-    for (d = alldevs; d; d = d->next) {
-      printf("%d. %s\n    ", ++i, d->name);
-      if (d->description)
-        printf(" (%s)\n", d->description);
-      else
-        printf(" (No description available)\n");
-    }
-
-    if (i == 0)
-      FAILURE(Runtime, "No network interfaces found");
-
-    if (i == 1)
-      inum = 1;
-    else {
-      inum = 0;
-      while (inum < 1 || inum > i) {
-        printf("%%NIC-Q-NICNO: Enter the interface number (1-%d):", i);
-        (void)!scanf("%d", &inum);
-      }
-    }
-
-    /* Jump to the selected adapter */
-    for (d = alldevs, i = 0; i < inum - 1; d = d->next, i++)
-      ;
-
-    cfg = d->name;
-  }
-
-#if defined(WIN32)
-
-  // Opening with pcap_open on Windows allows specification of
-  // PCAP_OPENFLAG_NOCAPTURE_LOCAL, which stops the pcap device from seeing it's
-  // own transmitted packets.
-  //
-  // This is important because:
-  //    1. Real ethernet cards don't reflect packets except while in loopback
-  //    mode(s).
-  //    2. Reflecting all packets increases inbound packet processing and host
-  //    load.
-  //    3. DECNET Phase IV will think a reflected packet is from another node
-  //            that has the same DECNET Phase IV address (AA-xx-xx-xx-xx-xx),
-  //            and will panic on startup and abort.
-  //    4. Libpcap doesn't reflect packets, and we want winpcap/libpcap
-  //    processing to be identical.
-  // Loopback packets are handled via direct entry in the receive queue.
-  if ((fp = pcap_open(cfg, 65536 /*snaplen: capture entire packets */,
-                      PCAP_OPENFLAG_PROMISCUOUS |
-                          PCAP_OPENFLAG_NOCAPTURE_LOCAL /*promiscuous */,
-                      10 /*read timeout: 10ms. */, 0 /* auth structure */,
-                      errbuf)) == NULL) // connect to pcap...
+  // Host side: pcap on a host adapter, a TAP interface, or a virtual switch
+  // shared with other emulated NICs.
+#if defined(HAVE_PCAP)
+  cfg = myCfg->get_text_value("backend", "pcap");
+#elif defined(HAVE_TAP)
+  cfg = myCfg->get_text_value("backend", "tap");
 #else
-  if ((fp = pcap_open_live(cfg, 65536 /*snaplen: capture entire packets */,
-                           1 /*promiscuous */, 1 /*read timeout: 1ms. */,
-                           errbuf)) == nullptr) // connect to pcap...
+  cfg = myCfg->get_text_value("backend", "vswitch");
 #endif
-    FAILURE_2(Runtime, "Error opening adapter %s:\n %s", cfg, errbuf);
-
-  if (pcap_setnonblock(fp, 1, errbuf) == PCAP_ERROR)
-    FAILURE_2(Runtime, "Error setting adapter %s non-blocking:\n %s", cfg,
-              errbuf);
+  if (!strcmp(cfg, "pcap")) {
+#if defined(HAVE_PCAP)
+    backend = new CNetPcap(devid_string, myCfg->get_text_value("adapter"));
+#else
+    FAILURE_1(Configuration, "%s: backend pcap needs libpcap support",
+              devid_string);
+#endif
+  } else if (!strcmp(cfg, "tap")) {
+#if defined(HAVE_TAP)
+    backend = new CNetTap(devid_string, myCfg->get_text_value("adapter"));
+#else
+    FAILURE_1(Configuration, "%s: backend tap needs Linux TAP support",
+              devid_string);
+#endif
+  } else if (!strcmp(cfg, "vswitch")) {
+#if defined(HAVE_VSWITCH)
+    backend = new CNetVswitch(devid_string,
+                              myCfg->get_text_value("switch", "axpbox"));
+#else
+    FAILURE_1(Configuration, "%s: backend vswitch needs Linux",
+              devid_string);
+#endif
+  } else
+    FAILURE_2(Configuration, "%s: unknown network backend %s", devid_string,
+              cfg);
 
   // set default mac = Digital ethernet prefix: 08-00-2B + hexified "ES40" + nic
   // number
@@ -390,6 +452,7 @@ void CDEC21143::start_threads() {
   if (!myThread) {
     printf(" nic");
     StopThread = false;
+    open_doorbell();
     myThread = std::make_unique<std::thread>([this](){ this->run(); });
   }
 }
@@ -398,8 +461,10 @@ void CDEC21143::stop_threads() {
   StopThread = true;
   if (myThread) {
     printf(" nic");
+    ring_doorbell();
     myThread->join();
     myThread = nullptr;
+    close_doorbell();
   }
 }
 
@@ -407,9 +472,16 @@ void CDEC21143::stop_threads() {
  * Destructor.
  **/
 CDEC21143::~CDEC21143() {
+  SPacketQueueStats stats;
+
   stop_threads();
 
-  pcap_close(fp);
+  rx_queue->get_stats(&stats);
+  printf("%s: receive queue: %" PRIu64 " frames queued, %" PRIu64
+         " dropped, %d at most.\n",
+         devid_string, stats.packets, stats.dropped, stats.highwater);
+
+  delete backend;
   delete rx_queue;
 }
 
@@ -445,18 +517,14 @@ void CDEC21143::check_state() {
 }
 
 void CDEC21143::receive_process() {
-  struct pcap_pkthdr *packet_header;
-  const u_char *packet_data = NULL;
 
   // if receive process active
   if (state.reg[CSR_OPMODE / 8] & OPMODE_SR) {
 
     // get packets from host nic if not in internal loopback mode
     if (!(state.reg[CSR_OPMODE / 8] & OPMODE_OM_INTLOOP)) {
-      while (pcap_next_ex(fp, &packet_header, &packet_data) > 0) {
-        rx_queue->add_tail(packet_data, packet_header->caplen, calc_crc, true);
+      if (backend->receive(rx_queue, calc_crc))
         state.reg[CSR_SIASTAT / 8] |= SIASTAT_TRA; // set 10bT activity
-      }
     }
 
     // process a receive descriptor until we run out of
@@ -529,12 +597,11 @@ void CDEC21143::nic_write(u32 address, int dsize, u32 data) {
     state.reg[CSR_STATUS / 8] &= ~STATUS_TU;
     state.tx.suspend = false;
     state.tx.idling = state.tx.idling_threshold;
-
-    //        DoClock();
+    ring_doorbell();
     break;
 
   case CSR_RXPOLL: /*  csr2  */
-    //        DoClock();
+    ring_doorbell();
     break;
 
   case CSR_RXLIST: /*  csr3  */
@@ -556,8 +623,7 @@ void CDEC21143::nic_write(u32 address, int dsize, u32 data) {
   case CSR_STATUS: /*  csr5  */
   case CSR_INTEN:  /*  csr7  */
     /*  Recalculate interrupt assertion.  */
-
-    //              DoClock();
+    ring_doorbell();
     break;
 
   case CSR_OPMODE: /*  csr6:  */
@@ -616,7 +682,7 @@ void CDEC21143::nic_write(u32 address, int dsize, u32 data) {
     //                      printf("[ dec21143: UNIMPLEMENTED OPMODE bits:
     //                      0x%08x ]\n", (int)data);
     //              }
-    //              DoClock();
+    ring_doorbell();
     break;
 
   case CSR_MISSED: /*  csr8  */
@@ -1004,17 +1070,17 @@ int CDEC21143::dec21143_rx() {
   int to_xfer;
 
   /*  Is current packet finished? Then check for new ones.  */
-  if (state.rx.current.used >= state.rx.current.len) {
+  if (!rx_packet) {
 
     /*  Nothing available? Then abort.  */
-    if (rx_queue->count() == 0)
+    if (!(rx_packet = rx_queue->head_packet()))
       return 0; // indicate nothing was processed
 
     //      printf("pcap recv: %d bytes (%d captured) for
     //      %02x:%02x:%02x:%02x:%02x:%02x  \n",packet_header->len,
     //      packet_header->caplen,packet_data[0],packet_data[1],packet_data[2],packet_data[3],packet_data[4],packet_data[5]);
-    // get next packet from receive queue
-    rx_queue->get_head(state.rx.current);
+    // the packet is DMA'd straight from the receive queue, and released when
+    // it's done
 
     /*  Append a 4 byte CRC:  */
 
@@ -1065,53 +1131,56 @@ int CDEC21143::dec21143_rx() {
   rdes0 = 0x00000000;
 
   //  Is this the first buffer of the frame?
-  if (state.rx.current.used == 0)
+  if (rx_packet->used == 0)
     rdes0 |= TDSTAT_Rx_FS;
 
   // use buffer 1, if length is non-zero
   if (buf1_size > 0) {
-    to_xfer = state.rx.current.len - state.rx.current.used;
+    to_xfer = rx_packet->len - rx_packet->used;
     if (to_xfer > buf1_size)
       to_xfer = buf1_size;
 
     // DMA bytes from the packet into buffer 1
-    do_pci_write(rdes2, &state.rx.current.frame[state.rx.current.used], 1,
-                 to_xfer);
+    do_pci_write(rdes2, &rx_packet->frame[rx_packet->used], 1, to_xfer);
 
     // update used
-    state.rx.current.used += to_xfer;
+    rx_packet->used += to_xfer;
   }
 
   // use buffer 2, if length is non-zero and not a chain buffer
   if ((buf2_size > 0) && (!(rdes1 & TDCTL_CH))) {
-    to_xfer = state.rx.current.len - state.rx.current.used;
+    to_xfer = rx_packet->len - rx_packet->used;
     if (to_xfer > buf2_size)
       to_xfer = buf2_size;
 
     // DMA bytes from the packet into buffer 2
-    do_pci_write(rdes3, state.rx.current.frame + state.rx.current.used, 1,
-                 to_xfer);
+    do_pci_write(rdes3, rx_packet->frame + rx_packet->used, 1, to_xfer);
 
     // update used
-    state.rx.current.used += to_xfer;
+    rx_packet->used += to_xfer;
   }
 
   //  Frame completed?
-  if (state.rx.current.used >= state.rx.current.len) {
+  if (rx_packet->used >= rx_packet->len) {
 
     //        debug("frame complete.\n");
     rdes0 |= TDSTAT_Rx_LS;
 
     /*  Set the frame length:  */
-    rdes0 |= (state.rx.current.len << 16) & TDSTAT_Rx_FL;
+    rdes0 |= (rx_packet->len << 16) & TDSTAT_Rx_FL;
 
     /*  Frame too long? (1518 is max ethernet frame length)  */
-    if (state.rx.current.len > 1518)
+    if (rx_packet->len > 1518)
       rdes0 |= TDSTAT_Rx_TL;
 
     // set receive interrupt and receive state to waiting-for-packet
     state.reg[CSR_STATUS / 8] =
         (state.reg[CSR_STATUS / 8] & ~STATUS_RS) | STATUS_RI | STATUS_RS_WAIT;
+
+    // free the queue slot
+    if (rx_packet != &state.rx.current)
+      rx_queue->pop_head();
+    rx_packet = nullptr;
   }
 
   // Writeback rdes0, others are read-only
@@ -1277,8 +1346,7 @@ int CDEC21143::dec21143_tx() {
       if (!(state.reg[CSR_OPMODE / 8] & OPMODE_OM_INTLOOP)) {
 
         // printf("pcap send: %d bytes   \n", state.tx.cur_buf_len);
-        if (pcap_sendpacket(fp, state.tx.cur_buf, state.tx.cur_buf_len))
-          printf("Error sending the packet: %s\n", pcap_geterr(fp));
+        backend->send(state.tx.cur_buf, state.tx.cur_buf_len);
       }
 
       // if in internal or external loopback mode, add packet to read queue
@@ -1345,7 +1413,6 @@ int CDEC21143::dec21143_tx() {
 void CDEC21143::SetupFilter() {
   u8 mac[16][6];
   char mac_txt[16][20];
-  char filter[1000];
   int i;
   int j;
   int numUnique;
@@ -1406,25 +1473,12 @@ void CDEC21143::SetupFilter() {
   for (i = 0; i < numUnique; i++)
     printf("Unique MAC[%d] = %s. \n", i, mac_txt[unique[i]]);
 #endif
-  filter[0] = '\0';
 
-  // strcat(filter,"ether broadcast");
   // There must be at least one unique item; at least the mac of the card
-  strcat(filter, "ether dst ");
-  strcat(filter, mac_txt[unique[0]]);
-  for (i = 1; i < numUnique; i++) {
-    strcat(filter, " or ether dst ");
-    strcat(filter, mac_txt[unique[i]]);
-  }
-
-#if defined(DEBUG_NIC_FILTER)
-  printf("FILTER = %s.   \n", filter);
-#endif
-  if (pcap_compile(fp, &fcode, filter, 1, 0xffffffff) < 0)
-    FAILURE_1(Logic, "Unable to compile the packet filter (%s)", filter);
-
-  if (pcap_setfilter(fp, &fcode) < 0)
-    FAILURE(Runtime, "Error setting the filter.");
+  u8 unique_mac[16][6];
+  for (i = 0; i < numUnique; i++)
+    memcpy(unique_mac[i], mac[unique[i]], 6);
+  backend->set_filter(unique_mac, numUnique);
 }
 
 /**
@@ -1570,6 +1624,12 @@ int CDEC21143::SaveState(FILE *f) {
   if ((res = CPCIDevice::SaveState(f)))
     return res;
 
+  // The packet being received is saved; the rest of the queue is not.
+  if (!rx_packet)
+    state.rx.current.len = state.rx.current.used = 0;
+  else if (rx_packet != &state.rx.current)
+    memcpy(&state.rx.current, rx_packet, sizeof(eth_packet));
+
   fwrite(&nic_magic1, sizeof(u32), 1, f);
   fwrite(&ss, sizeof(long), 1, f);
   fwrite(&state, sizeof(state), 1, f);
@@ -1619,6 +1679,11 @@ int CDEC21143::RestoreState(FILE *f) {
     return -1;
   }
 
+  // Continue with the packet that was being received.
+  rx_queue->flush();
+  rx_packet = (state.rx.current.used < state.rx.current.len) ? &state.rx.current
+                                                             : nullptr;
+
   r = fread(&m2, sizeof(u32), 1, f);
   if (r != 1) {
     printf("%s: unexpected end of file!\n", devid_string);
@@ -1633,4 +1698,4 @@ int CDEC21143::RestoreState(FILE *f) {
   printf("%s: %ld bytes restored.\n", devid_string, ss);
   return 0;
 }
-#endif // defined(HAVE_PCAP)
+#endif // defined(HAVE_NETWORK)
@@ -34,12 +34,9 @@
 
 #include "DEC21143_mii.hpp"
 #include "DEC21143_tulipreg.hpp"
-#include "PCIDevice.hpp"
-#if defined(WIN32)
-#define HAVE_REMOTE
-#endif
 #include "Ethernet.hpp"
-#include <pcap.h>
+#include "NetBackend.hpp"
+#include "PCIDevice.hpp"
 
 /**
  * \brief Emulated DEC 21143 NIC device.
@@ -79,6 +76,16 @@ private:
   std::atomic_bool myThreadDead{false};
   bool StopThread;
 
+  /// Doorbell rung by the register interface to wake the NIC thread; an
+  /// eventfd (both ends the same) or a pipe. -1 if neither is available.
+  int doorbell_rd = -1;
+  int doorbell_wr = -1;
+
+  void open_doorbell();
+  void close_doorbell();
+  void ring_doorbell();
+  void wait_for_work();
+
   u32 nic_read(u32 address, int dsize);
   void nic_write(u32 address, int dsize, u32 data);
   void mii_access(uint32_t oldreg, uint32_t idata);
@@ -90,8 +97,10 @@ private:
   void set_rx_state(int rx_state);
 
   CPacketQueue *rx_queue;
-  pcap_t *fp;
-  struct bpf_program fcode;
+  eth_packet *rx_packet = nullptr; /**< packet being received; at the head of
+                                      rx_queue, or state.rx.current after a
+                                      restore */
+  CNetBackend *backend; /**< host side: pcap or TAP */
   bool calc_crc;
 
   /// The state structure contains all elements that need to be saved to the
@@ -27,8 +27,16 @@
  */
 
 #include "Disk.hpp"
+#include "DiskCache.hpp"
 #include "StdAfx.hpp"
 
+// Error codes for CDisk::do_scsi_error.
+#define SCSI_OK 0
+#define SCSI_ILL_CMD -1    /* illegal command */
+#define SCSI_LBA_RANGE -2  /* LBA out of range */
+#define SCSI_TOO_BIG -3    /* Too big for buffer */
+#define SCSI_MEDIUM_ERR -4 /* Backend I/O failed */
+
 /**
  * \brief Constructor.
  **/
@@ -45,6 +53,12 @@ CDisk::CDisk(CConfigurator *cfg, CSystem *sys, CDiskController *ctrl,
   myBus = idebus;
   myDev = idedev;
   atapi_mode = false;
+  io_threads = 0;
+  io_stop = false;
+  task_deferred = 0;
+  task_io_busy = 0;
+  barrier_io_busy = 0;
+  tasks_ready = 0;
 
   a = myCfg->get_myName();
   b = myCfg->get_myValue();
@@ -63,6 +77,25 @@ CDisk::CDisk(CConfigurator *cfg, CSystem *sys, CDiskController *ctrl,
 
   state.block_size = is_cdrom ? 2048 : 512;
   state.scsi.sense.available = false;
+  state.scsi.disconnecting = false;
+  state.scsi.reselected = false;
+
+  disconnect = myCfg->get_bool_value("disconnect", false);
+
+  cache = nullptr;
+  size_t cache_size = (size_t)myCfg->get_num_value("cache_size", false, 0);
+  if (cache_size) {
+    size_t extent = (size_t)myCfg->get_num_value("cache_extent", false,
+                                                 64 * 1024);
+    int readahead = (int)myCfg->get_num_value("readahead", false, 4);
+    bool write_back = myCfg->get_bool_value("write_back", false);
+    if (extent < 2048 || (extent & (extent - 1)))
+      FAILURE_1(Configuration,
+                "%s: cache_extent must be a power of two of at least 2K",
+                devid_string);
+    CHECK_ALLOCATION(cache = new CDiskCache(this, cache_size, extent,
+                                            readahead, write_back));
+  }
 
   myCtrl->register_disk(this, myBus, myDev);
 }
@@ -71,10 +104,306 @@ CDisk::CDisk(CConfigurator *cfg, CSystem *sys, CDiskController *ctrl,
  * \brief Destructor.
  **/
 CDisk::~CDisk(void) {
+  // Backends flush the cache and stop the workers in their own destructor,
+  // while they can still do I/O.
+  stop_io_workers();
+  if (cache) {
+    printf("%s: cache %" PRId64 " hits, %" PRId64 " misses, %" PRId64
+           " readaheads.\n",
+           devid_string, cache->get_hits(), cache->get_misses(),
+           cache->get_readaheads());
+    delete cache;
+  }
   free(devid_string);
   devid_string = nullptr;
 }
 
+/**
+ * \brief Read bytes from a given position.
+ *
+ * Default implementation for backends that only have a current position.
+ * Not thread safe; backends that override this with a thread safe version
+ * can set io_threads to have submitted requests run in parallel.
+ **/
+size_t CDisk::read_bytes_at(void *dest, size_t bytes, off_t_large byte) {
+  if (!seek_byte(byte))
+    return 0;
+  return read_bytes(dest, bytes);
+}
+
+/**
+ * \brief Write bytes to a given position.
+ *
+ * \sa read_bytes_at
+ **/
+size_t CDisk::write_bytes_at(void *src, size_t bytes, off_t_large byte) {
+  if (!seek_byte(byte))
+    return 0;
+  return write_bytes(src, bytes);
+}
+
+/**
+ * \brief Read into a list of buffers, starting at a given position.
+ *
+ * Default implementation that reads the segments one by one; backends can
+ * override this with a single system call.
+ **/
+size_t CDisk::read_vec_at(SDiskVec *vec, int count, off_t_large byte) {
+  size_t done = 0;
+
+  for (int i = 0; i < count && byte + (off_t_large)done < byte_size; i++) {
+    size_t r = read_bytes_at(vec[i].buf, vec[i].len, byte + done);
+    done += r;
+    if (r != vec[i].len)
+      break;
+  }
+  return done;
+}
+
+/**
+ * \brief Write from a list of buffers, starting at a given position.
+ *
+ * \sa read_vec_at
+ **/
+size_t CDisk::write_vec_at(SDiskVec *vec, int count, off_t_large byte) {
+  size_t done = 0;
+
+  for (int i = 0; i < count && byte + (off_t_large)done < byte_size; i++) {
+    size_t r = write_bytes_at(vec[i].buf, vec[i].len, byte + done);
+    done += r;
+    if (r != vec[i].len)
+      break;
+  }
+  return done;
+}
+
+/**
+ * \brief Perform a single I/O request.
+ **/
+void CDisk::do_io(SDiskIO *io) {
+  if (io->cached && cache) {
+    if (io->write)
+      io->result = cache->write(io->buf, io->bytes, io->byte);
+    else
+      io->result = cache->read(io->buf, io->bytes, io->byte);
+    return;
+  }
+
+  if (io->write)
+    io->result = write_bytes_at(io->buf, io->bytes, io->byte);
+  else
+    io->result = read_bytes_at(io->buf, io->bytes, io->byte);
+}
+
+/**
+ * \brief Submit an asynchronous I/O request.
+ *
+ * The request is queued for the I/O worker threads if there are any;
+ * otherwise it is performed immediately. Either way, it is returned by
+ * get_completed_io() once it has finished.
+ **/
+void CDisk::submit_io(SDiskIO *io) {
+  io_in_flight++;
+  if (io_workers.empty()) {
+    do_io(io);
+    complete_io(io);
+    return;
+  }
+
+  std::lock_guard<std::mutex> lock(io_mutex);
+  io_queue.push_back(io);
+  io_cond.notify_one();
+}
+
+/**
+ * \brief Hand a finished I/O request to its completion callback or queue it
+ * for get_completed_io().
+ **/
+void CDisk::complete_io(SDiskIO *io) {
+  if (io->done) {
+    io_in_flight--;
+    io->done(io);
+    return;
+  }
+
+  std::lock_guard<std::mutex> lock(io_mutex);
+  io_done.push_back(io);
+}
+
+/**
+ * \brief Return a completed I/O request, or nullptr if none has completed.
+ **/
+SDiskIO *CDisk::get_completed_io() {
+  std::lock_guard<std::mutex> lock(io_mutex);
+  if (io_done.empty())
+    return nullptr;
+
+  SDiskIO *io = io_done.front();
+  io_done.pop_front();
+  io_in_flight--;
+  return io;
+}
+
+/**
+ * \brief I/O worker thread loop.
+ **/
+void CDisk::io_run() {
+  for (;;) {
+    SDiskIO *io;
+    {
+      std::unique_lock<std::mutex> lock(io_mutex);
+      io_cond.wait(lock, [this] { return io_stop || !io_queue.empty(); });
+      if (io_queue.empty())
+        return;
+      io = io_queue.front();
+      io_queue.pop_front();
+    }
+
+    do_io(io);
+    complete_io(io);
+  }
+}
+
+/**
+ * \brief Start the I/O worker threads.
+ **/
+void CDisk::start_threads() {
+  if (!io_workers.empty() || !io_threads)
+    return;
+
+  io_stop = false;
+  printf(" %s", devid_string);
+  for (int i = 0; i < io_threads; i++)
+    io_workers.push_back(
+        std::make_unique<std::thread>([this]() { this->io_run(); }));
+}
+
+/**
+ * \brief Flush the block cache and stop the I/O worker threads.
+ **/
+void CDisk::stop_threads() {
+  flush_cache();
+  stop_io_workers();
+}
+
+/**
+ * \brief Stop the I/O worker threads.
+ *
+ * Requests that were already queued are completed first.
+ **/
+void CDisk::stop_io_workers() {
+  if (io_workers.empty())
+    return;
+
+  {
+    std::lock_guard<std::mutex> lock(io_mutex);
+    io_stop = true;
+  }
+  io_cond.notify_all();
+
+  printf(" %s", devid_string);
+  for (auto &t : io_workers)
+    t->join();
+  io_workers.clear();
+}
+
+/**
+ * \brief Read blocks at the current position, through the cache if enabled.
+ **/
+size_t CDisk::read_blocks(void *dest, size_t blocks) {
+  size_t bytes = blocks * state.block_size;
+
+  if (!cache)
+    return read_bytes(dest, bytes) / state.block_size;
+
+  bytes = cache->read(dest, bytes, state.byte_pos);
+  state.byte_pos += bytes;
+  return bytes / state.block_size;
+}
+
+/**
+ * \brief Write blocks at the current position, through the cache if enabled.
+ **/
+size_t CDisk::write_blocks(void *src, size_t blocks) {
+  size_t bytes = blocks * state.block_size;
+
+  if (!cache)
+    return write_bytes(src, bytes) / state.block_size;
+
+  if (read_only)
+    return 0;
+
+  bytes = cache->write(src, bytes, state.byte_pos);
+  state.byte_pos += bytes;
+  return bytes / state.block_size;
+}
+
+/**
+ * \brief Read into a list of buffers at the current position.
+ *
+ * Used for DMA straight into guest memory. Goes through the cache if
+ * enabled. \return number of bytes read.
+ **/
+size_t CDisk::read_vec(SDiskVec *vec, int count) {
+  size_t done = 0;
+
+  if (!cache) {
+    done = read_vec_at(vec, count, state.byte_pos);
+  } else {
+    for (int i = 0; i < count; i++) {
+      size_t r = cache->read(vec[i].buf, vec[i].len, state.byte_pos + done);
+      done += r;
+      if (r != vec[i].len)
+        break;
+    }
+  }
+
+  state.byte_pos += done;
+  return done;
+}
+
+/**
+ * \brief Write from a list of buffers at the current position.
+ *
+ * \sa read_vec
+ **/
+size_t CDisk::write_vec(SDiskVec *vec, int count) {
+  size_t done = 0;
+
+  if (read_only)
+    return 0;
+
+  if (!cache) {
+    done = write_vec_at(vec, count, state.byte_pos);
+  } else {
+    for (int i = 0; i < count; i++) {
+      size_t r = cache->write(vec[i].buf, vec[i].len, state.byte_pos + done);
+      done += r;
+      if (r != vec[i].len)
+        break;
+    }
+  }
+
+  state.byte_pos += done;
+  return done;
+}
+
+/**
+ * \brief Write any data held in the block cache to the backend.
+ *
+ * Called for SCSI SYNCHRONIZE CACHE and ATA FLUSH CACHE. Writes from
+ * commands we disconnected from are waited for first. Returns false if
+ * some of the data couldn't be written.
+ **/
+bool CDisk::flush_cache() {
+  wait_tasks();
+  if (cache && !cache->flush()) {
+    printf("%s: cache flush failed.\n", devid_string);
+    return false;
+  }
+  return true;
+}
+
 /**
  * \Calculate the number of cylinders to report.
  **/
@@ -104,10 +433,15 @@ void CDisk::scsi_select_me(int bus) {
   state.scsi.stat.available = 0;
   state.scsi.stat.read = 0;
   state.scsi.lun_selected = false;
+  state.scsi.stream.remaining = 0;
+  state.scsi.initiator = scsi_bus[bus]->get_initiator();
+  alloc_scsi_buffers();
+  state.scsi.disconnect_priv = false;
+  state.scsi.tag_type = 0;
+  state.scsi.tag = 0;
+  state.scsi.disconnecting = false;
+  state.scsi.reselected = false;
 
-  // state.scsi.disconnect_priv = false;
-  // state.scsi.will_disconnect = false;
-  // state.scsi.disconnected = false;
   if (atapi_mode)
     scsi_set_phase(bus, SCSI_PHASE_COMMAND);
   else
@@ -117,15 +451,58 @@ void CDisk::scsi_select_me(int bus) {
 static u32 disk_magic1 = 0xD15D15D1;
 static u32 disk_magic2 = 0x15D15D5;
 
+/// Saved form of an SDiskTask; followed by the command bytes and, for
+/// reads, the data.
+struct SDiskTaskRec {
+  int initiator;
+  int tag_type;
+  u8 tag;
+  bool write;
+  u32 cmdlen;
+  u64 byte;
+  u64 bytes;
+  u64 result;
+};
+
 /**
  * Save state to a Virtual Machine State file.
  **/
 int CDisk::SaveState(FILE *f) {
   long ss = sizeof(state);
 
+  // Make the disk image match the saved state.
+  flush_cache();
+
   fwrite(&disk_magic1, sizeof(u32), 1, f);
   fwrite(&ss, sizeof(long), 1, f);
   fwrite(&state, sizeof(state), 1, f);
+
+  // Only the part of the data buffers that is still in use is saved.
+  if (state.scsi.dati.read < state.scsi.dati.available)
+    fwrite(dati_buf.data(), 1, state.scsi.dati.available, f);
+  if (state.scsi.dato.written < state.scsi.dato.expected)
+    fwrite(dato_buf.data(), 1, state.scsi.dato.written, f);
+
+  // Commands we disconnected from. flush_cache() waited for their I/O, so
+  // only the results are left to report to the initiator.
+  u32 ntasks = (u32)tasks.size();
+  fwrite(&ntasks, sizeof(u32), 1, f);
+  for (auto &t : tasks) {
+    SDiskTaskRec rec;
+    rec.initiator = t->initiator;
+    rec.tag_type = t->tag_type;
+    rec.tag = t->tag;
+    rec.write = t->write;
+    rec.cmdlen = (u32)t->cmd.size();
+    rec.byte = t->io.byte;
+    rec.bytes = t->io.bytes;
+    rec.result = t->io.result;
+    fwrite(&rec, sizeof(rec), 1, f);
+    fwrite(t->cmd.data(), 1, rec.cmdlen, f);
+    if (!t->write)
+      fwrite(t->data.data(), 1, rec.result, f);
+  }
+
   fwrite(&disk_magic2, sizeof(u32), 1, f);
   printf("%s: %d bytes saved.\n", devid_string, (int)ss);
   return 0;
@@ -168,6 +545,72 @@ int CDisk::RestoreState(FILE *f) {
     return -1;
   }
 
+  if (state.scsi.dati.available > DATI_BUFSZ ||
+      state.scsi.dato.expected > DATO_BUFSZ) {
+    printf("%s: SCSI buffer size does not match!\n", devid_string);
+    return -1;
+  }
+
+  alloc_scsi_buffers();
+  if (state.scsi.dati.read < state.scsi.dati.available) {
+    r = fread(dati_buf.data(), 1, state.scsi.dati.available, f);
+    if (r != state.scsi.dati.available) {
+      printf("%s: unexpected end of file!\n", devid_string);
+      return -1;
+    }
+  }
+  if (state.scsi.dato.written < state.scsi.dato.expected) {
+    r = fread(dato_buf.data(), 1, state.scsi.dato.written, f);
+    if (r != state.scsi.dato.written) {
+      printf("%s: unexpected end of file!\n", devid_string);
+      return -1;
+    }
+  }
+
+  u32 ntasks;
+  r = fread(&ntasks, sizeof(u32), 1, f);
+  if (r != 1) {
+    printf("%s: unexpected end of file!\n", devid_string);
+    return -1;
+  }
+
+  tasks.clear();
+  for (u32 i = 0; i < ntasks; i++) {
+    SDiskTaskRec rec;
+    std::unique_ptr<SDiskTask> t = std::make_unique<SDiskTask>();
+
+    r = fread(&rec, sizeof(rec), 1, f);
+    if (r != 1 || rec.cmdlen > sizeof(state.scsi.cmd.data) ||
+        rec.result > rec.bytes || rec.bytes > DATI_BUFSZ) {
+      printf("%s: unexpected end of file!\n", devid_string);
+      return -1;
+    }
+
+    t->initiator = rec.initiator;
+    t->tag_type = rec.tag_type;
+    t->tag = rec.tag;
+    t->barrier = false;
+    t->flush = false;
+    t->started = true;
+    t->ready = true;
+    t->write = rec.write;
+    t->cmd.resize(rec.cmdlen);
+    t->data.resize(rec.write ? 0 : (size_t)rec.result);
+    t->io.write = rec.write;
+    t->io.byte = rec.byte;
+    t->io.bytes = (size_t)rec.bytes;
+    t->io.result = (size_t)rec.result;
+    if (fread(t->cmd.data(), 1, t->cmd.size(), f) != t->cmd.size() ||
+        fread(t->data.data(), 1, t->data.size(), f) != t->data.size()) {
+      printf("%s: unexpected end of file!\n", devid_string);
+      return -1;
+    }
+    tasks.push_back(std::move(t));
+  }
+
+  // The initiator picks these up when it next waits for reselection.
+  tasks_ready = (int)tasks.size();
+
   r = fread(&m2, sizeof(u32), 1, f);
   if (r != 1) {
     printf("%s: unexpected end of file!\n", devid_string);
@@ -236,12 +679,12 @@ void *CDisk::scsi_xfer_ptr_me(int bus, size_t bytes) {
 
   switch (scsi_get_phase(0)) {
   case SCSI_PHASE_DATA_OUT:
-    res = &(state.scsi.dato.data[state.scsi.dato.written]);
+    res = &dato_buf[state.scsi.dato.written];
     state.scsi.dato.written += bytes;
     break;
 
   case SCSI_PHASE_DATA_IN:
-    res = &(state.scsi.dati.data[state.scsi.dati.read]);
+    res = &dati_buf[state.scsi.dati.read];
     state.scsi.dati.read += bytes;
     break;
 
@@ -261,31 +704,6 @@ void *CDisk::scsi_xfer_ptr_me(int bus, size_t bytes) {
     break;
 
   case SCSI_PHASE_MSG_IN:
-
-    // if (PT.reselected)
-    //{
-    //  retval = 0x80; // identify
-    //  break;
-    //}
-    // if (PT.disconnected)
-    //{
-    //  if (!PT.dati_ptr)
-    //    retval = 0x04; // disconnect
-    //  else
-    //  {
-    //    if (state.scsi.msgi.read==0)
-    //    {
-    //      retval = 0x02; // save data pointer
-    //      state.scsi.msgi.read=1;
-    //    }
-    //    else if (state.scsi.msgi.read==1)
-    //    {
-    //      retval = 0x04; // disconnect
-    //      state.scsi.msgi.read=0;
-    //    }
-    //  }
-    //  break;
-    //}
     res = &(state.scsi.msgi.data[state.scsi.msgi.read]);
     state.scsi.msgi.read += bytes;
     break;
@@ -306,8 +724,6 @@ void *CDisk::scsi_xfer_ptr_me(int bus, size_t bytes) {
  *
  * For an overview of data transfer during a SCSI bus phase,
  * see SCSIDevice::scsi_xfer_ptr.
- *
- * \todo Handle disconnect/reconnect properly.
  **/
 void CDisk::scsi_xfer_done_me(int bus) {
   int res;
@@ -318,11 +734,28 @@ void CDisk::scsi_xfer_done_me(int bus) {
     if (state.scsi.dato.written < state.scsi.dato.expected)
       break;
 
+    if (state.scsi.stream.remaining) {
+      // Write this chunk, and receive the next one. If the write fails,
+      // end the command now; the initiator sees the phase change.
+      if (!write_dato_chunk()) {
+        state.scsi.stream.remaining = 0;
+        state.scsi.dato.expected = 0;
+        state.scsi.dato.written = 0;
+        do_scsi_error(SCSI_MEDIUM_ERR);
+        newphase = SCSI_PHASE_STATUS;
+        break;
+      }
+      next_dato_chunk();
+      break;
+    }
+
     res = do_scsi_command();
     if (res == 2)
       FAILURE(IllegalState, "do_command returned 2 after DATA OUT phase");
 
-    if (state.scsi.dati.available)
+    if (state.scsi.disconnecting)
+      newphase = SCSI_PHASE_MSG_IN;
+    else if (state.scsi.dati.available)
       newphase = SCSI_PHASE_DATA_IN;
     else
       newphase = SCSI_PHASE_STATUS;
@@ -332,6 +765,15 @@ void CDisk::scsi_xfer_done_me(int bus) {
     if (state.scsi.dati.read < state.scsi.dati.available)
       break;
 
+    if (state.scsi.stream.remaining) {
+      // The status was set up for success when the command started.
+      if (!next_dati_chunk()) {
+        do_scsi_error(SCSI_MEDIUM_ERR);
+        newphase = SCSI_PHASE_STATUS;
+      }
+      break;
+    }
+
     newphase = SCSI_PHASE_STATUS;
     break;
 
@@ -339,6 +781,8 @@ void CDisk::scsi_xfer_done_me(int bus) {
     res = do_scsi_command();
     if (res == 2)
       newphase = SCSI_PHASE_DATA_OUT;
+    else if (state.scsi.disconnecting)
+      newphase = SCSI_PHASE_MSG_IN;
     else if (state.scsi.dati.available)
       newphase = SCSI_PHASE_DATA_IN;
     else
@@ -362,20 +806,28 @@ void CDisk::scsi_xfer_done_me(int bus) {
     break;
 
   case SCSI_PHASE_MSG_IN:
-
-    // if (state.scsi.reselected)
-    //{
-    //  state.scsi.reselected = false;
-    //  newphase = state.scsi.disconnect_phase;
-    //}
-    // else if (state.scsi.disconnected)
-    //{
-    //  if (!state.scsi.msgi.read)
-    //    newphase = -1;
-    //}
     if (state.scsi.msgi.read < state.scsi.msgi.available)
       break;
 
+    if (state.scsi.disconnecting) {
+      // DISCONNECT has been read; the command continues in the background.
+      state.scsi.disconnecting = false;
+      scsi_free(0);
+      return;
+    }
+
+    if (state.scsi.reselected) {
+      // IDENTIFY and the queue tag have been read; the status phase is
+      // followed by COMMAND COMPLETE as usual.
+      state.scsi.reselected = false;
+      state.scsi.msgi.data[0] = 0x00;
+      state.scsi.msgi.available = 1;
+      state.scsi.msgi.read = 0;
+      newphase = state.scsi.dati.available ? SCSI_PHASE_DATA_IN
+                                           : SCSI_PHASE_STATUS;
+      break;
+    }
+
     if (state.scsi.cmd.written) {
       scsi_free(0);
       return;
@@ -388,27 +840,8 @@ void CDisk::scsi_xfer_done_me(int bus) {
               devid_string, scsi_get_phase(0));
   }
 
-  // if data in and can disconnect...
-  // if (state.phase!=7 && newphase==1 && PT.will_disconnect &&
-  // !PT.disconnected)
-  //{
-  //  printf("%s: Disconnecting now...\n",devid_string);
-  //  PT.disconnected = true;
-  //  PT.disconnect_phase = newphase;
-  //  newphase = 7; // msg in
-  //}
-  if (newphase != scsi_get_phase(0)) {
-
-    //    if (newphase==-1)
-    //    {
-    //      printf("%s: Disconnect. Timer started!\n",devid_string);
-    //      // disconnect. generate interrupt?
-    //      state.disconnected = 20;
-    //    }
+  if (newphase != scsi_get_phase(0))
     scsi_set_phase(0, newphase);
-  }
-
-  // getchar();
 }
 
 // SCSI commands:
@@ -472,11 +905,6 @@ void CDisk::scsi_xfer_done_me(int bus) {
 #define SCSIMP_CACHING 0x08
 #define SCSIMP_CDROM_CAP 0x2A
 
-#define SCSI_OK 0
-#define SCSI_ILL_CMD -1   /* illegal command */
-#define SCSI_LBA_RANGE -2 /* LBA out of range */
-#define SCSI_TOO_BIG -3   /* Too big for buffer */
-
 void CDisk::do_scsi_error(int errcode) {
   state.scsi.stat.available = 1;
   state.scsi.stat.data[0] = 0;
@@ -540,6 +968,16 @@ void CDisk::do_scsi_error(int errcode) {
     printf("%s: Command returns check sense status (sense: SYSTEM RESOURCE "
            "FAILURE).\n",
            devid_string);
+#endif
+    break;
+
+  case SCSI_MEDIUM_ERR:
+    state.scsi.sense.data[2] = 0x03;  // medium error
+    state.scsi.sense.data[12] = 0x11; // unrecovered read error
+    state.scsi.sense.data[13] = 0x00;
+#if defined(DEBUG_SCSI)
+    printf("%s: Command returns check sense status (sense: MEDIUM ERROR).\n",
+           devid_string);
 #endif
   }
 }
@@ -620,6 +1058,23 @@ int CDisk::do_scsi_command() {
     FAILURE_1(NotImplemented, "%s: LUN not supported!\n", devid_string);
   }
 
+  // Commands we do while connected must not overtake the tasks their queue
+  // tag says they follow. READ, WRITE and SYNCHRONIZE CACHE may become tasks
+  // themselves; they wait further down when they don't.
+  switch (state.scsi.cmd.data[0]) {
+  case SCSICMD_READ:
+  case SCSICMD_READ_10:
+  case SCSICMD_READ_12:
+  case SCSICMD_READ_CD:
+  case SCSICMD_WRITE:
+  case SCSICMD_WRITE_10:
+  case SCSICMD_SYNCHRONIZE_CACHE:
+    break;
+
+  default:
+    wait_task_order();
+  }
+
   switch (state.scsi.cmd.data[0]) {
   case SCSICMD_TEST_UNIT_READY:
 #if defined(DEBUG_SCSI)
@@ -671,10 +1126,10 @@ int CDisk::do_scsi_command() {
 #endif
     state.scsi.dati.read = 0;
     state.scsi.dati.available = retlen;
-    memcpy(state.scsi.dati.data, state.scsi.sense.data,
+    memcpy(dati_buf.data(), state.scsi.sense.data,
            state.scsi.sense.available);
     for (unsigned int x2 = state.scsi.sense.available; x2 < retlen; x2++)
-      state.scsi.dati.data[x2] = 0;
+      dati_buf[x2] = 0;
 
     do_scsi_error(SCSI_OK);
     break;
@@ -693,7 +1148,7 @@ int CDisk::do_scsi_command() {
     u8 qual_dev = state.scsi.lun_selected ? 0x7F : (cdrom() ? 0x05 : 0x00);
 
     retlen = state.scsi.cmd.data[4];
-    state.scsi.dati.data[0] = qual_dev; // device type
+    dati_buf[0] = qual_dev; // device type
     if (state.scsi.cmd.data[1] & 0x01) {
 
       // Vital Product Data
@@ -703,11 +1158,11 @@ int CDisk::do_scsi_command() {
         // Page 0 is basically a list of page codes supported, so if
         // any others are added, make sure to insert them in the proper
         // place and increase the page length.
-        state.scsi.dati.data[1] = 0x00; // page code 0
-        state.scsi.dati.data[2] = 0x00; // reserved
-        state.scsi.dati.data[3] = 0x02; // page length
-        state.scsi.dati.data[4] = 0x00; // page 0 is supported.
-        state.scsi.dati.data[5] = 0x80; // page 0x80 is supported.
+        dati_buf[1] = 0x00; // page code 0
+        dati_buf[2] = 0x00; // reserved
+        dati_buf[3] = 0x02; // page length
+        dati_buf[4] = 0x00; // page 0 is supported.
+        dati_buf[5] = 0x80; // page 0x80 is supported.
         break;
 
       case 0x80:
@@ -715,10 +1170,10 @@ int CDisk::do_scsi_command() {
         sprintf(serial_number, "SRL%04x", scsi_initiator_id[0] * 0x0101);
 
         // unit serial number page
-        state.scsi.dati.data[1] = 0x80; // page code: 0x80
-        state.scsi.dati.data[2] = 0x00; // reserved
-        state.scsi.dati.data[3] = (u8)strlen(serial_number);
-        memcpy(&state.scsi.dati.data[4], serial_number, strlen(serial_number));
+        dati_buf[1] = 0x80; // page code: 0x80
+        dati_buf[2] = 0x00; // reserved
+        dati_buf[3] = (u8)strlen(serial_number);
+        memcpy(&dati_buf[4], serial_number, strlen(serial_number));
         break;
 
       default:
@@ -727,8 +1182,8 @@ int CDisk::do_scsi_command() {
                   "Don't know format for vital product data page %02x!!\n",
                   state.scsi.cmd.data[2]);
 #else
-        state.scsi.dati.data[1] = state.scsi.cmd.data[2]; // page code
-        state.scsi.dati.data[2] = 0x00;                   // reserved
+        dati_buf[1] = state.scsi.cmd.data[2]; // page code
+        dati_buf[2] = 0x00;                   // reserved
 #endif
       }
     } else {
@@ -739,23 +1194,25 @@ int CDisk::do_scsi_command() {
         retlen = 36;
       }
 
-      state.scsi.dati.data[1] = 0;    // not removable;
-      state.scsi.dati.data[2] = 0x02; // ANSI scsi 2
-      state.scsi.dati.data[3] = 0x02; // response format
-      state.scsi.dati.data[4] = 32;   // additional length
-      state.scsi.dati.data[5] = 0;    // reserved
-      state.scsi.dati.data[6] = 0x04; // reserved
-      state.scsi.dati.data[7] = 0x60; // capabilities
+      dati_buf[1] = 0;    // not removable;
+      dati_buf[2] = 0x02; // ANSI scsi 2
+      dati_buf[3] = 0x02; // response format
+      dati_buf[4] = 32;   // additional length
+      dati_buf[5] = 0;    // reserved
+      dati_buf[6] = 0x04; // reserved
+      dati_buf[7] = 0x60; // capabilities
+      if (disconnect && !cdrom())
+        dati_buf[7] |= 0x02; // tagged command queuing
 
       //                        vendor  model           rev.
-      memcpy(&(state.scsi.dati.data[8]), "DEC     RZ58     (C) DEC2000", 28);
+      memcpy(&(dati_buf[8]), "DEC     RZ58     (C) DEC2000", 28);
 
       //  Some data is different for CD-ROM drives:
       if (cdrom()) {
-        state.scsi.dati.data[1] = 0x80; //  0x80 = removable
+        dati_buf[1] = 0x80; //  0x80 = removable
 
         //                           vendor  model           rev.
-        memcpy(&(state.scsi.dati.data[8]), "DEC     RRD42   (C) DEC 4.5d", 28);
+        memcpy(&(dati_buf[8]), "DEC     RRD42   (C) DEC 4.5d", 28);
       }
     }
 
@@ -765,7 +1222,7 @@ int CDisk::do_scsi_command() {
 #if defined(DEBUG_SCSI)
     printf("%s: Returning data: ", devid_string);
     for (unsigned int x1 = 0; x1 < 36; x1++)
-      printf("%02x ", state.scsi.dati.data[x1]);
+      printf("%02x ", dati_buf[x1]);
     printf("\n");
 #endif
     do_scsi_error(SCSI_OK);
@@ -788,25 +1245,25 @@ int CDisk::do_scsi_command() {
       if (state.scsi.cmd.data[0] == SCSICMD_MODE_SENSE) {
         q = 4;
         retlen = state.scsi.cmd.data[4];
-        state.scsi.dati.data[0] = retlen; // mode data length
-        state.scsi.dati.data[1] =
+        dati_buf[0] = retlen; // mode data length
+        dati_buf[1] =
             cdrom() ? 0x01 : 0x00;      // medium type (120 mm data for CD-ROM)
-        state.scsi.dati.data[2] = 0x00; // device specific parameter
-        state.scsi.dati.data[3] =
+        dati_buf[2] = 0x00; // device specific parameter
+        dati_buf[3] =
             8 * num_blk_desc; // block descriptor length: 1 page (?)
       } else {
         q = 8;
         retlen = state.scsi.cmd.data[7] * 256 + state.scsi.cmd.data[8];
-        state.scsi.dati.data[0] = (u8)(retlen >> 8); // mode data length
-        state.scsi.dati.data[1] = (u8)retlen;
-        state.scsi.dati.data[2] =
+        dati_buf[0] = (u8)(retlen >> 8); // mode data length
+        dati_buf[1] = (u8)retlen;
+        dati_buf[2] =
             cdrom() ? 0x01 : 0x00;      // medium type (120 mm data for CD-ROM)
-        state.scsi.dati.data[3] = 0x00; // device specific parameter
-        state.scsi.dati.data[4] = 0x00; // reserved
-        state.scsi.dati.data[5] = 0x00; // reserved
-        state.scsi.dati.data[6] = (u8)(
+        dati_buf[3] = 0x00; // device specific parameter
+        dati_buf[4] = 0x00; // reserved
+        dati_buf[5] = 0x00; // reserved
+        dati_buf[6] = (u8)(
             (8 * num_blk_desc) >> 8); //  block descriptor length: 1 page (?)
-        state.scsi.dati.data[7] = (u8)(8 * num_blk_desc);
+        dati_buf[7] = (u8)(8 * num_blk_desc);
       }
 
       if ((state.scsi.cmd.data[2] & 0xc0) > 0x40) {
@@ -828,18 +1285,18 @@ int CDisk::do_scsi_command() {
       pagecode = state.scsi.cmd.data[2] & 0x3f;
 
       // printf("[ MODE SENSE pagecode=%i ]\n", pagecode);
-      state.scsi.dati.data[q++] = 0x00; //  density code
-      state.scsi.dati.data[q++] =
+      dati_buf[q++] = 0x00; //  density code
+      dati_buf[q++] =
           0; //  nr of blocks, high (0 = all remaining blocks)
-      state.scsi.dati.data[q++] = 0;    //  nr of blocks, mid
-      state.scsi.dati.data[q++] = 0;    //  nr of blocks, low
-      state.scsi.dati.data[q++] = 0x00; //  reserved
-      state.scsi.dati.data[q++] = (u8)(get_block_size() >> 16) & 255;
-      state.scsi.dati.data[q++] = (u8)(get_block_size() >> 8) & 255;
-      state.scsi.dati.data[q++] = (u8)(get_block_size() >> 0) & 255;
+      dati_buf[q++] = 0;    //  nr of blocks, mid
+      dati_buf[q++] = 0;    //  nr of blocks, low
+      dati_buf[q++] = 0x00; //  reserved
+      dati_buf[q++] = (u8)(get_block_size() >> 16) & 255;
+      dati_buf[q++] = (u8)(get_block_size() >> 8) & 255;
+      dati_buf[q++] = (u8)(get_block_size() >> 0) & 255;
 
       for (unsigned int x1 = q; x1 < retlen; x1++)
-        state.scsi.dati.data[x1] = 0;
+        dati_buf[x1] = 0;
 
       do_scsi_error(SCSI_OK);
 
@@ -851,37 +1308,37 @@ int CDisk::do_scsi_command() {
         break;
 
       case SCSIMP_READ_WRITE_ERRREC: //  read-write error recovery page
-        state.scsi.dati.data[q + 0] = pagecode;
-        state.scsi.dati.data[q + 1] = 10;
+        dati_buf[q + 0] = pagecode;
+        dati_buf[q + 1] = 10;
         break;
 
       case SCSIMP_FORMAT_PARAMS: //  format device page
-        state.scsi.dati.data[q + 0] = pagecode;
-        state.scsi.dati.data[q + 1] = 22;
+        dati_buf[q + 0] = pagecode;
+        dati_buf[q + 1] = 22;
         if (!changeable) {
 
           //  10,11 = sectors per track
-          state.scsi.dati.data[q + 10] = 0;
-          state.scsi.dati.data[q + 11] = (u8)get_sectors();
+          dati_buf[q + 10] = 0;
+          dati_buf[q + 11] = (u8)get_sectors();
 
           //  12,13 = physical sector size
-          state.scsi.dati.data[q + 12] = (u8)(get_block_size() >> 8) & 255;
-          state.scsi.dati.data[q + 13] = (u8)(get_block_size() >> 0) & 255;
+          dati_buf[q + 12] = (u8)(get_block_size() >> 8) & 255;
+          dati_buf[q + 13] = (u8)(get_block_size() >> 0) & 255;
         }
         break;
 
       case SCSIMP_RIGID_GEOMETRY: //  rigid disk geometry page
-        state.scsi.dati.data[q + 0] = pagecode;
-        state.scsi.dati.data[q + 1] = 22;
+        dati_buf[q + 0] = pagecode;
+        dati_buf[q + 1] = 22;
         if (!changeable) {
-          state.scsi.dati.data[q + 2] = (u8)(get_cylinders() >> 16) & 255;
-          state.scsi.dati.data[q + 3] = (u8)(get_cylinders() >> 8) & 255;
-          state.scsi.dati.data[q + 4] = (u8)get_cylinders() & 255;
-          state.scsi.dati.data[q + 5] = (u8)get_heads();
+          dati_buf[q + 2] = (u8)(get_cylinders() >> 16) & 255;
+          dati_buf[q + 3] = (u8)(get_cylinders() >> 8) & 255;
+          dati_buf[q + 4] = (u8)get_cylinders() & 255;
+          dati_buf[q + 5] = (u8)get_heads();
 
           // rpms
-          state.scsi.dati.data[q + 20] = (7200 >> 8) & 255;
-          state.scsi.dati.data[q + 21] = 7200 & 255;
+          dati_buf[q + 20] = (7200 >> 8) & 255;
+          dati_buf[q + 21] = 7200 & 255;
         }
         break;
 
@@ -892,33 +1349,33 @@ int CDisk::do_scsi_command() {
                     devid_string);
         }
 
-        state.scsi.dati.data[q + 0] = pagecode;
-        state.scsi.dati.data[q + 1] = 0x1e; // length
+        dati_buf[q + 0] = pagecode;
+        dati_buf[q + 1] = 0x1e; // length
         if (!changeable) {
 
           //  2,3 = transfer rate
-          state.scsi.dati.data[q + 2] = ((5000) >> 8) & 255;
-          state.scsi.dati.data[q + 3] = (5000) & 255;
+          dati_buf[q + 2] = ((5000) >> 8) & 255;
+          dati_buf[q + 3] = (5000) & 255;
 
-          state.scsi.dati.data[q + 4] = (u8)get_heads();
-          state.scsi.dati.data[q + 5] = (u8)get_sectors();
+          dati_buf[q + 4] = (u8)get_heads();
+          dati_buf[q + 5] = (u8)get_sectors();
 
           //  6,7 = data bytes per sector
-          state.scsi.dati.data[q + 6] = (u8)(get_block_size() >> 8) & 255;
-          state.scsi.dati.data[q + 7] = (u8)(get_block_size() >> 0) & 255;
+          dati_buf[q + 6] = (u8)(get_block_size() >> 8) & 255;
+          dati_buf[q + 7] = (u8)(get_block_size() >> 0) & 255;
 
-          state.scsi.dati.data[q + 8] = (u8)(get_cylinders() >> 8) & 255;
-          state.scsi.dati.data[q + 9] = (u8)get_cylinders() & 255;
+          dati_buf[q + 8] = (u8)(get_cylinders() >> 8) & 255;
+          dati_buf[q + 9] = (u8)get_cylinders() & 255;
 
           // rpms
-          state.scsi.dati.data[q + 28] = (7200 >> 8) & 255;
-          state.scsi.dati.data[q + 29] = 7200 & 255;
+          dati_buf[q + 28] = (7200 >> 8) & 255;
+          dati_buf[q + 29] = 7200 & 255;
         }
         break;
 
       case SCSIMP_CACHING:                      // Caching page
-        state.scsi.dati.data[q + 0] = pagecode; // page code
-        state.scsi.dati.data[q + 1] = 0x12;     // page length
+        dati_buf[q + 0] = pagecode; // page code
+        dati_buf[q + 1] = 0x12;     // page length
         if (!changeable) {
 
           // 2 = IC,ABPF,CAP,DISC,SIZE,WCE,MF,RCD
@@ -930,59 +1387,59 @@ int CDisk::do_scsi_command() {
           //     |  |    +---------------------- cache analysis (0=drive)
           //     |  +--------------------------- abort prefetch (1=abrt on cmd)
           //     +------------------------------ initiator control (0=drive)
-          state.scsi.dati.data[q + 2] = 0x0a;
+          dati_buf[q + 2] = 0x0a;
 
-          state.scsi.dati.data[q + 3] = 0;    // read/write cache retention
-          state.scsi.dati.data[q + 4] = 0x00; // disable prefetch
-          state.scsi.dati.data[q + 5] = 0x00; // for req's greater than this
-          state.scsi.dati.data[q + 6] = 0;    // minimum prefetch
-          state.scsi.dati.data[q + 7] = 0;
+          dati_buf[q + 3] = 0;    // read/write cache retention
+          dati_buf[q + 4] = 0x00; // disable prefetch
+          dati_buf[q + 5] = 0x00; // for req's greater than this
+          dati_buf[q + 6] = 0;    // minimum prefetch
+          dati_buf[q + 7] = 0;
 
-          state.scsi.dati.data[q + 8] = 0; // maximum prefetch
-          state.scsi.dati.data[q + 9] = 0;
+          dati_buf[q + 8] = 0; // maximum prefetch
+          dati_buf[q + 9] = 0;
 
-          state.scsi.dati.data[q + 10] = 0; // maximum prefetch ceiling
-          state.scsi.dati.data[q + 11] = 0;
+          dati_buf[q + 10] = 0; // maximum prefetch ceiling
+          dati_buf[q + 11] = 0;
 
-          state.scsi.dati.data[q + 12] = 0;
-          state.scsi.dati.data[q + 13] = 0; // # cache segments
-          state.scsi.dati.data[q + 14] = 0; // cache segement size
-          state.scsi.dati.data[q + 15] = 0;
+          dati_buf[q + 12] = 0;
+          dati_buf[q + 13] = 0; // # cache segments
+          dati_buf[q + 14] = 0; // cache segement size
+          dati_buf[q + 15] = 0;
 
-          state.scsi.dati.data[q + 16] = 0; // reserved
-          state.scsi.dati.data[q + 17] = 0; // non-cache segement size
-          state.scsi.dati.data[q + 18] = 0;
-          state.scsi.dati.data[q + 19] = 0;
+          dati_buf[q + 16] = 0; // reserved
+          dati_buf[q + 17] = 0; // non-cache segement size
+          dati_buf[q + 18] = 0;
+          dati_buf[q + 19] = 0;
         }
         break;
 
       case SCSIMP_CDROM_CAP: // CD-ROM capabilities
-        state.scsi.dati.data[q + 0] = pagecode;
-        state.scsi.dati.data[q + 1] = 0x14; // length
+        dati_buf[q + 0] = pagecode;
+        dati_buf[q + 1] = 0x14; // length
         if (!changeable) {
-          state.scsi.dati.data[q + 2] = 0x03; // read CD-R/CD-RW
-          state.scsi.dati.data[q + 3] = 0x00; // no write
-          state.scsi.dati.data[q + 4] = 0x00; // dvd/audio capabilities
-          state.scsi.dati.data[q + 5] = 0x00; // cd-da capabilities
-          state.scsi.dati.data[q + 6] =
+          dati_buf[q + 2] = 0x03; // read CD-R/CD-RW
+          dati_buf[q + 3] = 0x00; // no write
+          dati_buf[q + 4] = 0x00; // dvd/audio capabilities
+          dati_buf[q + 5] = 0x00; // cd-da capabilities
+          dati_buf[q + 6] =
               state.scsi.locked ? 0x23 : 0x21; // tray-loader
-          state.scsi.dati.data[q + 7] = 0x00;
-          state.scsi.dati.data[q + 8] =
+          dati_buf[q + 7] = 0x00;
+          dati_buf[q + 8] =
               (u8)(2800 >> 8); // max read speed in kBps (2.8Mbps = 16x)
-          state.scsi.dati.data[q + 9] = (u8)(2800 >> 0);
-          state.scsi.dati.data[q + 10] =
+          dati_buf[q + 9] = (u8)(2800 >> 0);
+          dati_buf[q + 10] =
               (u8)(0 >> 8); // number of volume levels
-          state.scsi.dati.data[q + 11] = (u8)(0 >> 0);
-          state.scsi.dati.data[q + 12] = (u8)(64 >> 8); // buffer size in KBytes
-          state.scsi.dati.data[q + 13] = (u8)(64 >> 0);
-          state.scsi.dati.data[q + 14] = (u8)(2800 >> 8); // current read speed
-          state.scsi.dati.data[q + 15] = (u8)(2800 >> 0);
-          state.scsi.dati.data[q + 16] = 0;            // reserved
-          state.scsi.dati.data[q + 17] = 0;            // digital output format
-          state.scsi.dati.data[q + 18] = (u8)(0 >> 8); // max write speed
-          state.scsi.dati.data[q + 19] = (u8)(0 >> 0);
-          state.scsi.dati.data[q + 20] = (u8)(0 >> 8); // current write speed
-          state.scsi.dati.data[q + 21] = (u8)(0 >> 0);
+          dati_buf[q + 11] = (u8)(0 >> 0);
+          dati_buf[q + 12] = (u8)(64 >> 8); // buffer size in KBytes
+          dati_buf[q + 13] = (u8)(64 >> 0);
+          dati_buf[q + 14] = (u8)(2800 >> 8); // current read speed
+          dati_buf[q + 15] = (u8)(2800 >> 0);
+          dati_buf[q + 16] = 0;            // reserved
+          dati_buf[q + 17] = 0;            // digital output format
+          dati_buf[q + 18] = (u8)(0 >> 8); // max write speed
+          dati_buf[q + 19] = (u8)(0 >> 0);
+          dati_buf[q + 20] = (u8)(0 >> 8); // current write speed
+          dati_buf[q + 21] = (u8)(0 >> 0);
         }
         break;
 
@@ -995,7 +1452,7 @@ int CDisk::do_scsi_command() {
 #if defined(DEBUG_SCSI)
       printf("%s: Returning data: ", devid_string);
       for (unsigned int x1 = 0; x1 < q + 30; x1++)
-        printf("%02x ", state.scsi.dati.data[x1]);
+        printf("%02x ", dati_buf[x1]);
       printf("\n");
 #endif
     }
@@ -1028,24 +1485,24 @@ int CDisk::do_scsi_command() {
     printf("%s: MODE SELECT.\n", devid_string);
     printf("Data: ");
     for (unsigned int x = 0; x < state.scsi.dato.written; x++)
-      printf("%02x ", state.scsi.dato.data[x]);
+      printf("%02x ", dato_buf[x]);
     printf("\n");
 #endif
     if (state.scsi.cmd.written == 6 && state.scsi.dato.written == 12 &&
-        state.scsi.dato.data[0] ==
+        dato_buf[0] ==
             0x00 // data length
-                 //&& state.scsi.dato.data[1] == 0x05 // medium type - ignore
-        && state.scsi.dato.data[2] == 0x00  // dev. specific
-        && state.scsi.dato.data[3] == 0x08  // block descriptor length
-        && state.scsi.dato.data[4] == 0x00  // density code
-        && state.scsi.dato.data[5] == 0x00  // all blocks
-        && state.scsi.dato.data[6] == 0x00  // all blocks
-        && state.scsi.dato.data[7] == 0x00  // all blocks
-        && state.scsi.dato.data[8] == 0x00) // reserved
+                 //&& dato_buf[1] == 0x05 // medium type - ignore
+        && dato_buf[2] == 0x00  // dev. specific
+        && dato_buf[3] == 0x08  // block descriptor length
+        && dato_buf[4] == 0x00  // density code
+        && dato_buf[5] == 0x00  // all blocks
+        && dato_buf[6] == 0x00  // all blocks
+        && dato_buf[7] == 0x00  // all blocks
+        && dato_buf[8] == 0x00) // reserved
     {
-      set_block_size((state.scsi.dato.data[9] << 16) |
-                     (state.scsi.dato.data[10] << 8) |
-                     state.scsi.dato.data[11]);
+      set_block_size((dato_buf[9] << 16) |
+                     (dato_buf[10] << 8) |
+                     dato_buf[11]);
 #if defined(DEBUG_SCSI)
       printf("%s: Block size set to %d.\n", devid_string, get_block_size());
 #endif
@@ -1056,7 +1513,7 @@ int CDisk::do_scsi_command() {
         printf("%02x ", state.scsi.cmd.data[x]);
       printf("\nData: ");
       for (x = 0; x < state.scsi.dato.written; x++)
-        printf("%02x ", state.scsi.dato.data[x]);
+        printf("%02x ", dato_buf[x]);
       printf("\nThis might be an attempt to change our blocksize or something "
              "like that...\nPlease check the above data, then press enter.\n>");
       getchar();
@@ -1080,15 +1537,15 @@ int CDisk::do_scsi_command() {
 
     // READ CAPACITY returns the number of the last LBA (n-1);
     // not the number of LBA's (n)
-    state.scsi.dati.data[0] = (u8)((get_lba_size() - 1) >> 24) & 255;
-    state.scsi.dati.data[1] = (u8)((get_lba_size() - 1) >> 16) & 255;
-    state.scsi.dati.data[2] = (u8)((get_lba_size() - 1) >> 8) & 255;
-    state.scsi.dati.data[3] = (u8)((get_lba_size() - 1) >> 0) & 255;
+    dati_buf[0] = (u8)((get_lba_size() - 1) >> 24) & 255;
+    dati_buf[1] = (u8)((get_lba_size() - 1) >> 16) & 255;
+    dati_buf[2] = (u8)((get_lba_size() - 1) >> 8) & 255;
+    dati_buf[3] = (u8)((get_lba_size() - 1) >> 0) & 255;
 
-    state.scsi.dati.data[4] = (u8)(get_block_size() >> 24) & 255;
-    state.scsi.dati.data[5] = (u8)(get_block_size() >> 16) & 255;
-    state.scsi.dati.data[6] = (u8)(get_block_size() >> 8) & 255;
-    state.scsi.dati.data[7] = (u8)(get_block_size() >> 0) & 255;
+    dati_buf[4] = (u8)(get_block_size() >> 24) & 255;
+    dati_buf[5] = (u8)(get_block_size() >> 16) & 255;
+    dati_buf[6] = (u8)(get_block_size() >> 8) & 255;
+    dati_buf[7] = (u8)(get_block_size() >> 0) & 255;
 
     state.scsi.dati.read = 0;
     state.scsi.dati.available = 8;
@@ -1096,7 +1553,7 @@ int CDisk::do_scsi_command() {
 #if defined(DEBUG_SCSI)
     printf("%s: Returning data: ", devid_string);
     for (unsigned int x1 = 0; x1 < 8; x1++)
-      printf("%02x ", state.scsi.dati.data[x1]);
+      printf("%02x ", dati_buf[x1]);
     printf("\n");
 #endif
     do_scsi_error(SCSI_OK);
@@ -1109,12 +1566,6 @@ int CDisk::do_scsi_command() {
 #if defined(DEBUG_SCSI)
     printf("%s: READ.\n", devid_string);
 #endif
-
-    // if (state.scsi.disconnect_priv)
-    //{
-    //  //printf("%s: Will disconnect before returning read data.\n",
-    //  devid_string); state.scsi.will_disconnect = true;
-    //}
     if (state.scsi.cmd.data[0] == SCSICMD_READ) {
 
       //  bits 4..0 of cmd[1], and cmd[2] and cmd[3]
@@ -1157,24 +1608,31 @@ int CDisk::do_scsi_command() {
                state.scsi.cmd.data[8];
     }
 
-    // Within bounds?
-    if ((ofs + retlen) > get_lba_size()) {
+    // Within bounds? Done in 64 bits, READ(12) can ask for 2^32 blocks.
+    if ((off_t_large)ofs + retlen > get_lba_size()) {
       do_scsi_error(SCSI_LBA_RANGE);
       break;
     }
 
-    // Would exceed buffer?
-    if (retlen > DATI_BUFSZ) {
+    // ATAPI can't take the data in chunks.
+    if (atapi_mode && (off_t_large)retlen * get_block_size() > DATI_BUFSZ) {
       printf("%s: read too big (%d)\n", devid_string, retlen);
       do_scsi_error(SCSI_TOO_BIG);
       break;
     }
 
-    //  Return data:
-    seek_block(ofs);
-    read_blocks(state.scsi.dati.data, retlen);
-    state.scsi.dati.read = 0;
-    state.scsi.dati.available = retlen * get_block_size();
+    if (do_scsi_disconnect(false, ofs, retlen))
+      break;
+    wait_task_order();
+
+    //  Return data; if it doesn't fit in the buffer, the rest follows when
+    //  the initiator has read the first chunk.
+    state.scsi.stream.byte = (off_t_large)ofs * get_block_size();
+    state.scsi.stream.remaining = (off_t_large)retlen * get_block_size();
+    if (!next_dati_chunk()) {
+      do_scsi_error(SCSI_MEDIUM_ERR);
+      break;
+    }
 
 #if defined(DEBUG_SCSI)
     printf("%s: READ  ofs=%d size=%d\n", devid_string, ofs, retlen);
@@ -1213,7 +1671,7 @@ int CDisk::do_scsi_command() {
     }
 
     // Within bounds?
-    if ((ofs + 1) > get_lba_size()) {
+    if ((off_t_large)ofs + 1 > get_lba_size()) {
       do_scsi_error(SCSI_LBA_RANGE);
       break;
     }
@@ -1227,9 +1685,9 @@ int CDisk::do_scsi_command() {
 
     //  Return data:
     seek_block(ofs);
-    read_blocks(state.scsi.dati.data, 1);
+    read_blocks(dati_buf.data(), 1);
     for (unsigned int x1 = get_block_size(); x1 < retlen; x1++)
-      state.scsi.dati.data[x1] = 0; // set ECC bytes to 0.
+      dati_buf[x1] = 0; // set ECC bytes to 0.
     state.scsi.dati.read = 0;
     state.scsi.dati.available = retlen;
     do_scsi_error(SCSI_OK);
@@ -1264,27 +1722,37 @@ int CDisk::do_scsi_command() {
     }
 
     // Within bounds?
-    if (((ofs + retlen)) > get_lba_size()) {
+    if ((off_t_large)ofs + retlen > get_lba_size()) {
       do_scsi_error(SCSI_LBA_RANGE);
       break;
     }
 
-    // Would exceed buffer?
-    if (retlen * get_block_size() > DATO_BUFSZ) {
-      printf("%s: write too big (%d)\n", devid_string,
-             (int)(retlen * get_block_size()));
-      do_scsi_error(SCSI_TOO_BIG);
+    if (!state.scsi.dato.expected) {
+      // Receive the data; if it doesn't fit in the buffer, it is written
+      // one chunk at a time as it comes in (see scsi_xfer_done_me).
+      state.scsi.stream.byte = (off_t_large)ofs * get_block_size();
+      state.scsi.stream.remaining = (off_t_large)retlen * get_block_size();
+      if (state.scsi.stream.remaining > DATO_BUFSZ)
+        wait_task_order();
+      if (next_dato_chunk())
+        return 2;
+
+      do_scsi_error(SCSI_OK);
       break;
     }
 
-    state.scsi.dato.expected = retlen * get_block_size();
-
-    if (state.scsi.dato.written < state.scsi.dato.expected)
-      return 2;
+    //  Write data (the last chunk). Only writes that came in as a single
+    //  chunk are queued; earlier chunks of a longer one are already on disk.
+    if (state.scsi.stream.byte ==
+            (off_t_large)ofs * (off_t_large)get_block_size() &&
+        do_scsi_disconnect(true, ofs, retlen))
+      break;
+    wait_task_order();
 
-    //  Write data
-    seek_block(ofs);
-    write_blocks(state.scsi.dato.data, retlen);
+    if (!write_dato_chunk()) {
+      do_scsi_error(SCSI_MEDIUM_ERR);
+      break;
+    }
 
 #if defined(DEBUG_SCSI)
     printf("%s: WRITE  ofs=%d size=%d\n", devid_string, ofs, retlen);
@@ -1296,6 +1764,13 @@ int CDisk::do_scsi_command() {
 #if defined(DEBUG_SCSI)
     printf("%s: SYNCHRONIZE CACHE.\n", devid_string);
 #endif
+    if (do_scsi_disconnect_flush())
+      break;
+
+    if (!flush_cache()) {
+      do_scsi_error(SCSI_MEDIUM_ERR);
+      break;
+    }
     do_scsi_error(SCSI_OK);
     break;
 
@@ -1329,53 +1804,53 @@ int CDisk::do_scsi_command() {
           0020 01 00 00 00 00 00 00 00 01 00 00 00 01 00 01 00 ................
           0030 00 00 00 00 00 10 00 00 00 10 00 00 01 00 00 00 ................
     */
-    state.scsi.dati.data[q++] = 1; // first track
-    state.scsi.dati.data[q++] = 1; // last track
+    dati_buf[q++] = 1; // first track
+    dati_buf[q++] = 1; // last track
     if (state.scsi.cmd.data[6] <= 1) {
-      state.scsi.dati.data[q++] = 0;    // reserved
-      state.scsi.dati.data[q++] = 0x14; // adr/control (Q-channel: current
+      dati_buf[q++] = 0;    // reserved
+      dati_buf[q++] = 0x14; // adr/control (Q-channel: current
                                         // position, data track, no copy)
-      state.scsi.dati.data[q++] = 1;    // track number
-      state.scsi.dati.data[q++] = 0;    // reserved
+      dati_buf[q++] = 1;    // track number
+      dati_buf[q++] = 0;    // reserved
       if (state.scsi.cmd.data[1] & 0x02) {
         u32 x = lba2msf(0);
-        state.scsi.dati.data[q++] = 0;
-        state.scsi.dati.data[q++] = (x & 0xff0000) >> 16;
-        state.scsi.dati.data[q++] = (x & 0xff00) >> 8;
-        state.scsi.dati.data[q++] = x & 0xff;
+        dati_buf[q++] = 0;
+        dati_buf[q++] = (x & 0xff0000) >> 16;
+        dati_buf[q++] = (x & 0xff00) >> 8;
+        dati_buf[q++] = x & 0xff;
       } else {
-        state.scsi.dati.data[q++] = 0 >> 24; // lba
-        state.scsi.dati.data[q++] = 0 >> 16;
-        state.scsi.dati.data[q++] = 0 >> 8;
-        state.scsi.dati.data[q++] = 0;
+        dati_buf[q++] = 0 >> 24; // lba
+        dati_buf[q++] = 0 >> 16;
+        dati_buf[q++] = 0 >> 8;
+        dati_buf[q++] = 0;
       }
     }
 
-    state.scsi.dati.data[q++] = 0; // reserved
-    state.scsi.dati.data[q++] =
+    dati_buf[q++] = 0; // reserved
+    dati_buf[q++] =
         0x16; // adr/control (Q-channel: current position, data track, copy)
-    state.scsi.dati.data[q++] = 0xAA; // track number
-    state.scsi.dati.data[q++] = 0;    // reserved
+    dati_buf[q++] = 0xAA; // track number
+    dati_buf[q++] = 0;    // reserved
     if (state.scsi.cmd.data[1] & 0x02) {
       u32 x = lba2msf(get_lba_size());
-      state.scsi.dati.data[q++] = 0;
-      state.scsi.dati.data[q++] = (x & 0xff0000) >> 16;
-      state.scsi.dati.data[q++] = (x & 0xff00) >> 8;
-      state.scsi.dati.data[q++] = x & 0xff;
+      dati_buf[q++] = 0;
+      dati_buf[q++] = (x & 0xff0000) >> 16;
+      dati_buf[q++] = (x & 0xff00) >> 8;
+      dati_buf[q++] = x & 0xff;
     } else {
-      state.scsi.dati.data[q++] = (u8)(get_lba_size() >> 24); // lba
-      state.scsi.dati.data[q++] = (u8)(get_lba_size() >> 16);
-      state.scsi.dati.data[q++] = (u8)(get_lba_size() >> 8);
-      state.scsi.dati.data[q++] = (u8)get_lba_size();
+      dati_buf[q++] = (u8)(get_lba_size() >> 24); // lba
+      dati_buf[q++] = (u8)(get_lba_size() >> 16);
+      dati_buf[q++] = (u8)(get_lba_size() >> 8);
+      dati_buf[q++] = (u8)get_lba_size();
     }
 
-    state.scsi.dati.data[0] = (u8)(q >> 8);
-    state.scsi.dati.data[1] = (u8)q;
+    dati_buf[0] = (u8)(q >> 8);
+    dati_buf[1] = (u8)q;
 
 #if defined(DEBUG_SCSI)
     printf("%s: Returning data: ", devid_string);
     for (unsigned int x1 = 0; x1 < q; x1++)
-      printf("%02x ", state.scsi.dati.data[x1]);
+      printf("%02x ", dati_buf[x1]);
     printf("\n");
 #endif
     do_scsi_error(SCSI_OK);
@@ -1432,8 +1907,7 @@ int CDisk::do_scsi_message() {
 #if defined(DEBUG_SCSI)
         printf(" w/disconnect priv");
 #endif
-
-        //        state.scsi.disconnect_priv = true;
+        state.scsi.disconnect_priv = true;
       }
 
       if (state.scsi.msgo.data[msg] & 0x07) {
@@ -1489,6 +1963,18 @@ int CDisk::do_scsi_message() {
         msg += msglen;
         break;
 
+      case 0x20: // simple queue tag
+      case 0x21: // head of queue tag
+      case 0x22: // ordered queue tag
+#if defined(DEBUG_SCSI)
+        printf("%s: MSG: queue tag %02x: %d.\n", devid_string,
+               state.scsi.msgo.data[msg], state.scsi.msgo.data[msg + 1]);
+#endif
+        state.scsi.tag_type = state.scsi.msgo.data[msg];
+        state.scsi.tag = state.scsi.msgo.data[msg + 1];
+        msg += 2;
+        break;
+
       default:
         FAILURE_2(NotImplemented, "%s: MSG: don't understand message %02x.\n",
                   devid_string, state.scsi.msgo.data[msg]);
@@ -1503,6 +1989,414 @@ int CDisk::do_scsi_message() {
     return SCSI_PHASE_COMMAND;
 }
 
+/**
+ * \brief Disconnect from a READ or WRITE command.
+ *
+ * If the initiator allows it, the transfer is handed to the I/O worker
+ * threads and we disconnect; see queue_task. The initiator is reselected
+ * when the transfer has finished.
+ *
+ * Returns false if the command should be done synchronously instead.
+ **/
+bool CDisk::do_scsi_disconnect(bool write, off_t_large lba, size_t blocks) {
+  if (!disconnect || !state.scsi.disconnect_priv || atapi_mode ||
+      !has_io_threads() || !blocks || blocks * state.block_size > DATI_BUFSZ)
+    return false;
+
+  std::unique_ptr<SDiskTask> t = std::make_unique<SDiskTask>();
+  SDiskTask *tp = t.get();
+
+  t->flush = false;
+  t->write = write;
+  if (write) {
+    // The task takes the data buffer; we get a fresh one.
+    t->data = std::move(dato_buf);
+    dato_buf = get_buffer();
+  } else
+    t->data = get_buffer();
+
+  t->io.write = write;
+  t->io.byte = lba * state.block_size;
+  t->io.bytes = blocks * state.block_size;
+  t->io.buf = t->data.data();
+  t->io.tag = tp;
+  t->io.cached = true;
+  t->io.done = [this, tp](SDiskIO *) { task_done(tp); };
+  queue_task(std::move(t));
+  return true;
+}
+
+/**
+ * \brief Disconnect from SYNCHRONIZE CACHE.
+ *
+ * Used while commands we disconnected from are still busy, so that the
+ * cache is flushed once they have finished without keeping the bus (and
+ * the initiator) waiting for them.
+ *
+ * Returns false if the command should be done synchronously instead.
+ **/
+bool CDisk::do_scsi_disconnect_flush() {
+  if (!disconnect || !state.scsi.disconnect_priv || atapi_mode)
+    return false;
+
+  {
+    std::lock_guard<std::mutex> lock(task_mutex);
+    if (!task_deferred && !task_io_busy)
+      return false;
+  }
+
+  std::unique_ptr<SDiskTask> t = std::make_unique<SDiskTask>();
+
+  t->flush = true;
+  t->write = true;
+  t->io.write = true;
+  t->io.byte = 0;
+  t->io.bytes = 0;
+  t->io.buf = nullptr;
+  t->io.tag = t.get();
+  queue_task(std::move(t));
+  return true;
+}
+
+/**
+ * \brief Queue a task for the command in progress and send DISCONNECT.
+ *
+ * Message In is set up to send DISCONNECT, preceded by SAVE DATA POINTER for
+ * writes, as the data has been transferred already. The task is started
+ * right away if the queue tags allow it, or by task_done once the tasks
+ * before it have finished. Nothing here waits for the I/O threads.
+ **/
+void CDisk::queue_task(std::unique_ptr<SDiskTask> t) {
+  SDiskTask *tp = t.get();
+  std::vector<SDiskTask *> start;
+
+  t->initiator = state.scsi.initiator;
+  t->tag_type = state.scsi.tag_type;
+  t->tag = state.scsi.tag;
+  t->barrier = t->flush || t->tag_type == 0x21 || t->tag_type == 0x22;
+  t->started = false;
+  t->ready = false;
+  t->io.result = 0;
+  t->cmd.assign(state.scsi.cmd.data,
+                state.scsi.cmd.data + state.scsi.cmd.written);
+
+  {
+    std::lock_guard<std::mutex> lock(task_mutex);
+    tasks.push_back(std::move(t));
+    task_deferred++;
+    start = start_tasks();
+  }
+
+#if defined(DEBUG_SCSI)
+  printf("%s: Disconnecting from %s tag %d.\n", devid_string,
+         tp->flush ? "SYNCHRONIZE CACHE" : tp->write ? "WRITE" : "READ",
+         tp->tag);
+#endif
+
+  state.scsi.dati.available = 0;
+  state.scsi.dati.read = 0;
+  state.scsi.msgi.available = 0;
+  state.scsi.msgi.read = 0;
+  if (tp->io.bytes && tp->write)
+    state.scsi.msgi.data[state.scsi.msgi.available++] = 0x02; // save data ptr
+  state.scsi.msgi.data[state.scsi.msgi.available++] = 0x04;   // disconnect
+  state.scsi.disconnecting = true;
+
+  // Only we reselect, so the task stays around until we return.
+  run_tasks(start);
+}
+
+/**
+ * \brief Mark the tasks that may start now as started.
+ *
+ * Tasks start in the order they were received. ORDERED and HEAD OF QUEUE
+ * tasks wait for everything before them; everything waits for those.
+ * Called with task_mutex held; the caller starts the returned tasks with
+ * run_tasks after releasing it.
+ **/
+std::vector<SDiskTask *> CDisk::start_tasks() {
+  std::vector<SDiskTask *> start;
+
+  for (auto &t : tasks) {
+    if (t->started)
+      continue;
+    if (t->barrier ? task_io_busy != 0 : barrier_io_busy != 0)
+      break;
+
+    t->started = true;
+    task_deferred--;
+    task_io_busy++;
+    if (t->barrier)
+      barrier_io_busy++;
+    start.push_back(t.get());
+  }
+  return start;
+}
+
+/**
+ * \brief Start the I/O for tasks returned by start_tasks.
+ *
+ * A SYNCHRONIZE CACHE task only starts when everything before it has
+ * finished, so it flushes the cache right here, on whichever thread
+ * finished the last of those.
+ **/
+void CDisk::run_tasks(const std::vector<SDiskTask *> &start) {
+  for (SDiskTask *t : start) {
+    if (t->flush) {
+      // A failed flush is reported as a medium error on reselection.
+      if (cache && !cache->flush())
+        t->io.result = t->io.bytes + 1;
+      task_done(t);
+    } else
+      submit_io(&t->io);
+  }
+}
+
+/**
+ * \brief Called when a task's transfer has finished.
+ *
+ * Normally runs on an I/O worker thread. Marks the task ready, starts any
+ * tasks that were waiting for it, and wakes the initiator, which reselects
+ * us from its own thread. Nothing here touches the bus or the initiator's
+ * state.
+ **/
+void CDisk::task_done(SDiskTask *t) {
+  std::vector<SDiskTask *> start;
+  int initiator;
+  {
+    std::lock_guard<std::mutex> lock(task_mutex);
+    t->ready = true;
+    task_io_busy--;
+    if (t->barrier)
+      barrier_io_busy--;
+    tasks_ready++;
+    initiator = t->initiator;
+    start = start_tasks();
+  }
+  task_cond.notify_all();
+
+  // The task may be gone once the initiator has reselected us; the tasks
+  // just started are not ready yet, so they aren't.
+  run_tasks(start);
+  scsi_request_reselect(0, initiator);
+}
+
+/**
+ * \brief Wait until the backend I/O of all tasks has finished.
+ *
+ * The I/O threads never need the initiator, so this can't deadlock against
+ * it; disconnecting initiators don't get here from SYNCHRONIZE CACHE though,
+ * see do_scsi_disconnect_flush.
+ **/
+void CDisk::wait_tasks() {
+  std::unique_lock<std::mutex> lock(task_mutex);
+  task_cond.wait(lock,
+                 [this] { return task_io_busy == 0 && task_deferred == 0; });
+}
+
+/**
+ * \brief Wait for the tasks the command in progress must not overtake.
+ *
+ * Used for commands that are done synchronously while tasks we disconnected
+ * from may still be busy. A SIMPLE tagged command waits for ORDERED and HEAD
+ * OF QUEUE tasks only, like a SIMPLE task would in start_tasks; ORDERED,
+ * HEAD OF QUEUE and untagged commands wait for all tasks.
+ **/
+void CDisk::wait_task_order() {
+  if (state.scsi.tag_type != 0x20) {
+    wait_tasks();
+    return;
+  }
+
+  std::unique_lock<std::mutex> lock(task_mutex);
+  task_cond.wait(lock, [this] {
+    for (auto &t : tasks) {
+      if (t->barrier && !t->ready)
+        return false;
+    }
+    return true;
+  });
+}
+
+/**
+ * \brief Take a data buffer from the pool, or allocate one.
+ **/
+std::vector<u8> CDisk::get_buffer() {
+  std::vector<u8> buf;
+
+  if (!buf_pool.empty()) {
+    buf = std::move(buf_pool.back());
+    buf_pool.pop_back();
+  }
+  buf.resize(DATI_BUFSZ);
+  return buf;
+}
+
+/**
+ * \brief Return a data buffer to the pool.
+ **/
+void CDisk::put_buffer(std::vector<u8> &&buf) {
+  if (buf.size() >= DATI_BUFSZ && buf_pool.size() < 8)
+    buf_pool.push_back(std::move(buf));
+}
+
+/**
+ * \brief Make sure the Data In and Data Out buffers exist.
+ *
+ * They are allocated the first time the disk is selected, so disks that
+ * are never used over SCSI don't need them.
+ **/
+void CDisk::alloc_scsi_buffers() {
+  if (dati_buf.size() < DATI_BUFSZ)
+    dati_buf = get_buffer();
+  if (dato_buf.size() < DATO_BUFSZ)
+    dato_buf = get_buffer();
+}
+
+/**
+ * \brief Read the next chunk of a READ into the Data In buffer.
+ *
+ * Returns false, with nothing left to send, if the backend read fails.
+ **/
+bool CDisk::next_dati_chunk() {
+  size_t bytes = DATI_BUFSZ;
+
+  if (state.scsi.stream.remaining < (off_t_large)bytes)
+    bytes = (size_t)state.scsi.stream.remaining;
+
+  state.scsi.dati.read = 0;
+  state.scsi.dati.available = 0;
+  if (!seek_byte(state.scsi.stream.byte) ||
+      read_blocks(dati_buf.data(), bytes / state.block_size) !=
+          bytes / state.block_size) {
+    printf("%s: read error at byte %" PRId64 ".\n", devid_string,
+           (u64)state.scsi.stream.byte);
+    state.scsi.stream.remaining = 0;
+    return false;
+  }
+
+  state.scsi.dati.available = (unsigned int)bytes;
+  state.scsi.stream.byte += bytes;
+  state.scsi.stream.remaining -= bytes;
+  return true;
+}
+
+/**
+ * \brief Write the chunk of a WRITE in the Data Out buffer to the backend.
+ *
+ * Returns false if the backend write fails.
+ **/
+bool CDisk::write_dato_chunk() {
+  size_t blocks = state.scsi.dato.expected / state.block_size;
+
+  if (!seek_byte(state.scsi.stream.byte) ||
+      write_blocks(dato_buf.data(), blocks) != blocks) {
+    printf("%s: write error at byte %" PRId64 ".\n", devid_string,
+           (u64)state.scsi.stream.byte);
+    return false;
+  }
+
+  state.scsi.stream.byte += state.scsi.dato.expected;
+  return true;
+}
+
+/**
+ * \brief Set up the Data Out buffer for the next chunk of a WRITE.
+ *
+ * Returns false if there is nothing left to receive.
+ **/
+bool CDisk::next_dato_chunk() {
+  size_t bytes = DATO_BUFSZ;
+
+  if (state.scsi.stream.remaining < (off_t_large)bytes)
+    bytes = (size_t)state.scsi.stream.remaining;
+
+  state.scsi.dato.expected = (unsigned int)bytes;
+  state.scsi.dato.written = 0;
+  state.scsi.stream.remaining -= bytes;
+  return bytes != 0;
+}
+
+/**
+ * \brief Called when we reselect the initiator.
+ *
+ * Pick a finished task, set up its data and status, and send IDENTIFY and
+ * SIMPLE QUEUE TAG in the Message In phase.
+ **/
+void CDisk::scsi_reselect_me(int bus) {
+  std::unique_ptr<SDiskTask> t;
+
+  {
+    std::lock_guard<std::mutex> lock(task_mutex);
+    for (auto i = tasks.begin(); i != tasks.end(); i++) {
+      if ((*i)->ready) {
+        t = std::move(*i);
+        tasks.erase(i);
+        tasks_ready--;
+        break;
+      }
+    }
+  }
+
+  if (!t) {
+    // Nothing to reselect for; stay off the bus.
+    return;
+  }
+
+  state.scsi.msgo.written = 0;
+  state.scsi.cmd.written = (unsigned int)t->cmd.size();
+  memcpy(state.scsi.cmd.data, t->cmd.data(), t->cmd.size());
+  state.scsi.dato.expected = 0;
+  state.scsi.dato.written = 0;
+  state.scsi.dati.read = 0;
+  state.scsi.dati.available = 0;
+  state.scsi.stream.remaining = 0;
+  state.scsi.lun_selected = false;
+  state.scsi.initiator = t->initiator;
+  state.scsi.tag_type = t->tag_type;
+  state.scsi.tag = t->tag;
+  state.scsi.disconnecting = false;
+  state.scsi.reselected = true;
+
+  if (!t->write && t->io.result == t->io.bytes) {
+    // Swap buffers instead of copying the data.
+    t->data.resize(DATI_BUFSZ);
+    dati_buf.swap(t->data);
+    state.scsi.dati.available = (unsigned int)t->io.result;
+  }
+  put_buffer(std::move(t->data));
+
+  // Sets up the status byte and COMMAND COMPLETE, which is sent after the
+  // reselection messages.
+  if (t->io.result != t->io.bytes) {
+    printf("%s: %s error at byte %" PRId64 ".\n", devid_string,
+           t->write ? "write" : "read", (u64)t->io.byte);
+    do_scsi_error(SCSI_MEDIUM_ERR);
+  } else
+    do_scsi_error(SCSI_OK);
+
+  state.scsi.msgi.available = 0;
+  state.scsi.msgi.read = 0;
+  state.scsi.msgi.data[state.scsi.msgi.available++] = 0x80; // identify, lun 0
+  if (t->tag_type) {
+    state.scsi.msgi.data[state.scsi.msgi.available++] = 0x20; // simple tag
+    state.scsi.msgi.data[state.scsi.msgi.available++] = t->tag;
+  }
+
+#if defined(DEBUG_SCSI)
+  printf("%s: Reselecting for %s tag %d.\n", devid_string,
+         t->write ? "WRITE" : "READ", t->tag);
+#endif
+  scsi_set_phase(bus, SCSI_PHASE_MSG_IN);
+}
+
+/**
+ * \brief Return true if a task is waiting to reselect the initiator.
+ *
+ * Polled by the initiator's thread; see CSCSIBus::reselect_pending.
+ **/
+bool CDisk::scsi_reselect_ready_me(int bus) { return tasks_ready > 0; }
+
 static int primes_54[54] = {
     2,   3,   5,   7,   11,  13,  17,  19,  23,  29,  31,  37,  41,  43,
     47,  53,  59,  61,  67,  71,  73,  79,  83,  89,  97,  101, 103, 107,
@@ -33,9 +33,66 @@
 #include "SCSIBus.hpp"
 #include "SCSIDevice.hpp"
 
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <vector>
+
+/// Size of the SCSI data buffers; larger transfers are done in chunks.
 #define DATO_BUFSZ 256 * 1024
 #define DATI_BUFSZ 256 * 1024
 
+/**
+ * \brief Disk I/O request for the asynchronous interface of CDisk.
+ *
+ * The submitter owns the request and the buffer until the request is
+ * returned by CDisk::get_completed_io().
+ **/
+struct SDiskIO {
+  bool write;       /**< Write (true) or read (false). **/
+  off_t_large byte; /**< Byte position on the disk. **/
+  size_t bytes;     /**< Number of bytes to transfer. **/
+  void *buf;        /**< Data buffer. **/
+  void *tag;        /**< For use by the submitter. **/
+  size_t result;    /**< Number of bytes transferred, set on completion. **/
+  bool cached = false; /**< Go through the disk's block cache, if any. **/
+  /** If set, called on completion instead of queueing the request for
+   *  get_completed_io(). Runs on an I/O worker thread. **/
+  std::function<void(SDiskIO *)> done;
+};
+
+/**
+ * \brief Segment of a vectored disk transfer.
+ **/
+struct SDiskVec {
+  void *buf;
+  size_t len;
+};
+
+/**
+ * \brief SCSI command that the disk disconnected from.
+ *
+ * Created when the initiator allows disconnection; the data transfer to or
+ * from the backend runs asynchronously, and the disk reselects the initiator
+ * once it has finished.
+ **/
+struct SDiskTask {
+  int initiator;        /**< SCSI id of the initiator to reselect. **/
+  int tag_type;         /**< Queue tag message (0x20..0x22), 0 if untagged. **/
+  u8 tag;               /**< Queue tag. **/
+  bool barrier;         /**< ORDERED or HEAD OF QUEUE tag. **/
+  bool flush;           /**< SYNCHRONIZE CACHE; flushes the block cache. **/
+  bool started;         /**< I/O has been started. **/
+  bool ready;           /**< I/O finished; waiting to reselect. **/
+  bool write;           /**< Write (true) or read (false). **/
+  std::vector<u8> cmd;  /**< Command bytes. **/
+  std::vector<u8> data; /**< Data read, or data to write. **/
+  SDiskIO io;
+};
+
+class CDiskCache;
+
 /**
  * \brief Abstract base class for disks (connects to a CDiskController)
  **/
@@ -51,26 +108,42 @@ public:
   virtual size_t scsi_expected_xfer_me(int bus);
   virtual void *scsi_xfer_ptr_me(int bus, size_t bytes);
   virtual void scsi_xfer_done_me(int bus);
+  virtual void scsi_reselect_me(int bus);
+  virtual bool scsi_reselect_ready_me(int bus);
 
   void set_atapi_mode() { atapi_mode = true; };
 
   int do_scsi_command();
   int do_scsi_message();
   void do_scsi_error(int errcode);
+  bool do_scsi_disconnect(bool write, off_t_large lba, size_t blocks);
+  bool do_scsi_disconnect_flush();
 
   virtual bool seek_byte(off_t_large byte) = 0;
   virtual size_t read_bytes(void *dest, size_t bytes) = 0;
   virtual size_t write_bytes(void *src, size_t bytes) = 0;
 
+  virtual size_t read_bytes_at(void *dest, size_t bytes, off_t_large byte);
+  virtual size_t write_bytes_at(void *src, size_t bytes, off_t_large byte);
+  virtual size_t read_vec_at(SDiskVec *vec, int count, off_t_large byte);
+  virtual size_t write_vec_at(SDiskVec *vec, int count, off_t_large byte);
+
+  void submit_io(SDiskIO *io);
+  SDiskIO *get_completed_io();
+  int get_io_in_flight() { return io_in_flight; };
+  bool has_io_threads() { return !io_workers.empty(); };
+
+  virtual void start_threads();
+  virtual void stop_threads();
+
   bool seek_block(off_t_large lba) {
     return seek_byte(lba * state.block_size);
   };
-  size_t read_blocks(void *dest, size_t blocks) {
-    return read_bytes(dest, blocks * state.block_size) / state.block_size;
-  };
-  size_t write_blocks(void *src, size_t blocks) {
-    return write_bytes(src, blocks * state.block_size) / state.block_size;
-  };
+  size_t read_blocks(void *dest, size_t blocks);
+  size_t write_blocks(void *src, size_t blocks);
+  size_t read_vec(SDiskVec *vec, int count);
+  size_t write_vec(SDiskVec *vec, int count);
+  bool flush_cache();
 
   size_t get_block_size() { return state.block_size; };
   void set_block_size(size_t bs) {
@@ -117,6 +190,62 @@ protected:
 
   bool atapi_mode;
 
+  /// Asynchronous I/O. Backends that can do I/O at a position without
+  /// touching the current position (read_bytes_at/write_bytes_at are thread
+  /// safe) set io_threads; submitted requests are then run by that many
+  /// worker threads. Otherwise requests are run when they are submitted.
+  int io_threads;
+  std::vector<std::unique_ptr<std::thread>> io_workers;
+  std::mutex io_mutex;
+  std::condition_variable io_cond;
+  std::deque<SDiskIO *> io_queue;
+  std::deque<SDiskIO *> io_done;
+  std::atomic<int> io_in_flight{0};
+  bool io_stop;
+
+  void io_run();
+  void do_io(SDiskIO *io);
+  void complete_io(SDiskIO *io);
+  void stop_io_workers();
+
+  /// Block cache, or nullptr if not enabled for this disk.
+  CDiskCache *cache;
+
+  /// Disconnect from READ and WRITE commands while the backend works, and
+  /// advertise tagged command queuing.
+  bool disconnect;
+
+  /// Commands we disconnected from, in the order they were received.
+  std::deque<std::unique_ptr<SDiskTask>> tasks;
+  std::mutex task_mutex;
+  std::condition_variable task_cond;
+  int task_deferred;   ///< Tasks waiting for earlier tasks before starting
+  int task_io_busy;    ///< Tasks with backend I/O still running
+  int barrier_io_busy; ///< ORDERED/HEAD OF QUEUE tasks with I/O running
+  std::atomic<int> tasks_ready; ///< Tasks waiting to reselect
+
+  void queue_task(std::unique_ptr<SDiskTask> t);
+  std::vector<SDiskTask *> start_tasks();
+  void run_tasks(const std::vector<SDiskTask *> &start);
+  void task_done(SDiskTask *t);
+  void wait_tasks();
+  void wait_task_order();
+
+  /// Data In and Data Out buffers for SCSI commands. These are not part of
+  /// the saved state; only a transfer in progress is saved.
+  std::vector<u8> dati_buf;
+  std::vector<u8> dato_buf;
+
+  /// Spare data buffers, so disconnected commands don't allocate.
+  std::vector<std::vector<u8>> buf_pool;
+
+  std::vector<u8> get_buffer();
+  void put_buffer(std::vector<u8> &&buf);
+  void alloc_scsi_buffers();
+  bool next_dati_chunk();
+  bool next_dato_chunk();
+  bool write_dato_chunk();
+
   /// The state structure contains all elements that need to be saved to the
   /// statefile
   struct SDisk_state {
@@ -149,21 +278,28 @@ protected:
         unsigned int written; /**< Number of bytes in buffer. **/
       } cmd;
 
-      /// State for Data In phase (disk -> controller)
+      /// State for Data In phase (disk -> controller). The data is in
+      /// dati_buf.
       struct SDisk_dati {
-        u8 data[DATI_BUFSZ];    /**< Data buffer. **/
         unsigned int available; /**< Number of bytes available to read. **/
         unsigned int read;      /**< Number of bytes read so far. **/
       } dati;
 
-      /// State for Data Out phase (controller -> disk)
+      /// State for Data Out phase (controller -> disk). The data is in
+      /// dato_buf.
       struct SDisk_dato {
-        u8 data[DATO_BUFSZ];   /**< Data buffer. **/
         unsigned int expected; /**< Number of bytes the initiator is expected to
                                   write. **/
         unsigned int written;  /**< Number of bytes written sofar. **/
       } dato;
 
+      /// READ or WRITE transferred in buffer-sized chunks.
+      struct SDisk_stream {
+        off_t_large byte;      /**< Disk position of the current chunk
+                                  (WRITE) or the next one (READ). **/
+        off_t_large remaining; /**< Bytes left after the current chunk. **/
+      } stream;
+
       /// State for Status phase (disk -> controller)
       struct SDisk_stat {
         u8 data[256];           /**< Data buffer. **/
@@ -179,12 +315,14 @@ protected:
 
       bool locked; /**< Media is locked (for CD-ROM type devices). **/
 
-      // bool disconnect_priv;       /**< Initiator has allowed us to
-      // disconnect/reconnect. **/ bool will_disconnect;       /**< We intend to
-      // disconnect. **/ bool disconnected;          /**< We have disconnected.
-      // **/ bool reselected;            /**< We have reselected the initiator.
-      // **/ int disconnect_phase;       /**< After we reconnect, we should go
-      // to this SCSI phase. **/
+      int initiator;        /**< SCSI id of the initiator that selected us. **/
+      bool disconnect_priv; /**< Initiator has allowed us to
+                               disconnect/reconnect. **/
+      int tag_type; /**< Queue tag message received (0x20..0x22), or 0. **/
+      u8 tag;       /**< Queue tag received. **/
+      bool disconnecting; /**< We release the bus after Message In. **/
+      bool reselected;    /**< We have reselected the initiator; Message In
+                             holds IDENTIFY and the queue tag. **/
     } scsi;
   } state;
 };
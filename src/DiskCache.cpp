@@ -0,0 +1,354 @@
+/* AXPbox Alpha Emulator
+ * Copyright (C) 2020 Tomáš Glozar
+ * Website: https://github.com/lenticularis39/axpbox
+ *
+ * Forked from: ES40 emulator
+ * Copyright (C) 2007-2008 by the ES40 Emulator Project
+ * Copyright (C) 2007 by Camiel Vanderhoeven
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301,
+ * USA.
+ *
+ * Although this is not required, the author would appreciate being notified of,
+ * and receiving any modifications you may make to the source code that might
+ * serve the general public.
+ */
+
+#include "DiskCache.hpp"
+#include "Disk.hpp"
+#include "StdAfx.hpp"
+
+/**
+ * \brief Constructor.
+ *
+ * \param disk        Disk to cache.
+ * \param size        Maximum size of the cache in bytes.
+ * \param extent      Size of a cache extent in bytes.
+ * \param readahead   Number of extents to read ahead on sequential reads.
+ * \param write_back  Keep writes in the cache until flushed.
+ **/
+CDiskCache::CDiskCache(CDisk *disk, size_t size, size_t extent, int readahead,
+                       bool write_back) {
+  myDisk = disk;
+  extent_size = extent;
+  max_extents = size / extent;
+  if (max_extents < 1)
+    max_extents = 1;
+  this->readahead = readahead;
+  this->write_back = write_back;
+  next_sequential = 0;
+  sequential = 0;
+  hits = 0;
+  misses = 0;
+  readaheads = 0;
+}
+
+/**
+ * \brief Destructor. The cache must have been flushed by the disk.
+ **/
+CDiskCache::~CDiskCache() {}
+
+/**
+ * \brief Number of valid bytes in an extent (the last one may be short).
+ **/
+size_t CDiskCache::extent_bytes(u64 index) {
+  off_t_large start = (off_t_large)index * extent_size;
+  off_t_large size = myDisk->get_byte_size();
+
+  if (start >= size)
+    return 0;
+  if (size - start < (off_t_large)extent_size)
+    return (size_t)(size - start);
+  return extent_size;
+}
+
+/**
+ * \brief Find an extent and move it to the front of the LRU list.
+ **/
+CDiskCache::SExtent *CDiskCache::lookup(u64 index) {
+  auto it = extents.find(index);
+  if (it == extents.end())
+    return nullptr;
+
+  lru.splice(lru.begin(), lru, it->second);
+  return &*it->second;
+}
+
+/**
+ * \brief Write a dirty extent back to the disk.
+ *
+ * Returns false if the write failed; the extent stays dirty then.
+ **/
+bool CDiskCache::write_extent(SExtent &e) {
+  if (!e.dirty)
+    return true;
+
+  if (myDisk->write_bytes_at(e.data.data(), e.data.size(),
+                             (off_t_large)e.index * extent_size) !=
+      e.data.size())
+    return false;
+  e.dirty = false;
+  return true;
+}
+
+/**
+ * \brief Make room for an extent if the cache is full.
+ *
+ * The least recently used extent is evicted. Returns false if it is dirty
+ * and can't be written back; it stays in the cache then.
+ **/
+bool CDiskCache::evict() {
+  if (extents.size() < max_extents)
+    return true;
+
+  SExtent &victim = lru.back();
+  if (!write_extent(victim))
+    return false;
+  extents.erase(victim.index);
+  lru.pop_back();
+  return true;
+}
+
+/**
+ * \brief Add an extent at the front of the LRU list, evicting the least
+ * recently used one if the cache is full.
+ *
+ * Returns false, without adding the extent, if nothing could be evicted.
+ **/
+bool CDiskCache::insert(SExtent &&e) {
+  if (!evict())
+    return false;
+
+  u64 index = e.index;
+  lru.push_front(std::move(e));
+  extents[index] = lru.begin();
+  return true;
+}
+
+/**
+ * \brief Bring an extent into the cache.
+ *
+ * \param fill  Read the extent from the disk; when false the caller is
+ *              about to overwrite all of it.
+ *
+ * Returns nullptr if the extent couldn't be read, or no room could be made
+ * for it.
+ **/
+CDiskCache::SExtent *CDiskCache::load(u64 index, bool fill) {
+  SExtent e;
+  e.index = index;
+  e.dirty = false;
+  e.data.resize(extent_bytes(index));
+
+  if (fill && myDisk->read_bytes_at(e.data.data(), e.data.size(),
+                                    (off_t_large)index * extent_size) !=
+                  e.data.size())
+    return nullptr;
+
+  if (!insert(std::move(e)))
+    return nullptr;
+  return &lru.front();
+}
+
+/**
+ * \brief Read ahead the extents following a sequential read.
+ *
+ * The reads are queued for the disk's I/O worker threads; the data is added
+ * to the cache when they complete, unless a write to the extent happened
+ * in the meantime.
+ **/
+void CDiskCache::start_readahead(u64 index) {
+  for (int i = 0; i < readahead; i++) {
+    u64 ra = index + i;
+    size_t bytes = extent_bytes(ra);
+
+    if (!bytes)
+      break;
+    if (extents.count(ra) || pending.count(ra))
+      continue;
+
+    pending[ra] = true;
+    readaheads++;
+
+    SDiskIO *io = new SDiskIO;
+    io->write = false;
+    io->byte = (off_t_large)ra * extent_size;
+    io->bytes = bytes;
+    io->buf = new char[bytes];
+    io->tag = nullptr;
+    io->done = [this, ra](SDiskIO *io) {
+      {
+        std::lock_guard<std::mutex> lock(cache_mutex);
+        auto p = pending.find(ra);
+        if (p != pending.end() && p->second && io->result == io->bytes &&
+            !extents.count(ra) && evict()) {
+          SExtent e;
+          e.index = ra;
+          e.dirty = false;
+          e.data.assign((char *)io->buf, (char *)io->buf + io->bytes);
+          // Read ahead data goes to the back; it is promoted when used.
+          lru.push_back(std::move(e));
+          extents[ra] = std::prev(lru.end());
+        }
+        if (p != pending.end())
+          pending.erase(p);
+      }
+      delete[](char *) io->buf;
+      delete io;
+    };
+    myDisk->submit_io(io);
+  }
+}
+
+/**
+ * \brief Read from the disk through the cache.
+ *
+ * Returns the number of bytes read; less than requested if the disk
+ * couldn't be read.
+ **/
+size_t CDiskCache::read(void *dest, size_t bytes, off_t_large byte) {
+  std::lock_guard<std::mutex> lock(cache_mutex);
+
+  u64 first = (u64)byte / extent_size;
+  size_t done = 0;
+
+  while (done < bytes) {
+    u64 index = (u64)(byte + done) / extent_size;
+    size_t offset = (size_t)((byte + done) % extent_size);
+    SExtent *e = lookup(index);
+
+    if (e) {
+      hits++;
+    } else {
+      misses++;
+      e = load(index, true);
+      if (!e)
+        break;
+    }
+
+    if (offset >= e->data.size())
+      break;
+
+    size_t len = e->data.size() - offset;
+    if (len > bytes - done)
+      len = bytes - done;
+
+    memcpy((char *)dest + done, e->data.data() + offset, len);
+    done += len;
+  }
+
+  // Sequential stream detection.
+  u64 last = (u64)(byte + (done ? done - 1 : 0)) / extent_size;
+  if (first == next_sequential || first + 1 == next_sequential)
+    sequential++;
+  else
+    sequential = 0;
+  next_sequential = last + 1;
+
+  if (readahead && sequential >= 2 && myDisk->has_io_threads())
+    start_readahead(last + 1);
+
+  return done;
+}
+
+/**
+ * \brief Write to the disk through the cache.
+ *
+ * Returns the number of bytes written; less than requested if the disk
+ * couldn't be read or written.
+ **/
+size_t CDiskCache::write(void *src, size_t bytes, off_t_large byte) {
+  std::lock_guard<std::mutex> lock(cache_mutex);
+
+  size_t done = 0;
+
+  while (done < bytes) {
+    u64 index = (u64)(byte + done) / extent_size;
+    size_t offset = (size_t)((byte + done) % extent_size);
+    size_t len = extent_size - offset;
+    if (len > bytes - done)
+      len = bytes - done;
+
+    auto p = pending.find(index);
+    if (p != pending.end())
+      p->second = false;
+
+    SExtent *e = lookup(index);
+    if (!e && write_back) {
+      e = load(index, offset || len < extent_bytes(index));
+      if (!e)
+        break;
+    }
+
+    if (e) {
+      if (offset >= e->data.size())
+        break;
+      if (len > e->data.size() - offset)
+        len = e->data.size() - offset;
+      memcpy(e->data.data() + offset, (char *)src + done, len);
+      if (write_back)
+        e->dirty = true;
+    }
+
+    if (!write_back &&
+        myDisk->write_bytes_at((char *)src + done, len, byte + done) != len)
+      break;
+
+    done += len;
+  }
+
+  return done;
+}
+
+/**
+ * \brief Write all dirty extents back to the disk.
+ *
+ * Returns false if any of them couldn't be written; those stay dirty.
+ **/
+bool CDiskCache::flush() {
+  std::lock_guard<std::mutex> lock(cache_mutex);
+  bool ok = true;
+
+  for (auto &e : lru) {
+    if (!write_extent(e))
+      ok = false;
+  }
+  return ok;
+}
+
+/**
+ * \brief Drop all extents. Dirty data is written back first.
+ *
+ * Returns false if some dirty data couldn't be written; those extents are
+ * kept.
+ **/
+bool CDiskCache::invalidate() {
+  std::lock_guard<std::mutex> lock(cache_mutex);
+  bool ok = true;
+
+  for (auto e = lru.begin(); e != lru.end();) {
+    if (!write_extent(*e)) {
+      ok = false;
+      e++;
+      continue;
+    }
+    extents.erase(e->index);
+    e = lru.erase(e);
+  }
+  for (auto &p : pending)
+    p.second = false;
+  sequential = 0;
+  return ok;
+}
@@ -0,0 +1,99 @@
+/* AXPbox Alpha Emulator
+ * Copyright (C) 2020 Tomáš Glozar
+ * Website: https://github.com/lenticularis39/axpbox
+ *
+ * Forked from: ES40 emulator
+ * Copyright (C) 2007-2008 by the ES40 Emulator Project
+ * Copyright (C) 2007 by Camiel Vanderhoeven
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301,
+ * USA.
+ *
+ * Although this is not required, the author would appreciate being notified of,
+ * and receiving any modifications you may make to the source code that might
+ * serve the general public.
+ */
+
+#if !defined(__DISKCACHE_H__)
+#define __DISKCACHE_H__
+
+#include "StdAfx.hpp"
+
+#include <list>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+
+class CDisk;
+
+/**
+ * \brief Host-side block cache for a CDisk.
+ *
+ * Holds an LRU list of fixed-size extents of the disk. Sequential reads are
+ * detected and the following extents are read ahead through the disk's I/O
+ * worker threads. In write-back mode, writes are kept in the cache until
+ * the extent is evicted or flush() is called; otherwise they are written
+ * through to the disk.
+ **/
+class CDiskCache {
+public:
+  CDiskCache(CDisk *disk, size_t size, size_t extent, int readahead,
+             bool write_back);
+  ~CDiskCache();
+
+  size_t read(void *dest, size_t bytes, off_t_large byte);
+  size_t write(void *src, size_t bytes, off_t_large byte);
+  bool flush();
+  bool invalidate();
+
+  u64 get_hits() { return hits; };
+  u64 get_misses() { return misses; };
+  u64 get_readaheads() { return readaheads; };
+
+private:
+  struct SExtent {
+    u64 index;
+    bool dirty;
+    std::vector<char> data;
+  };
+
+  CDisk *myDisk;
+  size_t extent_size;
+  size_t max_extents;
+  int readahead;
+  bool write_back;
+
+  std::mutex cache_mutex;
+  std::list<SExtent> lru; ///< Most recently used at the front
+  std::unordered_map<u64, std::list<SExtent>::iterator> extents;
+  /// Extents being read ahead; false once a write made the data stale
+  std::unordered_map<u64, bool> pending;
+
+  u64 next_sequential; ///< Extent that continues the last read
+  int sequential;      ///< Number of sequential reads in a row
+
+  u64 hits;
+  u64 misses;
+  u64 readaheads;
+
+  size_t extent_bytes(u64 index);
+  SExtent *lookup(u64 index);
+  SExtent *load(u64 index, bool fill);
+  bool evict();
+  bool insert(SExtent &&e);
+  bool write_extent(SExtent &e);
+  void start_readahead(u64 index);
+};
+#endif //! defined(__DISKCACHE_H__)
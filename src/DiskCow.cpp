@@ -0,0 +1,333 @@
+/* AXPbox Alpha Emulator
+ * Copyright (C) 2020 Tomáš Glozar
+ * Website: https://github.com/lenticularis39/axpbox
+ *
+ * Forked from: ES40 emulator
+ * Copyright (C) 2007-2008 by the ES40 Emulator Project
+ * Copyright (C) 2007 by Camiel Vanderhoeven
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301,
+ * USA.
+ *
+ * Although this is not required, the author would appreciate being notified of,
+ * and receiving any modifications you may make to the source code that might
+ * serve the general public.
+ */
+
+#include "DiskCow.hpp"
+#include "StdAfx.hpp"
+
+#if !defined(HAVE_FSYNC) && defined(_WIN32)
+#include <io.h> // _commit
+#endif
+
+/**
+ * \brief Constructor.
+ *
+ * Opens the base image read-only and the delta file read/write. The delta
+ * file is created if it does not exist yet.
+ **/
+CDiskCow::CDiskCow(CConfigurator *cfg, CSystem *sys, CDiskController *c,
+                   int idebus, int idedev)
+    : CDisk(cfg, sys, c, idebus, idedev) {
+  base_filename = myCfg->get_text_value("base");
+  delta_filename = myCfg->get_text_value("file");
+  if (!base_filename || !delta_filename)
+    FAILURE_1(Configuration, "%s: both base and file must be set",
+              devid_string);
+
+  cluster_size = (u32)myCfg->get_num_value("cluster_size", false, 64 * 1024);
+  if (cluster_size < 512 || (cluster_size & (cluster_size - 1)))
+    FAILURE_1(Configuration,
+              "%s: cluster_size must be a power of two of at least 512",
+              devid_string);
+
+  base_handle = fopen(base_filename, "rb");
+  if (!base_handle)
+    FAILURE_2(Runtime, "%s: base image %s could not be opened", devid_string,
+              base_filename);
+
+  fseek_large(base_handle, 0, SEEK_END);
+  byte_size = ftell_large(base_handle);
+
+  CHECK_ALLOCATION(cow_mutex = new CFastMutex("disk-cow"));
+
+  delta_handle = fopen(delta_filename, read_only ? "rb" : "rb+");
+  if (!delta_handle) {
+    if (read_only)
+      FAILURE_2(Runtime, "%s: delta file %s could not be opened", devid_string,
+                delta_filename);
+    create_delta();
+  }
+  open_delta();
+
+  state.byte_pos = 0;
+
+  // Requests are serialized by cow_mutex, one worker keeps them off the
+  // emulator thread.
+  io_threads = myCfg->get_num_value("io_threads", false, 1);
+
+  sectors = 32;
+  heads = 8;
+
+  determine_layout();
+
+  model_number = myCfg->get_text_value("model_number", "ES40COWDISK");
+
+  printf("%s: Mounted %s over %s, %" PRId64 " %zd-byte blocks, %" PRId64
+         "/%ld/%ld.\n",
+         devid_string, delta_filename, base_filename,
+         byte_size / state.block_size, state.block_size, cylinders, heads,
+         sectors);
+}
+
+/**
+ * \brief Destructor.
+ **/
+CDiskCow::~CDiskCow(void) {
+  stop_threads();
+  printf("%s: Closing files.\n", devid_string);
+  fclose(delta_handle);
+  fclose(base_handle);
+  delete cow_mutex;
+}
+
+/**
+ * \brief Create an empty delta file for the base image.
+ **/
+void CDiskCow::create_delta() {
+  SCowHeader hdr;
+  memset(&hdr, 0, sizeof(hdr));
+  hdr.magic = COW_MAGIC;
+  hdr.version = COW_VERSION;
+  hdr.cluster_size = cluster_size;
+  hdr.disk_size = byte_size;
+  hdr.clusters = (byte_size + cluster_size - 1) / cluster_size;
+  strncpy(hdr.base, base_filename, sizeof(hdr.base) - 1);
+
+  delta_handle = fopen(delta_filename, "wb+");
+  if (!delta_handle)
+    FAILURE_2(Runtime, "%s: delta file %s could not be created", devid_string,
+              delta_filename);
+
+  std::vector<u64> empty((size_t)hdr.clusters, 0);
+  fwrite(&hdr, sizeof(hdr), 1, delta_handle);
+  fseek_large(delta_handle, COW_TABLE_OFFSET, SEEK_SET);
+  if (fwrite(empty.data(), sizeof(u64), empty.size(), delta_handle) !=
+      empty.size())
+    FAILURE_2(Runtime, "%s: delta file %s could not be written", devid_string,
+              delta_filename);
+  if (!sync_delta())
+    FAILURE_2(Runtime, "%s: delta file %s could not be written", devid_string,
+              delta_filename);
+
+  printf("%s: Created delta file %s for %s.\n", devid_string, delta_filename,
+         base_filename);
+}
+
+/**
+ * \brief Read the header and allocation table of the delta file.
+ **/
+void CDiskCow::open_delta() {
+  SCowHeader hdr;
+
+  fseek_large(delta_handle, 0, SEEK_SET);
+  if (fread(&hdr, sizeof(hdr), 1, delta_handle) != 1 ||
+      hdr.magic != COW_MAGIC || hdr.version != COW_VERSION)
+    FAILURE_2(Runtime, "%s: %s is not a delta file", devid_string,
+              delta_filename);
+
+  if (hdr.disk_size != (u64)byte_size)
+    FAILURE_2(Runtime, "%s: base image %s does not match the delta file",
+              devid_string, base_filename);
+
+  if (hdr.cluster_size < 512 || (hdr.cluster_size & (hdr.cluster_size - 1)))
+    FAILURE_2(Runtime, "%s: %s has an invalid cluster size", devid_string,
+              delta_filename);
+
+  if (hdr.clusters !=
+      (hdr.disk_size + hdr.cluster_size - 1) / hdr.cluster_size)
+    FAILURE_2(Runtime, "%s: allocation table of %s has the wrong size",
+              devid_string, delta_filename);
+
+  hdr.base[sizeof(hdr.base) - 1] = '\0';
+  if (strncmp(hdr.base, base_filename, sizeof(hdr.base) - 1))
+    FAILURE_3(Runtime, "%s: delta file %s was made for base image %s",
+              devid_string, delta_filename, hdr.base);
+
+  cluster_size = hdr.cluster_size;
+  table.resize((size_t)hdr.clusters);
+  fseek_large(delta_handle, COW_TABLE_OFFSET, SEEK_SET);
+  if (fread(table.data(), sizeof(u64), table.size(), delta_handle) !=
+      table.size())
+    FAILURE_2(Runtime, "%s: allocation table of %s is truncated",
+              devid_string, delta_filename);
+
+  // New clusters go at the end of the file, aligned to the cluster size.
+  fseek_large(delta_handle, 0, SEEK_END);
+  next_free = ftell_large(delta_handle);
+  next_free = (next_free + cluster_size - 1) & ~((off_t_large)cluster_size - 1);
+}
+
+/**
+ * \brief Write the delta file through to the host disk.
+ **/
+bool CDiskCow::sync_delta() {
+  if (fflush(delta_handle))
+    return false;
+#if defined(HAVE_FSYNC)
+  return fsync(fileno(delta_handle)) == 0;
+#elif defined(_WIN32)
+  return _commit(_fileno(delta_handle)) == 0;
+#else
+  return true;
+#endif
+}
+
+bool CDiskCow::seek_byte(off_t_large byte) {
+  if (byte >= byte_size) {
+    FAILURE_1(InvalidArgument, "%s: Seek beyond end of file!\n", devid_string);
+  }
+
+  state.byte_pos = byte;
+  return true;
+}
+
+size_t CDiskCow::read_bytes(void *dest, size_t bytes) {
+  size_t r = read_bytes_at(dest, bytes, state.byte_pos);
+  state.byte_pos += r;
+  return r;
+}
+
+size_t CDiskCow::write_bytes(void *src, size_t bytes) {
+  size_t r = write_bytes_at(src, bytes, state.byte_pos);
+  state.byte_pos += r;
+  return r;
+}
+
+/**
+ * \brief Read from the base image. The part beyond its end reads as zeroes.
+ **/
+size_t CDiskCow::read_base(void *dest, size_t bytes, off_t_large byte) {
+  fseek_large(base_handle, byte, SEEK_SET);
+  size_t r = fread(dest, 1, bytes, base_handle);
+  if (r < bytes)
+    memset((char *)dest + r, 0, bytes - r);
+  return bytes;
+}
+
+/**
+ * \brief Allocate a cluster in the delta file and fill it from the base.
+ *
+ * The cluster data is synced to the host disk before the table entry is
+ * written, so a crash (of the emulator or the host) can leak space in the
+ * delta file, but never leaves a table entry that points at a cluster that
+ * was not written. Guest data written to the cluster afterwards is not
+ * synced, like that of any other file disk.
+ *
+ * \return Position of the cluster in the delta file.
+ **/
+u64 CDiskCow::allocate_cluster(u64 cluster) {
+  std::vector<char> buf(cluster_size);
+  u64 pos = next_free;
+
+  read_base(buf.data(), cluster_size, (off_t_large)cluster * cluster_size);
+  fseek_large(delta_handle, pos, SEEK_SET);
+  if (fwrite(buf.data(), 1, cluster_size, delta_handle) != cluster_size ||
+      !sync_delta())
+    return 0;
+
+  fseek_large(delta_handle, COW_TABLE_OFFSET + cluster * sizeof(u64),
+              SEEK_SET);
+  if (fwrite(&pos, sizeof(u64), 1, delta_handle) != 1)
+    return 0;
+
+  table[(size_t)cluster] = pos;
+  next_free += cluster_size;
+  return pos;
+}
+
+/**
+ * \brief Read bytes from a given position. Thread safe.
+ **/
+size_t CDiskCow::read_bytes_at(void *dest, size_t bytes, off_t_large byte) {
+  SCOPED_FM_LOCK(cow_mutex);
+
+  if (byte >= byte_size)
+    return 0;
+  if (byte + (off_t_large)bytes > byte_size)
+    bytes = (size_t)(byte_size - byte);
+
+  size_t done = 0;
+  while (done < bytes) {
+    u64 cluster = (u64)byte / cluster_size;
+    size_t offset = (size_t)(byte % cluster_size);
+    size_t len = cluster_size - offset;
+    if (len > bytes - done)
+      len = bytes - done;
+
+    char *p = (char *)dest + done;
+    if (table[(size_t)cluster]) {
+      fseek_large(delta_handle, table[(size_t)cluster] + offset, SEEK_SET);
+      if (fread(p, 1, len, delta_handle) != len)
+        break;
+    } else {
+      read_base(p, len, byte);
+    }
+
+    done += len;
+    byte += len;
+  }
+  return done;
+}
+
+/**
+ * \brief Write bytes to a given position. Thread safe.
+ *
+ * Clusters that are still in the base image are copied to the delta file
+ * first.
+ **/
+size_t CDiskCow::write_bytes_at(void *src, size_t bytes, off_t_large byte) {
+  if (read_only)
+    return 0;
+
+  SCOPED_FM_LOCK(cow_mutex);
+
+  if (byte >= byte_size)
+    return 0;
+  if (byte + (off_t_large)bytes > byte_size)
+    bytes = (size_t)(byte_size - byte);
+
+  size_t done = 0;
+  while (done < bytes) {
+    u64 cluster = (u64)byte / cluster_size;
+    size_t offset = (size_t)(byte % cluster_size);
+    size_t len = cluster_size - offset;
+    if (len > bytes - done)
+      len = bytes - done;
+
+    u64 pos = table[(size_t)cluster];
+    if (!pos && !(pos = allocate_cluster(cluster)))
+      break;
+
+    fseek_large(delta_handle, pos + offset, SEEK_SET);
+    if (fwrite((char *)src + done, 1, len, delta_handle) != len)
+      break;
+
+    done += len;
+    byte += len;
+  }
+  return done;
+}
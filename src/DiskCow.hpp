@@ -0,0 +1,96 @@
+/* AXPbox Alpha Emulator
+ * Copyright (C) 2020 Tomáš Glozar
+ * Website: https://github.com/lenticularis39/axpbox
+ *
+ * Forked from: ES40 emulator
+ * Copyright (C) 2007-2008 by the ES40 Emulator Project
+ * Copyright (C) 2007 by Camiel Vanderhoeven
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301,
+ * USA.
+ *
+ * Although this is not required, the author would appreciate being notified of,
+ * and receiving any modifications you may make to the source code that might
+ * serve the general public.
+ */
+
+#if !defined(__DISKCOW_H__)
+#define __DISKCOW_H__
+
+#include "Disk.hpp"
+
+#include <vector>
+
+/// Magic number at the start of a copy-on-write delta file ("AXPC").
+#define COW_MAGIC 0x43505841
+#define COW_VERSION 1
+
+/// The allocation table starts at this offset in the delta file.
+#define COW_TABLE_OFFSET 4096
+
+/**
+ * \brief Header of a copy-on-write delta file.
+ **/
+struct SCowHeader {
+  u32 magic;
+  u32 version;
+  u32 cluster_size; /**< Allocation unit in bytes. **/
+  u32 reserved;
+  u64 disk_size;    /**< Size of the base image (and of the disk). **/
+  u64 clusters;     /**< Number of entries in the allocation table. **/
+  char base[256];   /**< Base image the delta was created for. **/
+};
+
+/**
+ * \brief Emulated disk that layers a delta file over a read-only base image.
+ *
+ * The delta file holds a header, a block allocation table with one u64 per
+ * cluster, and the clusters that have been written to. A table entry of 0
+ * means the cluster is still read from the base image; otherwise it is the
+ * offset of the cluster in the delta file. Clusters are allocated at the end
+ * of the delta file on the first write to them.
+ **/
+class CDiskCow : public CDisk {
+public:
+  CDiskCow(CConfigurator *cfg, CSystem *sys, CDiskController *c, int idebus,
+           int idedev);
+  virtual ~CDiskCow(void);
+
+  virtual bool seek_byte(off_t_large byte);
+  virtual size_t read_bytes(void *dest, size_t bytes);
+  virtual size_t write_bytes(void *src, size_t bytes);
+
+  virtual size_t read_bytes_at(void *dest, size_t bytes, off_t_large byte);
+  virtual size_t write_bytes_at(void *src, size_t bytes, off_t_large byte);
+
+protected:
+  FILE *base_handle;
+  FILE *delta_handle;
+  char *base_filename;
+  char *delta_filename;
+
+  CFastMutex *cow_mutex;
+
+  u32 cluster_size;
+  std::vector<u64> table; ///< Allocation table (0 = in base image)
+  off_t_large next_free;  ///< First free cluster position in the delta file
+
+  void create_delta();
+  void open_delta();
+  bool sync_delta();
+  size_t read_base(void *dest, size_t bytes, off_t_large byte);
+  u64 allocate_cluster(u64 cluster);
+};
+#endif //! defined(__DISKCOW_H__)
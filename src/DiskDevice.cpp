@@ -114,6 +114,7 @@ CDiskDevice::CDiskDevice(CConfigurator *cfg, CSystem *sys, CDiskController *c,
 }
 
 CDiskDevice::~CDiskDevice(void) {
+  stop_threads();
   printf("%s: Closing file.\n", devid_string);
 #if defined(_WIN32)
   if (handle != INVALID_HANDLE_VALUE)
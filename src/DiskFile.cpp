@@ -32,6 +32,17 @@
 #include <fstream>
 #include <iostream>
 
+#if defined(HAVE_PREAD)
+#include <fcntl.h>
+#endif
+
+#if defined(HAVE_PREADV)
+#include <sys/uio.h>
+
+/// Largest number of segments passed to preadv/pwritev in one call.
+#define DISK_MAX_IOV 256
+#endif
+
 CDiskFile::CDiskFile(CConfigurator *cfg, CSystem *sys, CDiskController *c,
                      int idebus, int idedev)
     : CDisk(cfg, sys, c, idebus, idedev) {
@@ -82,13 +93,33 @@ CDiskFile::CDiskFile(CConfigurator *cfg, CSystem *sys, CDiskController *c,
     checkFileWritable(filename);
   }
 
+#if defined(HAVE_PREAD)
+  fd = open(filename, read_only ? O_RDONLY : O_RDWR);
+  if (fd < 0)
+    FAILURE_2(Runtime, "%s: file %s could not be opened", devid_string,
+              filename);
+
+  // determine size...
+  byte_size = lseek(fd, 0, SEEK_END);
+#else
   handle = fopen(filename, read_only ? "rb" : "rb+");
+  if (!handle)
+    FAILURE_2(Runtime, "%s: file %s could not be opened", devid_string,
+              filename);
+  CHECK_ALLOCATION(handle_mutex = new CFastMutex("disk-handle"));
 
   // determine size...
   fseek_large(handle, 0, SEEK_END);
   byte_size = ftell_large(handle);
   fseek_large(handle, 0, SEEK_SET);
-  state.byte_pos = ftell_large(handle);
+#endif
+  state.byte_pos = 0;
+
+  // Requests submitted through submit_io are handled by this many threads,
+  // using positional I/O so they don't disturb each other. One keeps the
+  // emulator thread free without a pile of mostly idle threads per disk;
+  // disks that see a lot of queued I/O can be given more.
+  io_threads = myCfg->get_num_value("io_threads", false, 1);
 
   sectors = 32;
   heads = 8;
@@ -144,34 +175,140 @@ void CDiskFile::createDiskFile(const std::string &fileName, u64 diskFileSize) {
 }
 
 CDiskFile::~CDiskFile(void) {
+  stop_threads();
   printf("%s: Closing file.\n", devid_string);
+#if defined(HAVE_PREAD)
+  close(fd);
+#else
   fclose(handle);
+  delete handle_mutex;
+#endif
 }
 
+/**
+ * \brief Set the current position.
+ *
+ * The position is only remembered; the actual I/O is done at that position
+ * by read_bytes and write_bytes.
+ **/
 bool CDiskFile::seek_byte(off_t_large byte) {
   if (byte >= byte_size) {
     FAILURE_1(InvalidArgument, "%s: Seek beyond end of file!\n", devid_string);
   }
 
-  fseek_large(handle, byte, SEEK_SET);
-  state.byte_pos = ftell_large(handle);
+  state.byte_pos = byte;
 
   return true;
 }
 
 size_t CDiskFile::read_bytes(void *dest, size_t bytes) {
-  size_t r;
-  r = fread(dest, 1, bytes, handle);
-  state.byte_pos = ftell_large(handle);
+  size_t r = read_bytes_at(dest, bytes, state.byte_pos);
+  state.byte_pos += r;
   return r;
 }
 
 size_t CDiskFile::write_bytes(void *src, size_t bytes) {
+  size_t r = write_bytes_at(src, bytes, state.byte_pos);
+  state.byte_pos += r;
+  return r;
+}
+
+/**
+ * \brief Read bytes from a given position. Thread safe.
+ **/
+size_t CDiskFile::read_bytes_at(void *dest, size_t bytes, off_t_large byte) {
+#if defined(HAVE_PREAD)
+  size_t done = 0;
+  while (done < bytes) {
+    ssize_t r = pread(fd, (char *)dest + done, bytes - done, byte + done);
+    if (r < 0 && errno == EINTR)
+      continue;
+    if (r <= 0)
+      break;
+    done += r;
+  }
+  return done;
+#else
+  SCOPED_FM_LOCK(handle_mutex);
+  fseek_large(handle, byte, SEEK_SET);
+  return fread(dest, 1, bytes, handle);
+#endif
+}
+
+/**
+ * \brief Write bytes to a given position. Thread safe.
+ **/
+size_t CDiskFile::write_bytes_at(void *src, size_t bytes, off_t_large byte) {
   if (read_only)
     return 0;
 
-  size_t r;
-  r = fwrite(src, 1, bytes, handle);
-  state.byte_pos = ftell_large(handle);
-  return r;
+#if defined(HAVE_PREAD)
+  size_t done = 0;
+  while (done < bytes) {
+    ssize_t r = pwrite(fd, (char *)src + done, bytes - done, byte + done);
+    if (r < 0 && errno == EINTR)
+      continue;
+    if (r <= 0)
+      break;
+    done += r;
+  }
+  return done;
+#else
+  SCOPED_FM_LOCK(handle_mutex);
+  fseek_large(handle, byte, SEEK_SET);
+  return fwrite(src, 1, bytes, handle);
+#endif
+}
+
+#if defined(HAVE_PREADV)
+/**
+ * \brief Read into a list of buffers with a single preadv call.
+ *
+ * Short or failed transfers are retried segment by segment.
+ **/
+size_t CDiskFile::read_vec_at(SDiskVec *vec, int count, off_t_large byte) {
+  struct iovec iov[DISK_MAX_IOV];
+  size_t total = 0;
+
+  if (count > DISK_MAX_IOV)
+    return CDisk::read_vec_at(vec, count, byte);
+
+  for (int i = 0; i < count; i++) {
+    iov[i].iov_base = vec[i].buf;
+    iov[i].iov_len = vec[i].len;
+    total += vec[i].len;
+  }
+
+  ssize_t r = preadv(fd, iov, count, byte);
+  if (r == (ssize_t)total)
+    return total;
+  return CDisk::read_vec_at(vec, count, byte);
 }
+
+/**
+ * \brief Write from a list of buffers with a single pwritev call.
+ *
+ * \sa read_vec_at
+ **/
+size_t CDiskFile::write_vec_at(SDiskVec *vec, int count, off_t_large byte) {
+  struct iovec iov[DISK_MAX_IOV];
+  size_t total = 0;
+
+  if (read_only)
+    return 0;
+
+  if (count > DISK_MAX_IOV)
+    return CDisk::write_vec_at(vec, count, byte);
+
+  for (int i = 0; i < count; i++) {
+    iov[i].iov_base = vec[i].buf;
+    iov[i].iov_len = vec[i].len;
+    total += vec[i].len;
+  }
+
+  ssize_t r = pwritev(fd, iov, count, byte);
+  if (r == (ssize_t)total)
+    return total;
+  return CDisk::write_vec_at(vec, count, byte);
+}
+#endif
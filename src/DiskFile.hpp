@@ -45,10 +45,20 @@ public:
   virtual size_t read_bytes(void *dest, size_t bytes);
   virtual size_t write_bytes(void *src, size_t bytes);
 
-  FILE *get_handle() { return handle; };
+  virtual size_t read_bytes_at(void *dest, size_t bytes, off_t_large byte);
+  virtual size_t write_bytes_at(void *src, size_t bytes, off_t_large byte);
+#if defined(HAVE_PREADV)
+  virtual size_t read_vec_at(SDiskVec *vec, int count, off_t_large byte);
+  virtual size_t write_vec_at(SDiskVec *vec, int count, off_t_large byte);
+#endif
 
 protected:
+#if defined(HAVE_PREAD)
+  int fd;
+#else
   FILE *handle;
+  CFastMutex *handle_mutex;
+#endif
   char *filename;
 
   void createDiskFile(const std::string &filename, u64 diskFileSize);
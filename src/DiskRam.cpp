@@ -52,6 +52,7 @@ CDiskRam::CDiskRam(CConfigurator *cfg, CSystem *sys, CDiskController *c,
 }
 
 CDiskRam::~CDiskRam(void) {
+  stop_threads();
   if (ramdisk) {
     printf("%s: RAMDISK freed.\n", devid_string);
     free(ramdisk);
@@ -38,23 +38,24 @@
 CPacketQueue::CPacketQueue(const char *name, int max) {
   this->name = name;
   this->max = max;
-  head = 0;
-  tail = -1;
-  cnt = 0;
-  highwater = 0;
-  dropped = 0;
   packets = new eth_packet[max];
 }
 
 CPacketQueue::~CPacketQueue() {
   delete[] packets;
-  printf("CPacketQueue(%s): highwater=%d, lost=%d\n", name, highwater, dropped);
+  printf("CPacketQueue(%s): highwater=%d, lost=%d\n", name, highwater.load(),
+         lost());
 }
 
 void CPacketQueue::flush() {
-  cnt = 0;
-  head = 0;
-  tail = -1;
+  head.store(tail.load(std::memory_order_acquire), std::memory_order_release);
+}
+
+void CPacketQueue::get_stats(SPacketQueueStats *stats) {
+  stats->packets = packets_added.load(std::memory_order_relaxed);
+  stats->dropped = dropped.load(std::memory_order_relaxed);
+  stats->highwater = highwater.load(std::memory_order_relaxed);
+  stats->count = count();
 }
 
 static const u32 crcTable[256] = {
@@ -102,20 +103,196 @@ static const u32 crcTable[256] = {
     0x54DE5729, 0x23D967BF, 0xB3667A2E, 0xC4614AB8, 0x5D681B02, 0x2A6F2B94,
     0xB40BBE37, 0xC30C8EA1, 0x5A05DF1B, 0x2D02EF8D};
 
-static u32 eth_crc32(u32 crc, const void *vbuf, int len) {
+/**
+ * \brief Tables for slicing-by-8: crcSlice[k][b] is the CRC of byte b
+ * followed by k zero bytes. crcSlice[0] is crcTable.
+ **/
+static u32 crcSlice[8][256];
+
+static void crc_init_slices() {
+  for (int i = 0; i < 256; i++) {
+    crcSlice[0][i] = crcTable[i];
+    for (int k = 1; k < 8; k++)
+      crcSlice[k][i] = (crcSlice[k - 1][i] >> 8) ^
+                       crcTable[crcSlice[k - 1][i] & 0xFF];
+  }
+}
+
+/**
+ * \brief CRC-32 (without the final inversions), 8 bytes per iteration.
+ **/
+static u32 crc32_slice8(u32 crc, const u8 *buf, size_t len) {
+  while (len >= 8) {
+    u32 lo = crc ^ ((u32)buf[0] | ((u32)buf[1] << 8) | ((u32)buf[2] << 16) |
+                    ((u32)buf[3] << 24));
+    u32 hi = (u32)buf[4] | ((u32)buf[5] << 8) | ((u32)buf[6] << 16) |
+             ((u32)buf[7] << 24);
+    crc = crcSlice[7][lo & 0xFF] ^ crcSlice[6][(lo >> 8) & 0xFF] ^
+          crcSlice[5][(lo >> 16) & 0xFF] ^ crcSlice[4][lo >> 24] ^
+          crcSlice[3][hi & 0xFF] ^ crcSlice[2][(hi >> 8) & 0xFF] ^
+          crcSlice[1][(hi >> 16) & 0xFF] ^ crcSlice[0][hi >> 24];
+    buf += 8;
+    len -= 8;
+  }
+
+  while (len--)
+    crc = (crc >> 8) ^ crcTable[(crc ^ *buf++) & 0xFF];
+  return crc;
+}
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define HAVE_CRC32_CLMUL
+#include <immintrin.h>
+
+/**
+ * \brief CRC-32 (without the final inversions) by folding with carry-less
+ * multiplication, 64 bytes per iteration.
+ *
+ * len must be a multiple of 16, and at least 64. This is the method from
+ * Intel's "Fast CRC Computation for Generic Polynomials Using PCLMULQDQ
+ * Instruction", with the constants for the reflected ethernet polynomial.
+ **/
+__attribute__((target("pclmul,sse4.1"))) static u32
+crc32_clmul(u32 crc, const u8 *buf, size_t len) {
+  alignas(16) static const u64 k1k2[] = {0x0154442bd4, 0x01c6e41596};
+  alignas(16) static const u64 k3k4[] = {0x01751997d0, 0x00ccaa009e};
+  alignas(16) static const u64 k5k0[] = {0x0163cd6124, 0x0000000000};
+  alignas(16) static const u64 poly[] = {0x01db710641, 0x01f7011641};
+  __m128i x0, x1, x2, x3, x4, x5, x6, x7, x8;
+
+  x1 = _mm_loadu_si128((const __m128i *)(buf + 0x00));
+  x2 = _mm_loadu_si128((const __m128i *)(buf + 0x10));
+  x3 = _mm_loadu_si128((const __m128i *)(buf + 0x20));
+  x4 = _mm_loadu_si128((const __m128i *)(buf + 0x30));
+  x1 = _mm_xor_si128(x1, _mm_cvtsi32_si128((int)crc));
+  x0 = _mm_load_si128((const __m128i *)k1k2);
+  buf += 64;
+  len -= 64;
+
+  // Fold 64 bytes at a time into four accumulators.
+  while (len >= 64) {
+    x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+    x6 = _mm_clmulepi64_si128(x2, x0, 0x00);
+    x7 = _mm_clmulepi64_si128(x3, x0, 0x00);
+    x8 = _mm_clmulepi64_si128(x4, x0, 0x00);
+    x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+    x2 = _mm_clmulepi64_si128(x2, x0, 0x11);
+    x3 = _mm_clmulepi64_si128(x3, x0, 0x11);
+    x4 = _mm_clmulepi64_si128(x4, x0, 0x11);
+    x1 = _mm_xor_si128(_mm_xor_si128(x1, x5),
+                       _mm_loadu_si128((const __m128i *)(buf + 0x00)));
+    x2 = _mm_xor_si128(_mm_xor_si128(x2, x6),
+                       _mm_loadu_si128((const __m128i *)(buf + 0x10)));
+    x3 = _mm_xor_si128(_mm_xor_si128(x3, x7),
+                       _mm_loadu_si128((const __m128i *)(buf + 0x20)));
+    x4 = _mm_xor_si128(_mm_xor_si128(x4, x8),
+                       _mm_loadu_si128((const __m128i *)(buf + 0x30)));
+    buf += 64;
+    len -= 64;
+  }
+
+  // Fold the accumulators into one.
+  x0 = _mm_load_si128((const __m128i *)k3k4);
+  x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+  x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+  x1 = _mm_xor_si128(_mm_xor_si128(x1, x2), x5);
+  x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+  x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+  x1 = _mm_xor_si128(_mm_xor_si128(x1, x3), x5);
+  x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+  x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+  x1 = _mm_xor_si128(_mm_xor_si128(x1, x4), x5);
+
+  // Fold the remaining 16 byte blocks.
+  while (len >= 16) {
+    x2 = _mm_loadu_si128((const __m128i *)buf);
+    x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+    x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+    x1 = _mm_xor_si128(_mm_xor_si128(x1, x2), x5);
+    buf += 16;
+    len -= 16;
+  }
+
+  // Fold 128 bits to 64 bits.
+  x2 = _mm_clmulepi64_si128(x1, x0, 0x10);
+  x3 = _mm_setr_epi32(~0, 0, ~0, 0);
+  x1 = _mm_srli_si128(x1, 8);
+  x1 = _mm_xor_si128(x1, x2);
+  x0 = _mm_loadl_epi64((const __m128i *)k5k0);
+  x2 = _mm_srli_si128(x1, 4);
+  x1 = _mm_and_si128(x1, x3);
+  x1 = _mm_clmulepi64_si128(x1, x0, 0x00);
+  x1 = _mm_xor_si128(x1, x2);
+
+  // Barrett reduction to 32 bits.
+  x0 = _mm_load_si128((const __m128i *)poly);
+  x2 = _mm_and_si128(x1, x3);
+  x2 = _mm_clmulepi64_si128(x2, x0, 0x10);
+  x2 = _mm_and_si128(x2, x3);
+  x2 = _mm_clmulepi64_si128(x2, x0, 0x00);
+  x1 = _mm_xor_si128(x1, x2);
+
+  return (u32)_mm_extract_epi32(x1, 1);
+}
+#endif
+
+static bool crc_use_clmul;
+
+/**
+ * \brief Build the slicing tables and pick the fastest CRC method for this
+ * CPU. Runs once, before any packet is queued.
+ **/
+static bool crc_init() {
+  crc_init_slices();
+#if defined(HAVE_CRC32_CLMUL)
+  __builtin_cpu_init();
+  crc_use_clmul =
+      __builtin_cpu_supports("pclmul") && __builtin_cpu_supports("sse4.1");
+#endif
+  return true;
+}
+
+static bool crc_initialized = crc_init();
+
+/**
+ * \brief Choose between the PCLMULQDQ and the slicing-by-8 CRC method, for
+ * tests and benchmarks. Returns whether PCLMULQDQ is in use; it isn't if
+ * the host doesn't have it.
+ **/
+bool eth_crc32_clmul(bool use) {
+#if defined(HAVE_CRC32_CLMUL)
+  crc_use_clmul = use && __builtin_cpu_supports("pclmul") &&
+                  __builtin_cpu_supports("sse4.1");
+#endif
+  return crc_use_clmul;
+}
+
+/**
+ * \brief Ethernet CRC-32 of a buffer, continuing from crc (0 to start).
+ **/
+u32 eth_crc32(u32 crc, const void *vbuf, int len) {
   const u32 mask = 0xFFFFFFFF;
-  const unsigned char *buf = (const unsigned char *)vbuf;
+  const u8 *buf = (const u8 *)vbuf;
 
   crc ^= mask;
-  while (0 != len--)
-    crc = (crc >> 8) ^ crcTable[(crc ^ (*buf++)) & 0xFF];
+#if defined(HAVE_CRC32_CLMUL)
+  if (crc_use_clmul && len >= 64) {
+    size_t n = (size_t)len & ~(size_t)15;
+    crc = crc32_clmul(crc, buf, n);
+    buf += n;
+    len -= (int)n;
+  }
+#endif
+  crc = crc32_slice8(crc, buf, (size_t)len);
   return (crc ^ mask);
 }
 
 bool CPacketQueue::add_tail(const u8 *packet_data, int packet_len,
                             bool calc_crc, bool need_crc) {
-  if ((cnt >= max) || (packet_len < 1) || (packet_len > 1514)) {
-    dropped += 1;
+  eth_packet *next = tail_packet();
+
+  if (!next || (packet_len < 1) || (packet_len > ETH_MAX_PACKET_RAW)) {
+    drop();
     printf("CPacketQueue(%s):add() packet lost! Size = %d", name, packet_len);
     printf(".. dst: %02x-%02x-%02x-%02x-%02x-%02x ", packet_data[0],
            packet_data[1], packet_data[2], packet_data[3], packet_data[4],
@@ -126,45 +303,77 @@ bool CPacketQueue::add_tail(const u8 *packet_data, int packet_len,
     return false;
   }
 
-  tail += 1;
-  if (tail >= max) {
-    tail = 0;
-  }
+  memcpy(next->frame, packet_data, packet_len); // copy packet data
+  commit_tail(packet_len, calc_crc, need_crc);
+  return true;
+}
+
+/**
+ * \brief Return the free slot at the tail, for the producer to fill in
+ * place; NULL if the queue is full.
+ **/
+eth_packet *CPacketQueue::tail_packet() {
+  u64 t = tail.load(std::memory_order_relaxed);
+
+  if ((int)(t - head.load(std::memory_order_acquire)) >= max)
+    return NULL;
+  return &packets[t % max];
+}
+
+/**
+ * \brief Add the packet in the tail slot (see tail_packet()) to the queue.
+ **/
+void CPacketQueue::commit_tail(int packet_len, bool calc_crc, bool need_crc) {
+  u64 t = tail.load(std::memory_order_relaxed);
+  eth_packet *next = &packets[t % max];
 
-  eth_packet *next = &packets[tail];
   next->len = packet_len;
   next->used = 0;
-  memcpy(next->frame, packet_data, packet_len); // copy packet data
-  if (need_crc) {                               // If packet needs CRC
-    u32 crc = calc_crc ? eth_crc32(0, packet_data, packet_len)
+  if (need_crc) { // If packet needs CRC
+    u32 crc = calc_crc ? eth_crc32(0, next->frame, packet_len)
                        : 0;                     // recalculate crc if needed
     u32 ncrc = htonl(crc);                      // put crc in network order
     memcpy(&next->frame[packet_len], &ncrc, 4); // append CRC to packet
     next->len += 4;                             // increase packet length
   }
 
-  cnt += 1;
-  if (cnt > highwater) {
-    highwater = cnt;
-  }
+  tail.store(t + 1, std::memory_order_release);
+  packets_added.fetch_add(1, std::memory_order_relaxed);
 
-  return true;
+  int cnt = (int)(t + 1 - head.load(std::memory_order_relaxed));
+  if (cnt > highwater.load(std::memory_order_relaxed))
+    highwater.store(cnt, std::memory_order_relaxed);
+}
+
+/**
+ * \brief Return the packet at the head, for the consumer to work on in
+ * place; NULL if the queue is empty.
+ **/
+eth_packet *CPacketQueue::head_packet() {
+  u64 h = head.load(std::memory_order_relaxed);
+
+  if (h == tail.load(std::memory_order_acquire))
+    return NULL;
+  return &packets[h % max];
+}
+
+/**
+ * \brief Release the packet at the head, so its slot can be reused.
+ **/
+void CPacketQueue::pop_head() {
+  head.store(head.load(std::memory_order_relaxed) + 1,
+             std::memory_order_release);
 }
 
 bool CPacketQueue::get_head(eth_packet &packet) {
-  if (cnt <= 0) {
+  eth_packet *headp = head_packet();
+
+  if (!headp)
     return false;
-  }
 
-  eth_packet *headp = &packets[head];
   packet.len = headp->len;
   packet.used = headp->used;
-  memcpy(packet.frame, headp->frame, sizeof(packet.frame));
-  head += 1;
-  if (head >= max) {
-    head = 0;
-  }
-
-  cnt -= 1;
+  memcpy(packet.frame, headp->frame, headp->len);
+  pop_head();
   return true;
 }
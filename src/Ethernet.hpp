@@ -51,33 +51,64 @@ struct eth_packet {             // ethernet packet
   u8 frame[ETH_MAX_PACKET_CRC]; // ethernet frame
 };
 
+/**
+ * \brief Counters of a packet queue.
+ **/
+struct SPacketQueueStats {
+  u64 packets;   /**< Packets added. **/
+  u64 dropped;   /**< Packets lost because the queue was full, or bad. **/
+  int highwater; /**< Most packets ever in the queue at once. **/
+  int count;     /**< Packets in the queue now. **/
+};
+
 /**
  * \brief Packet Queue for Ethernet packets.
+ *
+ * A single-producer, single-consumer ring: one thread adds packets while
+ * another (or the same) thread takes them out, without locking.
+ *
+ * The producer can fill the slot at the tail in place (tail_packet(), then
+ * commit_tail()), or have a packet copied in with add_tail(). The consumer
+ * works on the packet at the head in place (head_packet()) and releases it
+ * with pop_head().
  **/
 class CPacketQueue { // Ethernet Packet Queue
-
-  // private:
 public:
-  const char *name;    // queue name
-  int max;             // maximum items allowed in queue
-  int head;            // first item in queue
-  int tail;            // last item in queue
-  int cnt;             // current item count
-  int highwater;       // highwater mark (statistics)
-  int dropped;         // packets dropped because queue was full
-  eth_packet *packets; // packet array; dynamically allocated
-public:
-  inline int count() { return cnt; }
+  const char *name; // queue name
+  int max;          // maximum items allowed in queue
+
+  inline int count() {
+    return (int)(tail.load(std::memory_order_acquire) -
+                 head.load(std::memory_order_acquire));
+  }
 
   // get current count
-  inline int lost() { return dropped; }
+  inline int lost() { return (int)dropped.load(std::memory_order_relaxed); }
 
   // get number of lost packets
-  void flush(); // empties packet queue
+  void flush(); // empties packet queue (consumer)
   bool add_tail(const u8 *packet_data, int packet_len, bool calc_crc,
-                bool need_crc);            // adds pcap packet to queue
-  bool get_head(eth_packet &packet);       // get packet at head
+                bool need_crc); // adds a copy of a packet to the queue
+  eth_packet *tail_packet();    // free slot to fill, or NULL if full
+  void commit_tail(int packet_len, bool calc_crc,
+                   bool need_crc); // adds the packet in the tail slot
+  void drop() { dropped.fetch_add(1, std::memory_order_relaxed); }
+  eth_packet *head_packet();         // packet at head, or NULL if empty
+  void pop_head();                   // releases the packet at head
+  bool get_head(eth_packet &packet); // get a copy of the packet at head
+  void get_stats(SPacketQueueStats *stats);
   CPacketQueue(const char *name, int max); // constructor
   ~CPacketQueue();                         // destructor
+
+private:
+  std::atomic<u64> head{0}; // packets taken; written by the consumer
+  std::atomic<u64> tail{0}; // packets added; written by the producer
+  std::atomic<int> highwater{0};
+  std::atomic<u64> packets_added{0};
+  std::atomic<u64> dropped{0};
+  eth_packet *packets; // packet array; dynamically allocated
 };
+
+u32 eth_crc32(u32 crc, const void *buf, int len);
+bool eth_crc32_clmul(bool use);
 #endif // !defined(INCLUDED_ETHERNET_H)
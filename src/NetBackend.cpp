@@ -0,0 +1,64 @@
+/* AXPbox Alpha Emulator
+ * Copyright (C) 2020 Tomáš Glozar
+ * Website: https://github.com/lenticularis39/axpbox
+ *
+ * Forked from: ES40 emulator
+ * Copyright (C) 2007-2008 by the ES40 Emulator Project
+ * Copyright (C) 2007 by Camiel Vanderhoeven
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301,
+ * USA.
+ *
+ * Although this is not required, the author would appreciate being notified of,
+ * and receiving any modifications you may make to the source code that might
+ * serve the general public.
+ */
+
+#include "NetBackend.hpp"
+#include "StdAfx.hpp"
+
+CNetBackend::CNetBackend(const char *devid) {
+  devid_string = devid;
+  filter_count = 0;
+}
+
+CNetBackend::~CNetBackend() {}
+
+/**
+ * \brief Set the receive filter.
+ *
+ * The base class keeps the addresses for accept(); backends that can filter
+ * on the host side override this.
+ **/
+void CNetBackend::set_filter(const u8 (*macs)[6], int count) {
+  if (count > NET_FILTER_MAX)
+    count = NET_FILTER_MAX;
+  memcpy(filter, macs, count * 6);
+  filter_count = count;
+}
+
+/**
+ * \brief Check a received frame against the filter.
+ **/
+bool CNetBackend::accept(const u8 *frame, int len) {
+  if (len < 6)
+    return false;
+  if (!filter_count)
+    return true;
+  for (int i = 0; i < filter_count; i++)
+    if (!memcmp(frame, filter[i], 6))
+      return true;
+  return false;
+}
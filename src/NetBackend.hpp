@@ -0,0 +1,69 @@
+/* AXPbox Alpha Emulator
+ * Copyright (C) 2020 Tomáš Glozar
+ * Website: https://github.com/lenticularis39/axpbox
+ *
+ * Forked from: ES40 emulator
+ * Copyright (C) 2007-2008 by the ES40 Emulator Project
+ * Copyright (C) 2007 by Camiel Vanderhoeven
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301,
+ * USA.
+ *
+ * Although this is not required, the author would appreciate being notified of,
+ * and receiving any modifications you may make to the source code that might
+ * serve the general public.
+ */
+
+#if !defined(INCLUDED_NETBACKEND_H)
+#define INCLUDED_NETBACKEND_H
+
+#include "Ethernet.hpp"
+
+/// Maximum number of addresses in the receive filter (the 21143's perfect
+/// filter holds 16).
+#define NET_FILTER_MAX 16
+
+/**
+ * \brief Host side of an emulated network card.
+ *
+ * A backend moves ethernet frames between the emulated NIC and the host.
+ * Except for construction, all calls are made from the NIC thread.
+ **/
+class CNetBackend {
+public:
+  CNetBackend(const char *devid);
+  virtual ~CNetBackend();
+
+  /// Move the frames that have arrived into the queue. Returns the number of
+  /// frames received.
+  virtual int receive(CPacketQueue *q, bool calc_crc) = 0;
+
+  /// Send one frame. Returns false if it could not be sent.
+  virtual bool send(const u8 *frame, int len) = 0;
+
+  /// Accept only frames sent to one of these addresses.
+  virtual void set_filter(const u8 (*macs)[6], int count);
+
+  /// Descriptor that becomes readable when frames arrive, or -1.
+  virtual int get_fd() { return -1; }
+
+protected:
+  bool accept(const u8 *frame, int len);
+
+  const char *devid_string;
+  u8 filter[NET_FILTER_MAX][6];
+  int filter_count; /**< 0 until the first filter is set: accept all. **/
+};
+#endif // !defined(INCLUDED_NETBACKEND_H)
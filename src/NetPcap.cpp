@@ -0,0 +1,177 @@
+/* AXPbox Alpha Emulator
+ * Copyright (C) 2020 Tomáš Glozar
+ * Website: https://github.com/lenticularis39/axpbox
+ *
+ * Forked from: ES40 emulator
+ * Copyright (C) 2007-2008 by the ES40 Emulator Project
+ * Copyright (C) 2007 by Camiel Vanderhoeven
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301,
+ * USA.
+ *
+ * Although this is not required, the author would appreciate being notified of,
+ * and receiving any modifications you may make to the source code that might
+ * serve the general public.
+ */
+
+#include "StdAfx.hpp"
+
+#if defined(HAVE_PCAP)
+#include "NetPcap.hpp"
+
+/**
+ * \brief Open a host adapter.
+ *
+ * If no adapter is given, the user is asked to choose one.
+ **/
+CNetPcap::CNetPcap(const char *devid, const char *adapter)
+    : CNetBackend(devid) {
+  pcap_if_t *alldevs;
+  pcap_if_t *d;
+  u_int inum;
+  u_int i = 0;
+  char errbuf[PCAP_ERRBUF_SIZE];
+  const char *cfg = adapter;
+
+  if (!cfg) {
+    printf("\n%s: Choose a network adapter to connect to:\n", devid_string);
+    if (pcap_findalldevs(&alldevs, errbuf) == -1) {
+      FAILURE_1(Runtime, "Error in pcap_findalldevs_ex: %s", errbuf);
+    }
+
+    /* Print the list */
+    for (d = alldevs; d; d = d->next) {
+      printf("%d. %s\n    ", ++i, d->name);
+      if (d->description)
+        printf(" (%s)\n", d->description);
+      else
+        printf(" (No description available)\n");
+    }
+
+    if (i == 0)
+      FAILURE(Runtime, "No network interfaces found");
+
+    if (i == 1)
+      inum = 1;
+    else {
+      inum = 0;
+      while (inum < 1 || inum > i) {
+        printf("%%NIC-Q-NICNO: Enter the interface number (1-%d):", i);
+        (void)!scanf("%d", &inum);
+      }
+    }
+
+    /* Jump to the selected adapter */
+    for (d = alldevs, i = 0; i < inum - 1; d = d->next, i++)
+      ;
+
+    cfg = d->name;
+  }
+
+#if defined(WIN32)
+
+  // Opening with pcap_open on Windows allows specification of
+  // PCAP_OPENFLAG_NOCAPTURE_LOCAL, which stops the pcap device from seeing it's
+  // own transmitted packets.
+  //
+  // This is important because:
+  //    1. Real ethernet cards don't reflect packets except while in loopback
+  //    mode(s).
+  //    2. Reflecting all packets increases inbound packet processing and host
+  //    load.
+  //    3. DECNET Phase IV will think a reflected packet is from another node
+  //            that has the same DECNET Phase IV address (AA-xx-xx-xx-xx-xx),
+  //            and will panic on startup and abort.
+  //    4. Libpcap doesn't reflect packets, and we want winpcap/libpcap
+  //    processing to be identical.
+  // Loopback packets are handled via direct entry in the receive queue.
+  if ((fp = pcap_open(cfg, 65536 /*snaplen: capture entire packets */,
+                      PCAP_OPENFLAG_PROMISCUOUS |
+                          PCAP_OPENFLAG_NOCAPTURE_LOCAL /*promiscuous */,
+                      10 /*read timeout: 10ms. */, 0 /* auth structure */,
+                      errbuf)) == NULL) // connect to pcap...
+#else
+  if ((fp = pcap_open_live(cfg, 65536 /*snaplen: capture entire packets */,
+                           1 /*promiscuous */, 1 /*read timeout: 1ms. */,
+                           errbuf)) == nullptr) // connect to pcap...
+#endif
+    FAILURE_2(Runtime, "Error opening adapter %s:\n %s", cfg, errbuf);
+
+  if (pcap_setnonblock(fp, 1, errbuf) == PCAP_ERROR)
+    FAILURE_2(Runtime, "Error setting adapter %s non-blocking:\n %s", cfg,
+              errbuf);
+}
+
+CNetPcap::~CNetPcap() { pcap_close(fp); }
+
+int CNetPcap::receive(CPacketQueue *q, bool calc_crc) {
+  struct pcap_pkthdr *packet_header;
+  const u_char *packet_data = NULL;
+  int n = 0;
+
+  while (pcap_next_ex(fp, &packet_header, &packet_data) > 0) {
+    q->add_tail(packet_data, packet_header->caplen, calc_crc, true);
+    n++;
+  }
+  return n;
+}
+
+bool CNetPcap::send(const u8 *frame, int len) {
+  if (pcap_sendpacket(fp, frame, len)) {
+    printf("Error sending the packet: %s\n", pcap_geterr(fp));
+    return false;
+  }
+  return true;
+}
+
+/**
+ * \brief Compile the addresses into a BPF filter, so the host drops frames
+ * that aren't for us.
+ **/
+void CNetPcap::set_filter(const u8 (*macs)[6], int count) {
+  char expr[1000];
+  char mac_txt[20];
+
+  CNetBackend::set_filter(macs, count);
+
+  // strcat(expr,"ether broadcast");
+  // There must be at least one unique item; at least the mac of the card
+  expr[0] = '\0';
+  for (int i = 0; i < filter_count; i++) {
+    sprintf(mac_txt, "%02x:%02x:%02x:%02x:%02x:%02x", filter[i][0],
+            filter[i][1], filter[i][2], filter[i][3], filter[i][4],
+            filter[i][5]);
+    strcat(expr, i ? " or ether dst " : "ether dst ");
+    strcat(expr, mac_txt);
+  }
+
+#if defined(DEBUG_NIC_FILTER)
+  printf("FILTER = %s.   \n", expr);
+#endif
+  if (pcap_compile(fp, &fcode, expr, 1, 0xffffffff) < 0)
+    FAILURE_1(Logic, "Unable to compile the packet filter (%s)", expr);
+
+  if (pcap_setfilter(fp, &fcode) < 0)
+    FAILURE(Runtime, "Error setting the filter.");
+}
+
+int CNetPcap::get_fd() {
+#if defined(WIN32)
+  return -1;
+#else
+  return pcap_get_selectable_fd(fp);
+#endif
+}
+#endif // defined(HAVE_PCAP)
@@ -0,0 +1,59 @@
+/* AXPbox Alpha Emulator
+ * Copyright (C) 2020 Tomáš Glozar
+ * Website: https://github.com/lenticularis39/axpbox
+ *
+ * Forked from: ES40 emulator
+ * Copyright (C) 2007-2008 by the ES40 Emulator Project
+ * Copyright (C) 2007 by Camiel Vanderhoeven
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301,
+ * USA.
+ *
+ * Although this is not required, the author would appreciate being notified of,
+ * and receiving any modifications you may make to the source code that might
+ * serve the general public.
+ */
+
+#if !defined(INCLUDED_NETPCAP_H)
+#define INCLUDED_NETPCAP_H
+
+#include "NetBackend.hpp"
+
+#if defined(HAVE_PCAP)
+#if defined(WIN32)
+#define HAVE_REMOTE
+#endif
+#include <pcap.h>
+
+/**
+ * \brief Network backend that captures and injects frames on a host
+ * adapter with libpcap.
+ **/
+class CNetPcap : public CNetBackend {
+public:
+  CNetPcap(const char *devid, const char *adapter);
+  virtual ~CNetPcap();
+
+  virtual int receive(CPacketQueue *q, bool calc_crc);
+  virtual bool send(const u8 *frame, int len);
+  virtual void set_filter(const u8 (*macs)[6], int count);
+  virtual int get_fd();
+
+private:
+  pcap_t *fp;
+  struct bpf_program fcode;
+};
+#endif // defined(HAVE_PCAP)
+#endif // !defined(INCLUDED_NETPCAP_H)
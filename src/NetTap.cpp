@@ -0,0 +1,114 @@
+/* AXPbox Alpha Emulator
+ * Copyright (C) 2020 Tomáš Glozar
+ * Website: https://github.com/lenticularis39/axpbox
+ *
+ * Forked from: ES40 emulator
+ * Copyright (C) 2007-2008 by the ES40 Emulator Project
+ * Copyright (C) 2007 by Camiel Vanderhoeven
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301,
+ * USA.
+ *
+ * Although this is not required, the author would appreciate being notified of,
+ * and receiving any modifications you may make to the source code that might
+ * serve the general public.
+ */
+
+#include "StdAfx.hpp"
+
+#if defined(HAVE_TAP)
+#include "NetTap.hpp"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/if.h>
+#include <linux/if_tun.h>
+#include <sys/ioctl.h>
+
+/**
+ * \brief Attach to a TAP interface.
+ *
+ * If the interface doesn't exist, the kernel creates it; that needs
+ * CAP_NET_ADMIN. If no name is given, the kernel picks one (tapN).
+ **/
+CNetTap::CNetTap(const char *devid, const char *ifname) : CNetBackend(devid) {
+  struct ifreq ifr;
+
+  fd = open("/dev/net/tun", O_RDWR | O_NONBLOCK | O_CLOEXEC);
+  if (fd < 0)
+    FAILURE_2(Runtime, "%s: cannot open /dev/net/tun: %s", devid_string,
+              strerror(errno));
+
+  memset(&ifr, 0, sizeof(ifr));
+  ifr.ifr_flags = IFF_TAP | IFF_NO_PI;
+  if (ifname)
+    strncpy(ifr.ifr_name, ifname, IFNAMSIZ - 1);
+
+  if (ioctl(fd, TUNSETIFF, &ifr) < 0) {
+    int err = errno;
+    close(fd);
+    FAILURE_3(Runtime, "%s: cannot attach to TAP interface %s: %s",
+              devid_string, ifname ? ifname : "(new)", strerror(err));
+  }
+
+  // Frames are read into the receive queue; this buffer only takes the ones
+  // that are dropped because the queue is full.
+  rx_buf.resize(65536);
+
+  printf("%s: attached to TAP interface %s.\n", devid_string, ifr.ifr_name);
+}
+
+CNetTap::~CNetTap() { close(fd); }
+
+/**
+ * \brief Read the frames that are waiting, up to TAP_RX_BATCH at a time.
+ **/
+int CNetTap::receive(CPacketQueue *q, bool calc_crc) {
+  int n = 0;
+
+  for (int i = 0; i < TAP_RX_BATCH; i++) {
+    // Read straight into the queue; if it's full, the frame is dropped.
+    eth_packet *p = q->tail_packet();
+    u8 *buf = p ? p->frame : rx_buf.data();
+    ssize_t len = read(fd, buf, p ? sizeof(p->frame) : rx_buf.size());
+    if (len <= 0)
+      break;
+
+    if (!p) {
+      q->drop();
+      continue;
+    }
+
+    // Frames that filled the slot may have been truncated.
+    if (len > ETH_MAX_PACKET_RAW || !accept(buf, (int)len))
+      continue;
+
+    q->commit_tail((int)len, calc_crc, true);
+    n++;
+  }
+  return n;
+}
+
+bool CNetTap::send(const u8 *frame, int len) {
+  if (write(fd, frame, len) == len)
+    return true;
+
+  // A full TAP queue drops the frame, like a busy wire would.
+  if (errno != EAGAIN)
+    printf("%s: error sending the packet: %s\n", devid_string,
+           strerror(errno));
+  return false;
+}
+#endif // defined(HAVE_TAP)
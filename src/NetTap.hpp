@@ -0,0 +1,61 @@
+/* AXPbox Alpha Emulator
+ * Copyright (C) 2020 Tomáš Glozar
+ * Website: https://github.com/lenticularis39/axpbox
+ *
+ * Forked from: ES40 emulator
+ * Copyright (C) 2007-2008 by the ES40 Emulator Project
+ * Copyright (C) 2007 by Camiel Vanderhoeven
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301,
+ * USA.
+ *
+ * Although this is not required, the author would appreciate being notified of,
+ * and receiving any modifications you may make to the source code that might
+ * serve the general public.
+ */
+
+#if !defined(INCLUDED_NETTAP_H)
+#define INCLUDED_NETTAP_H
+
+#include "NetBackend.hpp"
+
+#if defined(HAVE_TAP)
+#include <vector>
+
+/// Largest number of frames read from the TAP device in one receive() call.
+#define TAP_RX_BATCH 64
+
+/**
+ * \brief Network backend connected to a Linux TAP interface.
+ *
+ * The TAP interface is usually added to a host bridge. Unlike pcap, it needs
+ * no capture privileges once the interface exists (ip tuntap add ... user),
+ * and only sees the frames the host sends to it.
+ **/
+class CNetTap : public CNetBackend {
+public:
+  CNetTap(const char *devid, const char *ifname);
+  virtual ~CNetTap();
+
+  virtual int receive(CPacketQueue *q, bool calc_crc);
+  virtual bool send(const u8 *frame, int len);
+  virtual int get_fd() { return fd; }
+
+private:
+  int fd;
+  std::vector<u8> rx_buf;
+};
+#endif // defined(HAVE_TAP)
+#endif // !defined(INCLUDED_NETTAP_H)
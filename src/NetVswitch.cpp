@@ -0,0 +1,420 @@
+/* AXPbox Alpha Emulator
+ * Copyright (C) 2020 Tomáš Glozar
+ * Website: https://github.com/lenticularis39/axpbox
+ *
+ * Forked from: ES40 emulator
+ * Copyright (C) 2007-2008 by the ES40 Emulator Project
+ * Copyright (C) 2007 by Camiel Vanderhoeven
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301,
+ * USA.
+ *
+ * Although this is not required, the author would appreciate being notified of,
+ * and receiving any modifications you may make to the source code that might
+ * serve the general public.
+ */
+
+#include "StdAfx.hpp"
+
+#if defined(HAVE_VSWITCH)
+#include "NetVswitch.hpp"
+
+#include <algorithm>
+#include <errno.h>
+#include <fcntl.h>
+#include <stddef.h>
+#include <sys/mman.h>
+
+static_assert(ATOMIC_INT_LOCK_FREE == 2 && ATOMIC_LLONG_LOCK_FREE == 2,
+              "the virtual switch needs lock-free atomics in shared memory");
+
+#define VSW_RING_MASK (VSW_RING_SIZE - 1)
+
+static u64 mac_to_u64(const u8 *mac) {
+  return ((u64)mac[0] << 40) | ((u64)mac[1] << 32) | ((u64)mac[2] << 24) |
+         ((u64)mac[3] << 16) | ((u64)mac[4] << 8) | (u64)mac[5];
+}
+
+static int mac_hash(u64 mac) {
+  return (int)((mac ^ (mac >> 17) ^ (mac >> 31)) & (VSW_MAC_TABLE - 1));
+}
+
+/**
+ * \brief Attach to a switch, creating it if it doesn't exist, and claim a
+ * free port.
+ **/
+CNetVswitch::CNetVswitch(const char *devid, const char *name)
+    : CNetBackend(devid) {
+  snprintf(shm_name, sizeof(shm_name), "/axpbox-vswitch-%s", name);
+
+  int fd = shm_open(shm_name, O_RDWR | O_CREAT, 0600);
+  if (fd < 0)
+    FAILURE_3(Runtime, "%s: cannot open switch %s: %s", devid_string,
+              shm_name, strerror(errno));
+
+  // Every user sizes the segment; growing a new one zero-fills it.
+  if (ftruncate(fd, sizeof(SVswShared)) < 0) {
+    int err = errno;
+    close(fd);
+    FAILURE_3(Runtime, "%s: cannot size switch %s: %s", devid_string,
+              shm_name, strerror(err));
+  }
+
+  shm = (SVswShared *)mmap(NULL, sizeof(SVswShared), PROT_READ | PROT_WRITE,
+                           MAP_SHARED, fd, 0);
+  close(fd);
+  if (shm == MAP_FAILED)
+    FAILURE_3(Runtime, "%s: cannot map switch %s: %s", devid_string, shm_name,
+              strerror(errno));
+
+  u32 magic = 0;
+  if (!shm->magic.compare_exchange_strong(magic, VSW_MAGIC) &&
+      magic != VSW_MAGIC)
+    FAILURE_2(Runtime, "%s: switch %s was created by an incompatible version",
+              devid_string, shm_name);
+
+  sock = socket(AF_UNIX, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (sock < 0)
+    FAILURE_2(Runtime, "%s: cannot create switch socket: %s", devid_string,
+              strerror(errno));
+
+  // Binding the port's socket claims the port; the address is freed when
+  // the owner exits, even if it crashes.
+  for (port = 0; port < VSW_PORTS; port++) {
+    struct sockaddr_un addr;
+    socklen_t len;
+
+    port_address(port, &addr, &len);
+    if (bind(sock, (struct sockaddr *)&addr, len) == 0)
+      break;
+    if (errno != EADDRINUSE)
+      FAILURE_2(Runtime, "%s: cannot bind switch socket: %s", devid_string,
+                strerror(errno));
+  }
+  if (port == VSW_PORTS)
+    FAILURE_2(Runtime, "%s: all %d ports of the switch are in use",
+              devid_string, VSW_PORTS);
+
+  // A previous owner of the port may have died with frames in its ring, or
+  // with a producer half way through adding one; start out empty, and
+  // forget the addresses that were learned on the port.
+  shm->port[port].in_use = 0;
+  forget(port);
+  reset_ring();
+  shm->port[port].rx_frames = 0;
+  shm->port[port].tx_frames = 0;
+  shm->port[port].in_use = 1;
+
+  printf("%s: connected to port %d of switch %s.\n", devid_string, port,
+         shm_name);
+}
+
+CNetVswitch::~CNetVswitch() {
+  printf("%s: switch port %d: %" PRIu64 " frames received, %" PRIu64
+         " sent, %u dropped.\n",
+         devid_string, port, (u64)shm->port[port].rx_frames,
+         (u64)shm->port[port].tx_frames, (u32)shm->ring[port].drops);
+  shm->port[port].in_use = 0;
+  forget(port);
+  close(sock);
+  munmap(shm, sizeof(SVswShared));
+}
+
+/**
+ * \brief Abstract socket address of a port.
+ **/
+void CNetVswitch::port_address(int p, struct sockaddr_un *addr,
+                               socklen_t *len) {
+  memset(addr, 0, sizeof(*addr));
+  addr->sun_family = AF_UNIX;
+  int n = snprintf(addr->sun_path + 1, sizeof(addr->sun_path) - 1, "%s/%d",
+                   shm_name, p);
+  *len = (socklen_t)(offsetof(struct sockaddr_un, sun_path) + 1 + n);
+}
+
+/**
+ * \brief Add a frame to a port's receive ring.
+ *
+ * This is a bounded multi-producer queue: a producer claims a position by
+ * advancing head, fills the slot, and then publishes it by setting the
+ * slot's sequence number to position + 1. The consumer frees the slot for
+ * the next round by setting it to position + VSW_RING_SIZE.
+ *
+ * Returns false if the ring is full.
+ **/
+bool CNetVswitch::enqueue(int p, const u8 *frame, int len) {
+  SVswRing &r = shm->ring[p];
+  u32 pos = r.head.load(std::memory_order_relaxed);
+  SVswSlot *s;
+
+  for (;;) {
+    u32 idx = pos & VSW_RING_MASK;
+    s = &r.slot[idx];
+    s32 dif = (s32)(s->seq.load(std::memory_order_acquire) + idx - pos);
+    if (dif == 0) {
+      if (r.head.compare_exchange_weak(pos, pos + 1,
+                                       std::memory_order_relaxed))
+        break;
+    } else if (dif < 0) {
+      r.drops++;
+      return false;
+    } else
+      pos = r.head.load(std::memory_order_relaxed);
+  }
+
+  memcpy(s->frame, frame, len);
+  s->len = len;
+
+  // If we took so long that the receiver gave up on the slot (see
+  // skip_stalled), the frame is lost.
+  u32 empty = pos - (pos & VSW_RING_MASK);
+  if (!s->seq.compare_exchange_strong(empty, pos + 1 - (pos & VSW_RING_MASK),
+                                      std::memory_order_release,
+                                      std::memory_order_relaxed)) {
+    r.drops++;
+    return false;
+  }
+  shm->port[p].rx_frames++;
+
+  // The receiver sleeps once it has emptied the ring; wake it up. The fence
+  // pairs with the one in dequeue: either we see the receiver caught up to
+  // this slot, or it sees the frame.
+  std::atomic_thread_fence(std::memory_order_seq_cst);
+  if (r.tail.load(std::memory_order_relaxed) == pos)
+    wake(p);
+  return true;
+}
+
+/**
+ * \brief Take a frame from our own receive ring, copying at most max bytes.
+ *
+ * The length comes from memory that other processes write to; a slot
+ * claiming more than VSW_FRAME_MAX bytes is dropped.
+ **/
+bool CNetVswitch::dequeue(u8 *frame, int max, int *len) {
+  SVswRing &r = shm->ring[port];
+
+  for (;;) {
+    u32 pos = r.tail.load(std::memory_order_relaxed);
+    u32 idx = pos & VSW_RING_MASK;
+    SVswSlot &s = r.slot[idx];
+
+    if ((s32)(s.seq.load(std::memory_order_acquire) + idx - (pos + 1)) < 0) {
+      if (skip_stalled(pos))
+        continue;
+      return false;
+    }
+    stalled = false;
+
+    // A frame longer than the buffer is reported with its full length, so
+    // the caller can tell it was cut short.
+    u32 n = s.len;
+    if (n <= VSW_FRAME_MAX) {
+      *len = (int)n;
+      memcpy(frame, s.frame, std::min(*len, max));
+    } else
+      r.drops++;
+    s.seq.store(pos + VSW_RING_SIZE - idx, std::memory_order_release);
+    r.tail.store(pos + 1, std::memory_order_release);
+
+    // Order the tail update before looking at the next slot; see enqueue.
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (n <= VSW_FRAME_MAX)
+      return true;
+  }
+}
+
+/**
+ * \brief Deal with a slot in our ring that isn't filled yet.
+ *
+ * If a producer claimed the slot and then died, the slot would never be
+ * filled and the ring would stay stuck behind it. A slot that stays claimed
+ * but unfilled for VSW_STALL_MS is given up on: it is freed for the next
+ * round, and the producer (should it still be alive) finds out when it
+ * tries to publish the frame.
+ *
+ * Returns true if the slot was skipped or has just been filled.
+ **/
+bool CNetVswitch::skip_stalled(u32 pos) {
+  SVswRing &r = shm->ring[port];
+  u32 idx = pos & VSW_RING_MASK;
+
+  if ((s32)(r.head.load(std::memory_order_relaxed) - pos) <= 0) {
+    stalled = false; // just empty
+    return false;
+  }
+
+  u64 now = host_time_ns();
+  if (!stalled || stall_pos != pos) {
+    stalled = true;
+    stall_pos = pos;
+    stall_since = now;
+    return false;
+  }
+  if (now - stall_since < (u64)VSW_STALL_MS * 1000000)
+    return false;
+
+  stalled = false;
+  u32 empty = pos - idx;
+  if (!r.slot[idx].seq.compare_exchange_strong(
+          empty, pos + VSW_RING_SIZE - idx, std::memory_order_acq_rel))
+    return true; // filled after all
+
+  r.drops++;
+  r.tail.store(pos + 1, std::memory_order_release);
+  std::atomic_thread_fence(std::memory_order_seq_cst);
+  printf("%s: switch port %d: skipped a frame that was never completed.\n",
+         devid_string, port);
+  return true;
+}
+
+/**
+ * \brief Empty our receive ring, whatever state it was left in.
+ *
+ * This is only done when claiming a port; if a producer from another
+ * process is still adding a frame to the ring of the previous owner, that
+ * frame may be lost or arrive after the reset.
+ **/
+void CNetVswitch::reset_ring() {
+  SVswRing &r = shm->ring[port];
+
+  for (int i = 0; i < VSW_RING_SIZE; i++)
+    r.slot[i].seq.store(0, std::memory_order_relaxed);
+  r.tail.store(0, std::memory_order_relaxed);
+  r.head.store(0, std::memory_order_relaxed);
+  r.drops = 0;
+  stalled = false;
+  std::atomic_thread_fence(std::memory_order_seq_cst);
+}
+
+/**
+ * \brief Ring the doorbell of a port.
+ *
+ * If the port's socket is gone, its owner exited without cleaning up; the
+ * port is marked free and the addresses learned on it are forgotten.
+ **/
+void CNetVswitch::wake(int p) {
+  struct sockaddr_un addr;
+  socklen_t len;
+  u8 b = 0;
+
+  port_address(p, &addr, &len);
+  if (sendto(sock, &b, 1, MSG_DONTWAIT, (struct sockaddr *)&addr, len) < 0 &&
+      (errno == ECONNREFUSED || errno == ENOENT)) {
+    shm->port[p].in_use = 0;
+    forget(p);
+  }
+}
+
+/**
+ * \brief Remember that a source address lives on our port.
+ **/
+void CNetVswitch::learn(const u8 *mac) {
+  if (mac[0] & 1) // not a station address
+    return;
+
+  u64 m = mac_to_u64(mac);
+  u64 entry = (m << 16) | (u64)(port + 1);
+  std::atomic<u64> &e = shm->mac_table[mac_hash(m)];
+  if (e.load(std::memory_order_relaxed) != entry)
+    e.store(entry, std::memory_order_relaxed);
+}
+
+/**
+ * \brief Remove the addresses learned on a port that has gone away.
+ **/
+void CNetVswitch::forget(int p) {
+  for (int i = 0; i < VSW_MAC_TABLE; i++) {
+    u64 e = shm->mac_table[i].load(std::memory_order_relaxed);
+    if ((e & 0xffff) == (u64)(p + 1))
+      shm->mac_table[i].compare_exchange_strong(e, 0,
+                                                std::memory_order_relaxed);
+  }
+}
+
+/**
+ * \brief Find the port an address lives on; -1 if unknown.
+ **/
+int CNetVswitch::lookup(const u8 *mac) {
+  u64 m = mac_to_u64(mac);
+  u64 entry = shm->mac_table[mac_hash(m)].load(std::memory_order_relaxed);
+
+  if ((entry >> 16) != m || !(entry & 0xffff))
+    return -1;
+
+  int p = (int)(entry & 0xffff) - 1;
+  if (p >= VSW_PORTS || !shm->port[p].in_use)
+    return -1;
+  return p;
+}
+
+/**
+ * \brief Take all frames from our receive ring.
+ **/
+int CNetVswitch::receive(CPacketQueue *q, bool calc_crc) {
+  u8 frame[VSW_FRAME_MAX];
+  int len;
+  int n = 0;
+
+  // Clear the doorbell before looking at the ring, so a frame added after
+  // we found the ring empty always wakes us up again.
+  while (recv(sock, frame, sizeof(frame), MSG_DONTWAIT) > 0)
+    ;
+
+  for (;;) {
+    // Copy straight into the queue; if it's full, the frame is dropped.
+    eth_packet *p = q->tail_packet();
+    u8 *buf = p ? p->frame : frame;
+    if (!dequeue(buf, p ? (int)sizeof(p->frame) : (int)sizeof(frame), &len))
+      break;
+
+    if (!p) {
+      q->drop();
+      continue;
+    }
+
+    if (len > ETH_MAX_PACKET_RAW || !accept(buf, len))
+      continue;
+
+    q->commit_tail(len, calc_crc, true);
+    n++;
+  }
+  return n;
+}
+
+/**
+ * \brief Switch a frame: to the port its destination was learned on, or to
+ * all other ports.
+ **/
+bool CNetVswitch::send(const u8 *frame, int len) {
+  if (len < 12 || len > VSW_FRAME_MAX)
+    return false;
+
+  shm->port[port].tx_frames++;
+  learn(frame + 6);
+
+  int dst = (frame[0] & 1) ? -1 : lookup(frame);
+  if (dst == port)
+    return true; // for ourselves; a real switch wouldn't send it back either
+
+  if (dst >= 0)
+    return enqueue(dst, frame, len);
+
+  for (int p = 0; p < VSW_PORTS; p++)
+    if (p != port && shm->port[p].in_use)
+      enqueue(p, frame, len);
+  return true;
+}
+#endif // defined(HAVE_VSWITCH)
@@ -0,0 +1,140 @@
+/* AXPbox Alpha Emulator
+ * Copyright (C) 2020 Tomáš Glozar
+ * Website: https://github.com/lenticularis39/axpbox
+ *
+ * Forked from: ES40 emulator
+ * Copyright (C) 2007-2008 by the ES40 Emulator Project
+ * Copyright (C) 2007 by Camiel Vanderhoeven
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301,
+ * USA.
+ *
+ * Although this is not required, the author would appreciate being notified of,
+ * and receiving any modifications you may make to the source code that might
+ * serve the general public.
+ */
+
+#if !defined(INCLUDED_NETVSWITCH_H)
+#define INCLUDED_NETVSWITCH_H
+
+#include "NetBackend.hpp"
+
+#if defined(HAVE_VSWITCH)
+#include <sys/socket.h>
+#include <sys/un.h>
+
+/// Identifies the shared memory layout ("VSW" + layout version).
+#define VSW_MAGIC 0x56535701
+
+#define VSW_PORTS 16      /**< Ports per switch. **/
+#define VSW_RING_SIZE 256 /**< Frames per port receive ring; a power of 2. **/
+#define VSW_MAC_TABLE 256 /**< Entries in the MAC table; a power of 2. **/
+#define VSW_FRAME_MAX 1528
+#define VSW_STALL_MS 100  /**< Wait for a claimed slot before skipping it. **/
+
+/**
+ * \brief One frame in a receive ring.
+ *
+ * The sequence number tells producers and the consumer whose turn it is
+ * (see CNetVswitch::enqueue). It is stored relative to the slot index, so
+ * that an all-zero segment is a valid, empty ring.
+ **/
+struct SVswSlot {
+  std::atomic<u32> seq;
+  u32 len;
+  u8 frame[VSW_FRAME_MAX];
+};
+
+/**
+ * \brief Receive ring of one port. Any port may add frames; only the owner
+ * takes them out.
+ **/
+struct SVswRing {
+  alignas(64) std::atomic<u32> head; /**< Next position to fill. **/
+  alignas(64) std::atomic<u32> tail; /**< Next position to take. **/
+  std::atomic<u32> drops;            /**< Frames lost to a full ring. **/
+  SVswSlot slot[VSW_RING_SIZE];
+};
+
+/**
+ * \brief Per-port bookkeeping, visible to all processes on the switch.
+ **/
+struct SVswPort {
+  std::atomic<u32> in_use;
+  std::atomic<u64> rx_frames;
+  std::atomic<u64> tx_frames;
+};
+
+/**
+ * \brief Layout of the shared memory segment.
+ *
+ * A new segment is zero-filled, which is a valid empty switch; the first
+ * user only has to set the magic number.
+ **/
+struct SVswShared {
+  std::atomic<u32> magic;
+  SVswPort port[VSW_PORTS];
+
+  /// Learned addresses: MAC << 16 | (port + 1), hashed by MAC. 0 is empty.
+  std::atomic<u64> mac_table[VSW_MAC_TABLE];
+
+  SVswRing ring[VSW_PORTS];
+};
+
+/**
+ * \brief Network backend connected to a virtual ethernet switch in shared
+ * memory.
+ *
+ * Every AXPbox instance (in this or other processes on the host) that
+ * names the same switch gets a port on it. Frames are copied straight into
+ * the receive ring of the destination port; the switch learns which port an
+ * address lives on from the frames it sends, and floods broadcasts,
+ * multicasts and unknown addresses to all ports.
+ *
+ * Each port also binds an abstract unix socket, which serves as the port's
+ * claim (it disappears with the process) and as a doorbell: a sender that
+ * finds the ring empty sends a byte, which wakes up the receiving NIC thread.
+ **/
+class CNetVswitch : public CNetBackend {
+public:
+  CNetVswitch(const char *devid, const char *name);
+  virtual ~CNetVswitch();
+
+  virtual int receive(CPacketQueue *q, bool calc_crc);
+  virtual bool send(const u8 *frame, int len);
+  virtual int get_fd() { return sock; }
+
+private:
+  bool enqueue(int port, const u8 *frame, int len);
+  bool dequeue(u8 *frame, int max, int *len);
+  bool skip_stalled(u32 pos);
+  void reset_ring();
+  void learn(const u8 *mac);
+  void forget(int port);
+  int lookup(const u8 *mac);
+  void wake(int port);
+  void port_address(int port, struct sockaddr_un *addr, socklen_t *len);
+
+  char shm_name[256];
+  SVswShared *shm;
+  int port;
+  int sock;
+
+  bool stalled; /**< The slot at stall_pos was claimed but isn't filled. **/
+  u32 stall_pos;
+  u64 stall_since; /**< host_time_ns() when the stall was noticed. **/
+};
+#endif // defined(HAVE_VSWITCH)
+#endif // !defined(INCLUDED_NETVSWITCH_H)
@@ -468,26 +468,50 @@ void CPCIDevice::WriteMem_Bar(int func, int bar, u32 address, int dsize,
             myCfg->get_myName(), myCfg->get_myValue(), func);
 }
 
+/**
+ * \brief Find the run of PCI addresses starting at address that maps to
+ * contiguous system addresses.
+ *
+ * Scatter-gather windows map each 8K page separately, so a transfer is
+ * split wherever consecutive pages are not consecutive in system memory.
+ *
+ * \param phys_addr  Receives the system address of the start of the run.
+ * \return           Length of the run (at most length).
+ **/
+size_t CPCIDevice::dma_run(u32 address, size_t length, u64 *phys_addr) {
+  *phys_addr = cSystem->PCI_Phys(myPCIBus, address);
+
+  size_t run = 0x2000 - (address & 0x1fff);
+  while (run < length) {
+    if (cSystem->PCI_Phys(myPCIBus, (u32)(address + run)) != *phys_addr + run)
+      return run;
+    run += 0x2000;
+  }
+  return length;
+}
+
 /**
  * \brief Read data from the PCI bus.
  *
  * Called by the PCI-device to read data off the PCI bus. address is the
  * 32-bit address put on the PCI bus. element_count elements of element_size
  * bytes each will be read in an endian-aware manner.
+ *
+ * The transfer is done with memcpy per run of addresses that is contiguous
+ * in main memory; anything else goes element by element through ReadMem.
  **/
 void CPCIDevice::do_pci_read(u32 address, void *dest, size_t element_size,
                              size_t element_count) {
-  size_t el;
   char *dst = (char *)dest;
 
   if (element_count == 0)
     return;
 
-  // get the 64-bit system wide address
-  u64 phys_addr = cSystem->PCI_Phys(myPCIBus, address);
-
   // if there is only one element to read, this is a simple ReadMem operation.
   if (element_count == 1) {
+    // get the 64-bit system wide address
+    u64 phys_addr = cSystem->PCI_Phys(myPCIBus, address);
+
     switch (element_size) {
     case 1:
       *(u8 *)dest = (u8)cSystem->ReadMem(phys_addr, 8, this);
@@ -508,76 +532,109 @@ void CPCIDevice::do_pci_read(u32 address, void *dest, size_t element_size,
     return;
   }
 
+  size_t length = element_size * element_count;
+
 #if defined(ES40_BIG_ENDIAN)
 
   // if this is a big-endian host machine, the memcpy method is only valid
   // if we're transferring bytes. Otherwise, endian-conversions need to be done.
   if (element_size == 1) {
 #endif
-
-    // get a pointer to system memory if the address is inside main memory
-    char *memptr = cSystem->PtrToMem(phys_addr);
-
-    // if the address is inside system memory, a simple memcpy operation is
-    // all that is needed.
-    if (memptr) {
-      memcpy(dest, memptr, element_size * element_count);
-      return;
+    while (length) {
+      u64 phys_addr;
+      size_t run = dma_run(address, length, &phys_addr);
+
+      // get a pointer to system memory if the run is inside main memory
+      char *memptr = cSystem->PtrToMem(phys_addr);
+      if (!memptr || !cSystem->PtrToMem(phys_addr + run - 1))
+        break;
+
+      memcpy(dst, memptr, run);
+      dst += run;
+      address += (u32)run;
+      length -= run;
     }
-
 #if defined(ES40_BIG_ENDIAN)
   }
 #endif
 
   // outside main memory, or inside main memory with endian-conversion
   // required we need to do the transfer element-by-element.
-  switch (element_size) {
-  case 1:
-    for (el = 0; el < element_count; el++) {
+  for (; length >= element_size; length -= element_size) {
+    u64 phys_addr = cSystem->PCI_Phys(myPCIBus, address);
+
+    switch (element_size) {
+    case 1:
       *(u8 *)dst = (u8)cSystem->ReadMem(phys_addr, 8, this);
-      dst++;
-      phys_addr++;
+      break;
+
+    case 2:
+      *(u16 *)dst = endian_16((u16)cSystem->ReadMem(phys_addr, 16, this));
+      break;
+
+    case 4:
+      *(u32 *)dst = endian_32((u32)cSystem->ReadMem(phys_addr, 32, this));
+      break;
+
+    default:
+      FAILURE(InvalidArgument, "Strange element size");
     }
-    break;
 
-  case 2: {
-    *(u16 *)dst = endian_16((u16)cSystem->ReadMem(phys_addr, 16, this));
-    dst += 2;
-    phys_addr += 2;
-  } break;
-
-  case 4: {
-    *(u32 *)dst = endian_32((u32)cSystem->ReadMem(phys_addr, 32, this));
-    dst += 4;
-    ;
-    phys_addr += 4;
-  } break;
-
-  default:
-    FAILURE(InvalidArgument, "Strange element size");
+    dst += element_size;
+    address += (u32)element_size;
   }
 }
 
+/**
+ * \brief Map a range of PCI addresses to host memory for direct DMA.
+ *
+ * Returns a pointer into system memory if the whole range maps to one
+ * contiguous piece of main memory, or nullptr if the caller has to use a
+ * bounce buffer with do_pci_read/do_pci_write. After writing to the mapped
+ * memory, the caller must call dma_unmap.
+ **/
+char *CPCIDevice::dma_map(u32 address, size_t length) {
+  u64 phys_addr;
+
+  if (!length || dma_run(address, length, &phys_addr) != length)
+    return nullptr;
+
+  char *memptr = cSystem->PtrToMem(phys_addr);
+  if (!memptr || !cSystem->PtrToMem(phys_addr + length - 1))
+    return nullptr;
+
+  return memptr;
+}
+
+/**
+ * \brief Finish a direct DMA write to memory obtained through dma_map.
+ **/
+void CPCIDevice::dma_unmap(u32 address, size_t length) {
+  cSystem->dma_written(cSystem->PCI_Phys(myPCIBus, address), length, this);
+}
+
 /**
  * \brief Write data to the PCI bus.
  *
  * Called by the PCI-device to write data to the PCI bus. address is the
  * 32-bit address put on the PCI bus. element_count elements of element_size
  * bytes each will be written in an endian-aware manner.
+ *
+ * \sa do_pci_read
  **/
 void CPCIDevice::do_pci_write(u32 address, void *source, size_t element_size,
                               size_t element_count) {
-  size_t el;
   char *src = (char *)source;
 
   if (element_count == 0)
     return;
 
-  // get the 64-bit system wide address
-  u64 phys_addr = cSystem->PCI_Phys(myPCIBus, address);
-
-  // if there is only one element to read, this is a simple ReadMem operation.
+  // if there is only one element to write, this is a simple WriteMem
+  // operation.
   if (element_count == 1) {
+    // get the 64-bit system wide address
+    u64 phys_addr = cSystem->PCI_Phys(myPCIBus, address);
+
     switch (element_size) {
     case 1:
       cSystem->WriteMem(phys_addr, 8, *(u8 *)source, this);
@@ -595,52 +652,56 @@ void CPCIDevice::do_pci_write(u32 address, void *source, size_t element_size,
     return;
   }
 
+  size_t length = element_size * element_count;
+
 #if defined(ES40_BIG_ENDIAN)
 
   // if this is a big-endian host machine, the memcpy method is only valid
   // if we're transferring bytes. Otherwise, endian-conversions need to be done.
   if (element_size == 1) {
 #endif
-
-    // get a pointer to system memory if the address is inside main memory
-    char *memptr = cSystem->PtrToMem(phys_addr);
-
-    // if the address is inside system memory, a simple memcpy operation is
-    // all that is needed.
-    if (memptr) {
-      memcpy(memptr, source, element_size * element_count);
-      return;
+    while (length) {
+      u64 phys_addr;
+      size_t run = dma_run(address, length, &phys_addr);
+
+      // get a pointer to system memory if the run is inside main memory
+      char *memptr = cSystem->PtrToMem(phys_addr);
+      if (!memptr || !cSystem->PtrToMem(phys_addr + run - 1))
+        break;
+
+      memcpy(memptr, src, run);
+      cSystem->dma_written(phys_addr, run, this);
+      src += run;
+      address += (u32)run;
+      length -= run;
     }
-
 #if defined(ES40_BIG_ENDIAN)
   }
 #endif
 
   // outside main memory, or inside main memory with endian-conversion
   // required we need to do the transfer element-by-element.
-  switch (element_size) {
-  case 1:
-    for (el = 0; el < element_count; el++) {
+  for (; length >= element_size; length -= element_size) {
+    u64 phys_addr = cSystem->PCI_Phys(myPCIBus, address);
+
+    switch (element_size) {
+    case 1:
       cSystem->WriteMem(phys_addr, 8, *(u8 *)src, this);
-      src++;
-      phys_addr++;
+      break;
+
+    case 2:
+      cSystem->WriteMem(phys_addr, 16, endian_16(*(u16 *)src), this);
+      break;
+
+    case 4:
+      cSystem->WriteMem(phys_addr, 32, endian_32(*(u32 *)src), this);
+      break;
+
+    default:
+      FAILURE(InvalidArgument, "Strange element size");
     }
-    break;
 
-  case 2: {
-    cSystem->WriteMem(phys_addr, 16, endian_16(*(u16 *)src), this);
-    src += 2;
-    phys_addr += 2;
-  } break;
-
-  case 4: {
-    cSystem->WriteMem(phys_addr, 32, endian_32(*(u32 *)src), this);
-    src += 4;
-    ;
-    phys_addr += 4;
-  } break;
-
-  default:
-    FAILURE(InvalidArgument, "Strange element size");
+    src += element_size;
+    address += (u32)element_size;
   }
 }
@@ -70,8 +70,11 @@ public:
                    size_t element_count);
   void do_pci_write(u32 address, void *source, size_t element_size,
                     size_t element_count);
+  char *dma_map(u32 address, size_t length);
+  void dma_unmap(u32 address, size_t length);
 
 protected:
+  size_t dma_run(u32 address, size_t length, u64 *phys_addr);
   bool do_pci_interrupt(int func, bool asserted);
   void add_function(int func, u32 data[64], u32 mask[64]);
   void add_legacy_io(int id, u32 base, u32 length);
@@ -147,6 +147,54 @@ void CSCSIBus::free_bus(int initiator) {
   state.phase = SCSI_PHASE_FREE;
 }
 
+/**
+ * \brief Request reselection of an initiator.
+ *
+ * Called by a target that disconnected earlier, once it is ready to
+ * continue. The initiator is only woken up through
+ * CSCSIDevice::scsi_reselect_wakeup_me; it finds the target with
+ * CSCSIBus::reselect_pending and reselects it with CSCSIBus::reselect from
+ * its own thread. May be called from any thread.
+ **/
+void CSCSIBus::request_reselect(int target, int initiator) {
+  if (initiator >= 0 && targets[initiator])
+    targets[initiator]->scsi_reselect_wakeup_me(target_bus_no[initiator]);
+}
+
+/**
+ * \brief Return the target that wants to reselect, or -1 if there is none.
+ *
+ * Targets are asked through CSCSIDevice::scsi_reselect_ready_me. When more
+ * than one target is waiting, the highest SCSI id wins, as it would in
+ * arbitration.
+ **/
+int CSCSIBus::reselect_pending() {
+  for (int i = 15; i >= 0; i--) {
+    if (targets[i] && targets[i]->scsi_reselect_ready_me(target_bus_no[i]))
+      return i;
+  }
+  return -1;
+}
+
+/**
+ * \brief Let a target reselect the initiator.
+ *
+ * Returns true if the target reconnected (= changed the SCSI phase).
+ * The bus must be free.
+ **/
+bool CSCSIBus::reselect(int initiator, int target) {
+  if (state.phase != SCSI_PHASE_FREE)
+    return false;
+
+  if (!targets[target])
+    return false;
+
+  state.initiator = initiator;
+  state.target = target;
+  targets[target]->scsi_reselect_me(target_bus_no[target]);
+  return (state.phase >= 0);
+}
+
 static u32 scsi_magic1 = 0x5C510123;
 static u32 scsi_magic2 = 0x32105c51;
 
@@ -56,6 +56,11 @@ public:
 
   /**< Get current SCSI bus phase **/
   void free_bus(int initiator);
+  int get_initiator() { return state.initiator; };
+
+  void request_reselect(int target, int initiator);
+  int reselect_pending();
+  bool reselect(int initiator, int target);
 
   CSCSIDevice *targets[16]; /**< pointers to the SCSI devices that respond to
                                the 15 possible target id's. **/
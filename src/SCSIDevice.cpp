@@ -110,6 +110,60 @@ void CSCSIDevice::scsi_free(int bus) {
   return scsi_bus[bus]->free_bus(scsi_initiator_id[bus]);
 }
 
+/**
+ * \brief Ask to reselect an initiator after a disconnect.
+ *
+ * See CSCSIBus::request_reselect for a description.
+ **/
+void CSCSIDevice::scsi_request_reselect(int bus, int initiator) {
+  scsi_bus[bus]->request_reselect(scsi_initiator_id[bus], initiator);
+}
+
+/**
+ * \brief Return the target waiting to reselect us, or -1.
+ *
+ * See CSCSIBus::reselect_pending for a description.
+ **/
+int CSCSIDevice::scsi_reselect_pending(int bus) {
+  return scsi_bus[bus]->reselect_pending();
+}
+
+/**
+ * \brief Accept reselection by a target.
+ *
+ * See CSCSIBus::reselect for a description.
+ **/
+bool CSCSIDevice::scsi_reselect(int bus, int target) {
+  return scsi_bus[bus]->reselect(scsi_initiator_id[bus], target);
+}
+
+/**
+ * \brief Called when this device reselects its initiator.
+ *
+ * Override this in targets that disconnect. Overrided functions should
+ * set the SCSI bus phase to a valid phase, normally Message In.
+ **/
+void CSCSIDevice::scsi_reselect_me(int bus) {
+  FAILURE(NotImplemented,
+          "reselecting device doesn't implement scsi_reselect_me");
+}
+
+/**
+ * \brief Return true if this device wants to reselect its initiator.
+ *
+ * Override this in targets that disconnect. Called from the initiator's
+ * thread.
+ **/
+bool CSCSIDevice::scsi_reselect_ready_me(int bus) { return false; }
+
+/**
+ * \brief Called when a target wants to reselect this device.
+ *
+ * Override this in initiators that let targets disconnect. May be called
+ * from any thread.
+ **/
+void CSCSIDevice::scsi_reselect_wakeup_me(int bus) {}
+
 /**
  * \brief Return the number of bytes expected or available.
  *
@@ -51,6 +51,13 @@ public:
   int scsi_get_phase(int bus);
   void scsi_free(int bus);
 
+  void scsi_request_reselect(int bus, int initiator);
+  int scsi_reselect_pending(int bus);
+  bool scsi_reselect(int bus, int target);
+  virtual void scsi_reselect_me(int bus);
+  virtual bool scsi_reselect_ready_me(int bus);
+  virtual void scsi_reselect_wakeup_me(int bus);
+
   virtual size_t scsi_expected_xfer_me(int bus);
   size_t scsi_expected_xfer(int bus);
 
@@ -353,6 +353,7 @@ void CSerial::serial_menu() {
   write("     2. Abort emulator (no changes saved)\r\n");
   write("     3. Save state to autosave.axp and continue\r\n");
   write("     4. Load state from autosave.axp and continue\r\n");
+  write("     5. Save incremental state to autosave-<n>.axp and continue\r\n");
 #endif
   while (!exitLoop) {
     FD_ZERO(&readset);
@@ -402,6 +403,20 @@ void CSerial::serial_menu() {
       exitLoop = true;
       break;
 
+    case '5': {
+      static int autosave_count = 0;
+      char fn[40];
+
+      sprintf(fn, "autosave-%d.axp", ++autosave_count);
+      write("%SRL-I-SAVESTATE: Saving incremental state to ");
+      write(fn);
+      write(".\r\n");
+      cSystem->SaveState(fn, true);
+      write("%SRL-I-CONTINUE: continuing emulation.\r\n");
+      exitLoop = true;
+      break;
+    }
+
     default:
       write("%SRL-W-INVALID: Not a valid answer.\r\n");
     }
@@ -192,10 +192,18 @@ inline char printable(char c) {
 #endif
 
 #include <atomic>
+#include <chrono>
 #include <memory>
 #include <thread>
 #include <typeinfo>
 
+/// Nanoseconds on the host's monotonic clock.
+inline u64 host_time_ns() {
+  return (u64)std::chrono::duration_cast<std::chrono::nanoseconds>(
+             std::chrono::steady_clock::now().time_since_epoch())
+      .count();
+}
+
 #define POCO_NO_UNWINDOWS
 
 #include "base/Mutex.hpp"
@@ -581,6 +581,14 @@ void CSym53C895::run() {
       mySemaphore.wait();
       if (StopThread)
         return;
+      if (reselect_wakeup.exchange(false)) {
+        MUTEX_LOCK(myRegLock);
+        if (state.wait_reselect && do_reselect()) {
+          state.wait_reselect = false;
+          state.executing = true;
+        }
+        MUTEX_UNLOCK(myRegLock);
+      }
       while (state.executing) {
         MUTEX_LOCK(myRegLock);
         execute();
@@ -672,6 +680,7 @@ CSym53C895::~CSym53C895() {
  **/
 void CSym53C895::chip_reset() {
   state.executing = false;
+  scripts_cache_flush();
   state.wait_reselect = false;
   state.irq_asserted = false;
   state.gen_timer = 0;
@@ -774,6 +783,8 @@ int CSym53C895::RestoreState(FILE *f) {
     return -1;
   }
 
+  scripts_cache_flush();
+
   printf("%s: %d bytes restored.\n", devid_string, (int)ss);
   return 0;
 }
@@ -979,6 +990,9 @@ void CSym53C895::WriteMem_Bar(int func, int bar, u32 address, int dsize,
       *((u32 *)p) = (u32)data;
       break;
     }
+
+    // Bumped after the store; fetch_ins checks it again after reading.
+    ram_gen++;
     break;
   }
 }
@@ -1546,27 +1560,10 @@ void CSym53C895::check_state() {
     }
   }
 
-  /**
+  // A target may have asked for reselection while we were busy.
+  if (state.wait_reselect && scsi_reselect_pending(0) >= 0)
+    scsi_reselect_wakeup_me(0);
 
-  if (state.wait_reselect && PT.disconnected)
-  {
-    state.executing = true;
-    state.wait_reselect = false;
-    PT.disconnected = false;
-    //PT.disconnect_priv = false;
-    //PT.will_disconnect = false;
-    PT.reselected = true;
-    state.phase = 7; // msg in //PT.disconnect_phase;
-    R8(SSID) = GET_DEST() | R_SSID_VAL; // valid scsi selector id
-    if (TB_R8(DCNTL,COM))
-      R8(SFBR) = GET_DEST();
-    // don't expect a disconnect.
-    SB_R8(SCNTL2,SDU,true);
-    //RAISE(SIST0,RSL);
-    return 0;
-  }
-
- **/
   if (state.disconnected) {
     if (!TB_R8(SCNTL2, SDU)) {
 
@@ -1589,6 +1586,47 @@ void CSym53C895::check_state() {
   }
 }
 
+/**
+ * \brief Let a target that is waiting to reselect us reconnect.
+ *
+ * Called with the register lock held. Returns true if a target has
+ * reselected us; SCRIPTS then continue with the instruction following
+ * WAIT RESELECT.
+ **/
+bool CSym53C895::do_reselect() {
+  int target = scsi_reselect_pending(0);
+
+  if (target < 0 || !scsi_reselect(0, target))
+    return false;
+
+  R8(SSID) = target | R_SSID_VAL; // valid scsi selector id
+  if (TB_R8(DCNTL, COM))
+    R8(SFBR) = target;
+
+  // don't expect a disconnect.
+  SB_R8(SCNTL2, SDU, true);
+  return true;
+}
+
+/**
+ * \brief Called by a disconnected target that is ready to reselect us.
+ *
+ * May be called from a disk I/O thread, so this only wakes up our thread.
+ * If SCRIPTS are waiting for reselection, the thread lets the target
+ * reconnect; otherwise the request is picked up the next time SCRIPTS
+ * execute WAIT RESELECT.
+ **/
+void CSym53C895::scsi_reselect_wakeup_me(int bus) {
+  if (reselect_wakeup.exchange(true))
+    return;
+
+  try {
+    mySemaphore.set();
+  } catch (CException &) {
+    // Already set; the thread wakes up anyway.
+  }
+}
+
 /**
  * Check SCSI Bus Phase.
  *
@@ -1706,35 +1744,52 @@ void CSym53C895::execute_bm_op() {
       return;
     }
 
-    if ((size_t)count > scsi_expected_xfer(0)) {
+    // Targets make large transfers available in chunks; keep moving data
+    // for as long as the target stays in this phase.
+    bool first = true;
+    while (count) {
+      u32 n = count;
+
+      if ((size_t)n > scsi_expected_xfer(0)) {
 #if defined(DEBUG_SYM_SCRIPTS)
-      printf("SYM: xfer %d bytes, max %d expected, in phase %d.\n", count,
-             scsi_expected_xfer(0), scsi_phase);
+        printf("SYM: xfer %d bytes, max %d expected, in phase %d.\n", n,
+               scsi_expected_xfer(0), scsi_phase);
 #endif
-      count = (u32)scsi_expected_xfer(0);
-    }
+        n = (u32)scsi_expected_xfer(0);
+      }
+      if (!n) {
+        // Nothing expected; let the target move on to its next phase.
+        scsi_xfer_done(0);
+        break;
+      }
 
-    u8 *scsi_data_ptr = (u8 *)scsi_xfer_ptr(0, count);
-    u8 *org_sdata_ptr = scsi_data_ptr;
+      u8 *scsi_data_ptr = (u8 *)scsi_xfer_ptr(0, n);
 
-    switch (scsi_phase) {
-    case SCSI_PHASE_COMMAND:
-    case SCSI_PHASE_DATA_OUT:
-    case SCSI_PHASE_MSG_OUT:
-      do_pci_read(R32(DNAD), scsi_data_ptr, 1, count);
-      R32(DNAD) += count;
-      break;
+      switch (scsi_phase) {
+      case SCSI_PHASE_COMMAND:
+      case SCSI_PHASE_DATA_OUT:
+      case SCSI_PHASE_MSG_OUT:
+        do_pci_read(R32(DNAD), scsi_data_ptr, 1, n);
+        R32(DNAD) += n;
+        break;
 
-    case SCSI_PHASE_STATUS:
-    case SCSI_PHASE_DATA_IN:
-    case SCSI_PHASE_MSG_IN:
-      do_pci_write(R32(DNAD), scsi_data_ptr, 1, count);
-      R32(DNAD) += count;
-      break;
-    }
+      case SCSI_PHASE_STATUS:
+      case SCSI_PHASE_DATA_IN:
+      case SCSI_PHASE_MSG_IN:
+        do_pci_write(R32(DNAD), scsi_data_ptr, 1, n);
+        R32(DNAD) += n;
+        break;
+      }
+
+      if (first)
+        R8(SFBR) = *scsi_data_ptr;
+      first = false;
+      scsi_xfer_done(0);
 
-    R8(SFBR) = *org_sdata_ptr;
-    scsi_xfer_done(0);
+      count -= n;
+      if (scsi_get_phase(0) != scsi_phase)
+        break;
+    }
     return;
   }
 }
@@ -1887,7 +1942,11 @@ void CSym53C895::execute_io_op() {
 #if defined(DEBUG_SYM_SCRIPTS)
     printf("SYM: %08x: WAIT RESELECT\n", R32(DSP) - 8);
 #endif
-    if (TB_R8(ISTAT, SIGP)) {
+    if (do_reselect()) {
+#if defined(DEBUG_SYM_SCRIPTS)
+      printf("SYM: reselected by %d.\n", R8(SSID) & R_SSID_ID);
+#endif
+    } else if (TB_R8(ISTAT, SIGP)) {
 #if defined(DEBUG_SYM_SCRIPTS)
       printf("SYM: SIGP set before wait reselect; jumping!\n");
 #endif
@@ -2436,6 +2495,104 @@ void CSym53C895::execute_mm_op() {
   return;
 }
 
+/**
+ * \brief Select the handler for a SCRIPTS instruction.
+ *
+ * The two most significant bits of the DCMD register determine the operation
+ * type. These are:
+ *   - 00: Block Move
+ *   - 01: I/O or R/W
+ *   - 10: Transfer Control
+ *   - 11: Memory Move or Load And Store
+ *   .
+ **/
+CSym53C895::ScriptsOp CSym53C895::decode_ins(u8 dcmd) {
+  switch ((dcmd >> 6) & 3) {
+  case 0:
+    return &CSym53C895::execute_bm_op;
+
+  case 1:
+    if (((dcmd >> 3) & 7) < 5)
+      return &CSym53C895::execute_io_op;
+    return &CSym53C895::execute_rw_op;
+
+  case 2:
+    return &CSym53C895::execute_tc_op;
+
+  default:
+    if ((dcmd >> 5) & 1)
+      return &CSym53C895::execute_ls_op;
+    return &CSym53C895::execute_mm_op;
+  }
+}
+
+/**
+ * \brief Fetch the SCRIPTS instruction at DSP into DBC and DSPS.
+ *
+ * Drivers run the same few hundred instructions for every command, so
+ * instructions are taken from the SCRIPTS cache when possible. On a miss,
+ * instructions in main memory are read directly and the page is marked as
+ * holding code, so that CPU or DMA writes to it change its generation.
+ * Instructions in our own SCRIPTS RAM are checked against ram_gen. If the
+ * generation changed while the instruction was being read, it is used once
+ * but not cached. Anything else is read with do_pci_read and not cached.
+ *
+ * Returns the handler for the instruction.
+ **/
+CSym53C895::ScriptsOp CSym53C895::fetch_ins() {
+  u32 dsp = R32(DSP);
+  SScriptsIns *e = &scripts_cache[(dsp >> 3) & (SCRIPTS_CACHE_SIZE - 1)];
+  u32 map_gen = cSystem->get_dma_map_gen(myPCIBus);
+
+  if (e->valid && e->dsp == dsp && e->map_gen == map_gen &&
+      e->gen == (e->ram ? ram_gen.load() : cSystem->get_code_gen(e->phys))) {
+    R32(DBC) = e->dbc;
+    R32(DSPS) = e->dsps;
+    return e->op;
+  }
+
+  u64 phys = cSystem->PCI_Phys(myPCIBus, dsp);
+  u32 ram_bar = pci_state.config_data[0][6] & ~0xf;
+  u64 ram = U64(0x80000000000) + U64(0x200000000) * myPCIBus + ram_bar;
+  char *mem = cSystem->PtrToMem(phys);
+
+  e->valid = true;
+  if (mem && (phys & ((U64(0x1) << CODE_PAGE_SHIFT) - 1)) <=
+                 (U64(0x1) << CODE_PAGE_SHIFT) - 8) {
+    e->ram = false;
+    e->gen = cSystem->mark_code_page(phys);
+    R32(DBC) = endian_32(*(u32 *)mem);
+    R32(DSPS) = endian_32(*(u32 *)(mem + 4));
+    e->valid = e->gen == cSystem->get_code_gen(phys);
+  } else if (ram_bar && phys >= ram && phys - ram <= sizeof(state.ram) - 8) {
+    e->ram = true;
+    e->gen = ram_gen.load();
+    R32(DBC) = *(u32 *)&state.ram[phys - ram];
+    R32(DSPS) = *(u32 *)&state.ram[phys - ram + 4];
+    e->valid = e->gen == ram_gen.load();
+  } else {
+    e->valid = false;
+    do_pci_read(dsp, &R32(DBC), 4, 1);
+    do_pci_read(dsp + 4, &R32(DSPS), 4, 1);
+  }
+
+  e->dsp = dsp;
+  e->phys = phys;
+  e->map_gen = map_gen;
+  e->dbc = R32(DBC);
+  e->dsps = R32(DSPS);
+  e->op = decode_ins(R8(DCMD));
+  return e->op;
+}
+
+/**
+ * \brief Empty the SCRIPTS cache.
+ **/
+void CSym53C895::scripts_cache_flush() {
+  for (int i = 0; i < SCRIPTS_CACHE_SIZE; i++)
+    scripts_cache[i].valid = false;
+}
+
 /**
  * Execute one SCRIPTS instruction.
  *
@@ -2456,17 +2613,14 @@ void CSym53C895::execute_mm_op() {
  * \endcode
  **/
 void CSym53C895::execute() {
-  int optype;
-  int opcode;
-  bool is_load_store;
+  ScriptsOp op;
 
 #if defined(DEBUG_SYM_SCRIPTS)
   printf("SYM: INS @ %x   \n", R32(DSP));
 #endif
 
   // Read 2 DWORDS into the DCMD, DBC and DSPS registers.
-  do_pci_read(R32(DSP), &R32(DBC), 4, 1);
-  do_pci_read(R32(DSP) + 4, &R32(DSPS), 4, 1);
+  op = fetch_ins();
 
   // Increase DSP to point to the next instruction
   R32(DSP) += 8;
@@ -2474,39 +2628,7 @@ void CSym53C895::execute() {
 #if defined(DEBUG_SYM_SCRIPTS)
   printf("SYM: INS = %x, %x, %x   \n", R8(DCMD), GET_DBC(), R32(DSPS));
 #endif
-  /* The two most significant bits of the DCMD register determine the operation
-   * type. These are:
-   *   00: Block Move
-   *   01: I/O or R/W
-   *   10: Transfer Control
-   *   11: Memory Move or Load And Store
-   */
-  optype = (R8(DCMD) >> 6) & 3;
-  switch (optype) {
-  case 0:
-    execute_bm_op();
-    break;
-
-  case 1:
-    opcode = (R8(DCMD) >> 3) & 7;
-    if (opcode < 5)
-      execute_io_op();
-    else
-      execute_rw_op();
-    break;
-
-  case 2:
-    execute_tc_op();
-    break;
-
-  case 3:
-    is_load_store = (R8(DCMD) >> 5) & 1;
-    if (is_load_store)
-      execute_ls_op();
-    else
-      execute_mm_op();
-    break;
-  }
+  (this->*op)();
 
   // single step mode
   if (TB_R8(DCNTL, SSM)) {
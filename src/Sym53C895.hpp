@@ -33,6 +33,9 @@
 #include "PCIDevice.hpp"
 #include "SCSIDevice.hpp"
 
+/// Number of entries in the SCRIPTS instruction cache (power of two).
+#define SCRIPTS_CACHE_SIZE 1024
+
 /**
  * \brief Symbios Sym53C895 SCSI disk controller.
  *
@@ -56,6 +59,7 @@ public:
   virtual int SaveState(FILE *f);
   virtual int RestoreState(FILE *f);
   virtual void check_state();
+  virtual void scsi_reselect_wakeup_me(int bus);
 
   void run();
   virtual void init();
@@ -103,6 +107,13 @@ private:
   void execute_bm_op();
   void execute();
 
+  /// Handler for one type of SCRIPTS instruction.
+  typedef void (CSym53C895::*ScriptsOp)();
+  ScriptsOp fetch_ins();
+  static ScriptsOp decode_ins(u8 dcmd);
+  void scripts_cache_flush();
+
+  bool do_reselect();
   void eval_interrupts();
   void set_interrupt(int reg, u8 interrupt);
   void chip_reset();
@@ -110,6 +121,26 @@ private:
   std::unique_ptr<std::thread> myThread;
   std::atomic_bool myThreadDead{false};
   CSemaphore mySemaphore;
+  /// Set by targets that want to reselect us; handled by the thread.
+  std::atomic_bool reselect_wakeup{false};
+
+  /// SCRIPTS instructions fetched before, direct mapped by DSP. An entry is
+  /// valid while the DMA translation and the generation of the memory page
+  /// (or of the SCRIPTS RAM) it was fetched from are unchanged.
+  struct SScriptsIns {
+    bool valid;
+    bool ram;    ///< Fetched from SCRIPTS RAM; gen is a ram_gen value
+    u32 dsp;     ///< PCI address of the instruction
+    u64 phys;    ///< System address of the instruction
+    u32 gen;     ///< Code page generation (or ram_gen) when fetched
+    u32 map_gen; ///< DMA translation generation when fetched
+    u32 dbc;     ///< First DWORD (DCMD and DBC)
+    u32 dsps;    ///< Second DWORD (DSPS)
+    ScriptsOp op;
+  } scripts_cache[SCRIPTS_CACHE_SIZE];
+
+  /// Incremented on every write to the SCRIPTS RAM.
+  std::atomic<u32> ram_gen{0};
   CMutex *myRegLock;
   bool StopThread;
 
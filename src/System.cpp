@@ -36,6 +36,20 @@
 #include <signal.h>
 #include <stdlib.h>
 
+#if defined(HAVE_ZLIB)
+#include <zlib.h>
+#endif
+
+#if defined(HAVE_SYS_MMAN_H)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+#if defined(_WIN32)
+#include <direct.h> // getcwd
+#endif
+
 #define CLOCK_RATIO 10000
 
 #if defined(LS_MASTER) || defined(LS_SLAVE)
@@ -89,17 +103,55 @@ CSystem::CSystem(CConfigurator *cfg) {
   state.tig.HaltB = 0;
 
   state.cpu_lock_flags = 0;
-
-  if (iNumMemoryBits > 30) {
-
-    // size_t may not be big enough, and makes 2^31 negative, so the
-    // alloc fails.  We're going to allocate the memory in
-    //  2^(iNumMemoryBits-10) chunks of 2^10.
-    CHECK_ALLOCATION(memory = calloc(1 << (iNumMemoryBits - 10), 1 << 10));
-  } else
-    CHECK_ALLOCATION(memory = calloc(1 << iNumMemoryBits, 1));
-
-  cpu_lock_mutex = new CFastMutex("cpu-locking-lock");
+  for (int j = 0; j < 4; j++)
+    cpu_lock_slot[j] = 0;
+  for (int j = 0; j < CPU_LOCK_FILTER_SIZE; j++)
+    cpu_lock_filter[j] = 0;
+  dma_map_gen[0] = 0;
+  dma_map_gen[1] = 0;
+  pci_windows_seq[0] = 0;
+  pci_windows_seq[1] = 0;
+  pci_windows_update(0);
+  pci_windows_update(1);
+
+  cchip_mutex = new CFastMutex("cchip-lock");
+
+  timer_start = host_time_ns();
+  timer_ticks = 0;
+
+  last_state_file[0] = '\0';
+  last_state_id = 0;
+
+  const char *backing = myCfg->get_text_value("memory.backing", "heap");
+  if (!strcasecmp(backing, "heap"))
+    mem_backing = MEM_BACKING_HEAP;
+  else if (!strcasecmp(backing, "anonymous"))
+    mem_backing = MEM_BACKING_ANONYMOUS;
+  else if (!strcasecmp(backing, "file"))
+    mem_backing = MEM_BACKING_FILE;
+  else if (!strcasecmp(backing, "private"))
+    mem_backing = MEM_BACKING_PRIVATE;
+  else
+    FAILURE_1(Configuration, "Invalid memory.backing %s", backing);
+
+  strncpy(mem_file, myCfg->get_text_value("memory.file", "memory.img"),
+          sizeof(mem_file) - 1);
+  mem_file[sizeof(mem_file) - 1] = '\0';
+  mem_hugepages = myCfg->get_bool_value("memory.hugepages", false);
+  mem_fd = -1;
+
+  alloc_memory();
+
+  CHECK_ALLOCATION(code_pages = new std::atomic<u32>
+                       [(size_t)1 << (iNumMemoryBits - CODE_PAGE_SHIFT)]());
+  CHECK_ALLOCATION(dirty_pages = (u8 *)malloc(
+                       (size_t)1 << (iNumMemoryBits - CODE_PAGE_SHIFT)));
+  memset(dirty_pages, 1, (size_t)1 << (iNumMemoryBits - CODE_PAGE_SHIFT));
+
+  // A private mapping starts out as a copy of the memory image, so the image
+  // can be the parent of incremental state files.
+  if (mem_backing == MEM_BACKING_PRIVATE)
+    clear_dirty(mem_file, STATE_PARENT_IMAGE);
 
   printf("%s(%s): $Id: System.cpp,v 1.79 2008/06/12 07:29:44 iamcamiel Exp $\n",
          cfg->get_myName(), cfg->get_myValue());
@@ -120,16 +172,275 @@ CSystem::~CSystem() {
   for (i = 0; i < iNumMemories; i++)
     free(asMemories[i]);
 
-  free(memory);
+  free_memory();
+  delete[] code_pages;
+  free(dirty_pages);
+  delete cchip_mutex;
 }
 
 /**
  * free memory, and allocate and clear new memory.
  **/
 void CSystem::ResetMem(unsigned int membits) {
-  free(memory);
+  free_memory();
+  delete[] code_pages;
+  free(dirty_pages);
   iNumMemoryBits = membits;
-  CHECK_ALLOCATION(memory = calloc(1 << iNumMemoryBits, 1));
+  alloc_memory();
+  CHECK_ALLOCATION(code_pages = new std::atomic<u32>
+                       [(size_t)1 << (iNumMemoryBits - CODE_PAGE_SHIFT)]());
+  CHECK_ALLOCATION(dirty_pages = (u8 *)malloc(
+                       (size_t)1 << (iNumMemoryBits - CODE_PAGE_SHIFT)));
+  memset(dirty_pages, 1, (size_t)1 << (iNumMemoryBits - CODE_PAGE_SHIFT));
+}
+
+/**
+ * Allocate guest memory according to memory.backing:
+ *  - heap: calloc.
+ *  - anonymous: anonymous mmap, optionally with huge pages.
+ *  - file: shared mmap of memory.file, so memory lives in the file.
+ *  - private: copy-on-write mmap of memory.file; pages are read from the
+ *    file when first used, and systems started from the same file share
+ *    the pages they haven't written to.
+ **/
+void CSystem::alloc_memory() {
+  size_t size = (size_t)1 << iNumMemoryBits;
+
+  if (mem_backing == MEM_BACKING_HEAP) {
+    if (iNumMemoryBits > 30) {
+
+      // size_t may not be big enough, and makes 2^31 negative, so the
+      // alloc fails.  We're going to allocate the memory in
+      //  2^(iNumMemoryBits-10) chunks of 2^10.
+      CHECK_ALLOCATION(memory = calloc(1 << (iNumMemoryBits - 10), 1 << 10));
+    } else
+      CHECK_ALLOCATION(memory = calloc(1 << iNumMemoryBits, 1));
+    return;
+  }
+
+#if defined(HAVE_SYS_MMAN_H)
+  void *p = MAP_FAILED;
+  struct stat st;
+
+  if (mem_backing == MEM_BACKING_ANONYMOUS) {
+#if defined(MAP_HUGETLB)
+    if (mem_hugepages)
+      p = mmap(NULL, size, PROT_READ | PROT_WRITE,
+               MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_HUGETLB, -1, 0);
+#endif
+    if (p == MAP_FAILED)
+      p = mmap(NULL, size, PROT_READ | PROT_WRITE,
+               MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  } else {
+    mem_fd = open(mem_file,
+                  (mem_backing == MEM_BACKING_FILE) ? (O_RDWR | O_CREAT)
+                                                    : O_RDONLY,
+                  0644);
+    if (mem_fd < 0)
+      FAILURE_1(FileNotFound, "Can't open memory file %s", mem_file);
+    if (fstat(mem_fd, &st))
+      FAILURE_1(Runtime, "Can't stat memory file %s", mem_file);
+
+    if ((size_t)st.st_size < size) {
+      if (mem_backing == MEM_BACKING_PRIVATE)
+        FAILURE_1(Configuration, "Memory file %s is smaller than memory",
+                  mem_file);
+      if (ftruncate(mem_fd, size))
+        FAILURE_1(Runtime, "Can't extend memory file %s", mem_file);
+    }
+
+    p = mmap(NULL, size, PROT_READ | PROT_WRITE,
+             (mem_backing == MEM_BACKING_FILE) ? MAP_SHARED
+                                               : (MAP_PRIVATE | MAP_NORESERVE),
+             mem_fd, 0);
+  }
+
+  if (p == MAP_FAILED)
+    FAILURE_1(Runtime, "Can't map %d MB of memory", (int)(size >> 20));
+
+#if defined(MADV_HUGEPAGE)
+  if (mem_hugepages)
+    madvise(p, size, MADV_HUGEPAGE);
+#endif
+  memory = p;
+#else
+  FAILURE(Configuration, "memory.backing needs mmap support");
+#endif
+}
+
+/**
+ * Free guest memory.
+ **/
+void CSystem::free_memory() {
+  if (mem_backing == MEM_BACKING_HEAP) {
+    free(memory);
+    return;
+  }
+
+#if defined(HAVE_SYS_MMAN_H)
+  munmap(memory, (size_t)1 << iNumMemoryBits);
+  if (mem_fd >= 0)
+    close(mem_fd);
+  mem_fd = -1;
+#endif
+}
+
+/**
+ * Replace memory with a fresh copy-on-write mapping of the memory file, at
+ * the same address. Changes made since the file was last written are
+ * dropped; from now on, writes no longer reach the file.
+ **/
+void CSystem::remap_private() {
+#if defined(HAVE_SYS_MMAN_H)
+  size_t size = (size_t)1 << iNumMemoryBits;
+
+  if (mmap(memory, size, PROT_READ | PROT_WRITE,
+           MAP_PRIVATE | MAP_NORESERVE | MAP_FIXED, mem_fd,
+           0) == MAP_FAILED)
+    FAILURE_1(Runtime, "Can't remap memory file %s", mem_file);
+
+#if defined(MADV_HUGEPAGE)
+  if (mem_hugepages)
+    madvise(memory, size, MADV_HUGEPAGE);
+#endif
+  mem_backing = MEM_BACKING_PRIVATE;
+#endif
+}
+
+/**
+ * Check if two names refer to the same file.
+ **/
+static bool same_file(const char *a, const char *b) {
+#if defined(HAVE_SYS_MMAN_H)
+  struct stat sa;
+  struct stat sb;
+
+  if (!stat(a, &sa) && !stat(b, &sb))
+    return sa.st_dev == sb.st_dev && sa.st_ino == sb.st_ino;
+#endif
+  return !strcmp(a, b);
+}
+
+/**
+ * Length of the directory part of a path, including the separator; 0 for a
+ * bare file name.
+ **/
+static size_t dir_length(const char *fn) {
+  const char *s = strrchr(fn, '/');
+#if defined(_WIN32)
+  const char *b = strrchr(fn, '\\');
+  if (!s || (b && b > s))
+    s = b;
+  if (!s && fn[0] && fn[1] == ':')
+    s = fn + 1;
+#endif
+  return s ? (size_t)(s - fn + 1) : 0;
+}
+
+static bool absolute_path(const char *fn) {
+#if defined(_WIN32)
+  if (fn[0] == '\\' || (fn[0] && fn[1] == ':'))
+    return true;
+#endif
+  return fn[0] == '/';
+}
+
+/**
+ * The name a state file records for its parent: relative to the directory
+ * of the state file where possible, so a chain of state files can be moved
+ * together, and absolute otherwise.
+ *
+ * \return false if the name doesn't fit.
+ **/
+static bool parent_name(char *out, size_t size, const char *fn,
+                        const char *parent) {
+  size_t d = dir_length(fn);
+  char cwd[512];
+  int n;
+
+  if (!*parent || !d || absolute_path(parent))
+    n = snprintf(out, size, "%s", parent);
+  else if (!strncmp(parent, fn, d))
+    n = snprintf(out, size, "%s", parent + d);
+  else if (getcwd(cwd, sizeof(cwd)))
+    n = snprintf(out, size, "%s/%s", cwd, parent);
+  else
+    return false;
+  return n >= 0 && (size_t)n < size;
+}
+
+/**
+ * Path of a parent recorded in a state file, which is relative to the
+ * directory of the state file (see parent_name).
+ **/
+static void parent_path(char *out, size_t size, const char *fn,
+                        const char *parent) {
+  size_t d = absolute_path(parent) ? 0 : dir_length(fn);
+
+  snprintf(out, size, "%.*s%s", (int)d, fn, parent);
+}
+
+/**
+ * Restore memory from a raw memory image file. When memory is mapped from
+ * that same file, this is just a new copy-on-write mapping; as after a
+ * save, the file then stays as the state file expects it.
+ *
+ * \return 0 on success, -1 on failure.
+ **/
+int CSystem::restore_image(const char *fn) {
+  size_t size = (size_t)1 << iNumMemoryBits;
+  FILE *f;
+
+  if ((mem_backing == MEM_BACKING_PRIVATE ||
+       mem_backing == MEM_BACKING_FILE) &&
+      same_file(fn, mem_file)) {
+    remap_private();
+    return 0;
+  }
+
+  f = fopen(fn, "rb");
+  if (!f) {
+    printf("%%SYS-F-NOFILE: Can't open memory image %s\n", fn);
+    return -1;
+  }
+
+  // Memory is partly overwritten by now, so there's no going back.
+  if (fread(memory, 1, size, f) != size)
+    FAILURE_1(Runtime, "Memory image %s is too small", fn);
+
+  fclose(f);
+  return 0;
+}
+
+/**
+ * Get the identity of a memory image file: its size and modification time
+ * (seconds and nanoseconds). A state file based on the image records it,
+ * so an image that was replaced or changed since is noticed on restore.
+ *
+ * \return false if the file can't be found.
+ **/
+bool CSystem::image_identity(const char *fn, u64 *ident) {
+#if defined(HAVE_SYS_MMAN_H)
+  struct stat st;
+
+  // Writes through a shared mapping update the time by the next msync.
+  if (mem_backing == MEM_BACKING_FILE && same_file(fn, mem_file))
+    msync(memory, (size_t)1 << iNumMemoryBits, MS_SYNC);
+
+  if (stat(fn, &st))
+    return false;
+
+  ident[0] = (u64)st.st_size;
+  ident[1] = (u64)st.st_mtime;
+#if defined(__APPLE__)
+  ident[2] = (u64)st.st_mtimespec.tv_nsec;
+#else
+  ident[2] = (u64)st.st_mtim.tv_nsec;
+#endif
+  return true;
+#else
+  return false;
+#endif
 }
 
 /**
@@ -160,6 +471,44 @@ char *CSystem::PtrToMem(u64 address) {
   return &(((char *)memory)[(int)address]);
 }
 
+/**
+ * Invalidate decoded instructions in a range of memory that was written to
+ * without going through WriteMem (e.g. DMA or state restore).
+ **/
+void CSystem::invalidate_code(u64 address, u64 length) {
+  u64 page;
+  u64 last;
+
+  if (!length || (address >> iNumMemoryBits))
+    return;
+
+  last = address + length - 1;
+  if (last >> iNumMemoryBits)
+    last = (U64(0x1) << iNumMemoryBits) - 1;
+
+  for (page = address >> CODE_PAGE_SHIFT; page <= (last >> CODE_PAGE_SHIFT);
+       page++) {
+    u32 gen = code_pages[page].load(std::memory_order_relaxed);
+
+    while ((gen & CODE_PAGE_USED) &&
+           !code_pages[page].compare_exchange_weak(
+               gen, (gen + 1) & ~CODE_PAGE_USED, std::memory_order_release,
+               std::memory_order_relaxed))
+      ;
+  }
+}
+
+/**
+ * Handle a range of memory written to by a device (DMA): invalidate decoded
+ * instructions, break LDx_L locks and mark the pages dirty.
+ **/
+void CSystem::dma_written(u64 address, u64 length, CSystemComponent *source) {
+  std::atomic_thread_fence(std::memory_order_seq_cst);
+  invalidate_code(address, length);
+  cpu_break_locks(address, length, source);
+  mark_dirty(address, length);
+}
+
 /**
  * Register a device as being a CPU. Return the CPU number.
  **/
@@ -287,6 +636,8 @@ void CSystem::Run() {
  * some devices may be clocked.
  **/
 int CSystem::SingleStep() {
+  check_timer();
+
   for (int i = 0; i < iNumCPUs; i++)
     if (!acCPUs[i]->get_waiting())
       acCPUs[i]->execute();
@@ -325,29 +676,103 @@ int CSystem::SingleStep() {
 #if defined(DEBUG_PORTACCESS)
 u64 lastport;
 #endif // defined(DEBUG_PORTACCESS)
+/**
+ * Set the LDx_L lock for a CPU. Any lock the CPU held before is dropped.
+ * Call this before doing the locked load.
+ *
+ * Each CPU owns its own slot, so this needs no mutex. A store looks at the
+ * filter and the slots only after the store and a full fence (see WriteMem);
+ * the lock is published and fenced here before the load. So either the
+ * store sees the lock and breaks it, or the locked load sees the store.
+ **/
 void CSystem::cpu_lock(int cpuid, u64 address) {
-  SCOPED_FM_LOCK(cpu_lock_mutex);
+  u64 lock = (address & CPU_LOCK_MASK) | CPU_LOCK_VALID;
 
   //  printf("cpu%d: lock %" PRIx64 ".   \n",cpuid,address);
-  state.cpu_lock_flags |= (1 << cpuid);
-  state.cpu_lock_address[cpuid] = address;
+  cpu_lock_filter[CPU_LOCK_FILTER(lock)].fetch_add(1,
+                                                   std::memory_order_seq_cst);
+
+  u64 old = cpu_lock_slot[cpuid].exchange(lock);
+  if (old)
+    cpu_lock_filter[CPU_LOCK_FILTER(old)]--;
+
+  std::atomic_thread_fence(std::memory_order_seq_cst);
 }
 
+/**
+ * Clear the LDx_L lock for a CPU (STx_C). Returns true if the lock was
+ * still held, i.e. the conditional store should succeed.
+ **/
 bool CSystem::cpu_unlock(int cpuid) {
-  SCOPED_FM_LOCK(cpu_lock_mutex);
+  u64 old = cpu_lock_slot[cpuid].exchange(0);
 
-  bool retval;
-  retval = state.cpu_lock_flags & (1 << cpuid);
-
-  //  printf("cpu%d: unlock (%s).   \n",cpuid,retval?"ok":"failed");
-  state.cpu_lock_flags &= ~(1 << cpuid);
-  return retval;
+  //  printf("cpu%d: unlock (%s).   \n",cpuid,old?"ok":"failed");
+  if (!old)
+    return false;
+  cpu_lock_filter[CPU_LOCK_FILTER(old)]--;
+  return true;
 }
 
+/**
+ * Break the LDx_L lock of a CPU because another component wrote to the
+ * locked line.
+ **/
 void CSystem::cpu_break_lock(int cpuid, CSystemComponent *source) {
-  SCOPED_FM_LOCK(cpu_lock_mutex);
+  u64 old = cpu_lock_slot[cpuid].exchange(0);
+
+  if (!old)
+    return;
+  cpu_lock_filter[CPU_LOCK_FILTER(old)]--;
   printf("cpu%d: lock broken by %s.   \n", cpuid, source->devid_string);
-  state.cpu_lock_flags &= ~(1 << cpuid);
+}
+
+/**
+ * Break the LDx_L locks of all CPUs (other than the source) that lie in a
+ * range of memory written by a component, e.g. by DMA.
+ **/
+void CSystem::cpu_break_locks(u64 address, u64 length,
+                              CSystemComponent *source) {
+  u64 first = address & CPU_LOCK_MASK;
+  u64 last = (address + length - 1) & CPU_LOCK_MASK;
+  u64 lock;
+  int i;
+
+  for (i = 0; i < iNumCPUs; i++) {
+    lock = cpu_lock_slot[i].load(std::memory_order_acquire);
+    if (!lock || source == acCPUs[i])
+      continue;
+    lock &= ~CPU_LOCK_VALID;
+    if (lock < first || lock > last)
+      continue;
+
+    // only break it if it is still the same lock
+    u64 expected = lock | CPU_LOCK_VALID;
+    if (cpu_lock_slot[i].compare_exchange_strong(expected, 0)) {
+      cpu_lock_filter[CPU_LOCK_FILTER(lock)]--;
+      printf("cpu%d: lock broken by %s.   \n", i, source->devid_string);
+    }
+  }
+}
+
+/**
+ * A CPU is about to sleep in an idle loop. It may only sleep if all other
+ * CPUs are asleep too: a CPU that is running may be about to store what
+ * the idle loop is waiting for. Call cpu_idle_end() afterwards either way.
+ **/
+bool CSystem::cpu_idle_begin() {
+  return idle_cpus.fetch_add(1) + 1 == iNumCPUs;
+}
+
+/**
+ * A CPU is done sleeping in an idle loop, or didn't get to sleep. The other
+ * CPUs went to sleep counting on this one not to run, so wake them up; they
+ * go back to sleep once their idle loops are detected again.
+ **/
+void CSystem::cpu_idle_end(CAlphaCPU *cpu) {
+  idle_cpus.fetch_sub(1);
+  for (int i = 0; i < iNumCPUs; i++)
+    if (acCPUs[i] != cpu)
+      acCPUs[i]->idle_wake();
 }
 
 /**
@@ -456,20 +881,12 @@ void CSystem::WriteMem(u64 address, int dsize, u64 data,
   u32 t32;
   u16 t16;
 #endif // defined(ALIGN_MEM_ACCESS)
-  if (state.cpu_lock_flags) {
-    for (i = 0; i < iNumCPUs; i++) {
-      if ((state.cpu_lock_flags & (1 << i)) &&
-          (!((state.cpu_lock_address[i] ^ address) &
-             U64(0x00000807ffffff00))) &&
-          (source != acCPUs[i]))
-        cpu_break_lock(i, source);
-    }
-  }
-
   a = address & U64(0x00000807ffffffff);
 
   if (a >> iNumMemoryBits) // non-memory
   {
+    if (cpu_lock_held(address))
+      cpu_break_locks(address, 1, source);
 
     // check registered device memory ranges
     for (i = 0; i < iNumMemories; i++) {
@@ -607,6 +1024,18 @@ void CSystem::WriteMem(u64 address, int dsize, u64 data,
   default:
     *((u64 *)p) = endian_64((u64)data);
   }
+
+  dirty_pages[a >> CODE_PAGE_SHIFT] = 1;
+
+  // Writing to a line another CPU holds a LDx_L lock on breaks the lock, and
+  // writing to a page that holds decoded instructions invalidates them. Both
+  // are looked for after the store (see cpu_lock and mark_code_page).
+  std::atomic_thread_fence(std::memory_order_seq_cst);
+  if (cpu_lock_held(a))
+    cpu_break_locks(a, dsize / 8, source);
+  if (code_pages[a >> CODE_PAGE_SHIFT].load(std::memory_order_relaxed) &
+      CODE_PAGE_USED)
+    invalidate_code(a, dsize / 8);
 }
 
 /**
@@ -1277,10 +1706,12 @@ void CSystem::pchip_csr_write(int num, u32 a, u64 data) {
   case 0x040:
   case 0x080:
     state.pchip[num].wsba[(a >> 6) & 3] = data & U64(0x00000000fff00003);
+    pci_windows_update(num);
     return;
 
   case 0x0c0:
     state.pchip[num].wsba[3] = (data & U64(0x00000080fff00001)) | 2;
+    pci_windows_update(num);
     return;
 
   case 0x100:
@@ -1288,6 +1719,7 @@ void CSystem::pchip_csr_write(int num, u32 a, u64 data) {
   case 0x180:
   case 0x1c0:
     state.pchip[num].wsm[(a >> 6) & 3] = data & U64(0x00000000fff00000);
+    pci_windows_update(num);
     return;
 
   case 0x200:
@@ -1295,11 +1727,13 @@ void CSystem::pchip_csr_write(int num, u32 a, u64 data) {
   case 0x280:
   case 0x2c0:
     state.pchip[num].tba[(a >> 6) & 3] = data & U64(0x00000007fffffc00);
+    pci_windows_update(num);
     return;
 
   case 0x300:
     state.pchip[num].pctl &= U64(0xffffe300f0300000);
     state.pchip[num].pctl |= (data & U64(0x00001cff0fcfffff));
+    pci_windows_update(num);
     return;
 
   case 0x340:
@@ -1315,6 +1749,7 @@ void CSystem::pchip_csr_write(int num, u32 a, u64 data) {
 
   case 0x480: // TLBIV
   case 0x4c0: // TLBIA
+    dma_tlb_flush(num);
     return;
 
   case 0x800: // PCI reset
@@ -1330,6 +1765,8 @@ void CSystem::pchip_csr_write(int num, u32 a, u64 data) {
 
 u64 CSystem::cchip_csr_read(u32 a, CSystemComponent *source) {
   CAlphaCPU *cpu = (CAlphaCPU *)source;
+  SCOPED_FM_LOCK(cchip_mutex);
+
   switch (a) {
   case 0x000:
     return state.cchip.csc;
@@ -1376,6 +1813,8 @@ u64 CSystem::cchip_csr_read(u32 a, CSystemComponent *source) {
 
 void CSystem::cchip_csr_write(u32 a, u64 data, CSystemComponent *source) {
   CAlphaCPU *cpu = (CAlphaCPU *)source;
+  SCOPED_FM_LOCK(cchip_mutex);
+
   switch (a) {
   case 0x000: // CSC
     state.cchip.csc &= ~U64(0x0777777fff3f0000);
@@ -1646,6 +2085,7 @@ int CSystem::LoadROM() {
       acCPUs[i]->set_PAL_BASE(endian_64(temp));
     buffer = PtrToMem(0);
     (void)!fread(buffer, 1, 0x200000, f);
+    mark_dirty(0, 0x200000);
     fclose(f);
   }
 
@@ -1759,6 +2199,7 @@ int CSystem::LoadROM() {
  **/
 void CSystem::interrupt(int number, bool assert) {
   int i;
+  SCOPED_FM_LOCK(cchip_mutex);
 
   if (number == -1) {
 
@@ -1885,15 +2326,38 @@ void CSystem::interrupt(int number, bool assert) {
  *device is ever added that uses this, we should probably support it.
  **/
 u64 CSystem::PCI_Phys(int pcibus, u32 address) {
-  u64 a;
-  int j;
+  SPCIWindows *ws = &pci_windows[pcibus];
+  SPCIWindow win;
+  bool found;
+  u32 seq;
+
+  // CPU threads may be rewriting the windows; find the window in a
+  // consistent state of the table, and copy only that one.
+  do {
+    seq = pci_windows_seq[pcibus].load(std::memory_order_acquire);
+    found = false;
+    if (!ws->hole // hole disabled
+        || (address < PCI_PCTL_HOLE_START) ||
+        (address > PCI_PCTL_HOLE_END)) // or address outside hole
+    {
+      for (int j = 0; j < ws->count && j < 4; j++) {
+        if ((address & ws->window[j].match) == ws->window[j].base) {
+          win = ws->window[j];
+          found = true;
+          break;
+        }
+      }
+    }
+    std::atomic_thread_fence(std::memory_order_acquire);
+  } while ((seq & 1) ||
+           seq != pci_windows_seq[pcibus].load(std::memory_order_relaxed));
 
 #if defined(DEBUG_PCI)
   printf("-------------- PCI MEMORY ACCESS FOR PCI HOSE %d --------------\n",
          pcibus);
 
   // Step through windows
-  for (j = 0; j < 4; j++) {
+  for (int j = 0; j < 4; j++) {
     printf("WSBA%d: %016" PRIx64 " WSM: %016" PRIx64 " TBA: %016" PRIx64 "\n", j,
            state.pchip[pcibus].wsba[j], state.pchip[pcibus].wsm[j],
            state.pchip[pcibus].tba[j]);
@@ -1903,46 +2367,102 @@ u64 CSystem::PCI_Phys(int pcibus, u32 address) {
          test_bit_64(state.pchip[pcibus].pctl, 5) ? "enabled" : "disabled");
   printf("--------------------------------------------------------------\n");
 #endif
-  if (!(state.pchip[pcibus].pctl & PCI_PCTL_HOLE) // hole disabled
-      || (address < PCI_PCTL_HOLE_START) ||
-      (address > PCI_PCTL_HOLE_END)) // or address outside hole
-  {
-
-    // Step through windows
-    for (j = 0; j < 4; j++) {
-      if ((state.pchip[pcibus].wsba[j] & 1) // window enabled...
-          && !((address ^ state.pchip[pcibus].wsba[j]) & 0xfff00000 &
-               ~state.pchip[pcibus].wsm[j])) // address in range...
-      {
-        if (state.pchip[pcibus].wsba[j] & 2) {
-          try {
-            a = PCI_Phys_scatter_gather(address, state.pchip[pcibus].wsm[j],
-                                        state.pchip[pcibus].tba[j]);
-          }
-
-          catch (char) {
-
-            // window disabled...
-            // not matched; treat as local PCI bus address
-            return U64(0x80000000000) | (pcibus * U64(0x200000000)) |
-                   (u64)address;
-          }
-        } else
-          a = PCI_Phys_direct_mapped(address, state.pchip[pcibus].wsm[j],
-                                     state.pchip[pcibus].tba[j]);
+  if (found) {
+    u64 a;
+    if (win.sg) {
+      u64 tag = DMA_TLB_TAG(address, win.num);
+      std::atomic<u64> &tlb = dma_tlb[pcibus][DMA_TLB_INDEX(address)];
+      u32 gen = dma_map_gen[pcibus].load(std::memory_order_acquire);
+      u64 e = tlb.load(std::memory_order_relaxed);
+
+      if ((e & 1) && DMA_TLB_ENTRY_TAG(e) == tag)
+        return DMA_TLB_ENTRY_PAGE(e) | (address & PCI_PTE_ADD2_MASK);
+
+      if (!PCI_Phys_scatter_gather(address, win.wsm, win.tba, &a)) {
+
+        // PTE invalid...
+        // not matched; treat as local PCI bus address
+        return U64(0x80000000000) | (pcibus * U64(0x200000000)) |
+               (u64)address;
+      }
+      e = DMA_TLB_ENTRY(a & ~PCI_PTE_ADD2_MASK, tag);
+      tlb.store(e, std::memory_order_relaxed);
+
+      // If the TLB was flushed since the PTE was read, the entry may be
+      // stale; take it out again (see dma_tlb_flush).
+      std::atomic_thread_fence(std::memory_order_seq_cst);
+      if (dma_map_gen[pcibus].load(std::memory_order_relaxed) != gen)
+        tlb.compare_exchange_strong(e, 0, std::memory_order_relaxed);
+    } else
+      a = PCI_Phys_direct_mapped(address, win.wsm, win.tba);
 #if defined(DEBUG_PCI)
-        printf("PCI memory address %08x translated to %016" PRIx64 "\n", address,
-               a);
+    printf("PCI memory address %08x translated to %016" PRIx64 "\n", address,
+           a);
 #endif
-        return a;
-      }
-    }
+    return a;
   }
 
   // not matched; treat as local PCI bus address
   return U64(0x80000000000) | (pcibus * U64(0x200000000)) | (u64)address;
 }
 
+/**
+ * Rebuild the window descriptors used by PCI_Phys from the WSBA, WSM, TBA
+ * and PCTL registers of a Pchip. Also empties its scatter-gather TLB.
+ *
+ * The table is rewritten under pci_windows_seq; concurrent updates take
+ * turns.
+ **/
+void CSystem::pci_windows_update(int pcibus) {
+  SPCIWindows *w = &pci_windows[pcibus];
+  std::atomic<u32> &seq = pci_windows_seq[pcibus];
+  int n = 0;
+
+  for (;;) {
+    u32 s = seq.load(std::memory_order_relaxed);
+    if (!(s & 1) &&
+        seq.compare_exchange_weak(s, s + 1, std::memory_order_relaxed))
+      break;
+  }
+  std::atomic_thread_fence(std::memory_order_release);
+
+  for (int j = 0; j < 4; j++) {
+    u64 wsba = state.pchip[pcibus].wsba[j];
+
+    if (!(wsba & 1)) // window disabled
+      continue;
+
+    SPCIWindow *win = &w->window[n++];
+    win->num = j;
+    win->match = 0xfff00000 & ~(u32)state.pchip[pcibus].wsm[j];
+    win->base = (u32)wsba & win->match;
+    win->sg = (wsba & 2) != 0;
+    win->wsm = state.pchip[pcibus].wsm[j];
+    win->tba = state.pchip[pcibus].tba[j];
+  }
+
+  w->count = n;
+  w->hole = (state.pchip[pcibus].pctl & PCI_PCTL_HOLE) != 0;
+  seq.fetch_add(1, std::memory_order_release);
+  dma_tlb_flush(pcibus);
+}
+
+/**
+ * Empty the scatter-gather TLB of a Pchip.
+ *
+ * The generation is bumped both before and after emptying the TLB. A fill
+ * in PCI_Phys that read its PTE before the flush either sees the first
+ * bump and drops its entry, or stored it early enough to be cleared here.
+ * A device that sees the second bump finds the TLB empty.
+ **/
+void CSystem::dma_tlb_flush(int pcibus) {
+  dma_map_gen[pcibus].fetch_add(1, std::memory_order_seq_cst);
+  std::atomic_thread_fence(std::memory_order_seq_cst);
+  for (int i = 0; i < DMA_TLB_SIZE; i++)
+    dma_tlb[pcibus][i].store(0, std::memory_order_relaxed);
+  dma_map_gen[pcibus].fetch_add(1, std::memory_order_release);
+}
+
 /**
  * Translate a 32-bit address coming off the PCI bus into a 64-bit
  * system address using direct-mapped DMA address translation.
@@ -1990,8 +2510,8 @@ u64 CSystem::PCI_Phys_direct_mapped(u32 address, u64 wsm, u64 tba) {
  * Translate a 32-bit address coming off the PCI bus into a 64-bit
  * system address using scatter-gather DMA address translation.
  *
- * If address can't be matched (PTE is invalid), an exception of type char
- * is thrown. The calling function should catch the exception, and do
+ * The system address is stored in *phys. If address can't be matched (PTE
+ * is invalid), false is returned. The calling function should then do
  * The Right Thing(tm): treat the address as a local PCI-bus address.
  *
  * Source: HRM, 10.1.4.3:
@@ -2057,7 +2577,8 @@ u64 CSystem::PCI_Phys_direct_mapped(u32 address, u64 wsm, u64 tba) {
  * +----------------------------+-------------------+
  * \endcode
  **/
-u64 CSystem::PCI_Phys_scatter_gather(u32 address, u64 wsm, u64 tba) {
+bool CSystem::PCI_Phys_scatter_gather(u32 address, u64 wsm, u64 tba,
+                                      u64 *phys) {
   u64 pte_a;
 
   u64 pte;
@@ -2076,10 +2597,10 @@ u64 CSystem::PCI_Phys_scatter_gather(u32 address, u64 wsm, u64 tba) {
 
     if (pte & PCI_PTE_PEER_BIT) // peer-to-peer
       a |= (PHYS_PIO_ACCESS);   // PIO access.
-    return a;
-  } else {
-    throw((char)'0');
+    *phys = a;
+    return true;
   }
+  return false;
 }
 
 /**
@@ -2105,56 +2626,216 @@ void CSystem::start_threads() {
   }
   printf("\n");
 
+  timer_start = host_time_ns();
+  timer_ticks = 0;
+#ifndef IDB
+  // When running with IDB, SingleStep checks the timer.
+  if (!timerThread) {
+    StopTimer = false;
+    timerThread = std::make_unique<std::thread>([this]() { this->run_timer(); });
+  }
+#endif
+
   for (i = 0; i < iNumCPUs; i++)
     acCPUs[i]->release_threads();
 }
 
 void CSystem::stop_threads() {
   printf("Stop threads:");
+  if (timerThread) {
+    StopTimer = true;
+    timerThread->join();
+    timerThread = nullptr;
+  }
   for (int i = 0; i < iNumComponents; i++)
     acComponents[i]->stop_threads();
   printf("\n");
 }
 
+/**
+ * Thread that drives the interval timer from the host clock.
+ **/
+void CSystem::run_timer() {
+  while (!StopTimer) {
+    u64 next = timer_start + (timer_ticks + 1) * 1000000000 / TIMER_HZ;
+    u64 now = host_time_ns();
+
+    if (next > now)
+      std::this_thread::sleep_for(std::chrono::nanoseconds(next - now));
+    check_timer();
+  }
+}
+
+/**
+ * Post the interval timer interrupt to all CPUs when it is due.
+ *
+ * When the host has kept us from running for more than one timer period,
+ * only one interrupt is posted, and the missed ticks are skipped rather
+ * than delivered in a burst; the interrupt could not be seen more than
+ * once before being acknowledged anyway.
+ **/
+void CSystem::check_timer() {
+  u64 lapse = host_time_ns() - timer_start;
+  u64 ticks = lapse / 1000000000 * TIMER_HZ +
+              lapse % 1000000000 * TIMER_HZ / 1000000000;
+
+  if (ticks <= timer_ticks)
+    return;
+
+  timer_ticks = ticks;
+  interrupt(-1, true);
+}
+
 /**
  * Save system state to a state file.
+ *
+ * File format 3.0 (STATE_VERSION_3_0):
+ * \code
+ * u32  magic (0xa1fae540)
+ * u32  version (0x00030000)
+ * u32  page size (8 KB)
+ * u32  memory bits
+ * u64  id of this state file
+ * u64  id of the parent state file (0 if none)
+ * u32  length of the parent file name, followed by the name (relative to
+ *      the directory of the state file, unless absolute)
+ * u64  size, modification time (s) and (ns) of the parent (memory image
+ *      parents only, see image_identity)
+ * pages, each:
+ *   u32  page number (STATE_PAGE_END ends the list)
+ *   u32  page type (STATE_PAGE_ZERO, STATE_PAGE_RAW or STATE_PAGE_ZLIB)
+ *   u32  data length, followed by the data (not for STATE_PAGE_ZERO)
+ * system state
+ * component states
+ * \endcode
+ *
+ * A full state file leaves out pages that are all zeroes. An incremental
+ * state file (incremental = true) only holds the pages written to since
+ * the parent, which is the state file last saved or restored; restoring it
+ * restores the parent's memory first.
  **/
-void CSystem::SaveState(const char *fn) {
+void CSystem::SaveState(const char *fn, bool incremental) {
   FILE *f;
   int i;
-  unsigned int m;
-  unsigned int j;
-  int *mem = (int *)memory;
-  int int0 = 0;
-  unsigned int memints = (1 << iNumMemoryBits) / (unsigned int)sizeof(int);
+  u32 page;
+  u32 pages = 1 << (iNumMemoryBits - CODE_PAGE_SHIFT);
+  u32 page_size = 1 << CODE_PAGE_SHIFT;
   u32 temp_32;
+  u64 id;
+  u64 parent_id;
+  u64 *p;
+  u32 j;
+  u32 saved = 0;
+#if defined(HAVE_ZLIB)
+  Bytef *zbuf;
+  uLongf zlen;
+
+  CHECK_ALLOCATION(zbuf = (Bytef *)malloc(compressBound(page_size)));
+#endif
+
+  if (incremental && (!last_state_id || !strcmp(fn, last_state_file))) {
+    printf("%%SYS-W-NOPARENT: No parent for incremental state, saving all.\n");
+    incremental = false;
+  }
+
+  const char *parent = incremental ? last_state_file : "";
+  bool image = false;
+
+  // With memory mapped shared from a file, the file already holds memory. A
+  // full save just refers to it; memory is then mapped copy-on-write, so the
+  // file stays as saved while the system runs on.
+  u64 ident[3];
+  if (!incremental && mem_backing == MEM_BACKING_FILE &&
+      image_identity(mem_file, ident)) {
+    image = true;
+    parent = mem_file;
+  }
+
+  // An incremental state file can be based on the memory image too, when
+  // memory is mapped private from it; it records the image the same way.
+  if (incremental && last_state_id == STATE_PARENT_IMAGE &&
+      !image_identity(parent, ident)) {
+    printf("%%SYS-W-NOPARENT: Memory image %s is gone, saving all.\n", parent);
+    incremental = false;
+    parent = "";
+  }
+
+  char stored[256];
+  if (!parent_name(stored, sizeof(stored), fn, parent)) {
+    printf("%%SYS-W-NOPARENT: Path of %s is too long, saving all.\n", parent);
+    incremental = image = false;
+    parent = "";
+    stored[0] = '\0';
+  }
 
   f = fopen(fn, "wb");
   if (f) {
     temp_32 = 0xa1fae540; // MAGIC NUMBER (ALFAES40 ==> A1FAE540 )
     fwrite(&temp_32, sizeof(u32), 1, f);
-    temp_32 = 0x00020001; // File Format Version 2.1
+    temp_32 = STATE_VERSION_3_0;
+    fwrite(&temp_32, sizeof(u32), 1, f);
+    fwrite(&page_size, sizeof(u32), 1, f);
+    temp_32 = iNumMemoryBits;
+    fwrite(&temp_32, sizeof(u32), 1, f);
+    id = ((u64)time(NULL) << 32) ^ host_time_ns();
+    fwrite(&id, sizeof(u64), 1, f);
+    parent_id = image ? STATE_PARENT_IMAGE : (incremental ? last_state_id : 0);
+    fwrite(&parent_id, sizeof(u64), 1, f);
+    temp_32 = (u32)strlen(stored);
     fwrite(&temp_32, sizeof(u32), 1, f);
+    fwrite(stored, 1, temp_32, f);
+    if (parent_id == STATE_PARENT_IMAGE)
+      fwrite(ident, sizeof(u64), 3, f);
 
     // memory
-    for (m = 0; m < memints; m++) {
-      if (mem[m]) {
-        fwrite(&(mem[m]), 1, sizeof(int), f);
-      } else {
-        j = 0;
-        m++;
-        while (!mem[m] && (m < memints)) {
-          m++;
-          j++;
-          if ((int)j == -1)
-            break;
-        }
+    for (page = 0; page < pages && !image; page++) {
+      if (incremental && !dirty_pages[page])
+        continue;
+
+      p = (u64 *)((char *)memory + ((size_t)page << CODE_PAGE_SHIFT));
+      for (j = 0; j < page_size / 8 && !p[j]; j++)
+        ;
+
+      if (j == page_size / 8) {
+        // zero page; only needs saving if the parent may have data there
+        if (!incremental)
+          continue;
+        fwrite(&page, sizeof(u32), 1, f);
+        temp_32 = STATE_PAGE_ZERO;
+        fwrite(&temp_32, sizeof(u32), 1, f);
+        continue;
+      }
 
-        if (mem[m])
-          m--;
-        fwrite(&int0, 1, sizeof(int), f);
-        fwrite(&j, 1, sizeof(int), f);
+      fwrite(&page, sizeof(u32), 1, f);
+      saved++;
+#if defined(HAVE_ZLIB)
+      zlen = compressBound(page_size);
+      if (compress2(zbuf, &zlen, (Bytef *)p, page_size, Z_BEST_SPEED) ==
+              Z_OK &&
+          zlen < page_size) {
+        temp_32 = STATE_PAGE_ZLIB;
+        fwrite(&temp_32, sizeof(u32), 1, f);
+        temp_32 = (u32)zlen;
+        fwrite(&temp_32, sizeof(u32), 1, f);
+        fwrite(zbuf, 1, zlen, f);
+        continue;
       }
+#endif
+      temp_32 = STATE_PAGE_RAW;
+      fwrite(&temp_32, sizeof(u32), 1, f);
+      fwrite(&page_size, sizeof(u32), 1, f);
+      fwrite(p, 1, page_size, f);
+    }
+
+    temp_32 = STATE_PAGE_END;
+    fwrite(&temp_32, sizeof(u32), 1, f);
+
+    state.cpu_lock_flags = 0;
+    for (i = 0; i < 4; i++) {
+      u64 lock = cpu_lock_slot[i].load();
+      if (lock)
+        state.cpu_lock_flags |= (1 << i);
+      state.cpu_lock_address[i] = lock & ~CPU_LOCK_VALID;
     }
 
     fwrite(&state, sizeof(state), 1, f);
@@ -2167,7 +2848,203 @@ void CSystem::SaveState(const char *fn) {
     for (i = 0; i < iNumComponents; i++)
       acComponents[i]->SaveState(f);
     fclose(f);
+
+    printf("%%SYS-I-SAVED: %d memory pages saved to %s%s%s.\n", saved, fn,
+           *parent ? ", based on " : "", parent);
+    if (image)
+      remap_private();
+    clear_dirty(fn, id);
+  } else
+    printf("%%SYS-F-NOFILE: Can't create state file %s\n", fn);
+
+#if defined(HAVE_ZLIB)
+  free(zbuf);
+#endif
+}
+
+/**
+ * Remember the state file memory now matches, and start tracking writes
+ * to memory from here.
+ **/
+void CSystem::clear_dirty(const char *fn, u64 id) {
+  memset(dirty_pages, 0, (size_t)1 << (iNumMemoryBits - CODE_PAGE_SHIFT));
+  strncpy(last_state_file, fn, sizeof(last_state_file) - 1);
+  last_state_file[sizeof(last_state_file) - 1] = '\0';
+  last_state_id = id;
+}
+
+/**
+ * Restore memory from a version 2.1 state file (run-length encoded ints).
+ * A damaged file is fatal, as memory has been partly overwritten.
+ **/
+void CSystem::restore_memory_v2(FILE *f) {
+  unsigned int m;
+  unsigned int j;
+  int *mem = (int *)memory;
+  unsigned int memints = (1 << iNumMemoryBits) / (unsigned int)sizeof(int);
+
+  for (m = 0; m < memints; m++) {
+    if (fread(&(mem[m]), 1, sizeof(int), f) != sizeof(int))
+      FAILURE(Runtime, "State file is damaged; memory was partly restored");
+    if (!mem[m]) {
+      if (fread(&j, 1, sizeof(int), f) != sizeof(int) || j >= memints - m)
+        FAILURE(Runtime, "State file is damaged; memory was partly restored");
+      while (j--) {
+        mem[++m] = 0;
+      }
+    }
+  }
+}
+
+/**
+ * Restore memory from a version 3.0 state file, positioned just after the
+ * version number. The pages are read one at a time straight into memory.
+ * For an incremental state file, the parent's memory is restored first.
+ * If expect_id is non-zero, the file's id must match it.
+ *
+ * The headers of the whole chain of parents are checked before memory is
+ * touched; a failure after that is fatal, as memory would be left half
+ * restored.
+ *
+ * \return 0 on success, -1 on failure (memory unchanged).
+ **/
+int CSystem::restore_memory(FILE *f, const char *fn, int depth, u64 *id,
+                            u64 expect_id) {
+  u32 page_size;
+  u32 membits;
+  u64 parent_id;
+  u64 check_id;
+  u64 ident[3];
+  u64 check_ident[3];
+  u32 len;
+  u32 page;
+  u32 type;
+  u32 pages = 1 << (iNumMemoryBits - CODE_PAGE_SHIFT);
+  char parent[256];
+  char path[512];
+  char *p;
+  FILE *pf;
+  u32 temp_32;
+  int result;
+
+  if (fread(&page_size, sizeof(u32), 1, f) != 1 ||
+      fread(&membits, sizeof(u32), 1, f) != 1 ||
+      fread(id, sizeof(u64), 1, f) != 1 ||
+      fread(&parent_id, sizeof(u64), 1, f) != 1 ||
+      fread(&len, sizeof(u32), 1, f) != 1 || len >= sizeof(parent) ||
+      fread(parent, 1, len, f) != len) {
+    printf("%%SYS-F-FORMAT: State file %s is damaged.\n", fn);
+    return -1;
+  }
+
+  parent[len] = '\0';
+  parent_path(path, sizeof(path), fn, parent);
+
+  if (parent_id == STATE_PARENT_IMAGE &&
+      fread(ident, sizeof(u64), 3, f) != 3) {
+    printf("%%SYS-F-FORMAT: State file %s is damaged.\n", fn);
+    return -1;
+  }
+
+  if (page_size != (U64(0x1) << CODE_PAGE_SHIFT) ||
+      membits != iNumMemoryBits) {
+    printf("%%SYS-F-MEMORY: State file %s has a different memory size.\n", fn);
+    return -1;
+  }
+
+  if (expect_id && *id != expect_id) {
+    printf("%%SYS-F-PARENT: State file %s is not the expected parent.\n", fn);
+    return -1;
+  }
+
+  if (parent_id == STATE_PARENT_IMAGE) {
+    if (!image_identity(path, check_ident)) {
+      printf("%%SYS-F-NOFILE: Can't open memory image %s\n", path);
+      return -1;
+    }
+    if (memcmp(ident, check_ident, sizeof(ident))) {
+      printf("%%SYS-F-IMAGE: Memory image %s has changed since %s was "
+             "saved.\n",
+             path, fn);
+      return -1;
+    }
+    if (restore_image(path))
+      return -1;
+  } else if (parent_id) {
+    if (depth >= 64) {
+      printf("%%SYS-F-PARENT: Too many parents for state file %s.\n", fn);
+      return -1;
+    }
+
+    pf = fopen(path, "rb");
+    if (!pf) {
+      printf("%%SYS-F-NOFILE: Can't open parent state file %s\n", path);
+      return -1;
+    }
+
+    if (fread(&temp_32, sizeof(u32), 1, pf) != 1 || temp_32 != 0xa1fae540 ||
+        fread(&temp_32, sizeof(u32), 1, pf) != 1 ||
+        temp_32 != STATE_VERSION_3_0) {
+      printf("%%SYS-F-FORMAT: Parent %s is not a version 3.0 state file.\n",
+             path);
+      fclose(pf);
+      return -1;
+    }
+
+    result = restore_memory(pf, path, depth + 1, &check_id, parent_id);
+    fclose(pf);
+    if (result)
+      return -1;
+  } else
+    memset(memory, 0, (size_t)1 << iNumMemoryBits);
+
+  for (;;) {
+    if (fread(&page, sizeof(u32), 1, f) != 1)
+      break;
+    if (page == STATE_PAGE_END)
+      return 0;
+    if (page >= pages || fread(&type, sizeof(u32), 1, f) != 1)
+      break;
+
+    p = (char *)memory + ((size_t)page << CODE_PAGE_SHIFT);
+    if (type == STATE_PAGE_ZERO) {
+      memset(p, 0, page_size);
+      continue;
+    }
+
+    if (fread(&len, sizeof(u32), 1, f) != 1)
+      break;
+
+    if (type == STATE_PAGE_RAW) {
+      if (len != page_size || fread(p, 1, len, f) != len)
+        break;
+      continue;
+    }
+
+#if defined(HAVE_ZLIB)
+    if (type == STATE_PAGE_ZLIB) {
+      Bytef zbuf[(1 << CODE_PAGE_SHIFT) + 64];
+      uLongf zlen = page_size;
+
+      if (len > sizeof(zbuf) || fread(zbuf, 1, len, f) != len ||
+          uncompress((Bytef *)p, &zlen, zbuf, len) != Z_OK ||
+          zlen != page_size)
+        break;
+      continue;
+    }
+#else
+    if (type == STATE_PAGE_ZLIB)
+      FAILURE_1(Runtime,
+                "State file %s is compressed; no zlib support (memory was "
+                "partly restored)",
+                fn);
+#endif
+
+    break;
   }
+
+  FAILURE_1(Runtime, "State file %s is damaged; memory was partly restored",
+            fn);
 }
 
 /**
@@ -2176,11 +3053,8 @@ void CSystem::SaveState(const char *fn) {
 void CSystem::RestoreState(const char *fn) {
   FILE *f;
   int i;
-  unsigned int m;
-  unsigned int j;
-  int *mem = (int *)memory;
-  unsigned int memints = (1 << iNumMemoryBits) / (unsigned int)sizeof(int);
   u32 temp_32;
+  u64 id = 0;
 
   f = fopen(fn, "rb");
   if (!f) {
@@ -2192,30 +3066,44 @@ void CSystem::RestoreState(const char *fn) {
   if (temp_32 != 0xa1fae540) // MAGIC NUMBER (ALFAES40 ==> A1FAE540 )
   {
     printf("%%SYS-F-FORMAT: %s does not appear to be a state file.\n", fn);
+    fclose(f);
     return;
   }
 
   (void)!fread(&temp_32, sizeof(u32), 1, f);
 
-  if (temp_32 != 0x00020001) // File Format Version 2.1
-  {
+  // memory
+  if (temp_32 == STATE_VERSION_2_1)
+    restore_memory_v2(f);
+  else if (temp_32 == STATE_VERSION_3_0) {
+    if (restore_memory(f, fn, 0, &id, 0)) {
+      fclose(f);
+      return;
+    }
+  } else {
     printf("%%SYS-I-VERSION: State file %s is a different version.\n", fn);
+    fclose(f);
     return;
   }
 
-  // memory
-  for (m = 0; m < memints; m++) {
-    (void)!fread(&(mem[m]), 1, sizeof(int), f);
-    if (!mem[m]) {
-      (void)!fread(&j, 1, sizeof(int), f);
-      while (j--) {
-        mem[++m] = 0;
-      }
-    }
+  invalidate_code(0, U64(0x1) << iNumMemoryBits);
+
+  if (fread(&state, sizeof(state), 1, f) != 1)
+    FAILURE_1(Runtime, "State file %s is truncated after the memory pages", fn);
+
+  for (i = 0; i < CPU_LOCK_FILTER_SIZE; i++)
+    cpu_lock_filter[i] = 0;
+  pci_windows_update(0);
+  pci_windows_update(1);
+  for (i = 0; i < 4; i++) {
+    if (state.cpu_lock_flags & (1 << i)) {
+      cpu_lock_slot[i] = (state.cpu_lock_address[i] & CPU_LOCK_MASK) |
+                         CPU_LOCK_VALID;
+      cpu_lock_filter[CPU_LOCK_FILTER(state.cpu_lock_address[i])]++;
+    } else
+      cpu_lock_slot[i] = 0;
   }
 
-  (void)!fread(&state, sizeof(state), 1, f);
-
   // components
   //
   //  Components should also save any non-initial memory-registrations and
@@ -2227,6 +3115,14 @@ void CSystem::RestoreState(const char *fn) {
   }
 
   fclose(f);
+
+  // Only version 3.0 files can be the parent of an incremental state file.
+  if (id)
+    clear_dirty(fn, id);
+  else {
+    memset(dirty_pages, 1, (size_t)1 << (iNumMemoryBits - CODE_PAGE_SHIFT));
+    last_state_id = 0;
+  }
 }
 
 /**
@@ -2347,6 +3243,8 @@ void CSystem::panic(char *message, int flags) {
  *the interrupt.
  **/
 void CSystem::clear_clock_int(int ProcNum) {
+  SCOPED_FM_LOCK(cchip_mutex);
+
   state.cchip.misc &= ~(U64(0x10) << ProcNum);
   acCPUs[ProcNum]->irq_h(2, false, 0);
 }
@@ -35,6 +35,51 @@
 
 #define MAX_COMPONENTS 100
 
+/// Pages of memory tracked for writes to code (8 KB).
+#define CODE_PAGE_SHIFT 13
+/// Flag in CSystem::code_pages: page holds decoded instructions.
+#define CODE_PAGE_USED 0x80000000
+
+/// Address bits that must match for a store to break a LDx_L lock.
+#define CPU_LOCK_MASK U64(0x00000807ffffff00)
+/// Valid bit in a CSystem::cpu_lock_slot entry (addresses there are masked).
+#define CPU_LOCK_VALID U64(0x1)
+/// Number of counters in the lock filter (power of 2).
+#define CPU_LOCK_FILTER_SIZE 1024
+#define CPU_LOCK_FILTER(a) ((int)((a) >> 8) & (CPU_LOCK_FILTER_SIZE - 1))
+
+/// Number of entries in each Pchip's scatter-gather TLB (power of 2).
+#define DMA_TLB_SIZE 64
+#define DMA_TLB_INDEX(a) ((int)((a) >> 13) & (DMA_TLB_SIZE - 1))
+/// Tag of a TLB entry: PCI page number and window.
+#define DMA_TLB_TAG(a, w) ((((u64)(a) >> 13) << 2) | (w))
+/// TLB entry: system page << 24 | tag << 1 | valid.
+#define DMA_TLB_ENTRY(p, t) ((((p) >> 13) << 24) | ((t) << 1) | 1)
+#define DMA_TLB_ENTRY_TAG(e) (((e) >> 1) & 0x7fffff)
+#define DMA_TLB_ENTRY_PAGE(e) (((e) >> 24) << 13)
+
+/// State file format with run-length encoded memory.
+#define STATE_VERSION_2_1 0x00020001
+/// State file format with memory in (compressed) pages, see SaveState.
+#define STATE_VERSION_3_0 0x00030000
+/// Memory page types in a version 3.0 state file.
+#define STATE_PAGE_ZERO 0
+#define STATE_PAGE_RAW 1
+#define STATE_PAGE_ZLIB 2
+/// Marks the end of the memory pages in a version 3.0 state file.
+#define STATE_PAGE_END 0xffffffff
+/// Parent id of a state file whose memory is in a raw memory image file.
+#define STATE_PARENT_IMAGE U64(0xffffffffffffffff)
+
+/// How guest memory is allocated (sys0 memory.backing).
+#define MEM_BACKING_HEAP 0      /**< calloc (default) */
+#define MEM_BACKING_ANONYMOUS 1 /**< anonymous mmap */
+#define MEM_BACKING_FILE 2      /**< shared mmap of memory.file */
+#define MEM_BACKING_PRIVATE 3   /**< private (copy-on-write) mmap of memory.file */
+
+/// Interval timer frequency (1024 Hz, as set up by SRM in the TOY clock).
+#define TIMER_HZ 1024
+
 #if defined(PROFILE)
 #define PROFILE_FROM U64(0x8000)
 #define PROFILE_TO U64(0x1a81c0)
@@ -106,21 +151,33 @@ public:
   void DumpMemory(unsigned int filenum);
   char *PtrToMem(u64 address);
   unsigned int get_memory_bits();
+  u32 get_code_gen(u64 address);
+  u32 mark_code_page(u64 address);
+  void invalidate_code(u64 address, u64 length);
+  inline void mark_dirty(u64 address, u64 length);
+  void dma_written(u64 address, u64 length, CSystemComponent *source);
   void RestoreState(const char *fn);
-  void SaveState(const char *fn);
+  void SaveState(const char *fn, bool incremental = false);
   u64 PCI_Phys(int pcibus, u32 address);
   u64 PCI_Phys_direct_mapped(u32 address, u64 wsm, u64 tba);
-  u64 PCI_Phys_scatter_gather(u32 address, u64 wsm, u64 tba);
+  bool PCI_Phys_scatter_gather(u32 address, u64 wsm, u64 tba, u64 *phys);
+  void dma_tlb_flush(int pcibus);
+  void pci_windows_update(int pcibus);
+  u32 get_dma_map_gen(int pcibus);
   void interrupt(int number, bool assert);
   int LoadROM();
   u64 ReadMem(u64 address, int dsize, CSystemComponent *source);
   void WriteMem(u64 address, int dsize, u64 data, CSystemComponent *source);
+  u64 ReadMemFast(u64 address, int dsize, CSystemComponent *source);
+  void WriteMemFast(u64 address, int dsize, u64 data,
+                    CSystemComponent *source);
   void Run();
   int SingleStep();
 
   void init();
   void start_threads();
   void stop_threads();
+  void check_timer();
 
   int RegisterMemory(CSystemComponent *component, int index, u64 base,
                      u64 length);
@@ -152,6 +209,11 @@ public:
   void cpu_lock(int cpuid, u64 address);
   bool cpu_unlock(int cpuid);
   void cpu_break_lock(int cpuid, CSystemComponent *source);
+  void cpu_break_locks(u64 address, u64 length, CSystemComponent *source);
+  inline bool cpu_lock_held(u64 address);
+
+  bool cpu_idle_begin();
+  void cpu_idle_end(CAlphaCPU *cpu);
 
 private:
   u64 cchip_csr_read(u32 address, CSystemComponent *source);
@@ -164,11 +226,61 @@ private:
   void tig_write(u32 address, u8 data);
 
   int iNumCPUs;
-  CFastMutex *cpu_lock_mutex;
+
+  void run_timer();
+  std::unique_ptr<std::thread> timerThread;
+  std::atomic_bool StopTimer{false};
+
+  /// Host time the interval timer was started, and ticks fired since then.
+  u64 timer_start;
+  u64 timer_ticks;
+
+  /// Protects state.cchip, which is changed by both CPU and device threads.
+  CFastMutex *cchip_mutex;
+
+  /// Per-CPU LDx_L lock: masked address | CPU_LOCK_VALID, or 0 when clear.
+  std::atomic<u64> cpu_lock_slot[4];
+
+  /// Number of CPUs holding a lock on a line hashing to each counter. A
+  /// store only has to look at cpu_lock_slot if its counter is non-zero.
+  std::atomic<int> cpu_lock_filter[CPU_LOCK_FILTER_SIZE];
+
+  /// Number of CPUs sleeping in (or about to sleep in) an idle loop.
+  std::atomic<int> idle_cpus{0};
+
+  /// Enabled DMA windows of a Pchip, in window order, precomputed from
+  /// WSBA/WSM/TBA/PCTL by pci_windows_update whenever those are written.
+  struct SPCIWindow {
+    int num;   ///< Window number (part of the TLB tag)
+    u32 base;  ///< WSBA<31:20>
+    u32 match; ///< Address bits that must equal base (~WSM<31:20>)
+    bool sg;   ///< Scatter-gather window
+    u64 wsm;
+    u64 tba;
+  };
+  struct SPCIWindows {
+    int count;
+    bool hole; ///< PCTL<HOLE>: 512K..1M-1 is never matched
+    SPCIWindow window[4];
+  } pci_windows[2];
+
+  /// Sequence count of pci_windows, odd while pci_windows_update rewrites a
+  /// table. DMA threads copy the table and retry if it changed meanwhile.
+  std::atomic<u32> pci_windows_seq[2];
+
+  /// Scatter-gather translations per Pchip and window, so DMA doesn't read
+  /// a PTE from memory for every access. Emptied on TLBIA/TLBIV and by
+  /// pci_windows_update.
+  std::atomic<u64> dma_tlb[2][DMA_TLB_SIZE];
+
+  /// Incremented whenever the DMA address translation of a Pchip may have
+  /// changed (dma_tlb_flush), so devices can cache translated addresses.
+  std::atomic<u32> dma_map_gen[2];
 
   /// The state structure contains all elements that need to be saved to the
   /// statefile.
   struct SSys_state {
+    /// Copy of cpu_lock_slot, only kept up to date when saving state.
     int cpu_lock_flags;
     u64 cpu_lock_address[4];
 
@@ -363,6 +475,38 @@ private:
   } state;
   void *memory;
 
+  /// One entry per 8 KB page of memory. Bit 31 is set while a CPU holds
+  /// decoded instructions from the page; the other bits are a generation
+  /// number that is incremented when such a page is written to. Marking a
+  /// page and writing to it are ordered with full fences: either the writer
+  /// sees the mark and bumps the generation, or the reader sees the write.
+  std::atomic<u32> *code_pages;
+
+  /// One byte per 8 KB page of memory, non-zero when the page was written to
+  /// since the last state file was saved or restored.
+  u8 *dirty_pages;
+
+  /// The last state file saved or restored, the parent for incremental saves.
+  char last_state_file[256];
+  u64 last_state_id;
+
+  /// Guest memory allocation (MEM_BACKING_*), and the memory image file.
+  int mem_backing;
+  char mem_file[256];
+  int mem_fd;
+  bool mem_hugepages;
+
+  void alloc_memory();
+  void free_memory();
+  void remap_private();
+  int restore_image(const char *fn);
+  bool image_identity(const char *fn, u64 *ident);
+
+  void restore_memory_v2(FILE *f);
+  int restore_memory(FILE *f, const char *fn, int depth, u64 *id,
+                     u64 expect_id);
+  void clear_dirty(const char *fn, u64 id);
+
   //    void * memmap;
   int iNumComponents;
   CSystemComponent *acComponents[MAX_COMPONENTS];
@@ -380,15 +524,145 @@ private:
 #endif
 };
 
+/**
+ * Get the DMA translation generation of a Pchip. PCI addresses translated
+ * by PCI_Phys stay valid as long as this doesn't change.
+ **/
+inline u32 CSystem::get_dma_map_gen(int pcibus) {
+  return dma_map_gen[pcibus].load(std::memory_order_acquire);
+}
+
+/**
+ * Get the code generation of the page that contains a memory address.
+ * Decoded instructions from that page are valid as long as this doesn't
+ * change.
+ **/
+inline u32 CSystem::get_code_gen(u64 address) {
+  return code_pages[address >> CODE_PAGE_SHIFT].load(std::memory_order_acquire);
+}
+
+/**
+ * Mark the page that contains a memory address as holding decoded
+ * instructions, so writes to it will invalidate them. Returns the code
+ * generation to compare against later.
+ **/
+inline u32 CSystem::mark_code_page(u64 address) {
+  u32 gen = code_pages[address >> CODE_PAGE_SHIFT].fetch_or(
+                CODE_PAGE_USED, std::memory_order_relaxed) |
+            CODE_PAGE_USED;
+
+  // Pairs with the fence in WriteMem/WriteMemFast: instructions read after
+  // this see any store that didn't see the mark.
+  std::atomic_thread_fence(std::memory_order_seq_cst);
+  return gen;
+}
+
+/**
+ * Record that a range of memory was written to, for incremental state files.
+ **/
+inline void CSystem::mark_dirty(u64 address, u64 length) {
+  if (!length || (address >> iNumMemoryBits))
+    return;
+
+  u64 last = address + length - 1;
+  if (last >> iNumMemoryBits)
+    last = (U64(0x1) << iNumMemoryBits) - 1;
+  memset(&dirty_pages[address >> CODE_PAGE_SHIFT], 1,
+         (size_t)((last >> CODE_PAGE_SHIFT) - (address >> CODE_PAGE_SHIFT) + 1));
+}
+
+/**
+ * Check whether any CPU might hold a LDx_L lock on the line containing an
+ * address. False positives are possible, false negatives are not.
+ **/
+inline bool CSystem::cpu_lock_held(u64 address) {
+  return cpu_lock_filter[CPU_LOCK_FILTER(address)].load(
+             std::memory_order_acquire) != 0;
+}
+
+/**
+ * \brief Read 8, 4, 2 or 1 byte(s) from a 64-bit system address.
+ *
+ * Naturally aligned reads from main memory are done here with a single host
+ * load; everything else is left to ReadMem.
+ **/
+inline u64 CSystem::ReadMemFast(u64 address, int dsize,
+                                CSystemComponent *source) {
+  if (!(address >> iNumMemoryBits) && !(address & ((dsize >> 3) - 1))) {
+    u8 *p = (u8 *)memory + address;
+
+    switch (dsize) {
+    case 8:
+      return *((u8 *)p);
+    case 16:
+      return endian_16(*((u16 *)p));
+    case 32:
+      return endian_32(*((u32 *)p));
+    default:
+      return endian_64(*((u64 *)p));
+    }
+  }
+
+  return ReadMem(address, dsize, source);
+}
+
+/**
+ * \brief Write 8, 4, 2 or 1 byte(s) to a 64-bit system address.
+ *
+ * Naturally aligned writes to main memory are done here with a single host
+ * store; everything else is left to WriteMem. LDx_L locks and decoded
+ * instructions on the line are only looked for after the store, so a lock
+ * taken or a page marked while the store was in flight is still seen.
+ *
+ * Only CPUs call this. With a single CPU, locks and code pages are only
+ * set by the thread doing the store, so the fence that orders the store
+ * against the other CPUs' cpu_lock and mark_code_page is left out.
+ **/
+inline void CSystem::WriteMemFast(u64 address, int dsize, u64 data,
+                                  CSystemComponent *source) {
+  if (!(address >> iNumMemoryBits) && !(address & ((dsize >> 3) - 1))) {
+    u8 *p = (u8 *)memory + address;
+
+    dirty_pages[address >> CODE_PAGE_SHIFT] = 1;
+    switch (dsize) {
+    case 8:
+      *((u8 *)p) = (u8)data;
+      break;
+    case 16:
+      *((u16 *)p) = endian_16((u16)data);
+      break;
+    case 32:
+      *((u32 *)p) = endian_32((u32)data);
+      break;
+    default:
+      *((u64 *)p) = endian_64((u64)data);
+    }
+
+    if (iNumCPUs > 1)
+      std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (cpu_lock_held(address))
+      cpu_break_locks(address, dsize / 8, source);
+    if (code_pages[address >> CODE_PAGE_SHIFT].load(
+            std::memory_order_relaxed) &
+        CODE_PAGE_USED)
+      invalidate_code(address, dsize / 8);
+    return;
+  }
+
+  WriteMem(address, dsize, data, source);
+}
+
 inline u64 CSystem::get_c_misc() { return state.cchip.misc; }
 
 inline u64 CSystem::get_c_dir(int ProcNum) {
+  SCOPED_FM_LOCK(cchip_mutex);
   return state.cchip.drir & state.cchip.dim[ProcNum];
 }
 
 inline u64 CSystem::get_c_dim(int ProcNum) { return state.cchip.dim[ProcNum]; }
 
 inline void CSystem::set_c_dim(int ProcNum, u64 value) {
+  SCOPED_FM_LOCK(cchip_mutex);
   state.cchip.dim[ProcNum] = value;
 }
 
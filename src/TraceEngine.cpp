@@ -758,7 +758,7 @@ int CTraceEngine::parse(char command[100][100]) {
              "    \n");
       printf("  LOAD [ STATE | DPR | FLASH | CSV ] <file>                      "
              "    \n");
-      printf("  SAVE [ STATE | DPR | FLASH ] <file>                            "
+      printf("  SAVE [ STATE | INCREMENTAL | DPR | FLASH ] <file>              "
              "    \n");
       printf("  JUMP <hex address>                                             "
              "    \n");
@@ -1367,6 +1367,11 @@ int CTraceEngine::parse(char command[100][100]) {
         return 0;
       }
 
+      if (!strncasecmp(command[1], "INCREMENTAL", strlen(command[1]))) {
+        theSystem->SaveState(command[2], true);
+        return 0;
+      }
+
       if (!strncasecmp(command[1], "DPR", strlen(command[1]))) {
         theDPR->SaveStateF(command[2]);
         return 0;
@@ -419,7 +419,7 @@ inline u64 fsqrt64(u64 asig, s32 exp) {
 #define DISP_21 (sext_u64_21(ins))
 
 #define DATA_PHYS_NT(addr, flags)                                              \
-  if (virt2phys(addr, &phys_address, flags, NULL, ins))                        \
+  if (virt2phys_data(addr, &phys_address, flags, ins))                         \
     return;
 
 #define ALIGN_PHYS(a) (phys_address & ~((u64)((a)-1)))
@@ -480,7 +480,7 @@ inline u64 fsqrt64(u64 asig, s32 exp) {
       dest |= (cSystem->ReadMem(phys_address, 8, this) << (ii * 8));           \
     }                                                                          \
   } else {                                                                     \
-    dest = cSystem->ReadMem(phys_address, size, this);                         \
+    dest = cSystem->ReadMemFast(phys_address, size, this);                     \
   }
 
 #define READ_VIRT_LOCK(va, size, dest)                                         \
@@ -495,7 +495,7 @@ inline u64 fsqrt64(u64 asig, s32 exp) {
       dest |= (cSystem->ReadMem(phys_address, 8, this) << (ii * 8));           \
     }                                                                          \
   } else {                                                                     \
-    dest = cSystem->ReadMem(phys_address, size, this);                         \
+    dest = cSystem->ReadMemFast(phys_address, size, this);                     \
   }
 
 #define READ_VIRT_F(va, size, dest, f)                                         \
@@ -510,7 +510,7 @@ inline u64 fsqrt64(u64 asig, s32 exp) {
     }                                                                          \
     dest = f(aa);                                                              \
   } else {                                                                     \
-    dest = f(cSystem->ReadMem(phys_address, size, this));                      \
+    dest = f(cSystem->ReadMemFast(phys_address, size, this));                  \
   }
 
 #define READ_VIRT_LOCK_F(va, size, dest, f)                                    \
@@ -526,7 +526,7 @@ inline u64 fsqrt64(u64 asig, s32 exp) {
     }                                                                          \
     dest = f(aa);                                                              \
   } else {                                                                     \
-    dest = f(cSystem->ReadMem(phys_address, size, this));                      \
+    dest = f(cSystem->ReadMemFast(phys_address, size, this));                  \
   }
 
 /**
@@ -551,7 +551,7 @@ inline u64 fsqrt64(u64 asig, s32 exp) {
       aa >>= 8;                                                                \
     }                                                                          \
   } else {                                                                     \
-    cSystem->WriteMem(phys_address, size, src, this);                          \
+    cSystem->WriteMemFast(phys_address, size, src, this);                      \
   }
 
 /**
@@ -252,14 +252,17 @@
 #define DO_IMPLVER state.r[REG_3] = CPU_IMPLVER;
 
 #define DO_RPCC                                                                \
+  sync_cc();                                                                   \
   state.r[REG_1] = ((u64)state.cc_offset) << 32 | (state.cc & U64(0xffffffff));
 
-// The following ops have no function right now (at least, not until multiple
-// CPU's are supported).
+// Memory barriers order this CPU's memory accesses against those of the
+// other CPU threads.
+#define DO_MB std::atomic_thread_fence(std::memory_order_seq_cst);
+#define DO_WMB std::atomic_thread_fence(std::memory_order_release);
+
+// The following ops have no function right now.
 #define DO_TRAPB ;
 #define DO_EXCB ;
-#define DO_MB ;
-#define DO_WMB ;
 #define DO_FETCH ;
 #define DO_FETCH_M ;
 #define DO_ECB ;
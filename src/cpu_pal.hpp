@@ -112,6 +112,7 @@
       break;                                                                   \
                                                                                \
     case 0xc0: /* CC */                                                        \
+      sync_cc();                                                               \
       state.r[REG_1] =                                                         \
           (((u64)state.cc_offset) << 32) | (state.cc & U64(0xffffffff));       \
       break;                                                                   \
@@ -258,6 +259,7 @@
     case 0x28: /* M_CTL */                                                     \
       state.smc = (int)(state.r[REG_2] >> 4) & 3;                              \
       state.m_ctl_spe = (int)(state.r[REG_2] >> 1) & 7;                        \
+      ftb_flush();                                                             \
       break;                                                                   \
                                                                                \
     case 0x29: /* DC_CTL */                                                    \
@@ -299,6 +301,7 @@
     case 0xc1: /* CC_CTL */                                                    \
       state.cc_ena = (state.r[REG_2] >> 32) & 1;                               \
       state.cc = (u32)(state.r[REG_2] & U64(0xfffffff0));                      \
+      set_cc_base();                                                           \
       break;                                                                   \
                                                                                \
     case 0xc4: /* VA_CTL */                                                    \
@@ -676,7 +676,7 @@ int main_cfg(int argc, char *argv[]) {
   card_q.setExplanation("Choose what PCI card you'd like to add. Choose none "
                         "if you have no more cards to add.");
   card_q.addAnswer("none", "", "No more cards to add");
-#if defined(HAVE_PCAP)
+#if defined(HAVE_NETWORK)
   card_q.addAnswer("nic", "dec21143", "DEC 21143 Network Interface (1 max)");
 #endif
   card_q.addAnswer("scsi", "sym53c810",
@@ -720,36 +720,81 @@ int main_cfg(int argc, char *argv[]) {
        */
       card_q.dropChoice("nic");
 
+#if defined(HAVE_NETWORK)
+      MultipleChoiceQuestion be_q;
+      be_q.setQuestion("How should the NIC connect to the host?");
+      be_q.setExplanation(
+          "pcap captures on a host adapter; tap uses a Linux TAP interface, "
+          "usually on a bridge; vswitch connects to other emulated NICs on "
+          "this host through a switch in shared memory.");
 #if defined(HAVE_PCAP)
-      MultipleChoiceQuestion if_q;
-      if_q.setQuestion("What host network interface should we connect to "
-                       "(answer ? for a list)?");
-      if_q.setExplanation("Choose 'list' to get a list at run-time.");
-      if_q.addAnswer("list", "", "Get a list at run-time");
-
-      /* Get a list of network interfaces and
-       * add them to the list.
-       */
-      pcap_if_t *alldevs;
-      pcap_if_t *d;
-      char errbuf[PCAP_ERRBUF_SIZE];
-
-      if (pcap_findalldevs(&alldevs, errbuf) == -1) {
-        /* No devices to add.
+      be_q.addAnswer("pcap", "pcap", "Capture on a host adapter (libpcap)");
+#endif
+#if defined(HAVE_TAP)
+      be_q.addAnswer("tap", "tap", "Linux TAP interface");
+#endif
+#if defined(HAVE_VSWITCH)
+      be_q.addAnswer("vswitch", "vswitch", "Virtual switch between emulators");
+#endif
+#if defined(HAVE_PCAP)
+      be_q.setDefault("pcap");
+#elif defined(HAVE_TAP)
+      be_q.setDefault("tap");
+#else
+      be_q.setDefault("vswitch");
+#endif
+      string backend = be_q.ask();
+
+      if (backend == "tap") {
+        FreeTextQuestion tap_q;
+        tap_q.setQuestion("What TAP interface should we connect to?");
+        tap_q.setExplanation("Create it first with 'ip tuntap add mode tap "
+                             "user <you>' and add it to a bridge.");
+        tap_q.setDefault("tap0");
+        os << "    backend = \"tap\";\n";
+        os << "    adapter = \"" << tap_q.ask() << "\";\n";
+      } else if (backend == "vswitch") {
+        FreeTextQuestion sw_q;
+        sw_q.setQuestion("What is the name of the switch?");
+        sw_q.setExplanation("All emulators that use the same name are "
+                            "connected to each other.");
+        sw_q.setDefault("axpbox");
+        os << "    backend = \"vswitch\";\n";
+        os << "    switch = \"" << sw_q.ask() << "\";\n";
+      }
+#if defined(HAVE_PCAP)
+      else {
+        MultipleChoiceQuestion if_q;
+        if_q.setQuestion("What host network interface should we connect to "
+                         "(answer ? for a list)?");
+        if_q.setExplanation("Choose 'list' to get a list at run-time.");
+        if_q.addAnswer("list", "", "Get a list at run-time");
+
+        /* Get a list of network interfaces and
+         * add them to the list.
          */
-        printf("Error in pcap_findalldevs_ex: %s", errbuf);
-      } else {
-        int i = 1;
-        for (d = alldevs; d; d = d->next) {
-          // if_q.addAnswer(i2s(i),d->name, string(d->name) + "(" +
-          // string(d->description) + ")");
-          if_q.addAnswer(i2s(i), d->name, d->name);
-          i++;
+        pcap_if_t *alldevs;
+        pcap_if_t *d;
+        char errbuf[PCAP_ERRBUF_SIZE];
+
+        if (pcap_findalldevs(&alldevs, errbuf) == -1) {
+          /* No devices to add.
+           */
+          printf("Error in pcap_findalldevs_ex: %s", errbuf);
+        } else {
+          int i = 1;
+          for (d = alldevs; d; d = d->next) {
+            // if_q.addAnswer(i2s(i),d->name, string(d->name) + "(" +
+            // string(d->description) + ")");
+            if_q.addAnswer(i2s(i), d->name, d->name);
+            i++;
+          }
         }
-      }
 
-      if (if_q.ask() != "")
-        os << "    adapter = \"" << if_q.getAnswer() << "\";\n";
+        if (if_q.ask() != "")
+          os << "    adapter = \"" << if_q.getAnswer() << "\";\n";
+      }
+#endif
 
       FreeTextQuestion mac_q;
       mac_q.setQuestion("What should the NIC's MAC address be?");
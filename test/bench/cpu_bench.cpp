@@ -0,0 +1,137 @@
+/* AXPbox Alpha Emulator
+ * Website: https://github.com/lenticularis39/axpbox
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301,
+ * USA.
+ */
+
+/**
+ * \file
+ * CPU benchmark: runs a small piece of Alpha code in PALmode, without any
+ * firmware, and reports the time per instruction.
+ *
+ * - fetch:  with the instruction cache enabled, a chain of branches that
+ *           visits 64 instruction cache lines in turn, so every fetch has to
+ *           look its line up (CAlphaCPU::get_icache).
+ * - memory: with the block cache, a loop of quadword loads and stores to
+ *           main memory (READ_VIRT/WRITE_VIRT through the SROM's DTB entry).
+ *
+ * Usage: cpu_bench fetch|memory [instructions]
+ **/
+
+#include "StdAfx.hpp"
+#include "AlphaCPU.hpp"
+#include "Configurator.hpp"
+#include "System.hpp"
+
+#include <chrono>
+
+#define CODE 0x10000
+#define DATA 0x100000
+#define LINES 64
+#define LINE_BYTES 2048
+
+static char config_fetch[] = "sys0 = tsunami\n"
+                             "{\n"
+                             "  memory.bits = 24;\n"
+                             "  cpu0 = ev68cb\n"
+                             "  {\n"
+                             "    icache = true;\n"
+                             "    idle_detect = false;\n"
+                             "  }\n"
+                             "}\n";
+
+static char config_memory[] = "sys0 = tsunami\n"
+                              "{\n"
+                              "  memory.bits = 24;\n"
+                              "  cpu0 = ev68cb\n"
+                              "  {\n"
+                              "    idle_detect = false;\n"
+                              "  }\n"
+                              "}\n";
+
+static u32 br(u64 from, u64 to) {
+  return (0x30 << 26) | (31 << 21) | (u32)(((to - from - 4) >> 2) & 0x1fffff);
+}
+
+static u32 mem(u32 op, int ra, int rb, int disp) {
+  return (op << 26) | (ra << 21) | (rb << 16) | (disp & 0xffff);
+}
+
+static u32 addq_lit(int ra, int lit, int rc) {
+  return (0x10 << 26) | (ra << 21) | (lit << 13) | (1 << 12) | (0x20 << 5) |
+         rc;
+}
+
+static void put(u64 a, u32 ins) { theSystem->WriteMem(a, 32, ins, nullptr); }
+
+int main(int argc, char *argv[]) {
+  bool fetch = argc > 1 && !strcmp(argv[1], "fetch");
+  u64 n = argc > 2 ? strtoull(argv[2], nullptr, 0) : 100000000;
+  u64 done = 0;
+
+  if (argc < 2 || (!fetch && strcmp(argv[1], "memory"))) {
+    printf("Usage: cpu_bench fetch|memory [instructions]\n");
+    return 1;
+  }
+
+  try {
+    if (fetch)
+      new CConfigurator(0, 0, 0, config_fetch, sizeof(config_fetch) - 1);
+    else
+      new CConfigurator(0, 0, 0, config_memory, sizeof(config_memory) - 1);
+    CAlphaCPU *cpu = theSystem->get_cpu(0);
+
+    if (fetch) {
+      for (int i = 0; i < LINES; i++)
+        put(CODE + i * LINE_BYTES,
+            br(CODE + i * LINE_BYTES, CODE + ((i + 1) % LINES) * LINE_BYTES));
+    } else {
+      // Increment 8 quadwords, then branch back.
+      u64 a = CODE;
+      for (int i = 0; i < 8; i++) {
+        put(a, mem(0x29, 3, 2, i * 8)); // LDQ r3, i*8(r2)
+        put(a + 4, addq_lit(3, 1, 3));  // ADDQ r3, 1, r3
+        put(a + 8, mem(0x2d, 3, 2, i * 8)); // STQ r3, i*8(r2)
+        a += 12;
+      }
+      put(a, br(a, CODE));
+      cpu->set_r(2, DATA);
+    }
+    cpu->set_pc(CODE + 1); // PALmode
+
+    auto start = std::chrono::steady_clock::now();
+    if (fetch) {
+      for (; done < n; done++)
+        cpu->execute();
+    } else {
+      for (; done < n; done += 25)
+        cpu->execute_block();
+    }
+    std::chrono::duration<double, std::nano> t =
+        std::chrono::steady_clock::now() - start;
+
+    if (!fetch && theSystem->ReadMem(DATA, 64, nullptr) != done / 25) {
+      printf("Memory loop didn't run as expected.\n");
+      return 1;
+    }
+    printf("\n%s, %" PRId64 " instructions: %.2f ns/instruction\n", argv[1],
+           done, t.count() / done);
+  } catch (CException &e) {
+    printf("%s\n", e.displayText().c_str());
+    return 1;
+  }
+  return 0;
+}
@@ -0,0 +1,122 @@
+/* AXPbox Alpha Emulator
+ * Website: https://github.com/lenticularis39/axpbox
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301,
+ * USA.
+ */
+
+/**
+ * \file
+ * PCI DMA address translation benchmark: the time CSystem::PCI_Phys takes
+ * through a direct-mapped and a scatter-gather window, and through the
+ * direct-mapped window while another thread keeps rewriting the Pchip's
+ * window registers.
+ *
+ * Usage: dma_bench [translations]
+ **/
+
+#include "StdAfx.hpp"
+#include "Configurator.hpp"
+#include "System.hpp"
+
+#include <atomic>
+#include <chrono>
+#include <thread>
+
+#define PCHIP0_CSR U64(0x0000080180000000)
+#define DIRECT_BASE 0x40000000
+#define SG_BASE 0x00800000
+#define SG_PTES 0x00100000
+#define SG_PAGES 0x00200000
+
+static char config[] = "sys0 = tsunami\n"
+                       "{\n"
+                       "  memory.bits = 24;\n"
+                       "  cpu0 = ev68cb\n"
+                       "  {\n"
+                       "  }\n"
+                       "}\n";
+
+static void pchip_write(u32 csr, u64 data) {
+  theSystem->WriteMem(PCHIP0_CSR + csr, 64, data, nullptr);
+}
+
+/**
+ * Time translations of addresses spread over 8 MB from base; returns
+ * nanoseconds per translation.
+ **/
+static double bench(u32 base, u64 n) {
+  u64 sum = 0;
+  auto start = std::chrono::steady_clock::now();
+
+  for (u64 i = 0; i < n; i++)
+    sum += theSystem->PCI_Phys(0, base + (u32)((i * 64) & 0x7fffff));
+
+  std::chrono::duration<double, std::nano> t =
+      std::chrono::steady_clock::now() - start;
+  if (sum == 1)
+    printf(" ");
+  return t.count() / n;
+}
+
+int main(int argc, char *argv[]) {
+  u64 n = argc > 1 ? strtoull(argv[1], nullptr, 0) : 50000000;
+
+  try {
+    new CConfigurator(0, 0, 0, config, sizeof(config) - 1);
+
+    // Window 0: 1 GB direct-mapped at 1 GB. Window 1: 8 MB scatter-gather
+    // at 8 MB, page i mapped to SG_PAGES + i * 8K.
+    pchip_write(0x100, 0x3ff00000);
+    pchip_write(0x200, 0);
+    pchip_write(0x000, DIRECT_BASE | 1);
+    for (u64 i = 0; i < 1024; i++)
+      theSystem->WriteMem(SG_PTES + i * 8, 64,
+                          (((SG_PAGES + i * 8192) >> 13) << 1) | 1, nullptr);
+    pchip_write(0x140, 0x00700000);
+    pchip_write(0x240, SG_PTES);
+    pchip_write(0x040, SG_BASE | 3);
+
+    if (theSystem->PCI_Phys(0, SG_BASE + 0x2010) != SG_PAGES + 0x2010 ||
+        theSystem->PCI_Phys(0, DIRECT_BASE + 0x1234) != 0x1234) {
+      printf("Windows not set up as expected.\n");
+      return 1;
+    }
+
+    double direct = bench(DIRECT_BASE, n);
+    double sg = bench(SG_BASE, n);
+
+    std::atomic<bool> stop(false);
+    std::atomic<u64> updates(0);
+    std::thread writer([&]() {
+      while (!stop.load(std::memory_order_relaxed)) {
+        pchip_write(0x140, 0x00700000);
+        updates.fetch_add(1, std::memory_order_relaxed);
+      }
+    });
+    double busy = bench(DIRECT_BASE, n);
+    stop = true;
+    writer.join();
+
+    printf("\nPCI_Phys, %" PRId64 " translations: direct-mapped %.2f ns, "
+           "scatter-gather %.2f ns, direct-mapped during %" PRId64
+           " window updates %.2f ns\n",
+           n, direct, sg, updates.load(), busy);
+  } catch (CException &e) {
+    printf("%s\n", e.displayText().c_str());
+    return 1;
+  }
+  return 0;
+}
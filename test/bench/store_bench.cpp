@@ -0,0 +1,85 @@
+/* AXPbox Alpha Emulator
+ * Website: https://github.com/lenticularis39/axpbox
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301,
+ * USA.
+ */
+
+/**
+ * \file
+ * Guest store benchmark: the time CSystem::WriteMemFast takes for aligned
+ * quadword stores to main memory.
+ *
+ * Usage: store_bench [cpus [stores]]
+ **/
+
+#include "StdAfx.hpp"
+#include "Configurator.hpp"
+#include "System.hpp"
+
+#include <chrono>
+
+static char config1[] = "sys0 = tsunami\n"
+                        "{\n"
+                        "  memory.bits = 24;\n"
+                        "  cpu0 = ev68cb\n"
+                        "  {\n"
+                        "  }\n"
+                        "}\n";
+
+static char config2[] = "sys0 = tsunami\n"
+                        "{\n"
+                        "  memory.bits = 24;\n"
+                        "  cpu0 = ev68cb\n"
+                        "  {\n"
+                        "  }\n"
+                        "  cpu1 = ev68cb\n"
+                        "  {\n"
+                        "  }\n"
+                        "}\n";
+
+/**
+ * Time stores to a 1 MB region; returns nanoseconds per store.
+ **/
+static double bench(u64 stores) {
+  auto start = std::chrono::steady_clock::now();
+
+  for (u64 i = 0; i < stores; i++)
+    theSystem->WriteMemFast((i * 8) & 0xfffff, 64, i, nullptr);
+
+  std::chrono::duration<double, std::nano> t =
+      std::chrono::steady_clock::now() - start;
+  return t.count() / stores;
+}
+
+int main(int argc, char *argv[]) {
+  int cpus = argc > 1 ? atoi(argv[1]) : 1;
+  u64 stores = argc > 2 ? strtoull(argv[2], nullptr, 0) : 100000000;
+
+  try {
+    if (cpus > 1)
+      new CConfigurator(0, 0, 0, config2, sizeof(config2) - 1);
+    else
+      new CConfigurator(0, 0, 0, config1, sizeof(config1) - 1);
+
+    double t = bench(stores);
+    printf("\nWriteMemFast, %d CPU(s), %" PRId64 " stores: %.2f ns/store\n",
+           theSystem->get_cpu_num(), stores, t);
+  } catch (CException &e) {
+    printf("%s\n", e.displayText().c_str());
+    return 1;
+  }
+  return 0;
+}
@@ -0,0 +1,90 @@
+/* AXPbox Alpha Emulator
+ * Website: https://github.com/lenticularis39/axpbox
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301,
+ * USA.
+ */
+
+/**
+ * \file
+ * Ethernet CRC-32: the check value, and every length from 0 to 1599 bytes
+ * at every alignment from 0 to 7 against a bitwise reference, with both the
+ * slicing-by-8 and (where the host has it) the PCLMULQDQ method.
+ **/
+
+#include "StdAfx.hpp"
+#include "Ethernet.hpp"
+
+#define MAX_LEN 1600
+
+static int failures = 0;
+
+/**
+ * Bitwise CRC-32 (reflected, polynomial 0x04C11DB7).
+ **/
+static u32 crc32_bitwise(const u8 *buf, int len) {
+  u32 crc = 0xFFFFFFFF;
+
+  for (int i = 0; i < len; i++) {
+    crc ^= buf[i];
+    for (int b = 0; b < 8; b++)
+      crc = (crc >> 1) ^ (0xEDB88320 & (0 - (crc & 1)));
+  }
+  return crc ^ 0xFFFFFFFF;
+}
+
+static void check(const char *method) {
+  static u8 buf[MAX_LEN + 8];
+
+  if (eth_crc32(0, "123456789", 9) != 0xCBF43926) {
+    printf("FAIL: %s: CRC of \"123456789\" is %08x\n", method,
+           eth_crc32(0, "123456789", 9));
+    failures++;
+  }
+
+  for (int i = 0; i < MAX_LEN + 8; i++)
+    buf[i] = (u8)(i * 131 + (i >> 7));
+
+  for (int align = 0; align < 8; align++) {
+    for (int len = 0; len < MAX_LEN; len++) {
+      u32 expect = crc32_bitwise(buf + align, len);
+      u32 got = eth_crc32(0, buf + align, len);
+
+      if (got != expect) {
+        printf("FAIL: %s: length %d at alignment %d: %08x, expected %08x\n",
+               method, len, align, got, expect);
+        failures++;
+      }
+    }
+  }
+}
+
+int main(int argc, char *argv[]) {
+  eth_crc32_clmul(false);
+  check("slicing-by-8");
+
+  if (eth_crc32_clmul(true))
+    check("PCLMULQDQ");
+  else
+    printf("PCLMULQDQ not available, not checked.\n");
+
+  if (failures) {
+    printf("%d CRC test(s) failed.\n", failures);
+    return 1;
+  }
+
+  printf("CRC tests passed.\n");
+  return 0;
+}
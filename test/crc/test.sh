@@ -0,0 +1,8 @@
+#!/bin/bash
+
+# Checks the ethernet CRC against a bitwise reference.
+if [[ -f ../../../build/crc_test ]]; then
+  ../../../build/crc_test
+else # Travis
+  ../../build/crc_test
+fi
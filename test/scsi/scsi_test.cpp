@@ -0,0 +1,295 @@
+/* AXPbox Alpha Emulator
+ * Website: https://github.com/lenticularis39/axpbox
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301,
+ * USA.
+ */
+
+/**
+ * \file
+ * Tagged command queueing on a SCSI disk with disconnect = true, driven by a
+ * minimal initiator on its own SCSI bus: commands done synchronously must
+ * see the data of ORDERED writes that were queued before them, and
+ * disconnected reads are reselected with their own tag and data. Requests
+ * beyond the end of the disk are refused.
+ **/
+
+#include "StdAfx.hpp"
+#include "Configurator.hpp"
+#include "Disk.hpp"
+#include "DiskController.hpp"
+#include "DiskFile.hpp"
+#include "SCSIBus.hpp"
+#include "SCSIDevice.hpp"
+#include "System.hpp"
+
+#define IMAGE "scsi-test.img"
+#define IMAGE_BLOCKS 4096
+#define BLOCKS 8
+#define ROUNDS 200
+
+static char config[] = "sys0 = tsunami\n"
+                       "{\n"
+                       "  memory.bits = 24;\n"
+                       "  cpu0 = ev68cb\n"
+                       "  {\n"
+                       "  }\n"
+                       "}\n";
+
+// Child configurations are parsed without whitespace.
+static char ctrl_text[] = "";
+static char disk_text[] =
+    "file=\"" IMAGE "\";disconnect=true;io_threads=4;";
+static char ctrl_name[] = "test";
+static char ctrl_value[] = "initiator";
+static char disk_name[] = "disk0.0";
+static char disk_value[] = "file";
+
+static int failures = 0;
+
+static void fail(const char *what, int round) {
+  printf("FAIL: %s in round %d\n", what, round);
+  failures++;
+}
+
+/**
+ * \brief SCSI initiator that issues commands to a disk at SCSI id 0.
+ **/
+class CTestInitiator : public CDiskController, public CSCSIDevice {
+public:
+  CTestInitiator(CConfigurator *cfg) : CDiskController(1, 16) {
+    scsi_register(0, new CSCSIBus(cfg, theSystem), 7);
+  }
+
+  virtual void register_disk(class CDisk *dsk, int bus, int dev) {
+    CDiskController::register_disk(dsk, bus, dev);
+    dsk->scsi_register(0, scsi_bus[0], dev);
+  }
+
+  /**
+   * Select the disk and send the command. Returns the status byte, or -1
+   * if the disk disconnected.
+   **/
+  int command(int tag_type, u8 tag, bool disc, const u8 *cdb, size_t cdblen,
+              u8 *data) {
+    u8 msg[3];
+    size_t msglen = 0;
+
+    if (!scsi_arbitrate(0) || !scsi_select(0, 0))
+      return -2;
+
+    msg[msglen++] = disc ? 0xc0 : 0x80;
+    if (tag_type) {
+      msg[msglen++] = (u8)tag_type;
+      msg[msglen++] = tag;
+    }
+    put(SCSI_PHASE_MSG_OUT, msg, msglen);
+    put(SCSI_PHASE_COMMAND, cdb, cdblen);
+    return phases(data, nullptr);
+  }
+
+  /**
+   * Let a disconnected disk reselect us and finish its command. Returns the
+   * status byte, and the tag the disk identified the command with.
+   **/
+  int reselect(u8 *data, u8 *tag) {
+    int target;
+
+    while ((target = scsi_bus[0]->reselect_pending()) < 0)
+      std::this_thread::yield();
+    if (!scsi_reselect(0, target))
+      return -2;
+    return phases(data, tag);
+  }
+
+private:
+  void put(int phase, const u8 *p, size_t len) {
+    if (scsi_get_phase(0) != phase)
+      FAILURE_1(IllegalState, "SCSI phase %d, expected another",
+                scsi_get_phase(0));
+    memcpy(scsi_xfer_ptr(0, len), p, len);
+    scsi_xfer_done(0);
+  }
+
+  /**
+   * Go through the data, status and message phases until the disk frees
+   * the bus.
+   **/
+  int phases(u8 *data, u8 *tag) {
+    int status = -1;
+    size_t pos = 0;
+    bool disconnected = false;
+
+    while (scsi_get_phase(0) != SCSI_PHASE_FREE) {
+      int phase = scsi_get_phase(0);
+      size_t n = scsi_expected_xfer(0);
+      u8 *p = (u8 *)scsi_xfer_ptr(0, n);
+
+      switch (phase) {
+      case SCSI_PHASE_DATA_OUT:
+        memcpy(p, data + pos, n);
+        pos += n;
+        break;
+
+      case SCSI_PHASE_DATA_IN:
+        memcpy(data + pos, p, n);
+        pos += n;
+        break;
+
+      case SCSI_PHASE_STATUS:
+        status = p[0];
+        break;
+
+      case SCSI_PHASE_MSG_IN:
+        for (size_t i = 0; i < n; i++) {
+          if (p[i] == 0x04)
+            disconnected = true;
+          else if (p[i] >= 0x20 && p[i] <= 0x22 && i + 1 < n && tag)
+            *tag = p[++i];
+        }
+        break;
+
+      default:
+        FAILURE_1(IllegalState, "unexpected SCSI phase %d", phase);
+      }
+      scsi_xfer_done(0);
+    }
+    return disconnected ? -1 : status;
+  }
+};
+
+static void rw10(u8 *cdb, u8 op, u32 lba, u16 blocks) {
+  memset(cdb, 0, 10);
+  cdb[0] = op;
+  cdb[2] = (u8)(lba >> 24);
+  cdb[3] = (u8)(lba >> 16);
+  cdb[4] = (u8)(lba >> 8);
+  cdb[5] = (u8)lba;
+  cdb[7] = (u8)(blocks >> 8);
+  cdb[8] = (u8)blocks;
+}
+
+/**
+ * The command must end in CHECK CONDITION with ILLEGAL REQUEST / LBA OUT OF
+ * RANGE as the sense.
+ **/
+static void check_range(CTestInitiator *ini, const u8 *cdb, size_t cdblen,
+                        const char *what) {
+  static u8 data[DATO_BUFSZ];
+  u8 sense[6] = {0x03, 0, 0, 0, 18, 0};
+
+  if (ini->command(0, 0, false, cdb, cdblen, data) != 0x02 ||
+      ini->command(0, 0, false, sense, 6, data) != 0 || (data[2] & 0x0f) != 5 ||
+      data[12] != 0x21) {
+    printf("FAIL: %s isn't refused as out of range\n", what);
+    failures++;
+  }
+}
+
+int main(int argc, char *argv[]) {
+  static u8 wbuf[4][BLOCKS * 512];
+  static u8 rbuf[BLOCKS * 512];
+  u8 cdb[12];
+  u8 tag;
+
+  try {
+    FILE *f = fopen(IMAGE, "wb");
+    static u8 zero[512];
+    for (int i = 0; i < IMAGE_BLOCKS; i++)
+      fwrite(zero, 1, sizeof(zero), f);
+    fclose(f);
+
+    CConfigurator *top =
+        new CConfigurator(0, 0, 0, config, sizeof(config) - 1);
+    if (!theSystem)
+      FAILURE(Configuration, "no system initialized");
+    CConfigurator *ctrl_cfg =
+        new CConfigurator(top, ctrl_name, ctrl_value, ctrl_text, 0);
+    CConfigurator *disk_cfg = new CConfigurator(
+        ctrl_cfg, disk_name, disk_value, disk_text, sizeof(disk_text) - 1);
+    CTestInitiator *ini = new CTestInitiator(ctrl_cfg);
+    CDisk *disk = new CDiskFile(disk_cfg, theSystem, ini, 0, 0);
+    disk->start_threads();
+    printf("\n");
+
+    for (int round = 0; round < ROUNDS; round++) {
+      // ORDERED writes the disk disconnects from...
+      for (int w = 0; w < 4; w++) {
+        memset(wbuf[w], (round * 4 + w) & 0xff, sizeof(wbuf[w]));
+        rw10(cdb, 0x2a, w * BLOCKS, BLOCKS);
+        if (ini->command(0x22, (u8)w, true, cdb, 10, wbuf[w]) != -1)
+          fail("ORDERED write didn't disconnect", round);
+      }
+
+      // ...then SIMPLE and untagged reads without the disconnect privilege,
+      // done while we're connected; they must see the writes.
+      for (int w = 0; w < 4; w++) {
+        memset(rbuf, 0xee, sizeof(rbuf));
+        rw10(cdb, 0x28, w * BLOCKS, BLOCKS);
+        if (ini->command(w & 1 ? 0 : 0x20, (u8)(8 + w), false, cdb, 10,
+                         rbuf) != 0)
+          fail("synchronous read status", round);
+        if (memcmp(rbuf, wbuf[w], sizeof(rbuf)))
+          fail("synchronous read overtook an ORDERED write", round);
+      }
+
+      for (int w = 0; w < 4; w++) {
+        if (ini->reselect(nullptr, &tag) != 0)
+          fail("ORDERED write status", round);
+      }
+
+      // SIMPLE reads the disk disconnects from come back with their tag.
+      for (int w = 0; w < 4; w++) {
+        rw10(cdb, 0x28, w * BLOCKS, BLOCKS);
+        if (ini->command(0x20, (u8)(16 + w), true, cdb, 10, nullptr) != -1)
+          fail("SIMPLE read didn't disconnect", round);
+      }
+      for (int w = 0; w < 4; w++) {
+        memset(rbuf, 0xee, sizeof(rbuf));
+        tag = 0;
+        if (ini->reselect(rbuf, &tag) != 0)
+          fail("SIMPLE read status", round);
+        if (tag < 16 || tag > 19 ||
+            memcmp(rbuf, wbuf[tag - 16], sizeof(rbuf)))
+          fail("SIMPLE read data", round);
+      }
+    }
+
+    // Requests whose end wraps around in 32 bits are out of range.
+    memset(cdb, 0, sizeof(cdb));
+    cdb[0] = 0xa8; // READ(12) of 0x200 blocks at 0xffffff00
+    cdb[2] = cdb[3] = cdb[4] = 0xff;
+    cdb[8] = 0x02;
+    check_range(ini, cdb, 12, "READ(12) past 4G blocks");
+    rw10(cdb, 0x2a, 0xffffffff, 2);
+    check_range(ini, cdb, 10, "WRITE(10) past 4G blocks");
+
+    disk->stop_threads();
+    printf("\n");
+  } catch (CException &e) {
+    printf("FAIL: %s\n", e.displayText().c_str());
+    failures++;
+  }
+
+  remove(IMAGE);
+
+  if (failures) {
+    printf("%d SCSI test(s) failed.\n", failures);
+    return 1;
+  }
+
+  printf("SCSI tests passed.\n");
+  return 0;
+}
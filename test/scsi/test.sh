@@ -0,0 +1,8 @@
+#!/bin/bash
+
+# Drives a SCSI disk with tagged commands it disconnects from.
+if [[ -f ../../../build/scsi_test ]]; then
+  ../../../build/scsi_test
+else # Travis
+  ../../build/scsi_test
+fi
@@ -0,0 +1,100 @@
+#!/bin/bash
+export LC_CTYPE=C
+export LANG=C
+export LC_ALL=C
+
+# Boots the SRM console on 4 CPUs, and reports how long it took to reach
+# the console prompt. All CPUs run in their own thread, so this exercises
+# the cross-CPU interrupt and LDx_L/STx_C paths. "show config" must then
+# list all 4 CPUs.
+
+# Download the firmware
+wget 'http://raymii.org/s/inc/downloads/es40-srmon/cl67srmrom.exe'
+
+# Start AXPbox
+if [[ -f ../../../build/axpbox ]]; then
+  ../../../build/axpbox run &
+  AXPBOX_PID=$!
+else # Travis
+  ../../build/axpbox run &
+  AXPBOX_PID=$!
+fi
+START=$(date +%s)
+
+# Wait for AXPbox to start
+sleep 5
+
+# Connect to terminal; input comes from a FIFO, so we can type commands
+rm -f console.in
+mkfifo console.in
+exec 3<>console.in
+nc -t 127.0.0.1 21000 <&3 | tee axp.log &
+NETCAT_PID=$!
+
+# Wait for the last line of log to become P00>>>
+timeout=900
+result=0
+while true
+do
+  if [ $timeout -eq 0 ]
+  then
+    echo "waiting for SRM prompt timed out" >&2
+    result=1
+    break
+  fi
+
+  # print last line and remove null byte from it
+  if [ "$(LC_ALL=C sed -n '$p' axp.log | LC_ALL=C sed 's/\x00//g')" == "P00>>>"  ]
+  then
+    echo
+    echo "SRM prompt reached with 4 CPUs after $(($(date +%s) - $START)) seconds"
+    break
+  fi
+
+  sleep 1
+  timeout=$(($timeout - 1))
+done
+
+# Console output after the command line we typed
+function command_output() {
+  LC_ALL=C sed -n '/show config/,$p' axp.log | LC_ALL=C sed 's/\x00//g;s/\r//g' | tail -n +2
+}
+
+# Ask for the configuration, and wait for the next prompt
+if [ $result -eq 0 ]
+then
+  printf 'show config\r' >&3
+  timeout=60
+  while ! command_output | LC_ALL=C grep -a -q '^P00>>>'
+  do
+    if [ $timeout -eq 0 ]
+    then
+      echo "show config didn't finish" >&2
+      result=1
+      break
+    fi
+    # page on if the console stops at --More--
+    if command_output | tail -n 1 | LC_ALL=C grep -a -q -- '--More--'
+    then
+      printf ' ' >&3
+    fi
+    sleep 1
+    timeout=$(($timeout - 1))
+  done
+
+  for cpu in 0 1 2 3
+  do
+    if ! command_output | LC_ALL=C grep -a -q "^CPU $cpu"
+    then
+      echo "CPU $cpu is missing from show config" >&2
+      result=1
+    fi
+  done
+fi
+
+kill $NETCAT_PID
+kill $AXPBOX_PID
+exec 3>&-
+
+rm -f axp.log console.in cl67* *.rom
+exit $result
@@ -0,0 +1,161 @@
+/* AXPbox Alpha Emulator
+ * Website: https://github.com/lenticularis39/axpbox
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301,
+ * USA.
+ */
+
+/**
+ * \file
+ * Save and restore round trip with memory mapped private from a memory
+ * image (memory.backing = "private"): full and incremental state files are
+ * restored over scribbled memory, a state file whose image has changed
+ * is refused, and a chain of state files still restores after being moved
+ * to another directory.
+ **/
+
+#include "StdAfx.hpp"
+#include "Configurator.hpp"
+#include "System.hpp"
+
+#include <sys/stat.h>
+
+#define MEM_BITS 24
+#define PAGE_SIZE 8192
+#define IMAGE "state-test.img"
+#define DIR "state-test-dir"
+#define MOVED "state-test-moved"
+
+static char config[] = "sys0 = tsunami\n"
+                             "{\n"
+                             "  memory.bits = 24;\n"
+                             "  memory.backing = \"private\";\n"
+                             "  memory.file = \"" IMAGE "\";\n"
+                             "  cpu0 = ev68cb\n"
+                             "  {\n"
+                             "  }\n"
+                             "}\n";
+
+static int failures = 0;
+
+/**
+ * The byte the memory image holds at an address.
+ **/
+static u8 image_byte(u64 a) { return (u8)((a >> 13) * 7 + (a & 0xff)); }
+
+static void write_image() {
+  static u8 page[PAGE_SIZE];
+  FILE *f = fopen(IMAGE, "wb");
+
+  for (u64 a = 0; a < (U64(0x1) << MEM_BITS); a += PAGE_SIZE) {
+    for (int i = 0; i < PAGE_SIZE; i++)
+      page[i] = image_byte(a + i);
+    fwrite(page, 1, PAGE_SIZE, f);
+  }
+  fclose(f);
+}
+
+static void check(const char *what, u64 a, u64 expect) {
+  u64 got = theSystem->ReadMem(a, 64, 0);
+
+  if (got != expect) {
+    printf("FAIL: %s: %" PRIx64 " is %016" PRIx64 ", expected %016" PRIx64
+           "\n",
+           what, a, got, expect);
+    failures++;
+  }
+}
+
+static u64 image_quad(u64 a) {
+  u64 q = 0;
+  for (int i = 7; i >= 0; i--)
+    q = (q << 8) | image_byte(a + i);
+  return q;
+}
+
+int main(int argc, char *argv[]) {
+  try {
+    write_image();
+    new CConfigurator(0, 0, 0, config, sizeof(config) - 1);
+    if (!theSystem)
+      FAILURE(Configuration, "no system initialized");
+
+    check("image", 0x2000, image_quad(0x2000));
+    check("image", 0x7f0008, image_quad(0x7f0008));
+
+    // Incremental save against the image the memory is mapped from.
+    theSystem->WriteMem(0x8000, 64, U64(0x4444444444444444), 0);
+    theSystem->SaveState("state-incr.axp", true);
+    theSystem->WriteMem(0x8000, 64, U64(0x5555555555555555), 0);
+    theSystem->WriteMem(0xa000, 64, U64(0x6666666666666666), 0);
+    theSystem->RestoreState("state-incr.axp");
+    check("incremental", 0x8000, U64(0x4444444444444444));
+    check("incremental", 0xa000, image_quad(0xa000));
+    check("incremental", 0x7f0008, image_quad(0x7f0008));
+
+    // Full save, restored over scribbled memory.
+    theSystem->WriteMem(0x4000, 64, U64(0x1111111111111111), 0);
+    theSystem->SaveState("state-full.axp", false);
+    theSystem->WriteMem(0x4000, 64, U64(0x2222222222222222), 0);
+    theSystem->WriteMem(0x6000, 64, U64(0x3333333333333333), 0);
+    theSystem->RestoreState("state-full.axp");
+    check("full", 0x4000, U64(0x1111111111111111));
+    check("full", 0x6000, image_quad(0x6000));
+    check("full", 0x8000, U64(0x4444444444444444));
+
+    // An image that changed since the save must not be used.
+    theSystem->WriteMem(0xa000, 64, U64(0x7777777777777777), 0);
+    FILE *f = fopen(IMAGE, "r+b");
+    fseek(f, 0xa000, SEEK_SET);
+    fputc(0x55, f);
+    fclose(f);
+    theSystem->RestoreState("state-incr.axp");
+    check("changed image", 0xa000, U64(0x7777777777777777));
+
+    // Parents are found relative to the directory of the state file.
+    mkdir(DIR, 0777);
+    theSystem->WriteMem(0xc000, 64, U64(0x8888888888888888), 0);
+    theSystem->SaveState(DIR "/full.axp", false);
+    theSystem->WriteMem(0xe000, 64, U64(0x9999999999999999), 0);
+    theSystem->SaveState(DIR "/incr.axp", true);
+    rename(DIR, MOVED);
+    theSystem->WriteMem(0xc000, 64, 0, 0);
+    theSystem->WriteMem(0xe000, 64, 0, 0);
+    theSystem->RestoreState(MOVED "/incr.axp");
+    check("moved", 0xc000, U64(0x8888888888888888));
+    check("moved", 0xe000, U64(0x9999999999999999));
+  } catch (CException &e) {
+    printf("FAIL: %s\n", e.displayText().c_str());
+    failures++;
+  }
+
+  remove("state-full.axp");
+  remove("state-incr.axp");
+  remove(MOVED "/full.axp");
+  remove(MOVED "/incr.axp");
+  remove(DIR "/full.axp");
+  remove(DIR "/incr.axp");
+  rmdir(MOVED);
+  rmdir(DIR);
+  remove(IMAGE);
+
+  if (failures) {
+    printf("%d state test(s) failed.\n", failures);
+    return 1;
+  }
+
+  printf("State tests passed.\n");
+  return 0;
+}
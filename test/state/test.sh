@@ -0,0 +1,8 @@
+#!/bin/bash
+
+# Saves and restores state with memory mapped private from a memory image.
+if [[ -f ../../../build/state_test ]]; then
+  ../../../build/state_test
+else # Travis
+  ../../build/state_test
+fi
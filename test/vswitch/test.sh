@@ -0,0 +1,8 @@
+#!/bin/bash
+
+# Exchanges frames between virtual switch ports in one process.
+if [[ -f ../../../build/vswitch_test ]]; then
+  ../../../build/vswitch_test
+else # Travis
+  ../../build/vswitch_test
+fi
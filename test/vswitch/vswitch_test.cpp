@@ -0,0 +1,227 @@
+/* AXPbox Alpha Emulator
+ * Website: https://github.com/lenticularis39/axpbox
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301,
+ * USA.
+ */
+
+/**
+ * \file
+ * Virtual switch ports in one process: unicast frames go to the port their
+ * destination was learned on, broadcasts to all other ports. A full ring
+ * drops frames, a slot that a producer claimed but never filled is skipped,
+ * and a port taken over from an owner that died starts with an empty ring
+ * and without the old owner's addresses.
+ **/
+
+#include "StdAfx.hpp"
+
+#if defined(HAVE_VSWITCH)
+#include "NetVswitch.hpp"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+static const u8 mac_a[6] = {0x08, 0x00, 0x2b, 0x00, 0x00, 0x0a};
+static const u8 mac_b[6] = {0x08, 0x00, 0x2b, 0x00, 0x00, 0x0b};
+static const u8 mac_c[6] = {0x08, 0x00, 0x2b, 0x00, 0x00, 0x0c};
+static const u8 mac_bcast[6] = {0xff, 0xff, 0xff, 0xff, 0xff, 0xff};
+
+static int failures = 0;
+static SVswShared *shm;
+
+static void check(bool ok, const char *what) {
+  if (!ok) {
+    printf("FAIL: %s\n", what);
+    failures++;
+  }
+}
+
+/**
+ * Send a 64 byte frame whose payload starts with a sequence number.
+ **/
+static bool send(CNetVswitch *from, const u8 *dst, const u8 *src, u32 seq) {
+  u8 frame[64];
+
+  memset(frame, 0, sizeof(frame));
+  memcpy(frame, dst, 6);
+  memcpy(frame + 6, src, 6);
+  frame[12] = 0x08;
+  memcpy(frame + 14, &seq, sizeof(seq));
+  return from->send(frame, sizeof(frame));
+}
+
+/**
+ * Receive everything a port has; returns the number of frames, and checks
+ * that they carry the sequence numbers first, first + 1, ...
+ **/
+static int receive(CNetVswitch *port, u32 first, const char *what) {
+  CPacketQueue q("test", 2 * VSW_RING_SIZE);
+  int n = port->receive(&q, false);
+  eth_packet *p;
+  u32 seq;
+
+  for (int i = 0; (p = q.head_packet()); i++) {
+    memcpy(&seq, p->frame + 14, sizeof(seq));
+    if (p->len != 64 + 4 || seq != first + i) { // with the CRC appended
+      printf("FAIL: %s: frame %d is wrong\n", what, i);
+      failures++;
+    }
+    q.pop_head();
+  }
+  return n;
+}
+
+/**
+ * MAC table entry of an address on a port.
+ **/
+static u64 mac_entry(const u8 *mac, int port) {
+  u64 m = 0;
+  for (int i = 0; i < 6; i++)
+    m = (m << 8) | mac[i];
+  return (m << 16) | (u64)(port + 1);
+}
+
+static bool learned(const u8 *mac, int port) {
+  for (int i = 0; i < VSW_MAC_TABLE; i++)
+    if (shm->mac_table[i] == mac_entry(mac, port))
+      return true;
+  return false;
+}
+
+static bool ring_reset(int port) {
+  SVswRing &r = shm->ring[port];
+  if (r.head != 0 || r.tail != 0)
+    return false;
+  for (int i = 0; i < VSW_RING_SIZE; i++)
+    if (r.slot[i].seq != 0)
+      return false;
+  return true;
+}
+
+int main(int argc, char *argv[]) {
+  char name[64];
+  char shm_name[128];
+
+  snprintf(name, sizeof(name), "test-%d", (int)getpid());
+  snprintf(shm_name, sizeof(shm_name), "/axpbox-vswitch-%s", name);
+
+  try {
+    CNetVswitch *a = new CNetVswitch("a", name);
+    CNetVswitch *b = new CNetVswitch("b", name);
+    CNetVswitch *c = new CNetVswitch("c", name);
+
+    int fd = shm_open(shm_name, O_RDWR, 0600);
+    shm = (SVswShared *)mmap(NULL, sizeof(SVswShared), PROT_READ | PROT_WRITE,
+                             MAP_SHARED, fd, 0);
+    close(fd);
+    if (shm == MAP_FAILED)
+      FAILURE(Runtime, "cannot map the switch");
+    check(shm->port[0].in_use && shm->port[1].in_use && shm->port[2].in_use,
+          "ports 0, 1 and 2 in use");
+
+    // B isn't known yet: flooded to b and c, not back to a.
+    check(send(a, mac_b, mac_a, 1), "send to unknown address");
+    check(receive(b, 1, "flood") == 1, "flood reaches b");
+    check(receive(c, 1, "flood") == 1, "flood reaches c");
+    check(receive(a, 0, "flood") == 0, "flood doesn't come back");
+
+    // A was learned on port 0, B on port 1: unicast from now on.
+    check(send(b, mac_a, mac_b, 2), "send to a");
+    check(receive(a, 2, "unicast") == 1, "unicast reaches a");
+    check(receive(c, 0, "unicast") == 0, "unicast to a skips c");
+    check(send(a, mac_b, mac_a, 3), "send to b");
+    check(receive(b, 3, "unicast") == 1, "unicast reaches b");
+    check(receive(c, 0, "unicast") == 0, "unicast to b skips c");
+    check(learned(mac_a, 0) && learned(mac_b, 1), "addresses learned");
+
+    check(send(c, mac_bcast, mac_c, 4), "broadcast");
+    check(receive(a, 4, "broadcast") == 1, "broadcast reaches a");
+    check(receive(b, 4, "broadcast") == 1, "broadcast reaches b");
+    check(receive(c, 0, "broadcast") == 0, "broadcast doesn't come back");
+
+    // A full ring drops the frame that doesn't fit.
+    for (u32 i = 0; i < VSW_RING_SIZE; i++)
+      check(send(a, mac_b, mac_a, 100 + i), "send to ring with room");
+    check(!send(a, mac_b, mac_a, 99), "send to full ring fails");
+    check(shm->ring[1].drops == 1, "full ring counts the drop");
+    check(receive(b, 100, "full ring") == VSW_RING_SIZE,
+          "full ring delivers what fit");
+
+    // A producer that claimed a slot and died: the frame after it comes
+    // through once the receiver has given up on the slot.
+    shm->ring[1].head++;
+    check(send(a, mac_b, mac_a, 5), "send behind stalled slot");
+    check(receive(b, 0, "stalled slot") == 0, "stalled slot holds up ring");
+    std::this_thread::sleep_for(std::chrono::milliseconds(2 * VSW_STALL_MS));
+    check(receive(b, 5, "stalled slot") == 1, "stalled slot skipped");
+    check(shm->ring[1].drops == 2, "stalled slot counts as a drop");
+
+    // A port that is closed forgets its addresses.
+    delete b;
+    check(!shm->port[1].in_use, "closed port is free");
+    check(!learned(mac_b, 1), "closed port forgets its addresses");
+
+    // An owner that died leaves frames, a half added frame and addresses
+    // behind; whoever takes the port over starts clean.
+    check(send(a, mac_b, mac_a, 6), "send to unknown address");
+    check(receive(c, 6, "flood") == 1, "flood reaches c");
+    SVswRing &r = shm->ring[1];
+    r.head = 7;
+    r.tail = 3;
+    for (int i = 3; i < 6; i++)
+      r.slot[i].seq = 1;
+    for (int i = 0; i < VSW_MAC_TABLE; i++)
+      if (!shm->mac_table[i]) {
+        shm->mac_table[i] = mac_entry(mac_b, 1);
+        break;
+      }
+    check(learned(mac_b, 1), "stale address planted");
+
+    b = new CNetVswitch("b", name);
+    check(shm->port[1].in_use, "port 1 taken over");
+    check(ring_reset(1), "taken over ring is empty");
+    check(!learned(mac_b, 1), "taken over port forgets old addresses");
+    check(receive(b, 0, "taken over") == 0, "nothing left in the ring");
+    check(send(a, mac_b, mac_a, 7), "send to port taken over");
+    check(receive(b, 7, "taken over") == 1, "port taken over receives");
+    check(receive(c, 7, "taken over") == 1, "flood still reaches c");
+
+    delete a;
+    delete b;
+    delete c;
+    munmap(shm, sizeof(SVswShared));
+  } catch (CException &e) {
+    printf("FAIL: %s\n", e.displayText().c_str());
+    failures++;
+  }
+
+  shm_unlink(shm_name);
+
+  if (failures) {
+    printf("%d virtual switch test(s) failed.\n", failures);
+    return 1;
+  }
+
+  printf("Virtual switch tests passed.\n");
+  return 0;
+}
+#else
+int main(int argc, char *argv[]) {
+  printf("Virtual switch not supported on this host; test skipped.\n");
+  return 0;
+}
+#endif // defined(HAVE_VSWITCH)